@@ -0,0 +1,604 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <malloc.h>
+
+#include <benchmark/benchmark.h>
+#include <boost/utility/string_view.hpp>
+
+#include <commonpp/thread/ThreadPool.hpp>
+
+#include "blabla/Router.hpp"
+
+// Benchmarks of the route table.
+//
+// Most benchmarks take the following arguments:
+// - subs: number of subscribed route prefixes,
+// - depth: number of '.' separated tokens of the published routes,
+// - zipf: whether the published routes follow a uniform (0) or a zipfian (1)
+//   distribution. The latter is closer to what producers do and is the one
+//   for which the per thread route cache of the Router matters.
+//
+// Example: blabla_bench_router --benchmark_filter='SubscriptionsFor/.*depth:4'
+//
+// Use a Release build, linked with jemalloc. With the glibc allocator, the
+// millions of chunks freed when a large table is replaced make the following
+// small allocations take milliseconds, which shows in BM_AddExistingRoute.
+
+namespace
+{
+using blabla::Router;
+using blabla::handlers::Client;
+using blabla::handlers::Subscription;
+using blabla::handlers::SubscriptionNode;
+
+constexpr size_t NB_CLIENTS = 16;
+// Lookups are generated before running the benchmarks, must be a power of 2.
+constexpr size_t NB_LOOKUPS = 1 << 20;
+// Upper bound of distinct published routes.
+constexpr size_t MAX_ROUTES = 1 << 20;
+// One lookup every SAMPLING_INTERVAL is timed on its own.
+constexpr size_t SAMPLING_INTERVAL = 256;
+
+// The clients are only used as subscribers, they are never started.
+struct Clients
+{
+    Clients()
+    : pool(1)
+    {
+        for (size_t i = 0; i < NB_CLIENTS + 1; ++i)
+        {
+            clients.emplace_back(Client::create(pool));
+        }
+    }
+
+    Client& operator[](size_t i)
+    {
+        return *clients[i % NB_CLIENTS];
+    }
+
+    // Not used by the routes of the data set.
+    Client& churn()
+    {
+        return *clients.back();
+    }
+
+    commonpp::thread::ThreadPool pool;
+    std::vector<std::shared_ptr<Client>> clients;
+};
+
+Clients& clients()
+{
+    static Clients clients;
+    return clients;
+}
+
+size_t heap_bytes()
+{
+    // Only meaningful with the glibc allocator.
+    return mallinfo2().uordblks;
+}
+
+struct DataSet
+{
+    DataSet(size_t nb_subs, size_t depth)
+    : nb_subs(nb_subs)
+    , depth(depth)
+    {
+        std::mt19937_64 rng(42);
+        // Enough tokens per level to have nb_subs distinct routes.
+        const size_t vocabulary = std::max<size_t>(
+            8, 2 * std::ceil(std::pow(double(nb_subs), 1.0 / depth)));
+        std::uniform_int_distribution<size_t> token(0, vocabulary - 1);
+        std::uniform_int_distribution<size_t> prefix_depth(1, depth);
+
+        auto random_route = [&](std::string route, size_t tokens) {
+            for (size_t i = 0; i < tokens; ++i)
+            {
+                if (!route.empty())
+                {
+                    route += '.';
+                }
+                route += "tok" + std::to_string(token(rng));
+            }
+            return route;
+        };
+
+        std::unordered_set<std::string> unique;
+        unique.reserve(nb_subs);
+        while (prefixes.size() < nb_subs)
+        {
+            // Mostly full routes, with some shorter prefixes.
+            size_t tokens = rng() % 4 ? depth : prefix_depth(rng);
+            auto prefix = random_route({}, tokens);
+            if (unique.insert(prefix).second)
+            {
+                prefixes.emplace_back(std::move(prefix));
+            }
+        }
+
+        // Each published route matches at least one prefix.
+        std::uniform_int_distribution<size_t> any_prefix(0, nb_subs - 1);
+        routes.reserve(std::min(nb_subs, MAX_ROUTES));
+        while (routes.size() < std::min(nb_subs, MAX_ROUTES))
+        {
+            const auto& prefix = prefixes[any_prefix(rng)];
+            size_t tokens = std::count(prefix.begin(), prefix.end(), '.') + 1;
+            routes.emplace_back(random_route(prefix, depth - tokens));
+        }
+
+        std::uniform_int_distribution<uint32_t> any_route(0, routes.size() - 1);
+        uniform.resize(NB_LOOKUPS);
+        std::generate(uniform.begin(), uniform.end(),
+                      [&] { return any_route(rng); });
+
+        // s = 0.99, the rank of a route is its index.
+        std::vector<double> cdf(routes.size());
+        double sum = 0;
+        for (size_t i = 0; i < routes.size(); ++i)
+        {
+            sum += 1.0 / std::pow(double(i + 1), 0.99);
+            cdf[i] = sum;
+        }
+
+        std::uniform_real_distribution<double> draw(0, sum);
+        zipf.resize(NB_LOOKUPS);
+        std::generate(zipf.begin(), zipf.end(), [&] {
+            return uint32_t(std::lower_bound(cdf.begin(), cdf.end(), draw(rng)) -
+                            cdf.begin());
+        });
+    }
+
+    const std::vector<uint32_t>& lookups(bool zipfian) const
+    {
+        return zipfian ? zipf : uniform;
+    }
+
+    size_t nb_subs;
+    size_t depth;
+    // Subscribed route prefixes.
+    std::vector<std::string> prefixes;
+    // Published routes.
+    std::vector<std::string> routes;
+    // Indexes in routes.
+    std::vector<uint32_t> uniform;
+    std::vector<uint32_t> zipf;
+};
+
+std::unique_ptr<Router> make_router(const DataSet& data)
+{
+    std::unique_ptr<Router> router(new Router);
+    std::vector<std::vector<Subscription>> per_client(NB_CLIENTS);
+    for (size_t i = 0; i < data.prefixes.size(); ++i)
+    {
+        per_client[i % NB_CLIENTS].push_back({data.prefixes[i], 0, false});
+    }
+
+    for (size_t i = 0; i < NB_CLIENTS; ++i)
+    {
+        router->add(std::move(per_client[i]), clients()[i]);
+    }
+
+    return router;
+}
+
+// Data sets with millions of routes are long to build, the last one is kept
+// for the benchmarks sharing the same arguments (including the ones running
+// in different threads).
+struct Fixture
+{
+    Fixture(size_t nb_subs, size_t depth)
+    : data(nb_subs, depth)
+    , router(make_router(data))
+    {
+    }
+
+    DataSet data;
+    std::unique_ptr<Router> router;
+};
+
+Fixture& fixture(const benchmark::State& state)
+{
+    static std::mutex mutex;
+    static std::unique_ptr<Fixture> current;
+
+    const size_t nb_subs = state.range(0);
+    const size_t depth = state.range(1);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!current || current->data.nb_subs != nb_subs ||
+        current->data.depth != depth)
+    {
+        current.reset();
+        current.reset(new Fixture(nb_subs, depth));
+    }
+
+    return *current;
+}
+
+struct LatencySampler
+{
+    LatencySampler()
+    {
+        samples.reserve(1 << 16);
+    }
+
+    template <typename Fn>
+    void measure(Fn&& fn)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto end = std::chrono::steady_clock::now();
+        samples.push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+                .count());
+    }
+
+    // Reported in ns, averaged amongst the threads.
+    void report(benchmark::State& state)
+    {
+        if (samples.empty())
+        {
+            return;
+        }
+
+        std::sort(samples.begin(), samples.end());
+        auto percentile = [this](double p) {
+            return double(samples[size_t(p * (samples.size() - 1))]);
+        };
+
+        using benchmark::Counter;
+        state.counters["p50_ns"] = Counter(percentile(0.5), Counter::kAvgThreads);
+        state.counters["p99_ns"] = Counter(percentile(0.99), Counter::kAvgThreads);
+        state.counters["p999_ns"] =
+            Counter(percentile(0.999), Counter::kAvgThreads);
+    }
+
+    std::vector<uint64_t> samples;
+};
+
+void run_lookups(benchmark::State& state, Fixture& f)
+{
+    const auto& lookups = f.data.lookups(state.range(2));
+    auto& routes = f.data.routes;
+    auto& router = *f.router;
+
+    LatencySampler sampler;
+    // Threads start at different positions to not hit the same routes at the
+    // same time.
+    size_t i = state.thread_index() * (NB_LOOKUPS / 16);
+    for (auto _ : state)
+    {
+        const auto& route = routes[lookups[i++ & (NB_LOOKUPS - 1)]];
+        if (BOOST_UNLIKELY(i % SAMPLING_INTERVAL == 0))
+        {
+            sampler.measure([&] {
+                benchmark::DoNotOptimize(router.subscriptions_for(route).size());
+            });
+        }
+        else
+        {
+            benchmark::DoNotOptimize(router.subscriptions_for(route).size());
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    sampler.report(state);
+}
+
+void BM_SubscriptionsFor(benchmark::State& state)
+{
+    run_lookups(state, fixture(state));
+}
+
+// Concurrent (un)subscriptions: a writer thread alternately subscribes to a
+// new route, which publishes a new table and invalidates the route caches,
+// and unsubscribes from it. state.range(3) is the number of subscriptions per
+// second, 0 meaning as fast as possible.
+void BM_SubscriptionsForWithChurn(benchmark::State& state)
+{
+    auto& f = fixture(state);
+    std::atomic<bool> running{true};
+    std::atomic<uint64_t> churned{0};
+    std::thread writer;
+
+    if (state.thread_index() == 0)
+    {
+        writer = std::thread([&] {
+            static std::atomic<uint64_t> route_id{0};
+            const auto rate = state.range(3);
+            const auto interval =
+                rate ? std::chrono::nanoseconds(std::chrono::seconds(1)) / rate
+                     : std::chrono::nanoseconds(0);
+            auto next = std::chrono::steady_clock::now();
+            auto& client = clients().churn();
+
+            while (running.load(std::memory_order_relaxed))
+            {
+                auto route = "churn." + std::to_string(route_id++);
+                for (auto node : f.router->add({{route, 0, false}}, client))
+                {
+                    node->remove_client(client);
+                }
+
+                ++churned;
+                next += interval;
+                std::this_thread::sleep_until(next);
+            }
+        });
+    }
+
+    run_lookups(state, f);
+
+    if (writer.joinable())
+    {
+        running = false;
+        writer.join();
+        state.counters["subscriptions"] = churned.load();
+    }
+}
+
+// Subscription of a new route, the table is copied.
+void BM_AddNewRoute(benchmark::State& state)
+{
+    DataSet data(state.range(0), state.range(1));
+    auto router = make_router(data);
+    auto& client = clients().churn();
+
+    size_t route_id = 0;
+    for (auto _ : state)
+    {
+        auto route = "new." + std::to_string(route_id++);
+        benchmark::DoNotOptimize(router->add({{route, 0, false}}, client));
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Subscription to an already subscribed route, only its node is updated.
+void BM_AddExistingRoute(benchmark::State& state)
+{
+    auto& f = fixture(state);
+    auto& client = clients().churn();
+
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        const auto& prefix = f.data.prefixes[i++ % f.data.prefixes.size()];
+        auto nodes = f.router->add({{prefix, 0, false}}, client);
+
+        state.PauseTiming();
+        nodes[0]->remove_client(client);
+        state.ResumeTiming();
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_Remove(benchmark::State& state)
+{
+    auto& f = fixture(state);
+
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        auto idx = i++ % f.data.prefixes.size();
+        auto& client = clients()[idx];
+        for (auto node : f.router->remove({{f.data.prefixes[idx], 0, false}}, client))
+        {
+            node->remove_client(client);
+        }
+
+        state.PauseTiming();
+        f.router->add({{f.data.prefixes[idx], 0, false}}, client);
+        state.ResumeTiming();
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Alternative containers for the prefix table. They are compared outside of
+// the Router, using the same resolution as Router::resolve, and without any
+// cache or RCU overhead.
+using Node = SubscriptionNode*;
+
+struct ViewHash
+{
+    size_t operator()(boost::string_view key) const
+    {
+        return blabla::detail::StrHash()(key.data(), key.size());
+    }
+};
+
+struct HtrieTable
+{
+    void insert(const std::string& key, Node node)
+    {
+        map.insert_ks(key.data(), key.size(), node);
+    }
+
+    Node find(boost::string_view key) const
+    {
+        auto it = map.find_ks(key.data(), key.size());
+        return it != map.end() ? it.value() : nullptr;
+    }
+
+    tsl::htrie_map<char, Node, blabla::detail::StrHash> map;
+};
+
+struct UnorderedTable
+{
+    void insert(const std::string& key, Node node)
+    {
+        keys.emplace_back(key);
+        map.emplace(keys.back(), node);
+    }
+
+    Node find(boost::string_view key) const
+    {
+        auto it = map.find(key);
+        return it != map.end() ? it->second : nullptr;
+    }
+
+    std::deque<std::string> keys;
+    std::unordered_map<boost::string_view, Node, ViewHash> map;
+};
+
+struct MapTable
+{
+    void insert(const std::string& key, Node node)
+    {
+        map.emplace(key, node);
+    }
+
+    Node find(boost::string_view key) const
+    {
+        auto it = map.find(key);
+        return it != map.end() ? it->second : nullptr;
+    }
+
+    std::map<std::string, Node, std::less<>> map;
+};
+
+struct SortedVectorTable
+{
+    using Entry = std::pair<std::string, Node>;
+
+    void insert(const std::string& key, Node node)
+    {
+        // Only used when building the table.
+        auto it = std::lower_bound(entries.begin(), entries.end(), key,
+                                   [](const Entry& e, const std::string& k) {
+                                       return e.first < k;
+                                   });
+        entries.emplace(it, key, node);
+    }
+
+    Node find(boost::string_view key) const
+    {
+        auto it = std::lower_bound(entries.begin(), entries.end(), key,
+                                   [](const Entry& e, boost::string_view k) {
+                                       return boost::string_view(e.first) < k;
+                                   });
+        return it != entries.end() && it->first == key ? it->second : nullptr;
+    }
+
+    std::vector<Entry> entries;
+};
+
+template <typename Table>
+void resolve(const Table& table, boost::string_view route, std::vector<Node>& out)
+{
+    size_t idx = 0;
+    while (idx != boost::string_view::npos)
+    {
+        idx = route.find_first_of('.', idx);
+        auto prefix = route.substr(0, idx);
+        if (idx != boost::string_view::npos)
+        {
+            ++idx;
+        }
+
+        if (auto node = table.find(prefix))
+        {
+            out.emplace_back(node);
+        }
+    }
+}
+
+template <typename Table>
+void BM_Resolve(benchmark::State& state)
+{
+    auto& f = fixture(state);
+
+    auto heap_before = heap_bytes();
+    Table table;
+    if (std::is_same<Table, SortedVectorTable>::value)
+    {
+        // Sorted insertions only append.
+        std::vector<std::string> sorted(f.data.prefixes);
+        std::sort(sorted.begin(), sorted.end());
+        for (size_t i = 0; i < sorted.size(); ++i)
+        {
+            table.insert(sorted[i], reinterpret_cast<Node>(i + 1));
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < f.data.prefixes.size(); ++i)
+        {
+            table.insert(f.data.prefixes[i], reinterpret_cast<Node>(i + 1));
+        }
+    }
+    auto heap_after = heap_bytes();
+
+    const auto& lookups = f.data.lookups(state.range(2));
+    std::vector<Node> out;
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        out.clear();
+        resolve(table, f.data.routes[lookups[i++ & (NB_LOOKUPS - 1)]], out);
+        benchmark::DoNotOptimize(out.data());
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["heap_mb"] =
+        double(heap_after > heap_before ? heap_after - heap_before : 0) /
+        (1 << 20);
+}
+
+const std::vector<int64_t> SUBS = {1000, 10000, 100000, 1000000, 10000000};
+const std::vector<int64_t> DEPTHS = {2, 4, 8};
+
+} // namespace
+
+BENCHMARK(BM_SubscriptionsFor)
+    ->ArgNames({"subs", "depth", "zipf"})
+    ->ArgsProduct({SUBS, DEPTHS, {0, 1}})
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+BENCHMARK(BM_SubscriptionsForWithChurn)
+    ->ArgNames({"subs", "depth", "zipf", "rate"})
+    ->ArgsProduct({{10000, 1000000}, {4}, {0, 1}, {10, 1000, 0}})
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+BENCHMARK(BM_AddNewRoute)
+    ->ArgNames({"subs", "depth"})
+    ->ArgsProduct({{1000, 10000, 100000, 1000000}, {4}});
+
+BENCHMARK(BM_AddExistingRoute)
+    ->ArgNames({"subs", "depth"})
+    ->ArgsProduct({{1000, 1000000}, {4}});
+
+BENCHMARK(BM_Remove)->ArgNames({"subs", "depth"})->ArgsProduct({{1000, 1000000}, {4}});
+
+BENCHMARK_TEMPLATE(BM_Resolve, HtrieTable)
+    ->ArgNames({"subs", "depth", "zipf"})
+    ->ArgsProduct({SUBS, DEPTHS, {0}});
+BENCHMARK_TEMPLATE(BM_Resolve, UnorderedTable)
+    ->ArgNames({"subs", "depth", "zipf"})
+    ->ArgsProduct({SUBS, DEPTHS, {0}});
+BENCHMARK_TEMPLATE(BM_Resolve, MapTable)
+    ->ArgNames({"subs", "depth", "zipf"})
+    ->ArgsProduct({SUBS, DEPTHS, {0}});
+BENCHMARK_TEMPLATE(BM_Resolve, SortedVectorTable)
+    ->ArgNames({"subs", "depth", "zipf"})
+    ->ArgsProduct({SUBS, DEPTHS, {0}});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,17 @@
+include(LibFindMacros)
+
+libfind_pkg_check_modules(HDRHISTOGRAM_PKGCONF hdr_histogram)
+
+find_path(HDRHISTOGRAM_INCLUDE_DIR
+        NAMES hdr/hdr_histogram.h
+        PATHS ${HDRHISTOGRAM_PKGCONF_INCLUDE_DIRS}
+        )
+
+find_library(HDRHISTOGRAM_LIBRARY
+        NAMES hdr_histogram_static hdr_histogram
+        PATHS ${HDRHISTOGRAM_PKGCONF_LIBRARY_DIRS}
+        )
+
+set(HDRHISTOGRAM_PROCESS_INCLUDES HDRHISTOGRAM_INCLUDE_DIR)
+set(HDRHISTOGRAM_PROCESS_LIBS HDRHISTOGRAM_LIBRARY)
+libfind_process(HDRHISTOGRAM)
@@ -0,0 +1,305 @@
+#include "Load.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <new>
+#include <random>
+
+#include <commonpp/core/LoggingInterface.hpp>
+
+namespace bench
+{
+
+CREATE_LOGGER(load_log, "bench::load");
+
+namespace
+{
+constexpr size_t NB_DRAWS = 1 << 16;
+constexpr size_t TIMESTAMP_SIZE = sizeof(int64_t);
+constexpr size_t MAX_LOGGED_ERRORS = 10;
+// One hour, in ns.
+constexpr int64_t MAX_LATENCY = 3600ll * 1000 * 1000 * 1000;
+constexpr auto SUBSCRIBE_TIMEOUT = std::chrono::seconds(10);
+
+int64_t to_ns(Clock::time_point ts)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               ts.time_since_epoch())
+        .count();
+}
+
+blabla::client::BlablaClientConfiguration client_configuration(const LoadConfiguration& conf)
+{
+    blabla::client::BlablaClientConfiguration client_conf;
+    client_conf.host = conf.host;
+    client_conf.port = conf.port;
+    client_conf.local_path = conf.local_path;
+    client_conf.sync_connect = true;
+    // What is published while disconnected is lost instead of delivered late.
+    client_conf.offline_buffer_bytes = 0;
+    client_conf.linger = conf.linger;
+    client_conf.max_batch_bytes = conf.batch_bytes;
+    return client_conf;
+}
+
+// Returns false if the server cannot be reached.
+bool connect(blabla::client::Client& client, const LoadConfiguration& conf, Errors& events)
+{
+    try
+    {
+        client.configure(client_configuration(conf));
+    }
+    catch (const std::exception& e)
+    {
+        events.report(e.what());
+        return false;
+    }
+
+    return client.is_connected();
+}
+
+std::vector<uint32_t> draw_routes(const LoadConfiguration& conf, std::mt19937& rng)
+{
+    std::vector<uint32_t> draws(NB_DRAWS);
+    if (!conf.zipf)
+    {
+        std::uniform_int_distribution<uint32_t> route(0, conf.nb_routes - 1);
+        std::generate(draws.begin(), draws.end(), [&] { return route(rng); });
+        return draws;
+    }
+
+    // s = 1, the rank of a route is its index.
+    std::vector<double> cdf(conf.nb_routes);
+    double sum = 0;
+    for (size_t i = 0; i < cdf.size(); ++i)
+    {
+        sum += 1.0 / double(i + 1);
+        cdf[i] = sum;
+    }
+
+    std::uniform_real_distribution<double> draw(0, sum);
+    std::generate(draws.begin(), draws.end(), [&] {
+        auto it = std::lower_bound(cdf.begin(), cdf.end(), draw(rng));
+        return uint32_t(std::min<size_t>(it - cdf.begin(), cdf.size() - 1));
+    });
+    return draws;
+}
+} // namespace
+
+std::string route_name(const LoadConfiguration& conf, size_t route)
+{
+    return conf.route_prefix + "." + std::to_string(route);
+}
+
+Histogram make_histogram()
+{
+    hdr_histogram* histogram = nullptr;
+    if (hdr_init(1, MAX_LATENCY, 3, &histogram) != 0)
+    {
+        throw std::bad_alloc();
+    }
+    return Histogram(histogram);
+}
+
+Errors::Errors(std::string connection)
+: connection(std::move(connection))
+{
+}
+
+void Errors::connect_error(const boost::system::error_code& ec)
+{
+    report("Cannot connect: " + ec.message());
+}
+
+void Errors::disconnected(const boost::system::error_code& ec)
+{
+    report("Disconnected: " + ec.message());
+}
+
+void Errors::error(const services::blabla::Error& error)
+{
+    report("Error from the server: " + error.description());
+}
+
+void Errors::report(const std::string& error)
+{
+    const auto previous = errors.fetch_add(1, std::memory_order_relaxed);
+    if (previous < MAX_LOGGED_ERRORS)
+    {
+        LOG(load_log, error) << connection << ": " << error;
+    }
+    else if (previous == MAX_LOGGED_ERRORS)
+    {
+        LOG(load_log, error) << connection << ": the next errors are only counted";
+    }
+}
+
+Producer::Producer(const LoadConfiguration& conf, size_t id)
+: conf(conf)
+, events("producer " + std::to_string(id))
+, client(events)
+{
+    std::mt19937 rng(id);
+    routes = draw_routes(conf, rng);
+    for (size_t i = 0; i < conf.nb_routes; ++i)
+    {
+        route_names.emplace_back(route_name(conf, i));
+    }
+
+    const auto max_payload_size = std::max(conf.max_payload_size, TIMESTAMP_SIZE);
+    std::uniform_int_distribution<uint32_t> size(
+        std::max(conf.min_payload_size, TIMESTAMP_SIZE), max_payload_size);
+    payload_sizes.resize(NB_DRAWS);
+    std::generate(payload_sizes.begin(), payload_sizes.end(),
+                  [&] { return size(rng); });
+    payload.resize(max_payload_size, 'x');
+}
+
+Producer::~Producer()
+{
+    stop();
+}
+
+bool Producer::connect()
+{
+    return bench::connect(client, conf, events);
+}
+
+void Producer::start()
+{
+    running = true;
+    thread = std::thread([this] { run(); });
+}
+
+void Producer::stop()
+{
+    running = false;
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+}
+
+void Producer::run()
+{
+    const std::chrono::nanoseconds interval(conf.rate ? 1000000000 / conf.rate : 0);
+    auto next = Clock::now();
+    size_t draw = 0;
+
+    while (running.load(std::memory_order_relaxed))
+    {
+        auto ts = Clock::now();
+        if (conf.rate)
+        {
+            if (next > ts)
+            {
+                std::this_thread::sleep_until(next);
+            }
+
+            // The intended send time is used as timestamp.
+            ts = next;
+            next += interval;
+        }
+
+        const auto& route = route_names[routes[draw % NB_DRAWS]];
+        const size_t payload_size = payload_sizes[draw % NB_DRAWS];
+        ++draw;
+
+        const int64_t ts_ns = to_ns(ts);
+        std::memcpy(payload.data(), &ts_ns, TIMESTAMP_SIZE);
+
+        // Refused while the client has too much to write, or disconnected.
+        while (!client.publish(route, {payload.data(), payload_size}))
+        {
+            if (!running.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+            std::this_thread::yield();
+        }
+
+        messages.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(payload_size, std::memory_order_relaxed);
+    }
+
+    client.flush();
+}
+
+Consumer::Consumer(const LoadConfiguration& conf, size_t id)
+: conf(conf)
+, events("consumer " + std::to_string(id))
+, client(std::make_unique<blabla::client::Client>(events))
+, measure_from(INT64_MAX)
+, histogram(make_histogram())
+{
+}
+
+bool Consumer::subscribe(const std::vector<std::string>& prefixes)
+{
+    if (!connect(*client, conf, events))
+    {
+        return false;
+    }
+
+    for (auto& prefix : prefixes)
+    {
+        client->subscribe(prefix, [this](const services::blabla::ConsumerMessageHeader&,
+                                         boost::string_view payload) {
+            on_message(payload);
+        });
+    }
+
+    // Requests are processed in order, the pong acknowledges the
+    // subscriptions. The promise outlives a timeout.
+    auto acknowledged = std::make_shared<std::promise<void>>();
+    auto pong = acknowledged->get_future();
+    if (!client->ping([acknowledged](auto) { acknowledged->set_value(); }))
+    {
+        events.report("Disconnected while subscribing");
+        return false;
+    }
+
+    if (pong.wait_for(SUBSCRIBE_TIMEOUT) != std::future_status::ready)
+    {
+        events.report("The subscriptions were not acknowledged");
+        return false;
+    }
+
+    // The refused subscriptions are reported before the pong.
+    return events.count() == 0;
+}
+
+void Consumer::start(Clock::time_point from)
+{
+    measure_from.store(to_ns(from), std::memory_order_relaxed);
+}
+
+void Consumer::stop()
+{
+    // Waits for the callback in progress.
+    client.reset();
+}
+
+void Consumer::on_message(boost::string_view payload)
+{
+    if (payload.size() < TIMESTAMP_SIZE)
+    {
+        events.report("Message without a timestamp received");
+        return;
+    }
+
+    int64_t ts_ns;
+    std::memcpy(&ts_ns, payload.data(), TIMESTAMP_SIZE);
+    if (ts_ns >= measure_from.load(std::memory_order_relaxed))
+    {
+        const auto latency = to_ns(Clock::now()) - ts_ns;
+        hdr_record_value(histogram.get(),
+                         std::min(std::max<int64_t>(latency, 1), MAX_LATENCY));
+    }
+
+    messages.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(payload.size(), std::memory_order_relaxed);
+}
+
+} // namespace bench
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <hdr/hdr_histogram.h>
+
+#include <blabla/client/Client.hpp>
+
+namespace bench
+{
+
+using Clock = std::chrono::steady_clock;
+
+struct LoadConfiguration
+{
+    std::string host;
+    int16_t port = 20100;
+    // Connects through the local transport of the server instead, when set.
+    std::string local_path;
+
+    size_t nb_routes = 1;
+    // Routes are named route_prefix.<index>.
+    std::string route_prefix = "bench";
+    // Zipfian instead of uniform route distribution.
+    bool zipf = false;
+
+    // Payloads start with the time at which the message is sent, they are
+    // at least that big.
+    size_t min_payload_size = 64;
+    size_t max_payload_size = 64;
+
+    // Messages per second per producer, 0 for as fast as possible. When set,
+    // latencies are measured from the time at which a message should have
+    // been sent, so stalls of the server are accounted for.
+    uint64_t rate = 0;
+    // When not 0, the publishes are gathered in MessageBatch of up to
+    // batch_bytes of payloads, sent after linger at most.
+    std::chrono::microseconds linger{0};
+    size_t batch_bytes = 64 * 1024;
+};
+
+struct HistogramDeleter
+{
+    void operator()(hdr_histogram* histogram) const
+    {
+        hdr_close(histogram);
+    }
+};
+using Histogram = std::unique_ptr<hdr_histogram, HistogramDeleter>;
+
+// Latencies in ns, up to an hour with 3 significant digits.
+Histogram make_histogram();
+
+// Logs and counts the errors of a connection, reported at the end of the
+// run.
+class Errors : public blabla::client::EventHandler
+{
+public:
+    explicit Errors(std::string connection);
+
+    void connect_error(const boost::system::error_code& ec) override;
+    void disconnected(const boost::system::error_code& ec) override;
+    void error(const services::blabla::Error& error) override;
+
+    // The first ones are logged, the next ones only counted.
+    void report(const std::string& error);
+
+    uint64_t count() const
+    {
+        return errors.load(std::memory_order_relaxed);
+    }
+
+private:
+    const std::string connection;
+    std::atomic<uint64_t> errors{0};
+};
+
+// Publishes on its own thread. The client writes what is published while
+// its previous write is in flight in a single write.
+class Producer
+{
+public:
+    Producer(const LoadConfiguration& conf, size_t id);
+    ~Producer();
+
+    // Returns false if the server cannot be reached.
+    bool connect();
+    void start();
+    void stop();
+
+    uint64_t sent_messages() const
+    {
+        return messages.load(std::memory_order_relaxed);
+    }
+
+    uint64_t sent_bytes() const
+    {
+        return bytes.load(std::memory_order_relaxed);
+    }
+
+    uint64_t errors() const
+    {
+        return events.count();
+    }
+
+private:
+    void run();
+
+    const LoadConfiguration& conf;
+    Errors events;
+    blabla::client::Client client;
+    std::vector<std::string> route_names;
+    // Pre-drawn indexes of routes and payload sizes.
+    std::vector<uint32_t> routes;
+    std::vector<uint32_t> payload_sizes;
+    std::vector<char> payload;
+
+    std::thread thread;
+    std::atomic<bool> running{false};
+    std::atomic<uint64_t> messages{0};
+    std::atomic<uint64_t> bytes{0};
+};
+
+// Receives on the thread of its client.
+class Consumer
+{
+public:
+    Consumer(const LoadConfiguration& conf, size_t id);
+
+    // Blocks until the server acknowledged the subscriptions, returns false
+    // if it cannot be reached or refused them.
+    bool subscribe(const std::vector<std::string>& prefixes);
+    // Latencies of the messages sent before measure_from are not recorded.
+    void start(Clock::time_point measure_from);
+    // Closes the connection, nothing is received afterwards.
+    void stop();
+
+    uint64_t received_messages() const
+    {
+        return messages.load(std::memory_order_relaxed);
+    }
+
+    uint64_t received_bytes() const
+    {
+        return bytes.load(std::memory_order_relaxed);
+    }
+
+    uint64_t errors() const
+    {
+        return events.count();
+    }
+
+    // Only safe to read once stopped.
+    const hdr_histogram& latencies() const
+    {
+        return *histogram;
+    }
+
+private:
+    void on_message(boost::string_view payload);
+
+    const LoadConfiguration& conf;
+    Errors events;
+    std::unique_ptr<blabla::client::Client> client;
+    // In ns since the epoch of Clock.
+    std::atomic<int64_t> measure_from;
+
+    Histogram histogram;
+    std::atomic<uint64_t> messages{0};
+    std::atomic<uint64_t> bytes{0};
+};
+
+std::string route_name(const LoadConfiguration& conf, size_t route);
+
+} // namespace bench
@@ -0,0 +1,287 @@
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#include <boost/program_options.hpp>
+
+#include <commonpp/core/LoggingInterface.hpp>
+#include <commonpp/thread/ThreadPool.hpp>
+
+#include "Load.hpp"
+
+CREATE_LOGGER(main_log, "main");
+
+namespace po = boost::program_options;
+
+struct Opts
+{
+    size_t producers;
+    size_t consumers;
+    // Consumer i subscribes to the routes r where r % consumers == i, instead
+    // of every consumer receiving every message.
+    bool partition;
+
+    uint64_t warmup;
+    uint64_t duration;
+
+    bench::LoadConfiguration conf;
+};
+
+auto get_opts(int ac, char** av)
+{
+    Opts opts;
+    uint64_t linger_us;
+    po::options_description desc("Allowed options");
+    // clang-format off
+    desc.add_options()
+        ("help,h", "Print this help")
+        ("host", po::value<std::string>(&opts.conf.host)->default_value("127.0.0.1"), "Server address")
+        ("port", po::value<int16_t>(&opts.conf.port)->default_value(20100), "Server port")
+        ("local", po::value<std::string>(&opts.conf.local_path), "Connect through the local transport of the server, on this path")
+        ("producers", po::value<size_t>(&opts.producers)->default_value(1), "Number of producer connections")
+        ("consumers", po::value<size_t>(&opts.consumers)->default_value(1), "Number of consumer connections, each one read by its own thread")
+        ("partition", po::bool_switch(&opts.partition), "Spread the routes amongst the consumers instead of fanning out")
+        ("routes", po::value<size_t>(&opts.conf.nb_routes)->default_value(16), "Number of routes")
+        ("route-prefix", po::value<std::string>(&opts.conf.route_prefix)->default_value("bench"), "Prefix of the routes")
+        ("zipf", po::bool_switch(&opts.conf.zipf), "Zipfian route distribution instead of uniform")
+        ("payload-size", po::value<size_t>(&opts.conf.min_payload_size)->default_value(64), "Payload size, at least 8 bytes")
+        ("max-payload-size", po::value<size_t>(&opts.conf.max_payload_size)->default_value(0), "Payload sizes are uniformly distributed up to this size")
+        ("rate", po::value<uint64_t>(&opts.conf.rate)->default_value(0), "Messages per second per producer, 0 for unlimited")
+        ("linger", po::value<uint64_t>(&linger_us)->default_value(0), "Gather the publishes in MessageBatch sent after this many microseconds at most, 0 to publish them one by one")
+        ("batch-bytes", po::value<size_t>(&opts.conf.batch_bytes)->default_value(64 * 1024), "Payload bytes of a MessageBatch")
+        ("warmup", po::value<uint64_t>(&opts.warmup)->default_value(2), "Seconds excluded from the results")
+        ("duration", po::value<uint64_t>(&opts.duration)->default_value(10), "Measured seconds")
+        // clang-format on
+        ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(ac, av, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << desc << std::endl;
+        exit(0);
+    }
+
+    if (opts.producers == 0 || opts.consumers == 0 || opts.conf.nb_routes == 0)
+    {
+        throw std::invalid_argument(
+            "producers, consumers and routes must be greater than 0");
+    }
+
+    opts.conf.max_payload_size =
+        std::max(opts.conf.max_payload_size, opts.conf.min_payload_size);
+    opts.conf.linger = std::chrono::microseconds(linger_us);
+
+    return opts;
+}
+
+// The bytes are the ones of the payloads.
+struct Totals
+{
+    uint64_t sent_messages = 0;
+    uint64_t sent_bytes = 0;
+    uint64_t received_messages = 0;
+    uint64_t received_bytes = 0;
+    uint64_t errors = 0;
+};
+
+Totals totals(const std::vector<std::unique_ptr<bench::Producer>>& producers,
+              const std::vector<std::unique_ptr<bench::Consumer>>& consumers)
+{
+    Totals t;
+    for (auto& producer : producers)
+    {
+        t.sent_messages += producer->sent_messages();
+        t.sent_bytes += producer->sent_bytes();
+        t.errors += producer->errors();
+    }
+
+    for (auto& consumer : consumers)
+    {
+        t.received_messages += consumer->received_messages();
+        t.received_bytes += consumer->received_bytes();
+        t.errors += consumer->errors();
+    }
+
+    return t;
+}
+
+double per_second(uint64_t value, std::chrono::duration<double> elapsed)
+{
+    return elapsed.count() > 0 ? double(value) / elapsed.count() : 0;
+}
+
+int main(int ac, char** av)
+{
+    commonpp::core::init_logging();
+    commonpp::core::enable_console_logging();
+
+    auto opts = get_opts(ac, av);
+    auto& conf = opts.conf;
+
+    std::vector<std::unique_ptr<bench::Consumer>> consumers;
+    for (size_t i = 0; i < opts.consumers; ++i)
+    {
+        std::vector<std::string> prefixes;
+        if (opts.partition)
+        {
+            for (size_t route = i; route < conf.nb_routes; route += opts.consumers)
+            {
+                prefixes.emplace_back(bench::route_name(conf, route));
+            }
+        }
+        else
+        {
+            prefixes.emplace_back(conf.route_prefix);
+        }
+
+        consumers.emplace_back(new bench::Consumer(conf, i));
+        if (!consumers.back()->subscribe(prefixes))
+        {
+            LOG(main_log, error) << "Consumer " << i << " could not subscribe";
+            return 1;
+        }
+    }
+
+    std::vector<std::unique_ptr<bench::Producer>> producers;
+    for (size_t i = 0; i < opts.producers; ++i)
+    {
+        producers.emplace_back(new bench::Producer(conf, i));
+        if (!producers.back()->connect())
+        {
+            LOG(main_log, error) << "Producer " << i << " could not connect";
+            return 1;
+        }
+    }
+
+    const auto start = bench::Clock::now();
+    const auto measure_from = start + std::chrono::seconds(opts.warmup);
+    const auto measure_until = measure_from + std::chrono::seconds(opts.duration);
+
+    for (auto& consumer : consumers)
+    {
+        consumer->start(measure_from);
+    }
+
+    for (auto& producer : producers)
+    {
+        producer->start();
+    }
+
+    LOG(main_log, info) << "Running " << opts.producers << " producers and "
+                        << opts.consumers << " consumers for " << opts.warmup
+                        << "s of warmup and " << opts.duration << "s";
+
+    Totals at_measure_start;
+    Totals previous;
+    auto previous_ts = start;
+    bool measuring = opts.warmup == 0;
+    std::cout << std::fixed << std::setprecision(1);
+
+    while (bench::Clock::now() < measure_until)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        auto now = bench::Clock::now();
+        auto current = totals(producers, consumers);
+        std::chrono::duration<double> elapsed = now - previous_ts;
+
+        if (!measuring && now >= measure_from)
+        {
+            measuring = true;
+            at_measure_start = current;
+        }
+
+        std::cout << (measuring ? "" : "[warmup] ") << "sent: "
+                  << per_second(current.sent_messages - previous.sent_messages,
+                                elapsed) /
+                         1000
+                  << "k msg/s, received: "
+                  << per_second(current.received_messages -
+                                    previous.received_messages,
+                                elapsed) /
+                         1000
+                  << "k msg/s, "
+                  << per_second(current.received_bytes - previous.received_bytes,
+                                elapsed) /
+                         (1 << 20)
+                  << " MB/s" << std::endl;
+
+        previous = current;
+        previous_ts = now;
+    }
+
+    for (auto& producer : producers)
+    {
+        producer->stop();
+    }
+
+    const auto measured = totals(producers, consumers);
+    std::chrono::duration<double> measured_time = bench::Clock::now() - measure_from;
+
+    // Let the consumers receive what is in flight.
+    const uint64_t fanout = opts.partition ? 1 : opts.consumers;
+    const auto drain_until = bench::Clock::now() + std::chrono::seconds(5);
+    auto final_totals = totals(producers, consumers);
+    while (final_totals.received_messages < final_totals.sent_messages * fanout &&
+           bench::Clock::now() < drain_until)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        final_totals = totals(producers, consumers);
+    }
+
+    for (auto& consumer : consumers)
+    {
+        consumer->stop();
+    }
+
+    auto latencies = bench::make_histogram();
+    for (auto& consumer : consumers)
+    {
+        hdr_add(latencies.get(), &consumer->latencies());
+    }
+
+    const auto expected = final_totals.sent_messages * fanout;
+    auto us = [](double ns) { return ns / 1000; };
+    auto percentile = [&latencies, &us](double p) {
+        return us(hdr_value_at_percentile(latencies.get(), p));
+    };
+
+    std::cout << "\nPublished:  "
+              << per_second(measured.sent_messages - at_measure_start.sent_messages,
+                            measured_time)
+              << " msg/s, "
+              << per_second(measured.sent_bytes - at_measure_start.sent_bytes,
+                            measured_time) /
+                     (1 << 20)
+              << " MB/s\n"
+              << "Delivered:  "
+              << per_second(measured.received_messages -
+                                at_measure_start.received_messages,
+                            measured_time)
+              << " msg/s, "
+              << per_second(measured.received_bytes -
+                                at_measure_start.received_bytes,
+                            measured_time) /
+                     (1 << 20)
+              << " MB/s\n"
+              << "Lost:       "
+              << (expected > final_totals.received_messages
+                      ? expected - final_totals.received_messages
+                      : 0)
+              << " of " << expected << " deliveries\n"
+              << "Errors:     " << final_totals.errors << "\n"
+              << "Latency (us) over " << latencies->total_count << " messages:\n"
+              << "  min    " << us(hdr_min(latencies.get())) << "\n"
+              << "  mean   " << us(hdr_mean(latencies.get())) << "\n"
+              << "  p50    " << percentile(50) << "\n"
+              << "  p90    " << percentile(90) << "\n"
+              << "  p99    " << percentile(99) << "\n"
+              << "  p99.9  " << percentile(99.9) << "\n"
+              << "  p99.99 " << percentile(99.99) << "\n"
+              << "  max    " << us(hdr_max(latencies.get())) << std::endl;
+
+    return final_totals.errors == 0 ? 0 : 1;
+}
@@ -1,15 +1,23 @@
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <boost/program_options.hpp>
 #include <commonpp/core/LoggingInterface.hpp>
-#include <commonpp/thread/ThreadPool.hpp>
 
-#include <blabla/client/Client.hpp>
+#include <blabla/client/ClientPool.hpp>
 
 namespace po = boost::program_options;
 
 struct Handler : blabla::client::EventHandler
 {
+    void error(const services::blabla::Error& error) override
+    {
+        std::cerr << "Error: " << error.description() << std::endl;
+    }
 };
 
 int main(int ac, char** av)
@@ -17,19 +25,138 @@ int main(int ac, char** av)
     commonpp::core::init_logging();
     commonpp::core::enable_console_logging();
 
-    commonpp::thread::ThreadPool pool(2);
     blabla::client::BlablaClientConfiguration conf;
+    std::vector<std::string> prefixes;
+    std::string route;
+    size_t count;
+    size_t payload_size;
+    size_t duration;
+    size_t linger_us;
+    size_t connections;
+    size_t threads;
+    bool verbose;
+
+    po::options_description desc("Allowed options");
+    // clang-format off
+    desc.add_options()
+        ("help,h", "Print this help")
+        ("host", po::value<std::string>(&conf.host)->default_value("localhost"), "server host")
+        ("port", po::value<int16_t>(&conf.port)->default_value(20100), "server port")
+        ("local", po::value<std::string>(&conf.local_path), "local transport path of the server")
+        ("subscribe", po::value<std::vector<std::string>>(&prefixes)->multitoken(), "route prefixes to subscribe to")
+        ("publish", po::value<std::string>(&route), "route to publish on")
+        ("count", po::value<size_t>(&count)->default_value(1), "messages to publish")
+        ("payload-size", po::value<size_t>(&payload_size)->default_value(64), "size of the published messages")
+        ("linger", po::value<size_t>(&linger_us)->default_value(0), "microseconds a published message may wait for others to be batched with")
+        ("max-batch-bytes", po::value<size_t>(&conf.max_batch_bytes), "payload bytes of a batch")
+        ("connections", po::value<size_t>(&connections)->default_value(1), "connections publishing, the routes are spread amongst them")
+        ("threads", po::value<size_t>(&threads)->default_value(1), "threads publishing, each one on its own sub route of the published one")
+        ("duration", po::value<size_t>(&duration)->default_value(10), "seconds to run")
+        ("verbose,v", po::bool_switch(&verbose), "print the messages received")
+        // clang-format on
+        ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(ac, av, desc), vm);
+    if (vm.count("help"))
+    {
+        std::cout << desc << "\n";
+        return EXIT_FAILURE;
+    }
+    po::notify(vm);
+    conf.linger = std::chrono::microseconds(linger_us);
 
     Handler handler;
-    blabla::client::Client cl(handler, pool);
+    blabla::client::ClientPool clients(handler, connections);
+
+    std::atomic<uint64_t> received{0};
+    for (auto& prefix : prefixes)
+    {
+        clients.subscribe(prefix, [&](const services::blabla::ConsumerMessageHeader& header,
+                                      boost::string_view payload) {
+            received.fetch_add(1, std::memory_order_relaxed);
+            if (verbose)
+            {
+                std::cout << header.route() << ": " << payload << std::endl;
+            }
+        });
+    }
+
+    conf.sync_connect = true;
+    clients.configure(conf);
+
+    // The server answers in order: once the pongs are received, what was
+    // sent before them, subscriptions included, was processed.
+    auto round_trip = [&clients] {
+        std::atomic<size_t> answers{0};
+        size_t expected = 0;
+        for (size_t i = 0; i < clients.size(); ++i)
+        {
+            expected += clients[i].ping([&answers](auto round_trip) {
+                std::cout << "Round trip: "
+                          << std::chrono::duration_cast<std::chrono::microseconds>(round_trip)
+                                 .count()
+                          << "us" << std::endl;
+                ++answers;
+            });
+        }
+
+        while (answers < expected)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    };
+    round_trip();
 
+    const auto start = std::chrono::steady_clock::now();
+    const auto end = start + std::chrono::seconds(duration);
+    if (!route.empty())
     {
-        conf.host = "localhost";
-        conf.port = 20100;
-        conf.sync_connect = false;
+        // Each thread publishes on its own route when there are many.
+        const std::string payload(payload_size, 'x');
+        std::atomic<size_t> published{0};
+        std::vector<std::thread> producers;
+        for (size_t t = 0; t < threads; ++t)
+        {
+            producers.emplace_back([&, t] {
+                const auto name = threads == 1 ? route : route + "." + std::to_string(t);
+                const size_t share = count / threads + (t < count % threads);
+                size_t sent = 0;
+                while (sent < share && std::chrono::steady_clock::now() < end)
+                {
+                    if (clients.publish(name, payload))
+                    {
+                        ++sent;
+                    }
+                    else
+                    {
+                        // Over max_queued_bytes.
+                        std::this_thread::yield();
+                    }
+                }
+                published += sent;
+            });
+        }
 
-        cl.configure(std::move(conf));
+        for (auto& producer : producers)
+        {
+            producer.join();
+        }
+
+        round_trip();
+        const auto elapsed =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+        std::cout << "Published " << published << " messages in " << elapsed.count()
+                  << "s" << std::endl;
+    }
+
+    while (std::chrono::steady_clock::now() < end && !prefixes.empty() &&
+           (route.empty() || received < count))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
 
-    std::this_thread::sleep_for(std::chrono::seconds(10));
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    std::cout << "Received " << received << " messages in " << elapsed.count() << "s"
+              << std::endl;
 }
@@ -22,7 +22,10 @@ namespace po = boost::program_options;
 struct Opts
 {
     std::string addr;
+    std::string unix_path;
     bool debug;
+    bool io_uring;
+    std::string journal_fsync;
 
     blabla::ServiceConfiguration conf;
 };
@@ -36,6 +39,20 @@ auto get_opts(int ac, char** av)
         ("help,h", "Print this help")
         ("addr", po::value<std::string>(&opts.addr)->default_value("0.0.0.0:10900"), "Address to bind")
         ("debug", po::value<bool>(&opts.debug)->default_value(false), "enable debug level")
+        ("io-uring", po::bool_switch(&opts.io_uring), "accept, read and write through io_uring if the kernel supports it")
+        ("reuse-port", po::bool_switch(&opts.conf.service.reuse_port), "accept from every io thread, on a shared port")
+        ("cpu-affinity", po::bool_switch(&opts.conf.service.cpu_affinity), "with --reuse-port, accept from the io thread of the CPU receiving the connection")
+        ("unix", po::value<std::string>(&opts.unix_path), "AF_UNIX stream path to listen on as well")
+        ("unix-uid", po::value<std::vector<uint32_t>>(&opts.conf.service.unix_allowed_uids)->multitoken(), "users allowed to connect on the AF_UNIX path, anyone by default")
+        ("local", po::value<std::string>(&opts.conf.service.local_path), "AF_UNIX path accepting the clients of this host, which then use shared memory")
+        ("journal", po::value<std::string>(&opts.conf.journal.directory), "directory of the message journals, disabled by default")
+        ("journal-prefix", po::value<std::vector<std::string>>(&opts.conf.journal.route_prefixes)->multitoken(), "route prefixes journaled, each in its own journal")
+        ("journal-segment-mb", po::value<size_t>()->notifier([&opts](size_t mb) { opts.conf.journal.segment_bytes = mb * 1024 * 1024; }), "size of the journal segment files")
+        ("journal-max-segments", po::value<size_t>(&opts.conf.journal.max_segments), "journal segments kept per prefix, 0 for all")
+        ("journal-fsync", po::value<std::string>(&opts.journal_fsync)->default_value("periodic"), "never, periodic or eager")
+        ("shard-per-core", po::bool_switch(&opts.conf.threads.shard_per_core), "pin each connection and its subscriptions to a single io thread")
+        ("metrics-addr", po::value<std::string>(&opts.conf.metrics.address)->default_value("0.0.0.0"), "address serving the metrics")
+        ("metrics-port", po::value<int>(&opts.conf.metrics.port)->default_value(0), "HTTP port serving the metrics on /metrics, disabled by default")
         // clang-format on
         ;
 
@@ -49,6 +66,24 @@ auto get_opts(int ac, char** av)
     }
 
     po::notify(vm);
+    if (opts.io_uring)
+    {
+        opts.conf.service.backend = blabla::NetworkBackend::io_uring;
+    }
+
+    if (opts.journal_fsync == "never")
+    {
+        opts.conf.journal.fsync = blabla::FsyncPolicy::never;
+    }
+    else if (opts.journal_fsync == "eager")
+    {
+        opts.conf.journal.fsync = blabla::FsyncPolicy::eager;
+    }
+    else if (opts.journal_fsync != "periodic")
+    {
+        std::cerr << "Invalid --journal-fsync: " << opts.journal_fsync << "\n";
+        exit(EXIT_FAILURE);
+    }
     return opts;
 }
 
@@ -67,6 +102,12 @@ int main(int ac, char** av)
             });
     }
 
+    if (!opts.unix_path.empty())
+    {
+        opts.conf.service.addresses.emplace_back(
+            blabla::ServiceConfiguration::Address{"", 0, opts.unix_path});
+    }
+
     commonpp::core::set_logging_level(commonpp::info);
     if (opts.debug)
     {
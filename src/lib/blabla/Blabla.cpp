@@ -1,8 +1,17 @@
 #include "Blabla.hpp"
 
+#include <algorithm>
+#include <future>
+#include <map>
+#include <sstream>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 
+#include <pthread.h>
+#include <sched.h>
+#include <sys/sysinfo.h>
+
 #include <boost/thread/shared_lock_guard.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <grpc++/server.h>
@@ -11,16 +20,40 @@
 #include <commonpp/core/LoggingInterface.hpp>
 #include <commonpp/thread/Thread.hpp>
 
+#include "Metrics.hpp"
 #include "Router.hpp"
+#include "Shard.hpp"
+#include "StrHash.hpp"
 
 #include "handlers/Acceptor.hpp"
+#include "journal/Journal.hpp"
+#include "handlers/LocalAcceptor.hpp"
 #include "handlers/Client.hpp"
+#include "handlers/MetricsListener.hpp"
 
 namespace blabla
 {
 
 CREATE_LOGGER(log, "service");
 
+namespace
+{
+struct RouteHash
+{
+    size_t operator()(boost::string_view route) const
+    {
+        return detail::StrHash()(route.data(), route.size());
+    }
+};
+
+// A route of a MessageBatch, resolved once for all its messages.
+struct ResolvedRoute
+{
+    std::vector<handlers::SubscriptionNode*> subscriptions;
+    const OutboundPolicy* policy = nullptr;
+};
+} // namespace
+
 namespace detail
 {
 struct Service : handlers::ClientManager
@@ -29,45 +62,338 @@ struct Service : handlers::ClientManager
     : pool(pool)
     , conf(conf)
     {
+        if (conf.service.backend == NetworkBackend::io_uring)
+        {
+            use_uring = handlers::Uring::supported();
+            if (!use_uring)
+            {
+                LOG(log, warning) << "io_uring is not supported, using asio";
+            }
+        }
+
+        if (conf.threads.shard_per_core)
+        {
+            const size_t nb_shards = std::max(conf.threads.io_context, 1);
+            for (size_t i = 0; i < nb_shards; ++i)
+            {
+                shards.emplace_back(std::make_unique<Shard>(
+                    i, static_cast<boost::asio::io_context&>(pool.getService(i)),
+                    nb_shards));
+            }
+        }
+
+        if (!conf.journal.directory.empty())
+        {
+            message_log = std::make_unique<journal::Journals>(conf.journal);
+        }
+
         start();
     }
 
     ~Service()
     {
         stop();
+
+        // The posted hand-overs reference the shards.
+        while (pending_handovers != 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
     }
 
     void start()
     {
+        start_metrics();
         start_acceptor();
     }
 
     void stop()
     {
+        metrics_listener.reset();
         stop_acceptor();
         stop_connections();
     }
 
+    void start_metrics()
+    {
+        if (conf.metrics.port == 0)
+        {
+            return;
+        }
+
+        auto addr = boost::asio::ip::address::from_string(conf.metrics.address);
+        metrics_listener = std::make_unique<handlers::MetricsListener>(
+            pool.getService(), boost::asio::ip::tcp::endpoint(addr, conf.metrics.port),
+            [this] { return render_metrics(); });
+
+        LOG(log, info) << "Serving the metrics on: " << addr.to_string()
+                       << " port: " << conf.metrics.port;
+    }
+
+    // The counters of the threads, and the state of the connections.
+    std::string render_metrics()
+    {
+        std::ostringstream out;
+        metrics::write(out, metrics::collect());
+
+        // Only the queues are read under the lock, the accepts and the
+        // disconnections wait for it.
+        std::vector<size_t> queued;
+        {
+            boost::shared_lock_guard<boost::shared_mutex> l(mutex);
+            queued.reserve(conns.size());
+            for (auto& conn : conns)
+            {
+                queued.push_back(handlers::outbound_bytes(*conn));
+            }
+        }
+
+        metrics::HistogramSnapshot outbound;
+        for (auto bytes : queued)
+        {
+            outbound.record(bytes);
+        }
+
+        metrics::write_gauge(out, "blabla_connections", "Open connections.",
+                             queued.size());
+        metrics::write_histogram(out, "blabla_outbound_queued_bytes",
+                                 "Bytes queued for a connection and not written yet, "
+                                 "amongst the open connections.",
+                                 outbound);
+
+        metrics::write_counter(out, "blabla_outbound_dropped_messages_total",
+                               "Messages dropped by the outbound policies.",
+                               stats.dropped_messages.load(std::memory_order_relaxed));
+        metrics::write_counter(out, "blabla_outbound_dropped_bytes_total",
+                               "Bytes dropped by the outbound policies.",
+                               stats.dropped_bytes.load(std::memory_order_relaxed));
+        metrics::write_counter(out, "blabla_outbound_disconnections_total",
+                               "Subscribers disconnected by the outbound policies.",
+                               stats.disconnections.load(std::memory_order_relaxed));
+        metrics::write_counter(out, "blabla_outbound_producer_pauses_total",
+                               "Producers paused by the outbound policies.",
+                               stats.producer_pauses.load(std::memory_order_relaxed));
+        return out.str();
+    }
+
     void start_acceptor()
     {
         DLOG(log, info) << "Starting acceptors";
         for (auto& address : conf.service.addresses)
         {
+            if (!address.path.empty())
+            {
+                start_unix_acceptor(address.path);
+                continue;
+            }
+
             auto addr = boost::asio::ip::address::from_string(address.address);
+            if (conf.service.reuse_port)
+            {
+                start_reuse_port_acceptors(addr, address.port);
+                continue;
+            }
+
             acceptors.emplace_back(std::make_unique<handlers::Acceptor>(
-                pool, std::move(addr), address.port));
+                pool, boost::asio::ip::tcp::endpoint(addr, address.port)));
 
+            accept_through_uring(*acceptors.back());
             acceptors.back()->start<handlers::Client>(
                 std::bind(&Service::on_new_client, this, std::placeholders::_1));
 
             LOG(log, info) << "Started listening: " << addr.to_string()
                            << " on port: " << address.port;
         }
+
+        if (!conf.service.local_path.empty())
+        {
+            local_acceptor = std::make_unique<handlers::LocalAcceptor>(
+                pool, conf.service.local_path, conf.service.local_ring_bytes);
+            local_acceptor->start<handlers::Client>(
+                std::bind(&Service::on_new_client, this, std::placeholders::_1),
+                [this](const ucred& credentials) {
+                    return allowed(credentials,
+                                   "[local:" + std::to_string(credentials.pid) + "]");
+                });
+
+            LOG(log, info) << "Started listening: " << conf.service.local_path;
+        }
+    }
+
+    // Falls back to asio if the ring of the io context of the acceptor cannot
+    // be created.
+    template <typename Acceptor>
+    void accept_through_uring(Acceptor& acceptor)
+    {
+        if (!use_uring)
+        {
+            return;
+        }
+
+        try
+        {
+            acceptor.use_uring();
+        }
+        catch (const std::exception& e)
+        {
+            LOG(log, error) << "Cannot accept through io_uring: " << e.what();
+        }
+    }
+
+    // The acceptors are bound in the order of the io contexts, which is the
+    // order used by the CPU steering program.
+    void start_reuse_port_acceptors(const boost::asio::ip::address& addr, int port)
+    {
+        const int nb_contexts = std::max(conf.threads.io_context, 1);
+        const auto first = acceptors.size();
+        for (int i = 0; i < nb_contexts; ++i)
+        {
+            acceptors.emplace_back(std::make_unique<handlers::Acceptor>(
+                pool, boost::asio::ip::tcp::endpoint(addr, port), pool.getService(i)));
+        }
+
+        // The affinity of a context is the one of its thread.
+        const int nb_threads = conf.threads.shard_per_core ? conf.threads.io_context
+                                                           : conf.threads.io_threads;
+        if (conf.service.cpu_affinity && nb_threads != nb_contexts)
+        {
+            LOG(log, warning) << "Cannot steer the connections by CPU with "
+                              << nb_threads << " threads for " << nb_contexts
+                              << " io contexts, it needs one thread per context";
+        }
+        else if (conf.service.cpu_affinity)
+        {
+            auto ec = acceptors[first]->steer_by_cpu(contexts_by_cpu(nb_contexts),
+                                                     nb_contexts);
+            if (ec)
+            {
+                LOG(log, warning) << "Cannot steer the connections by CPU: "
+                                  << ec.message();
+            }
+        }
+
+        for (auto i = first; i < acceptors.size(); ++i)
+        {
+            accept_through_uring(*acceptors[i]);
+            acceptors[i]->start<handlers::Client>(
+                std::bind(&Service::on_new_client, this, std::placeholders::_1));
+        }
+
+        LOG(log, info) << "Started listening: " << addr.to_string()
+                       << " on port: " << port << " from " << nb_contexts
+                       << " io contexts";
+    }
+
+    // The io context whose thread is pinned to each CPU, -1 for the CPUs no
+    // context is pinned to. The pool pins its threads to physical cores, the
+    // numbering of the CPUs of a core depends on the machine: the affinities
+    // are read from the threads, each context must be run by a single one.
+    // The CPUs shared by several contexts are spread amongst them.
+    std::vector<int> contexts_by_cpu(int nb_contexts)
+    {
+        std::vector<cpu_set_t> affinities(nb_contexts);
+        std::vector<std::future<void>> read;
+        for (int i = 0; i < nb_contexts; ++i)
+        {
+            auto done = std::make_shared<std::promise<void>>();
+            read.emplace_back(done->get_future());
+            boost::asio::post(pool.getService(i), [&affinity = affinities[i], done] {
+                CPU_ZERO(&affinity);
+                ::pthread_getaffinity_np(::pthread_self(), sizeof(affinity), &affinity);
+                done->set_value();
+            });
+        }
+        for (auto& future : read)
+        {
+            future.wait();
+        }
+
+        // A thread allowed on the same CPUs as the process is not pinned.
+        cpu_set_t process;
+        CPU_ZERO(&process);
+        ::sched_getaffinity(0, sizeof(process), &process);
+
+        // The offline CPUs are numbered too, they may come back online.
+        const int nb_cpus = std::min(::get_nprocs_conf(), CPU_SETSIZE);
+        std::vector<int> contexts(nb_cpus, -1);
+        std::map<std::vector<int>, size_t> spread;
+        for (int cpu = 0; cpu < nb_cpus; ++cpu)
+        {
+            std::vector<int> pinned;
+            for (int i = 0; i < nb_contexts; ++i)
+            {
+                if (CPU_ISSET(cpu, &affinities[i]) &&
+                    !CPU_EQUAL(&affinities[i], &process))
+                {
+                    pinned.push_back(i);
+                }
+            }
+
+            if (!pinned.empty())
+            {
+                contexts[cpu] = pinned[spread[pinned]++ % pinned.size()];
+            }
+        }
+        return contexts;
+    }
+
+    void start_unix_acceptor(const std::string& path)
+    {
+        unix_acceptors.emplace_back(std::make_unique<handlers::UnixAcceptor>(
+            pool, boost::asio::local::stream_protocol::endpoint(path)));
+
+        accept_through_uring(*unix_acceptors.back());
+        unix_acceptors.back()->start<handlers::Client>(
+            [this](std::shared_ptr<handlers::Client> client) {
+                if (!allowed(*client))
+                {
+                    boost::system::error_code ec;
+                    client->socket().close(ec);
+                    return;
+                }
+                on_new_client(std::move(client));
+            });
+
+        LOG(log, info) << "Started listening: " << path;
+    }
+
+    // Whether the user of an AF_UNIX peer may connect.
+    bool allowed(const handlers::Client& client) const
+    {
+        const auto& uids = conf.service.unix_allowed_uids;
+        if (uids.empty())
+        {
+            return true;
+        }
+
+        ucred credentials;
+        if (!client.peer_credentials(credentials))
+        {
+            LOG(log, warning) << "Cannot get the credentials of " << client.peer();
+            return false;
+        }
+
+        return allowed(credentials, client.peer());
+    }
+
+    bool allowed(const ucred& credentials, const std::string& peer) const
+    {
+        const auto& uids = conf.service.unix_allowed_uids;
+        if (!uids.empty() &&
+            std::find(uids.begin(), uids.end(), credentials.uid) == uids.end())
+        {
+            LOG(log, warning) << "Refusing " << peer << ", uid " << credentials.uid
+                              << " is not allowed";
+            return false;
+        }
+        return true;
     }
 
     void stop_acceptor()
     {
         acceptors.clear();
+        unix_acceptors.clear();
+        local_acceptor.reset();
     }
 
     void stop_connections()
@@ -99,11 +425,70 @@ struct Service : handlers::ClientManager
         }
     }
 
+    const ServiceConfiguration& configuration() const override
+    {
+        return conf;
+    }
+
+    bool uring_enabled() const override
+    {
+        return use_uring;
+    }
+
+    handlers::OutboundStats& outbound_stats() override
+    {
+        return stats;
+    }
+
+    journal::Journals* journals() override
+    {
+        return message_log.get();
+    }
+
+    // Longest configured route prefix matching the route, on '.' boundaries.
+    const OutboundPolicy& policy_for(boost::string_view route) const
+    {
+        const OutboundPolicy* policy = &conf.outbound.policy;
+        size_t matched = 0;
+        for (auto& pair : conf.outbound.route_policies)
+        {
+            const auto& prefix = pair.first;
+            if (prefix.size() < matched || prefix.size() > route.size() ||
+                !route.starts_with(prefix))
+            {
+                continue;
+            }
+
+            if (prefix.size() == route.size() || route[prefix.size()] == '.')
+            {
+                policy = &pair.second;
+                matched = prefix.size();
+            }
+        }
+
+        return *policy;
+    }
+
     void on_new_client(std::shared_ptr<handlers::Client> client) override
     {
         DLOG(log, debug) << "Got a new connection from: " << client->peer();
+        metrics::local().accepted.add();
 
         auto cl = client.get();
+        if (!shards.empty())
+        {
+            auto& ctx = boost::asio::query(cl->socket().get_executor(),
+                                           boost::asio::execution::context);
+            for (auto& shard : shards)
+            {
+                if (&static_cast<boost::asio::execution_context&>(shard->ctx) == &ctx)
+                {
+                    cl->set_shard_index(shard->index);
+                    break;
+                }
+            }
+        }
+
         {
             boost::unique_lock<boost::shared_mutex> l(mutex);
             conns.insert(std::move(client));
@@ -113,6 +498,12 @@ struct Service : handlers::ClientManager
 
     void remove_connection(std::shared_ptr<handlers::Client> client) override
     {
+        // The client left its subscription nodes.
+        if (!shards.empty())
+        {
+            route_shards.invalidate();
+        }
+
         boost::unique_lock<boost::shared_mutex> l(mutex);
         if (conns.erase(client) != 1)
         {
@@ -125,47 +516,324 @@ struct Service : handlers::ClientManager
     std::vector<handlers::SubscriptionNode*> subscribe(
         std::vector<handlers::Subscription> subs, handlers::Client* client) override
     {
-        return router.add(std::move(subs), *client);
+        if (shards.empty())
+        {
+            return router.add(std::move(subs), *client);
+        }
+
+        // The subscriptions of a queue group go to the shard owning it, the
+        // others to the shard of the client.
+        std::vector<std::vector<handlers::Subscription>> by_shard(shards.size());
+        for (auto& sub : subs)
+        {
+            const auto index =
+                sub.queue_group.empty()
+                    ? client->shard_index()
+                    : RouteShards::owner_of(sub.queue_group, shards.size());
+            by_shard[index].push_back(sub);
+        }
+
+        std::vector<handlers::SubscriptionNode*> nodes;
+        for (size_t i = 0; i < by_shard.size(); ++i)
+        {
+            if (by_shard[i].empty())
+            {
+                continue;
+            }
+
+            auto added = shards[i]->router.add(std::move(by_shard[i]), *client);
+            nodes.insert(nodes.end(), added.begin(), added.end());
+        }
+        route_shards.invalidate();
+        return nodes;
     }
 
     std::vector<handlers::SubscriptionNode*> unsubscribe(
-        std::vector<boost::string_view> subs, handlers::Client* client) override
+        std::vector<handlers::Subscription> subs, handlers::Client* client) override
     {
-        return router.remove(std::move(subs), *client);
+        auto nodes = router_of(*client).remove(subs, *client);
+        if (shards.empty() || subs.empty())
+        {
+            return nodes;
+        }
+
+        // An unsubscription is not told the queue group, it goes to the
+        // shards owning the groups of the client.
+        std::vector<size_t> owners;
+        for (auto& group : client->queue_groups())
+        {
+            const auto index = RouteShards::owner_of(group, shards.size());
+            if (index != client->shard_index() &&
+                std::find(owners.begin(), owners.end(), index) == owners.end())
+            {
+                owners.push_back(index);
+            }
+        }
+
+        for (auto index : owners)
+        {
+            auto removed = shards[index]->router.remove(subs, *client);
+            nodes.insert(nodes.end(), removed.begin(), removed.end());
+        }
+
+        // The client leaves the nodes now rather than once this returns, so
+        // that the shards of their routes are not resolved again before.
+        for (auto node : nodes)
+        {
+            node->remove_client(*client);
+        }
+        route_shards.invalidate();
+        return nodes;
+    }
+
+    Router& router_of(const handlers::Client& client)
+    {
+        return shards.empty() ? router : shards[client.shard_index()]->router;
     }
 
-    void emit_to(std::string route,
-                 std::unique_ptr<handlers::SharedBufferWithSpecificMetadata> msg) override
+    void emit_to(boost::string_view route,
+                 std::unique_ptr<handlers::SharedBufferWithSpecificMetadata> msg,
+                 handlers::Client* producer) override
     {
+        if (message_log)
+        {
+            message_log->append(route, *msg);
+        }
 
-        services::blabla::ConsumerMessageHeader header;
+        if (!shards.empty())
         {
-            header.mutable_header()->set_type(services::blabla::MESSAGE);
-            header.set_route(route);
-            header.set_message_size(msg->payload_size());
+            emit_sharded(route, std::move(msg), producer);
+            return;
         }
 
-        // Lock to avoid a client being destroyed while one is trying to deliver
-        // a message.
-        auto emit_lambda = [msg = std::move(msg), route, header](
+        deliver(router, route, *msg, producer);
+    }
+
+    void deliver(Router& router,
+                 boost::string_view route,
+                 const handlers::SharedBufferWithSpecificMetadata& msg,
+                 handlers::Client* producer)
+    {
+        deliver(router.subscriptions_for(route), policy_for(route), route, msg, producer);
+    }
+
+    void deliver(const std::vector<handlers::SubscriptionNode*>& subscriptions,
+                 const OutboundPolicy& policy,
+                 boost::string_view route,
+                 const handlers::SharedBufferWithSpecificMetadata& msg,
+                 handlers::Client* producer)
+    {
+        // Only the correlation id differs between subscribers.
+        handlers::ConsumerHeaderEncoder header(route, msg.payload_size(), msg.offset());
+
+        // A client unsubscribes from every SubscriptionNode before being
+        // removed from conns, the node locks taken by foreach_client and
+        // foreach_queue_group are enough to keep it alive while a message is
+        // delivered.
+        size_t fanout = 0;
+        auto emit_lambda = [&msg, &header, &policy, &fanout, route, producer](
                                handlers::Client& cl, int32_t correlation_id) {
-            auto current_client_metadata = header;
+            cl.send(msg.new_with_metadata(header.in(cl.wire_mode()), correlation_id),
+                    route, policy, producer);
+            ++fanout;
+        };
+
+        for (auto& sub : subscriptions)
+        {
+            sub->foreach_client(emit_lambda);
+        }
+        handlers::SubscriptionNode::foreach_queue_group(subscriptions, emit_lambda);
+        metrics::local().fanout.record(fanout);
+    }
+
+    // Runs on the thread of the producer shard: its subscribers are served
+    // right away, the other shards get the message once the current handler
+    // returns.
+    void emit_sharded(boost::string_view route,
+                      std::unique_ptr<handlers::SharedBufferWithSpecificMetadata> msg,
+                      handlers::Client* producer)
+    {
+        auto& local = *shards[producer->shard_index()];
+        for (auto index : route_shards.shards_for(route, shards))
+        {
+            if (index == local.index)
             {
-                current_client_metadata.set_correlation_id(correlation_id);
+                continue;
             }
-            std::vector<uint8_t> metadata;
+
+            auto& outbox = local.outboxes[index];
+            if (!outbox)
             {
-                metadata.resize(current_client_metadata.ByteSize());
-                current_client_metadata.SerializeToArray(metadata.data(),
-                                                         metadata.size());
+                outbox = std::make_unique<DeliveryBatch>();
             }
-            cl.send(msg->new_with_metadata(std::move(metadata)));
-        };
+            outbox->add(route, msg->share(), producer);
+            schedule_flush(local);
+        }
 
-        boost::shared_lock<boost::shared_mutex> l(mutex);
-        for (auto& sub : router.subscriptions_for(route))
+        deliver(local.router, route, *msg, producer);
+    }
+
+    void schedule_flush(Shard& shard)
+    {
+        if (shard.flush_scheduled)
         {
-            sub->foreach_client(emit_lambda);
+            return;
+        }
+
+        shard.flush_scheduled = true;
+        ++pending_handovers;
+        boost::asio::post(shard.ctx, [this, &shard] {
+            shard.flush_scheduled = false;
+            flush(shard);
+            --pending_handovers;
+        });
+    }
+
+    void flush(Shard& shard)
+    {
+        for (auto& outbox : shard.outboxes)
+        {
+            if (!outbox)
+            {
+                continue;
+            }
+
+            auto& destination = *shards[&outbox - shard.outboxes.data()];
+            const auto bytes = outbox->bytes;
+            const auto producers = outbox->producers;
+
+            destination.inbound_bytes += bytes;
+            if (destination.mailbox.push(std::move(outbox)))
+            {
+                ++pending_handovers;
+                boost::asio::post(destination.ctx, [this, &destination] {
+                    drain(destination);
+                    --pending_handovers;
+                });
+            }
+
+            // The subscribers do not have to be slow for the destination to
+            // fall behind, its thread may be busy with its own producers.
+            std::lock_guard<std::mutex> l(destination.paused_mutex);
+            if (destination.inbound_bytes > Shard::MAX_INBOUND_BYTES)
+            {
+                for (auto& producer : producers)
+                {
+                    producer->pause_reads();
+                    destination.paused_producers.emplace_back(producer);
+                }
+            }
+        }
+    }
+
+    void drain(Shard& shard)
+    {
+        for (auto& batch : shard.mailbox.take())
+        {
+            shard.inbox.emplace_back(std::move(batch));
+        }
+
+        // Bounded, so that the writes of the shard connections are not
+        // starved by a busy producer.
+        size_t delivered = 0;
+        while (!shard.inbox.empty() && delivered < Shard::MAX_DRAIN_BYTES)
+        {
+            auto batch = std::move(shard.inbox.front());
+            shard.inbox.pop_front();
+            for (auto& delivery : batch->deliveries)
+            {
+                deliver(shard.router, delivery.route, *delivery.message,
+                        delivery.producer);
+            }
+            shard.inbound_bytes -= batch->bytes;
+            delivered += batch->bytes;
+        }
+
+        if (!shard.inbox.empty())
+        {
+            ++pending_handovers;
+            boost::asio::post(shard.ctx, [this, &shard] {
+                drain(shard);
+                --pending_handovers;
+            });
+            return;
+        }
+
+        std::vector<std::weak_ptr<handlers::Client>> paused;
+        {
+            std::lock_guard<std::mutex> l(shard.paused_mutex);
+            if (shard.inbound_bytes > Shard::MAX_INBOUND_BYTES / 2)
+            {
+                return;
+            }
+            paused.swap(shard.paused_producers);
+        }
+
+        for (auto& weak : paused)
+        {
+            if (auto producer = weak.lock())
+            {
+                producer->resume_reads();
+            }
+        }
+    }
+
+    void emit_batch(std::vector<handlers::BatchMessage>& batch,
+                    handlers::Client* producer) override
+    {
+        if (message_log)
+        {
+            for (auto& msg : batch)
+            {
+                message_log->append(msg.route, *msg.message);
+            }
+        }
+
+        if (!shards.empty())
+        {
+            for (auto& msg : batch)
+            {
+                emit_sharded(msg.route, std::move(msg.message), producer);
+            }
+            return;
+        }
+
+        // Each route is resolved once, in the order of its first message. The
+        // messages are then delivered in the order of the batch: a subscriber
+        // matching several of its routes receives them in publish order, as
+        // if they were published one by one.
+        static thread_local std::unordered_map<boost::string_view, size_t, RouteHash>
+            indices;
+        static thread_local std::vector<ResolvedRoute> routes;
+        static thread_local std::vector<size_t> route_of;
+        indices.clear();
+        route_of.clear();
+
+        for (auto& msg : batch)
+        {
+            auto inserted = indices.emplace(msg.route, indices.size());
+            if (inserted.second)
+            {
+                if (routes.size() < indices.size())
+                {
+                    routes.emplace_back();
+                }
+
+                // The reference returned by the router is only valid until
+                // its next lookup.
+                auto& route = routes[inserted.first->second];
+                const auto& subscriptions = router.subscriptions_for(msg.route);
+                route.subscriptions.assign(subscriptions.begin(), subscriptions.end());
+                route.policy = &policy_for(msg.route);
+            }
+            route_of.push_back(inserted.first->second);
+        }
+
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            const auto& route = routes[route_of[i]];
+            deliver(route.subscriptions, *route.policy, batch[i].route,
+                    *batch[i].message, producer);
         }
     }
 
@@ -173,15 +841,27 @@ struct Service : handlers::ClientManager
     const ServiceConfiguration& conf;
 
     std::vector<std::unique_ptr<handlers::Acceptor>> acceptors;
+    std::vector<std::unique_ptr<handlers::UnixAcceptor>> unix_acceptors;
+    std::unique_ptr<handlers::LocalAcceptor> local_acceptor;
     mutable boost::shared_mutex mutex;
     std::unordered_set<std::shared_ptr<handlers::Client>> conns;
+    // Used unless the service runs a shard per core.
     Router router;
+    std::vector<std::unique_ptr<Shard>> shards;
+    RouteShards route_shards;
+    std::atomic<size_t> pending_handovers{0};
+    bool use_uring = false;
+    handlers::OutboundStats stats;
+    std::unique_ptr<journal::Journals> message_log;
+    std::unique_ptr<handlers::MetricsListener> metrics_listener;
 };
 } // namespace detail
 
 Service::Service(ServiceConfiguration _conf)
 : conf(std::move(_conf))
-, pool(conf.threads.io_threads, "blabla", conf.threads.io_context)
+, pool(conf.threads.shard_per_core ? conf.threads.io_context : conf.threads.io_threads,
+       "blabla",
+       conf.threads.io_context)
 {
 }
 
@@ -1,12 +1,83 @@
 #pragma once
 
+#include <chrono>
+#include <map>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include <commonpp/thread/ThreadPool.hpp>
 
 namespace blabla
 {
 
+// What to do with a message that does not fit in the outbound budget of a
+// subscriber, that is the subscriber does not read fast enough.
+struct OutboundPolicy
+{
+    enum class Overflow
+    {
+        drop_oldest,    // evict queued messages, oldest first.
+        drop_newest,    // do not queue the new message.
+        disconnect,     // close the subscriber connection.
+        pause_producer, // stop reading from the producer until drained.
+    };
+
+    // pause_producer queues the message anyway and only stops the reads of
+    // its producer: what the producer already received, and what the other
+    // producers send until they are paused in turn, is still queued. The
+    // queue may exceed max_bytes and max_messages by that much, the
+    // producers are resumed once it is back under half of them.
+    Overflow overflow = Overflow::drop_oldest;
+    size_t max_bytes = 64 * 1024 * 1024;
+    size_t max_messages = 1024 * 1024;
+};
+
+// Drives the connections.
+enum class NetworkBackend
+{
+    asio,
+    // The accepts, reads and writes go through io_uring, asio is used when
+    // the kernel does not support it. The local clients stay on their
+    // shared memory channels.
+    io_uring,
+};
+
+// When the journal files are flushed to the disk (fsync). Deliveries never
+// wait for it, a crash may lose what was not flushed yet.
+enum class FsyncPolicy
+{
+    // Left to the kernel writeback.
+    never,
+    // Every fsync_interval.
+    periodic,
+    // As soon as possible: the messages journaled while a flush runs are
+    // flushed together by the next one.
+    eager,
+};
+
+// Append only log of the messages published on some routes, which the
+// subscribers can replay. Disabled unless directory is set.
+struct JournalConfiguration
+{
+    std::string directory;
+    // A journal per route prefix (on '.' boundaries), in a directory of its
+    // name. A route goes to the longest prefix matching it, the other routes
+    // are not journaled.
+    std::vector<std::string> route_prefixes;
+
+    // Preallocated size of the segment files, the largest message must fit
+    // in one.
+    size_t segment_bytes = 64 * 1024 * 1024;
+    // Oldest segments are removed beyond this count, 0 keeps them all.
+    size_t max_segments = 0;
+    // Distance between the entries of the sparse index of a segment.
+    size_t index_interval_bytes = 4096;
+
+    FsyncPolicy fsync = FsyncPolicy::periodic;
+    std::chrono::milliseconds fsync_interval{100};
+};
+
 struct ServiceConfiguration
 {
 
@@ -14,17 +85,72 @@ struct ServiceConfiguration
     {
         std::string address;
         int port;
+        // When set, listens on this AF_UNIX stream path instead, address and
+        // port are ignored.
+        std::string path;
     };
 
     struct
     {
         std::vector<Address> addresses;
+        NetworkBackend backend = NetworkBackend::asio;
+
+        // One listening socket per address and io context instead of one per
+        // address, the kernel spreads the new connections amongst them
+        // (SO_REUSEPORT) and each context accepts its own connections.
+        bool reuse_port = false;
+        // With reuse_port, a connection is accepted by the io context whose
+        // thread is pinned to the CPU which received it. It needs one thread
+        // per context (shard_per_core, or io_threads equal to io_context),
+        // it is ignored with a warning otherwise. The CPUs no context is
+        // pinned to use the CPU index modulo the number of contexts.
+        bool cpu_affinity = false;
+
+        // Users (uid) allowed to connect on the AF_UNIX addresses and on
+        // local_path, checked with the credentials of the peer (SO_PEERCRED).
+        // Anyone who can open the path when empty.
+        std::vector<uint32_t> unix_allowed_uids;
+
+        // When set, the clients of the same host can connect on this
+        // AF_UNIX path and then talk to the server through shared memory
+        // rings of local_ring_bytes (a power of 2) in each direction.
+        std::string local_path;
+        uint64_t local_ring_bytes = 4 * 1024 * 1024;
     } service;
 
+    struct
+    {
+        // Queued messages of a connection are gathered into a single write,
+        // up to these limits. asio does not hand more than 64 buffers to
+        // writev anyway.
+        size_t max_write_buffers = 64;
+        size_t max_write_bytes = 256 * 1024;
+
+        // Budget of a connection, applied per route prefix: the policy with
+        // the longest prefix matching the route of a message is used.
+        OutboundPolicy policy;
+        std::map<std::string, OutboundPolicy> route_policies;
+    } outbound;
+
+    JournalConfiguration journal;
+
+    // Served over HTTP in the Prometheus text format, on GET /metrics.
+    // Disabled unless port is set, the metrics are collected either way.
+    struct
+    {
+        std::string address = "0.0.0.0";
+        int port = 0;
+    } metrics;
+
     struct
     {
         int io_threads = std::thread::hardware_concurrency();
         int io_context = commonpp::thread::get_nb_physical_core();
+        // One thread per io context, each owns the connections started on it
+        // and routes their subscriptions: publishing takes no shared lock and
+        // the deliveries to the other contexts are handed over in batches.
+        // io_threads is ignored.
+        bool shard_per_core = false;
     } threads;
 };
 
@@ -0,0 +1,154 @@
+#include "Metrics.hpp"
+
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace blabla
+{
+namespace metrics
+{
+
+namespace
+{
+struct Registry
+{
+    ThreadMetrics& add()
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        threads.emplace_back(new ThreadMetrics);
+        return *threads.back();
+    }
+
+    Totals collect()
+    {
+        Totals totals;
+        std::lock_guard<std::mutex> l(mutex);
+        for (auto& metrics : threads)
+        {
+            const auto& thread = *metrics;
+            totals.messages_in += thread.messages_in.get();
+            totals.bytes_in += thread.bytes_in.get();
+            totals.messages_out += thread.messages_out.get();
+            totals.bytes_out += thread.bytes_out.get();
+            totals.accepted += thread.accepted.get();
+            totals.route_lookups += thread.route_lookups.get();
+            totals.route_cache_misses += thread.route_cache_misses.get();
+            totals.route_lookup_ns.merge(thread.route_lookup_ns);
+            totals.fanout.merge(thread.fanout);
+            totals.delivery_ns.merge(thread.delivery_ns);
+        }
+        return totals;
+    }
+
+    std::mutex mutex;
+    // The metrics of the threads which exited are kept, the counters never go
+    // back.
+    std::vector<std::unique_ptr<ThreadMetrics>> threads;
+};
+
+Registry& registry()
+{
+    static Registry registry;
+    return registry;
+}
+
+void write_header(std::ostream& out, const char* name, const char* help, const char* type)
+{
+    out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type
+        << '\n';
+}
+} // namespace
+
+void* ThreadMetrics::operator new(size_t size)
+{
+    void* ptr = nullptr;
+    if (::posix_memalign(&ptr, alignof(ThreadMetrics), size) != 0)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void ThreadMetrics::operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+ThreadMetrics& detail::register_thread()
+{
+    return registry().add();
+}
+
+Totals collect()
+{
+    return registry().collect();
+}
+
+void write_counter(std::ostream& out, const char* name, const char* help, uint64_t value)
+{
+    write_header(out, name, help, "counter");
+    out << name << ' ' << value << '\n';
+}
+
+void write_gauge(std::ostream& out, const char* name, const char* help, double value)
+{
+    write_header(out, name, help, "gauge");
+    out << name << ' ' << value << '\n';
+}
+
+void write_histogram(std::ostream& out,
+                     const char* name,
+                     const char* help,
+                     const HistogramSnapshot& histogram,
+                     double scale)
+{
+    write_header(out, name, help, "histogram");
+
+    // The exposed buckets are cumulative.
+    uint64_t count = 0;
+    for (size_t i = 0; i + 1 < HISTOGRAM_BUCKETS; ++i)
+    {
+        count += histogram.buckets[i];
+        out << name << "_bucket{le=\"" << double(uint64_t(1) << i) * scale << "\"} "
+            << count << '\n';
+    }
+    count += histogram.buckets.back();
+    out << name << "_bucket{le=\"+Inf\"} " << count << '\n';
+    out << name << "_sum " << histogram.sum * scale << '\n';
+    out << name << "_count " << count << '\n';
+}
+
+void write(std::ostream& out, const Totals& totals)
+{
+    write_counter(out, "blabla_messages_in_total", "Messages published.",
+                  totals.messages_in);
+    write_counter(out, "blabla_bytes_in_total", "Bytes received from the connections.",
+                  totals.bytes_in);
+    write_counter(out, "blabla_messages_out_total", "Messages written to the subscribers.",
+                  totals.messages_out);
+    write_counter(out, "blabla_bytes_out_total", "Bytes written to the connections.",
+                  totals.bytes_out);
+    write_counter(out, "blabla_connections_accepted_total", "Connections accepted.",
+                  totals.accepted);
+    write_counter(out, "blabla_route_lookups_total", "Routes resolved to their subscriptions.",
+                  totals.route_lookups);
+    write_counter(out, "blabla_route_cache_misses_total",
+                  "Route lookups missing the route cache.", totals.route_cache_misses);
+    write_histogram(out, "blabla_route_lookup_seconds",
+                    "Duration of the route lookups missing the route cache.",
+                    totals.route_lookup_ns, 1e-9);
+    write_histogram(out, "blabla_fanout",
+                    "Subscribers a published message is handed to, by shard in shard "
+                    "per core mode.",
+                    totals.fanout);
+    write_histogram(out, "blabla_delivery_seconds",
+                    "From the read of a payload to the completion of its write to a "
+                    "subscriber.",
+                    totals.delivery_ns, 1e-9);
+}
+
+} // namespace metrics
+} // namespace blabla
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+#include <boost/config.hpp>
+
+namespace blabla
+{
+namespace metrics
+{
+
+// Counter written by a single thread: a relaxed load and store, without the
+// locked instruction of a fetch_add. Any thread may read it.
+class Counter
+{
+public:
+    void add(uint64_t n = 1) noexcept
+    {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const noexcept
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+// Buckets of powers of 2: bucket i holds the values in (2^(i-1), 2^i], the
+// first one 0 and 1 and the last one everything above.
+constexpr size_t HISTOGRAM_BUCKETS = 48;
+
+inline size_t bucket_of(uint64_t value) noexcept
+{
+    return value <= 1 ? 0
+                      : std::min<size_t>(64 - __builtin_clzll(value - 1),
+                                         HISTOGRAM_BUCKETS - 1);
+}
+
+// Histogram written by a single thread.
+class Histogram
+{
+public:
+    void record(uint64_t value, uint64_t count = 1) noexcept
+    {
+        buckets[bucket_of(value)].add(count);
+        total.add(value * count);
+    }
+
+private:
+    friend struct HistogramSnapshot;
+
+    std::array<Counter, HISTOGRAM_BUCKETS> buckets;
+    Counter total;
+};
+
+struct HistogramSnapshot
+{
+    void record(uint64_t value, uint64_t count = 1) noexcept
+    {
+        buckets[bucket_of(value)] += count;
+        sum += value * count;
+    }
+
+    void merge(const Histogram& histogram) noexcept
+    {
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        {
+            buckets[i] += histogram.buckets[i].get();
+        }
+        sum += histogram.total.get();
+    }
+
+    std::array<uint64_t, HISTOGRAM_BUCKETS> buckets{};
+    uint64_t sum = 0;
+};
+
+// Metrics of a thread, only written by it and summed on scrape. Aligned on a
+// cache line to avoid false sharing with the metrics of the other threads.
+struct alignas(64) ThreadMetrics
+{
+    // Messages published, and the bytes received from the connections.
+    Counter messages_in;
+    Counter bytes_in;
+    // Messages written to the subscribers, and the bytes written to the
+    // connections.
+    Counter messages_out;
+    Counter bytes_out;
+    Counter accepted;
+
+    Counter route_lookups;
+    Counter route_cache_misses;
+    // Duration of the lookups missing the route cache, in nanoseconds: the
+    // hits are not timed, reading the clock would cost more than them.
+    Histogram route_lookup_ns;
+
+    // Subscribers a message is handed to.
+    Histogram fanout;
+    // From the read of a payload to the completion of its write to a
+    // subscriber, in nanoseconds.
+    Histogram delivery_ns;
+
+    // The default operator new does not honour the alignment before C++17.
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr) noexcept;
+};
+
+namespace detail
+{
+ThreadMetrics& register_thread();
+}
+
+// Metrics of the calling thread.
+inline ThreadMetrics& local()
+{
+    static thread_local ThreadMetrics* metrics = nullptr;
+    if (BOOST_UNLIKELY(metrics == nullptr))
+    {
+        metrics = &detail::register_thread();
+    }
+    return *metrics;
+}
+
+// Nanoseconds of the steady clock, which stamps the received payloads.
+inline uint64_t now() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Sum of the metrics of every thread.
+struct Totals
+{
+    uint64_t messages_in = 0;
+    uint64_t bytes_in = 0;
+    uint64_t messages_out = 0;
+    uint64_t bytes_out = 0;
+    uint64_t accepted = 0;
+    uint64_t route_lookups = 0;
+    uint64_t route_cache_misses = 0;
+    HistogramSnapshot route_lookup_ns;
+    HistogramSnapshot fanout;
+    HistogramSnapshot delivery_ns;
+};
+
+Totals collect();
+
+// Prometheus text exposition format. The histograms are recorded in units
+// and exposed in units * scale (nanoseconds to seconds for instance).
+void write_counter(std::ostream& out, const char* name, const char* help, uint64_t value);
+void write_gauge(std::ostream& out, const char* name, const char* help, double value);
+void write_histogram(std::ostream& out,
+                     const char* name,
+                     const char* help,
+                     const HistogramSnapshot& histogram,
+                     double scale = 1);
+// The metrics of the threads.
+void write(std::ostream& out, const Totals& totals);
+
+} // namespace metrics
+} // namespace blabla
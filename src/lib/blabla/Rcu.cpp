@@ -0,0 +1,214 @@
+#include "Rcu.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace blabla
+{
+namespace rcu
+{
+
+namespace
+{
+// Epoch 0 means that the thread is not in a read side critical section.
+std::atomic<uint64_t> global_epoch{1};
+
+struct Slot
+{
+    std::atomic<uint64_t> epoch{0};
+    bool in_use = false;
+
+    // Avoid false sharing between the readers.
+    char padding[64 - sizeof(std::atomic<uint64_t>) - sizeof(bool)];
+};
+
+struct Registry
+{
+    Slot* acquire()
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        for (auto& slot : slots)
+        {
+            if (!slot.in_use)
+            {
+                slot.in_use = true;
+                return &slot;
+            }
+        }
+
+        slots.emplace_back();
+        slots.back().in_use = true;
+        return &slots.back();
+    }
+
+    void release(Slot* slot)
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        slot->epoch.store(0, std::memory_order_release);
+        slot->in_use = false;
+    }
+
+    std::mutex mutex;
+    // Slots are never freed, a deque does not move its elements.
+    std::deque<Slot> slots;
+};
+
+Registry& registry()
+{
+    static Registry registry;
+    return registry;
+}
+
+struct ThreadState
+{
+    ThreadState()
+    : slot(registry().acquire())
+    {
+    }
+
+    ~ThreadState()
+    {
+        registry().release(slot);
+    }
+
+    Slot* slot;
+    unsigned nesting = 0;
+};
+
+ThreadState& thread_state()
+{
+    static thread_local ThreadState state;
+    return state;
+}
+} // namespace
+
+ReadGuard::ReadGuard()
+{
+    auto& state = thread_state();
+    if (state.nesting++ == 0)
+    {
+        state.slot->epoch.store(global_epoch.load(std::memory_order_relaxed),
+                                std::memory_order_relaxed);
+        // The epoch must be visible before the snapshot is loaded.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+ReadGuard::~ReadGuard()
+{
+    auto& state = thread_state();
+    assert(state.nesting > 0);
+    if (--state.nesting == 0)
+    {
+        state.slot->epoch.store(0, std::memory_order_release);
+    }
+}
+
+namespace
+{
+class Reclaimer
+{
+public:
+    Reclaimer()
+    {
+        // Used by the thread until it is joined, it must be destroyed after.
+        registry();
+        thread = std::thread([this] { run(); });
+    }
+
+    ~Reclaimer()
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+
+    void add(std::function<void()> reclaim)
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            pending.emplace_back(std::move(reclaim));
+        }
+        cv.notify_one();
+    }
+
+private:
+    // What is still pending when stopping is reclaimed before exiting.
+    void run()
+    {
+        std::vector<std::function<void()>> batch;
+        std::unique_lock<std::mutex> l(mutex);
+        while (true)
+        {
+            cv.wait(l, [this] { return stopping || !pending.empty(); });
+            if (pending.empty())
+            {
+                return;
+            }
+
+            batch.swap(pending);
+            l.unlock();
+            synchronize();
+            for (auto& reclaim : batch)
+            {
+                reclaim();
+            }
+            batch.clear();
+            l.lock();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::function<void()>> pending;
+    bool stopping = false;
+    std::thread thread;
+};
+
+Reclaimer& reclaimer()
+{
+    static Reclaimer reclaimer;
+    return reclaimer;
+}
+} // namespace
+
+void call(std::function<void()> reclaim)
+{
+    reclaimer().add(std::move(reclaim));
+}
+
+void synchronize()
+{
+    assert(thread_state().nesting == 0);
+
+    // The new snapshot must be visible before the slots are read.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const auto target = global_epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+
+    auto& reg = registry();
+    std::lock_guard<std::mutex> l(reg.mutex);
+    for (auto& slot : reg.slots)
+    {
+        while (true)
+        {
+            auto epoch = slot.epoch.load(std::memory_order_acquire);
+            if (epoch == 0 || epoch >= target)
+            {
+                break;
+            }
+
+            std::this_thread::yield();
+        }
+    }
+}
+
+} // namespace rcu
+} // namespace blabla
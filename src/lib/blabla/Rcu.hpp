@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+namespace blabla
+{
+namespace rcu
+{
+
+// Read side critical section: a snapshot loaded while a ReadGuard is alive is
+// not reclaimed before the guard is destroyed. Entering and leaving a section
+// only stores into a slot owned by the current thread, it does not modify any
+// shared state. Sections can be nested.
+class ReadGuard
+{
+public:
+    ReadGuard();
+    ~ReadGuard();
+
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+};
+
+// Waits until every read side critical section that started before the call
+// has exited. A writer publishes a new snapshot, calls synchronize() and can
+// then reclaim the previous one.
+//
+// Must not be called from within a read side critical section.
+void synchronize();
+
+// Calls reclaim once every read side critical section that started before
+// the call has exited. Unlike synchronize() the caller does not wait: a thread
+// of its own waits for the grace period, shared by the callbacks queued
+// meanwhile, and runs them. It can be called from a read side critical
+// section.
+void call(std::function<void()> reclaim);
+
+} // namespace rcu
+} // namespace blabla
@@ -0,0 +1,236 @@
+#include "RoutePatterns.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace blabla
+{
+
+namespace
+{
+// Splits the first token of route, route is updated to the remaining tokens.
+boost::string_view next_token(boost::string_view& route)
+{
+    auto idx = route.find('.');
+    if (idx == boost::string_view::npos)
+    {
+        auto token = route;
+        route = boost::string_view();
+        return token;
+    }
+
+    auto token = route.substr(0, idx);
+    route.remove_prefix(idx + 1);
+    return token;
+}
+
+template <typename Children>
+auto lower_bound(Children& children, boost::string_view token)
+{
+    return std::lower_bound(
+        children.begin(), children.end(), token,
+        [](const auto& child, boost::string_view t) { return child.first < t; });
+}
+} // namespace
+
+RoutePatterns::Node::Node(const Node& other)
+: tail_match(other.tail_match)
+, exact_match(other.exact_match)
+{
+    children.reserve(other.children.size());
+    for (auto& child : other.children)
+    {
+        children.emplace_back(child.first, std::make_unique<Node>(*child.second));
+    }
+
+    if (other.any_token)
+    {
+        any_token = std::make_unique<Node>(*other.any_token);
+    }
+}
+
+RoutePatterns::RoutePatterns()
+: root(std::make_unique<Node>())
+{
+}
+
+RoutePatterns::~RoutePatterns() = default;
+
+RoutePatterns::RoutePatterns(const RoutePatterns& other)
+: root(std::make_unique<Node>(*other.root))
+, size(other.size)
+{
+}
+
+bool RoutePatterns::is_valid(boost::string_view pattern)
+{
+    if (pattern.empty())
+    {
+        return false;
+    }
+
+    while (!pattern.empty())
+    {
+        auto token = next_token(pattern);
+        if (token.empty())
+        {
+            return false;
+        }
+
+        if (token == ">")
+        {
+            return pattern.empty();
+        }
+
+        // Wildcards must be whole tokens.
+        if (token != "*" && token.find_first_of("*>") != boost::string_view::npos)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool RoutePatterns::matches(boost::string_view pattern, boost::string_view route)
+{
+    while (!pattern.empty())
+    {
+        auto token = next_token(pattern);
+        if (route.empty())
+        {
+            return false;
+        }
+
+        if (token == ">")
+        {
+            return true;
+        }
+
+        auto part = next_token(route);
+        if (token != "*" && token != part)
+        {
+            return false;
+        }
+    }
+
+    return route.empty();
+}
+
+// Returns the node holding the subscriptions of pattern, if any.
+const RoutePatterns::Node* RoutePatterns::find_node(boost::string_view pattern) const
+{
+    const Node* node = root.get();
+    // `>` is stored in the node of the previous token.
+    while (node != nullptr && !pattern.empty() && pattern != ">")
+    {
+        auto token = next_token(pattern);
+        if (token == "*")
+        {
+            node = node->any_token.get();
+            continue;
+        }
+
+        auto it = lower_bound(node->children, token);
+        node = it != node->children.end() && it->first == token
+                   ? it->second.get()
+                   : nullptr;
+    }
+
+    return node;
+}
+
+handlers::SubscriptionNode* RoutePatterns::find(boost::string_view pattern) const
+{
+    assert(is_valid(pattern));
+    auto node = find_node(pattern);
+    if (node == nullptr)
+    {
+        return nullptr;
+    }
+
+    return pattern.back() == '>' ? node->tail_match : node->exact_match;
+}
+
+void RoutePatterns::insert(boost::string_view pattern,
+                           handlers::SubscriptionNode* subscription)
+{
+    assert(is_valid(pattern));
+    Node* node = root.get();
+    while (!pattern.empty())
+    {
+        auto token = next_token(pattern);
+        if (token == ">")
+        {
+            assert(node->tail_match == nullptr);
+            node->tail_match = subscription;
+            ++size;
+            return;
+        }
+
+        if (token == "*")
+        {
+            if (!node->any_token)
+            {
+                node->any_token = std::make_unique<Node>();
+            }
+            node = node->any_token.get();
+            continue;
+        }
+
+        auto it = lower_bound(node->children, token);
+        if (it == node->children.end() || it->first != token)
+        {
+            it = node->children.emplace(it, token.to_string(),
+                                        std::make_unique<Node>());
+        }
+        node = it->second.get();
+    }
+
+    assert(node->exact_match == nullptr);
+    node->exact_match = subscription;
+    ++size;
+}
+
+void RoutePatterns::match(boost::string_view route,
+                          std::vector<handlers::SubscriptionNode*>& subscriptions) const
+{
+    if (size != 0 && !route.empty())
+    {
+        match(*root, route, subscriptions);
+    }
+}
+
+void RoutePatterns::match(const Node& node,
+                          boost::string_view remaining,
+                          std::vector<handlers::SubscriptionNode*>& subscriptions)
+{
+    if (remaining.empty())
+    {
+        if (node.exact_match)
+        {
+            subscriptions.emplace_back(node.exact_match);
+        }
+        return;
+    }
+
+    // At least one token remains.
+    if (node.tail_match)
+    {
+        subscriptions.emplace_back(node.tail_match);
+    }
+
+    auto token = next_token(remaining);
+    auto it = lower_bound(node.children, token);
+    if (it != node.children.end() && it->first == token)
+    {
+        match(*it->second, remaining, subscriptions);
+    }
+
+    if (node.any_token)
+    {
+        match(*node.any_token, remaining, subscriptions);
+    }
+}
+
+} // namespace blabla
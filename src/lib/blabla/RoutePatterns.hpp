@@ -0,0 +1,104 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/utility/string_view.hpp>
+
+namespace blabla
+{
+namespace handlers
+{
+struct SubscriptionNode;
+}
+
+// Token level trie of the wildcard subscriptions. Routes are split on '.', in
+// a pattern `*` matches exactly one token and `>`, which must be the last
+// token, matches one or more tokens: `a.*.c` matches `a.b.c` and `a.>`
+// matches `a.b` and `a.b.c`.
+//
+// Matching walks at most two branches per token (the literal one and `*`) so
+// its cost depends on the depth of the route, not on the number of patterns.
+class RoutePatterns
+{
+public:
+    RoutePatterns();
+    ~RoutePatterns();
+
+    // Deep copy, the SubscriptionNode are shared.
+    RoutePatterns(const RoutePatterns&);
+    RoutePatterns& operator=(const RoutePatterns&) = delete;
+
+    handlers::SubscriptionNode* find(boost::string_view pattern) const;
+    // The pattern must be valid and not already present.
+    void insert(boost::string_view pattern, handlers::SubscriptionNode* node);
+
+    // Appends the SubscriptionNode of every pattern matching route.
+    void match(boost::string_view route,
+               std::vector<handlers::SubscriptionNode*>& subscriptions) const;
+
+    // Calls cb on each SubscriptionNode.
+    template <typename CB>
+    void foreach_node(CB&& cb) const
+    {
+        foreach_node(*root, cb);
+    }
+
+    bool empty() const
+    {
+        return size == 0;
+    }
+
+    static bool is_valid(boost::string_view pattern);
+    // Whether a valid pattern matches route, without a trie.
+    static bool matches(boost::string_view pattern, boost::string_view route);
+
+private:
+    struct Node
+    {
+        Node() = default;
+        Node(const Node&);
+
+        // Sorted by token.
+        std::vector<std::pair<std::string, std::unique_ptr<Node>>> children;
+        std::unique_ptr<Node> any_token;                       // `*`
+        handlers::SubscriptionNode* tail_match = nullptr;      // `>`
+        handlers::SubscriptionNode* exact_match = nullptr;     // pattern ends here
+    };
+
+    const Node* find_node(boost::string_view pattern) const;
+    static void match(const Node& node,
+                      boost::string_view remaining,
+                      std::vector<handlers::SubscriptionNode*>& subscriptions);
+
+    template <typename CB>
+    static void foreach_node(const Node& node, CB& cb)
+    {
+        if (node.exact_match)
+        {
+            cb(node.exact_match);
+        }
+
+        if (node.tail_match)
+        {
+            cb(node.tail_match);
+        }
+
+        for (auto& child : node.children)
+        {
+            foreach_node(*child.second, cb);
+        }
+
+        if (node.any_token)
+        {
+            foreach_node(*node.any_token, cb);
+        }
+    }
+
+    std::unique_ptr<Node> root;
+    size_t size = 0;
+};
+
+} // namespace blabla
@@ -1,16 +1,89 @@
 #include "Router.hpp"
 
+#include <algorithm>
+#include <array>
+
+#include "Metrics.hpp"
+#include "Rcu.hpp"
+
 namespace blabla
 {
 
+namespace
+{
+std::atomic<uint64_t> next_generation{1};
+
+// Direct mapped cache of resolved routes, one per io thread. Producers tend to
+// publish to a small set of routes so a hit costs a hash and a comparison.
+struct RouteCache
+{
+    static constexpr size_t SIZE = 1024;
+    static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of 2");
+
+    struct Entry
+    {
+        const Router* router = nullptr;
+        uint64_t generation = 0;
+        std::string route;
+        std::vector<handlers::SubscriptionNode*> subscriptions;
+    };
+
+    // The router is part of the key, so a route resolved by many routers
+    // (one per shard) does not always land in the same entry.
+    Entry& entry_for(const Router* router, boost::string_view route)
+    {
+        auto hash = detail::StrHash()(route.data(), route.size());
+        hash ^= (reinterpret_cast<uintptr_t>(router) >> 4) * 0x9E3779B97F4A7C15ull;
+        return entries[hash & (SIZE - 1)];
+    }
+
+    std::array<Entry, SIZE> entries;
+};
+
+RouteCache& route_cache()
+{
+    static thread_local RouteCache cache;
+    return cache;
+}
+} // namespace
+
+Router::Router()
+: routes(new Routes)
+, generation(next_generation++)
+{
+}
+
 Router::~Router()
 {
-    for (auto it = routes.begin(), end = routes.end(); it != end; ++it)
+    std::unique_ptr<const Routes> current(routes.load());
+    for (auto it = current->prefixes.begin(), end = current->prefixes.end();
+         it != end; ++it)
     {
         delete it.value();
     }
 
-    routes.clear();
+    current->patterns.foreach_node(
+        [](handlers::SubscriptionNode* node) { delete node; });
+}
+
+handlers::SubscriptionNode* Router::find(const Routes& table,
+                                         const handlers::Subscription& sub)
+{
+    if (sub.pattern)
+    {
+        return table.patterns.find(sub.route);
+    }
+
+    auto it = table.prefixes.find_ks(sub.route.data(), sub.route.size());
+    return it != table.prefixes.end() ? it.value() : nullptr;
+}
+
+void Router::publish(std::unique_ptr<Routes> updated)
+{
+    const Routes* previous = routes.exchange(updated.release(), std::memory_order_acq_rel);
+    generation.store(next_generation++, std::memory_order_release);
+    // The (un)subscribing io thread does not wait for the publishers.
+    rcu::call([previous] { delete previous; });
 }
 
 std::vector<handlers::SubscriptionNode*> Router::add(
@@ -19,43 +92,99 @@ std::vector<handlers::SubscriptionNode*> Router::add(
     std::vector<handlers::SubscriptionNode*> subscriptions;
     subscriptions.reserve(routes_to_add.size());
 
-    // only one can succeed but rlock are not blocked yet.
-    boost::upgrade_lock<boost::shared_mutex> lock(mutex);
-    for (auto& pair : routes_to_add)
-    {
-        auto& ref = pair.first;
-        auto correlation_id = pair.second;
+    std::lock_guard<std::mutex> lock(mutex);
+    const Routes* current = routes.load(std::memory_order_relaxed);
+    // Only copied if a new route has to be inserted.
+    std::unique_ptr<Routes> updated;
 
-        auto it = routes.find_ks(ref.data(), ref.size());
-        if (it != routes.end())
+    for (auto& sub : routes_to_add)
+    {
+        auto subscription = find(updated ? *updated : *current, sub);
+        if (subscription != nullptr)
         {
-            auto subscription = it.value();
-            subscription->add_client(client, correlation_id);
+            subscription->add_client(client, sub.correlation_id, sub.queue_group);
             subscriptions.emplace_back(subscription);
             continue;
         }
 
-        auto subscription = std::make_unique<handlers::SubscriptionNode>();
-        subscription->add_client(client, correlation_id);
+        if (!updated)
         {
-            boost::upgrade_to_unique_lock<boost::shared_mutex> uniqueLock(lock);
-            routes.insert_ks(ref.data(), ref.size(), subscription.get());
+            updated = std::make_unique<Routes>(*current);
         }
 
-        subscriptions.emplace_back(subscription.release());
+        auto node = std::make_unique<handlers::SubscriptionNode>();
+        node->add_client(client, sub.correlation_id, sub.queue_group);
+        if (sub.pattern)
+        {
+            updated->patterns.insert(sub.route, node.get());
+        }
+        else
+        {
+            updated->prefixes.insert_ks(sub.route.data(), sub.route.size(),
+                                        node.get());
+        }
+        subscriptions.emplace_back(node.release());
+    }
+
+    if (updated)
+    {
+        publish(std::move(updated));
     }
 
     return subscriptions;
 }
 
-std::vector<handlers::SubscriptionNode*>
+const std::vector<handlers::SubscriptionNode*>&
 Router::subscriptions_for(boost::string_view route)
 {
-    std::vector<handlers::SubscriptionNode*> subscriptions;
+    auto& entry = route_cache().entry_for(this, route);
+    auto& local_metrics = metrics::local();
+    local_metrics.route_lookups.add();
+
+    // The generation must be read before the table: an entry may then be
+    // tagged with an older generation than its content, never a newer one.
+    auto current_generation = generation.load(std::memory_order_acquire);
+    if (BOOST_LIKELY(entry.router == this &&
+                     entry.generation == current_generation &&
+                     entry.route == route))
+    {
+        return entry.subscriptions;
+    }
+
+    const auto start = metrics::now();
+    entry.router = this;
+    entry.generation = current_generation;
+    entry.route.assign(route.data(), route.size());
+    entry.subscriptions.clear();
+
+    {
+        rcu::ReadGuard guard;
+        resolve(*routes.load(std::memory_order_acquire), route, entry.subscriptions);
+    }
+
+    local_metrics.route_cache_misses.add();
+    local_metrics.route_lookup_ns.record(metrics::now() - start);
+    return entry.subscriptions;
+}
+
+bool Router::has_subscribers(boost::string_view route)
+{
+    static thread_local std::vector<handlers::SubscriptionNode*> subscriptions;
+    subscriptions.clear();
+
+    rcu::ReadGuard guard;
+    resolve(*routes.load(std::memory_order_acquire), route, subscriptions);
+    return std::any_of(subscriptions.begin(), subscriptions.end(),
+                       [](handlers::SubscriptionNode* node) { return !node->empty(); });
+}
+
+void Router::resolve(const Routes& table,
+                     boost::string_view route,
+                     std::vector<handlers::SubscriptionNode*>& subscriptions)
+{
     boost::string_view subject_part;
     size_t idx = 0;
 
-    boost::shared_lock<boost::shared_mutex> lock(mutex);
     while (subject_part != route)
     {
         idx = route.find_first_of('.', idx);
@@ -69,30 +198,28 @@ Router::subscriptions_for(boost::string_view route)
             subject_part = route;
         }
 
-        auto it = routes.find_ks(subject_part.data(), subject_part.size());
-        if (it != routes.end())
+        auto it = table.prefixes.find_ks(subject_part.data(), subject_part.size());
+        if (it != table.prefixes.end())
         {
             subscriptions.emplace_back(it.value());
         }
     }
 
-    return subscriptions;
+    table.patterns.match(route, subscriptions);
 }
 
 std::vector<handlers::SubscriptionNode*> Router::remove(
-    std::vector<boost::string_view> routes_to_rm, handlers::Client& client)
+    std::vector<handlers::Subscription> routes_to_rm, handlers::Client& client)
 {
     std::vector<handlers::SubscriptionNode*> subscriptions;
-    boost::shared_lock<boost::shared_mutex> lock(mutex);
+    rcu::ReadGuard guard;
+    const Routes& table = *routes.load(std::memory_order_acquire);
 
-    for (auto& ref : routes_to_rm)
+    for (auto& sub : routes_to_rm)
     {
-        auto it = routes.find_ks(ref.data(), ref.size());
-        if (it != routes.end())
+        if (auto subscription = find(table, sub))
         {
-            auto subscription = it.value();
             subscriptions.emplace_back(subscription);
-            continue;
         }
     }
 
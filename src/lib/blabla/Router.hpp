@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <deque>
 #include <mutex>
 #include <set>
@@ -7,55 +8,66 @@
 #include <unordered_set>
 
 #include <boost/container/flat_set.hpp>
-#include <boost/thread/locks.hpp>
-#include <boost/thread/shared_mutex.hpp>
 #include <boost/utility/string_view.hpp>
-#include <murmur3.h>
 #include <tsl/htrie_map.h>
 
+#include "RoutePatterns.hpp"
+#include "StrHash.hpp"
 #include "handlers/Client.hpp"
 
 namespace blabla
 {
-namespace detail
-{
-struct StrHash
-{
-    std::size_t operator()(const char* key, std::size_t key_size) const
-    {
-        struct hash
-        {
-            uint64_t high;
-            uint64_t low;
-        };
-
-        hash h;
-        MurmurHash3_x64_128(key, key_size, 0, &h);
-        return h.low * (key_size * h.high);
-    }
-};
-} // namespace detail
-
+// The route table is an immutable snapshot: publishers resolve routes without
+// taking any lock, (un)subscriptions copy the table, modify the copy and
+// publish it. The previous snapshot is reclaimed once no publisher can still be
+// reading it, by the reclamation thread of Rcu.hpp: the writers do not wait.
 struct Router
 {
+    Router();
     ~Router();
 
     std::vector<handlers::SubscriptionNode*>
     add(std::vector<handlers::Subscription> routes, handlers::Client& client);
 
     std::vector<handlers::SubscriptionNode*>
-    remove(std::vector<boost::string_view> routes, handlers::Client& client);
+    remove(std::vector<handlers::Subscription> routes, handlers::Client& client);
 
-    std::vector<handlers::SubscriptionNode*>
+    // Results are cached per thread, the returned reference is valid until the
+    // next call made by the same thread.
+    const std::vector<handlers::SubscriptionNode*>&
     subscriptions_for(boost::string_view route);
 
+    // A client subscribed to route. Not cached, and the per thread cache of
+    // subscriptions_for is left alone: used by the other shards.
+    bool has_subscribers(boost::string_view route);
+
 private:
     // The container has been chosen for memory usage while having pretty decent
     // performances. For performances improvement, there might be some other
     // containers we could try such as the ones presented in the following
     // paper: https://tessil.github.io/2016/08/29/benchmark-hopscotch-map.html
-    boost::shared_mutex mutex;
-    tsl::htrie_map<char, handlers::SubscriptionNode*, detail::StrHash> routes;
+    struct Routes
+    {
+        // Subscriptions to every route starting with a prefix, split on '.'.
+        tsl::htrie_map<char, handlers::SubscriptionNode*, detail::StrHash> prefixes;
+        RoutePatterns patterns;
+    };
+
+    static handlers::SubscriptionNode* find(const Routes& table,
+                                            const handlers::Subscription& sub);
+
+    void publish(std::unique_ptr<Routes> updated);
+    static void resolve(const Routes& table,
+                        boost::string_view route,
+                        std::vector<handlers::SubscriptionNode*>& subscriptions);
+
+    // Serializes the writers.
+    std::mutex mutex;
+    std::atomic<const Routes*> routes;
+    // Changes each time a new table is published, it invalidates the per
+    // thread caches of subscriptions_for. Generations are unique amongst all
+    // the routers.
+    std::atomic<uint64_t> generation;
 };
 
 } // namespace blabla
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+
+#include "Router.hpp"
+#include "StrHash.hpp"
+#include "handlers/Client.hpp"
+
+namespace blabla
+{
+
+// Messages published on a shard for the subscribers of another one.
+struct DeliveryBatch
+{
+    struct Delivery
+    {
+        std::string route;
+        std::unique_ptr<handlers::SharedBufferWithSpecificMetadata> message;
+        handlers::Client* producer;
+    };
+
+    void add(boost::string_view route,
+             std::unique_ptr<handlers::SharedBufferWithSpecificMetadata> message,
+             handlers::Client* producer)
+    {
+        // Keeps the producers alive, for OutboundPolicy::pause_producer.
+        if (producers.empty() || producers.back().get() != producer)
+        {
+            producers.emplace_back(producer->shared_from_this());
+        }
+
+        bytes += route.size() + message->payload_size();
+        deliveries.push_back({route.to_string(), std::move(message), producer});
+    }
+
+    std::vector<Delivery> deliveries;
+    size_t bytes = 0;
+    std::vector<std::shared_ptr<handlers::Client>> producers;
+    DeliveryBatch* next = nullptr;
+};
+
+// Multiple producers, single consumer queue of batches: a lock free stack
+// which the consumer takes at once and reverses.
+class Mailbox
+{
+public:
+    ~Mailbox()
+    {
+        auto batch = head.exchange(nullptr);
+        while (batch)
+        {
+            std::unique_ptr<DeliveryBatch> current(batch);
+            batch = batch->next;
+        }
+    }
+
+    // Returns true if the mailbox was empty, the consumer must then be
+    // notified.
+    bool push(std::unique_ptr<DeliveryBatch> batch)
+    {
+        // The node belongs to the consumer once it is pushed.
+        auto node = batch.release();
+        auto previous = head.load(std::memory_order_relaxed);
+        do
+        {
+            node->next = previous;
+        } while (!head.compare_exchange_weak(previous, node, std::memory_order_release,
+                                             std::memory_order_relaxed));
+        return previous == nullptr;
+    }
+
+    // Batches in the order they were pushed.
+    std::vector<std::unique_ptr<DeliveryBatch>> take()
+    {
+        std::vector<std::unique_ptr<DeliveryBatch>> batches;
+        for (auto batch = head.exchange(nullptr, std::memory_order_acquire); batch;)
+        {
+            auto next = batch->next;
+            batches.emplace_back(batch);
+            batch = next;
+        }
+
+        std::reverse(batches.begin(), batches.end());
+        return batches;
+    }
+
+private:
+    std::atomic<DeliveryBatch*> head{nullptr};
+};
+
+// In shard per core mode, an io context and what its single thread owns: the
+// connections started on it and their subscriptions. Nothing but the mailbox
+// and its accounting is touched by the other shards, except the router: the
+// members of the queue groups owned by the shard (RouteShards::owner_of)
+// (un)subscribe in it, and RouteShards reads it on a cache miss.
+struct Shard
+{
+    // The producers handing over more than this to a shard are paused until
+    // it caught up, down to half of it.
+    static constexpr size_t MAX_INBOUND_BYTES = 16 * 1024 * 1024;
+    static constexpr size_t MAX_DRAIN_BYTES = 256 * 1024;
+
+    Shard(size_t index, boost::asio::io_context& ctx, size_t nb_shards)
+    : index(index)
+    , ctx(ctx)
+    , outboxes(nb_shards)
+    {
+    }
+
+    const size_t index;
+    boost::asio::io_context& ctx;
+    Router router;
+    Mailbox mailbox;
+    // Taken from the mailbox, delivered up to MAX_DRAIN_BYTES at a time.
+    std::deque<std::unique_ptr<DeliveryBatch>> inbox;
+
+    // Bytes pushed to the mailbox and not delivered yet.
+    std::atomic<size_t> inbound_bytes{0};
+    std::mutex paused_mutex;
+    std::vector<std::weak_ptr<handlers::Client>> paused_producers;
+
+    // Deliveries to the other shards, sent once the current handler returns.
+    std::vector<std::unique_ptr<DeliveryBatch>> outboxes;
+    bool flush_scheduled = false;
+};
+
+// The shards with subscribers to a route. A route is resolved in the router
+// of every shard once per change of the subscriptions, the result is then
+// cached per thread: a publish costs a single lookup whatever the number of
+// shards. Resolving reads the routers of the other shards, on purpose: their
+// tables are read under RCU and their nodes under the node locks, which is
+// all their own (un)subscriptions rely on, and their caches are left alone.
+class RouteShards
+{
+public:
+    // Must be called once a router of the shards changed, or once a client
+    // left its subscription nodes.
+    void invalidate() noexcept
+    {
+        generation.fetch_add(1, std::memory_order_release);
+    }
+
+    // The returned reference is valid until the next call made by the same
+    // thread.
+    const std::vector<size_t>& shards_for(boost::string_view route,
+                                          const std::vector<std::unique_ptr<Shard>>& shards)
+    {
+        auto& entry = cache().entry_for(this, route);
+
+        // Read before the routers, as in Router::subscriptions_for.
+        const auto current = generation.load(std::memory_order_acquire);
+        if (BOOST_LIKELY(entry.owner == this && entry.generation == current &&
+                         entry.route == route))
+        {
+            return entry.shards;
+        }
+
+        entry.owner = this;
+        entry.generation = current;
+        entry.route.assign(route.data(), route.size());
+        entry.shards.clear();
+        for (auto& shard : shards)
+        {
+            if (shard->router.has_subscribers(route))
+            {
+                entry.shards.push_back(shard->index);
+            }
+        }
+        return entry.shards;
+    }
+
+    // The members of a queue group are gathered in the router of a single
+    // shard, which picks one of them for every message.
+    static size_t owner_of(boost::string_view queue_group, size_t nb_shards)
+    {
+        return detail::StrHash()(queue_group.data(), queue_group.size()) % nb_shards;
+    }
+
+private:
+    struct Cache
+    {
+        static constexpr size_t SIZE = 1024;
+        static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of 2");
+
+        struct Entry
+        {
+            const RouteShards* owner = nullptr;
+            uint64_t generation = 0;
+            std::string route;
+            std::vector<size_t> shards;
+        };
+
+        Entry& entry_for(const RouteShards* owner, boost::string_view route)
+        {
+            auto hash = detail::StrHash()(route.data(), route.size());
+            hash ^= (reinterpret_cast<uintptr_t>(owner) >> 4) * 0x9E3779B97F4A7C15ull;
+            return entries[hash & (SIZE - 1)];
+        }
+
+        std::array<Entry, SIZE> entries;
+    };
+
+    static Cache& cache()
+    {
+        static thread_local Cache cache;
+        return cache;
+    }
+
+    std::atomic<uint64_t> generation{1};
+};
+
+} // namespace blabla
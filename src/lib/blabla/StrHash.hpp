@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <murmur3.h>
+
+namespace blabla
+{
+namespace detail
+{
+struct StrHash
+{
+    std::size_t operator()(const char* key, std::size_t key_size) const
+    {
+        struct hash
+        {
+            uint64_t high;
+            uint64_t low;
+        };
+
+        hash h;
+        MurmurHash3_x64_128(key, key_size, 0, &h);
+        return h.low * (key_size * h.high);
+    }
+};
+} // namespace detail
+} // namespace blabla
@@ -1,5 +1,10 @@
 #include "Client.hpp"
 
+#include <algorithm>
+#include <array>
+#include <arpa/inet.h>
+#include <cstring>
+
 #include <boost/asio.hpp>
 
 #include <commonpp/core/LoggingInterface.hpp>
@@ -12,26 +17,120 @@ namespace client
 
 CREATE_LOGGER(log, "blabla::client");
 
-namespace detail
+namespace
+{
+constexpr size_t HEADER_SIZE_SIZE = sizeof(uint32_t);
+constexpr size_t READ_SIZE = 256 * 1024;
+
+// Every frame is a 4 bytes big endian size followed by a protobuf message,
+// producer and consumer headers being followed by their payload.
+size_t append_frame(std::vector<uint8_t>& out, size_t size)
+{
+    const uint32_t be_size = htonl(static_cast<uint32_t>(size));
+    const auto offset = out.size();
+    out.resize(offset + HEADER_SIZE_SIZE + size);
+    std::memcpy(out.data() + offset, &be_size, HEADER_SIZE_SIZE);
+    return offset + HEADER_SIZE_SIZE;
+}
+
+void append_message(std::vector<uint8_t>& out,
+                    boost::string_view route,
+                    boost::string_view payload)
 {
+    static thread_local services::blabla::ProducerMessageHeader header;
+    header.mutable_header()->set_type(services::blabla::MESSAGE);
+    header.set_route(route.data(), route.size());
+    header.set_message_size(payload.size());
+
+    const auto offset = append_frame(out, header.ByteSizeLong());
+    header.SerializeWithCachedSizesToArray(out.data() + offset);
+    out.insert(out.end(), payload.begin(), payload.end());
+}
+
+void add_to_request(services::blabla::SubscribeRequest& req,
+                    const std::string& route,
+                    bool pattern,
+                    int32_t correlation_id,
+                    bool subscribe)
+{
+    auto sub = req.add_subscriptions();
+    if (subscribe)
+    {
+        sub->set_type(
+            pattern ? services::blabla::SubscribeRequest_Subscription_Type_SUBSCRIBE_PATTERN
+                    : services::blabla::SubscribeRequest_Subscription_Type_SUBSCRIBE);
+    }
+    else
+    {
+        sub->set_type(
+            pattern ? services::blabla::SubscribeRequest_Subscription_Type_UNSUBSCRIBE_PATTERN
+                    : services::blabla::SubscribeRequest_Subscription_Type_UNSUBSCRIBE);
+    }
+    sub->set_route_prefix(route);
+    sub->set_correlation_id(correlation_id);
 }
+} // namespace
 
 Client::Client(EventHandler& h)
 : hndl_(h)
 , pool_(std::make_shared<commonpp::thread::ThreadPool>(1, "blabla_client"))
-, socket_(pool_->getService())
+, owns_pool_(true)
+, shared_(std::make_shared<Shared>(pool_->getService()))
+, socket_(shared_->socket)
+, retry_timer_(pool_->getService())
+, linger_timer_(pool_->getService())
 {
 }
 
 Client::Client(EventHandler& h, commonpp::thread::ThreadPool& pool)
 : hndl_(h)
 , pool_(std::addressof(pool), commonpp::get_fake_delete(std::addressof(pool)))
-, socket_(pool_->getService())
+, owns_pool_(false)
+, shared_(std::make_shared<Shared>(pool_->getService()))
+, socket_(shared_->socket)
+, retry_timer_(pool_->getService())
+, linger_timer_(pool_->getService())
 {
 }
 
 Client::~Client()
 {
+    {
+        std::lock_guard<std::mutex> l(sock_mutex_);
+        state_ = State::closed;
+        boost::system::error_code ec;
+        socket_.close(ec);
+        retry_timer_.cancel(ec);
+        linger_timer_.cancel(ec);
+        if (channel_)
+        {
+            channel_->close();
+        }
+    }
+
+    // Waits for the handlers running, the ones still queued in the pool do
+    // nothing once we are gone.
+    {
+        std::lock_guard<std::shared_timed_mutex> l(shared_->mutex);
+        shared_->alive = false;
+    }
+
+    if (owns_pool_)
+    {
+        pool_->stop();
+    }
+}
+
+template <typename Handler>
+auto Client::guarded(Handler handler)
+{
+    return [shared = shared_, handler = std::move(handler)](auto&&... args) mutable {
+        std::shared_lock<std::shared_timed_mutex> l(shared->mutex);
+        if (shared->alive)
+        {
+            handler(std::forward<decltype(args)>(args)...);
+        }
+    };
 }
 
 using boost::asio::ip::tcp;
@@ -42,7 +141,20 @@ void Client::configure(BlablaClientConfiguration conf)
     conf_ = std::move(conf);
     pool_->start();
 
-    if (conf.sync_connect)
+    if (!conf_.local_path.empty())
+    {
+        if (conf_.sync_connect)
+        {
+            sync_connect_local();
+        }
+        else
+        {
+            async_connect_local();
+        }
+        return;
+    }
+
+    if (conf_.sync_connect)
     {
         sync_connect();
     }
@@ -52,6 +164,37 @@ void Client::configure(BlablaClientConfiguration conf)
     }
 }
 
+void Client::sync_connect_local()
+{
+    LOG(log, info) << "Trying to connect to: " << conf_.local_path;
+
+    {
+        std::lock_guard<std::mutex> l(sock_mutex_);
+        channel_ = shm::Channel::connect(pool_->getService(), conf_.local_path);
+    }
+
+    LOG(log, info) << "Connected to: " << conf_.local_path;
+    on_connected();
+}
+
+void Client::async_connect_local()
+{
+    // The handshake is a couple of local system calls.
+    pool_->post(guarded([this] {
+        try
+        {
+            sync_connect_local();
+        }
+        catch (const boost::system::system_error& e)
+        {
+            LOG(log, warning) << "Could not connect to: " << conf_.local_path
+                              << ": " << e.what() << ", retrying in "
+                              << retry_connect().count() << "ms";
+            this->hndl_.connect_error(e.code());
+        }
+    }));
+}
+
 void Client::sync_connect()
 {
     tcp::resolver resolver(pool_->getService());
@@ -63,7 +206,7 @@ void Client::sync_connect()
     auto it = resolver.resolve(query);
     tcp::resolver::results_type end;
 
-    std::lock_guard<std::mutex> l(sock_mutex_);
+    std::unique_lock<std::mutex> l(sock_mutex_);
     boost::system::error_code ec;
     for (; it != end; ++it)
     {
@@ -91,6 +234,10 @@ void Client::sync_connect()
     {
         boost::asio::detail::throw_error(ec);
     }
+
+    socket_.set_option(tcp::no_delay(true), ec);
+    l.unlock();
+    on_connected();
 }
 
 void Client::async_connect()
@@ -99,10 +246,10 @@ void Client::async_connect()
     auto resolver_ptr = std::make_unique<tcp::resolver>(pool_->getService());
     auto& resolver = *resolver_ptr;
     resolver.async_resolve(conf_.host, std::to_string(conf_.port),
-                           [this, _ = std::move(resolver_ptr)](
-                               const boost::system::error_code& ec, auto results) {
+                           guarded([this, _ = std::move(resolver_ptr)](
+                                       const boost::system::error_code& ec, auto results) {
                                async_resolve(std::move(ec), std::move(results));
-                           });
+                           }));
 }
 
 void Client::async_resolve(boost::system::error_code ec,
@@ -111,12 +258,8 @@ void Client::async_resolve(boost::system::error_code ec,
     if (ec)
     {
         LOG(log, warning) << "Resolve error: " << ec.message() << ", retrying in "
-                          << conf_.connect_retry_interval.count() << "ms";
+                          << retry_connect().count() << "ms";
         this->hndl_.connect_error(ec);
-        pool_->schedule(conf_.connect_retry_interval, [this] {
-            async_connect();
-            return false;
-        });
         return;
     }
 
@@ -129,38 +272,669 @@ void Client::async_connect(boost::asio::ip::tcp::resolver::results_type results)
     {
         LOG(log, warning)
             << "Connection error, not more host to try, retrying in "
-            << conf_.connect_retry_interval.count() << "ms";
+            << retry_connect().count() << "ms";
         this->hndl_.connect_error(boost::asio::error::not_found);
-        pool_->schedule(conf_.connect_retry_interval, [this] {
-            async_connect();
-            return false;
-        });
+        return;
     }
 
     std::lock_guard<std::mutex> l(sock_mutex_);
     boost::asio::async_connect(
         socket_, std::move(results),
-        [this](boost::system::error_code ec, auto connected_endpoint) {
+        guarded([this](boost::system::error_code ec, auto connected_endpoint) {
             if (ec)
             {
                 LOG(log, warning)
                     << "Connection error, could not connect to any address, "
                        "retrying in "
-                    << conf_.connect_retry_interval.count() << "ms";
+                    << retry_connect().count() << "ms";
                 this->hndl_.connect_error(ec);
-                pool_->schedule(conf_.connect_retry_interval, [this] {
-                    async_connect();
-                    return false;
-                });
-
                 return;
             }
 
             // no error, we can proceed.
             LOG(log, info) << "Connected to " << connected_endpoint.address()
                            << ":" << connected_endpoint.port();
-            this->hndl_.connected();
-        });
+            {
+                std::lock_guard<std::mutex> l(sock_mutex_);
+                socket_.set_option(tcp::no_delay(true), ec);
+            }
+            on_connected();
+        }));
+}
+
+std::chrono::milliseconds Client::retry_connect()
+{
+    std::chrono::milliseconds delay;
+    {
+        std::lock_guard<std::mutex> l(sock_mutex_);
+        auto ceiling = std::min(conf_.connect_retry_interval *
+                                    (int64_t(1) << std::min(retries_, 20u)),
+                                conf_.max_connect_retry_interval);
+        std::uniform_int_distribution<int64_t> draw(ceiling.count() / 2, ceiling.count());
+        delay = std::chrono::milliseconds(draw(rng_));
+        ++retries_;
+
+        retry_timer_.expires_after(delay);
+        retry_timer_.async_wait(guarded([this](const boost::system::error_code& ec) {
+            if (ec)
+            {
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> l(sock_mutex_);
+                if (state_ == State::closed)
+                {
+                    return;
+                }
+            }
+
+            if (conf_.local_path.empty())
+            {
+                async_connect();
+            }
+            else
+            {
+                async_connect_local();
+            }
+        }));
+    }
+    return delay;
+}
+
+void Client::on_connected()
+{
+    uint64_t connection;
+    {
+        std::lock_guard<std::mutex> subs(subs_mutex_);
+        std::lock_guard<std::mutex> l(sock_mutex_);
+        if (state_ == State::closed)
+        {
+            return;
+        }
+
+        state_ = State::connected;
+        connection = ++connection_;
+        retries_ = 0;
+        in_size_ = 0;
+
+        // A single request, followed by the messages published meanwhile.
+        if (!subscriptions_.empty())
+        {
+            services::blabla::SubscribeRequest req;
+            req.mutable_header()->set_type(services::blabla::SUSCRIBE_REQUEST);
+            for (auto& pair : subscriptions_)
+            {
+                add_to_request(req, pair.second.route, pair.second.pattern,
+                               pair.first, true);
+            }
+
+            const auto offset = append_frame(queued_, req.ByteSizeLong());
+            req.SerializeWithCachedSizesToArray(queued_.data() + offset);
+        }
+
+        if (offline_dropped_ != 0)
+        {
+            LOG(log, warning) << offline_dropped_
+                              << " messages published were dropped while disconnected";
+        }
+        queued_.insert(queued_.end(), offline_.begin() + offline_begin_, offline_.end());
+        offline_.clear();
+        offline_begin_ = 0;
+        offline_frames_.clear();
+        offline_dropped_ = 0;
+
+        // The write of the previous connection may still be completing.
+        if (!queued_.empty() && !write_in_flight_)
+        {
+            start_write();
+        }
+    }
+
+    read(connection);
+    // Whether the connection was made synchronously or not.
+    hndl_.connected();
+}
+
+void Client::on_error(const boost::system::error_code& ec, uint64_t connection)
+{
+    {
+        std::lock_guard<std::mutex> l(sock_mutex_);
+        if (state_ != State::connected || connection != connection_)
+        {
+            return;
+        }
+
+        state_ = State::connecting;
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+        if (channel_)
+        {
+            channel_->close();
+        }
+
+        // Only the write in flight is lost with the connection, it completes
+        // with an error and releases writing_. The publishes not written yet
+        // are sent again once connected.
+        keep_unwritten_offline();
+        pings_.clear();
+    }
+
+    LOG(log, warning) << "Connection lost: " << ec.message() << ", reconnecting in "
+                      << retry_connect().count() << "ms";
+    hndl_.disconnected(ec);
+}
+
+bool Client::is_connected() const
+{
+    std::lock_guard<std::mutex> l(sock_mutex_);
+    return state_ == State::connected;
+}
+
+bool Client::publish(boost::string_view route, boost::string_view payload, bool flush)
+{
+    std::lock_guard<std::mutex> l(sock_mutex_);
+    if (state_ != State::connected)
+    {
+        return state_ != State::closed && keep_offline(route, payload);
+    }
+
+    if (conf_.linger.count() != 0)
+    {
+        if (queued_.size() + writing_.size() + batch_payloads_.size() + payload.size() >
+            conf_.max_queued_bytes)
+        {
+            return false;
+        }
+
+        auto entry = batch_.add_entries();
+        entry->set_route(route.data(), route.size());
+        entry->set_message_size(payload.size());
+        batch_payloads_.insert(batch_payloads_.end(), payload.begin(), payload.end());
+
+        if (flush || batch_payloads_.size() >= conf_.max_batch_bytes)
+        {
+            send_batch();
+        }
+        else if (!linger_armed_)
+        {
+            linger_armed_ = true;
+            linger_timer_.expires_after(conf_.linger);
+            linger_timer_.async_wait(guarded([this](const boost::system::error_code& ec) {
+                if (ec)
+                {
+                    return;
+                }
+
+                std::lock_guard<std::mutex> l(sock_mutex_);
+                if (state_ == State::connected)
+                {
+                    send_batch();
+                }
+            }));
+        }
+        return true;
+    }
+
+    if (queued_.size() + writing_.size() + payload.size() > conf_.max_queued_bytes)
+    {
+        return false;
+    }
+
+    append_message(queued_, route, payload);
+    if (!write_in_flight_)
+    {
+        start_write();
+    }
+    return true;
+}
+
+// Must be called with sock_mutex_ held. The subscriptions are sent again on
+// connection and the pings are forgotten, only the publishes are kept.
+void Client::keep_unwritten_offline()
+{
+    services::blabla::DecodableMessage decodable;
+    services::blabla::ProducerMessageHeader message;
+    services::blabla::MessageBatch batch;
+
+    size_t offset = 0;
+    while (offset < queued_.size())
+    {
+        uint32_t size;
+        std::memcpy(&size, queued_.data() + offset, sizeof(size));
+        size = ntohl(size);
+        const uint8_t* frame = queued_.data() + offset + HEADER_SIZE_SIZE;
+        offset += HEADER_SIZE_SIZE + size;
+
+        if (!decodable.ParseFromArray(frame, size))
+        {
+            break;
+        }
+
+        switch (decodable.type().type())
+        {
+        case services::blabla::MESSAGE:
+            message.ParseFromArray(frame, size);
+            keep_unwritten_offline(message.route(),
+                                   reinterpret_cast<const char*>(queued_.data()) + offset,
+                                   message.message_size());
+            offset += message.message_size();
+            break;
+        case services::blabla::MESSAGE_BATCH:
+            batch.ParseFromArray(frame, size);
+            offset += keep_unwritten_offline(batch, queued_.data() + offset);
+            break;
+        default:
+            break;
+        }
+    }
+    queued_.clear();
+
+    // Published after what was queued.
+    keep_unwritten_offline(batch_, batch_payloads_.data());
+    batch_.clear_entries();
+    batch_payloads_.clear();
+    if (linger_armed_)
+    {
+        linger_armed_ = false;
+        boost::system::error_code ec;
+        linger_timer_.cancel(ec);
+    }
+}
+
+size_t Client::keep_unwritten_offline(const services::blabla::MessageBatch& batch,
+                                      const uint8_t* payloads)
+{
+    size_t offset = 0;
+    for (const auto& entry : batch.entries())
+    {
+        keep_unwritten_offline(entry.route(),
+                               reinterpret_cast<const char*>(payloads) + offset,
+                               entry.message_size());
+        offset += entry.message_size();
+    }
+    return offset;
+}
+
+void Client::keep_unwritten_offline(boost::string_view route,
+                                    const char* payload,
+                                    size_t payload_size)
+{
+    // The publish was accepted, it is accounted for if it does not fit.
+    if (!keep_offline(route, boost::string_view(payload, payload_size)))
+    {
+        ++offline_dropped_;
+    }
+}
+
+// Must be called with sock_mutex_ held.
+bool Client::keep_offline(boost::string_view route, boost::string_view payload)
+{
+    const auto end = offline_.size();
+    append_message(offline_, route, payload);
+    const auto size = offline_.size() - end;
+    if (size > conf_.offline_buffer_bytes)
+    {
+        offline_.resize(end);
+        return false;
+    }
+    offline_frames_.push_back(size);
+
+    while (offline_.size() - offline_begin_ > conf_.offline_buffer_bytes)
+    {
+        offline_begin_ += offline_frames_.front();
+        offline_frames_.pop_front();
+        ++offline_dropped_;
+    }
+
+    if (offline_begin_ > offline_.size() / 2)
+    {
+        offline_.erase(offline_.begin(), offline_.begin() + offline_begin_);
+        offline_begin_ = 0;
+    }
+    return true;
+}
+
+void Client::flush()
+{
+    std::lock_guard<std::mutex> l(sock_mutex_);
+    if (state_ == State::connected)
+    {
+        send_batch();
+    }
+}
+
+void Client::subscribe(const std::string& prefix, MessageCallback callback)
+{
+    add_subscription(prefix, false, std::move(callback));
+}
+
+void Client::subscribe_pattern(const std::string& pattern, MessageCallback callback)
+{
+    add_subscription(pattern, true, std::move(callback));
+}
+
+void Client::unsubscribe(const std::string& prefix)
+{
+    remove_subscription(prefix, false);
+}
+
+void Client::unsubscribe_pattern(const std::string& pattern)
+{
+    remove_subscription(pattern, true);
+}
+
+void Client::add_subscription(const std::string& route, bool pattern, MessageCallback callback)
+{
+    auto shared_callback = std::make_shared<const MessageCallback>(std::move(callback));
+
+    std::lock_guard<std::mutex> subs(subs_mutex_);
+    auto it = std::find_if(subscriptions_.begin(), subscriptions_.end(), [&](auto& pair) {
+        return pair.second.pattern == pattern && pair.second.route == route;
+    });
+    if (it != subscriptions_.end())
+    {
+        it->second.callback = std::move(shared_callback);
+        return;
+    }
+
+    const auto correlation_id = next_correlation_id_++;
+    subscriptions_.emplace(correlation_id,
+                           Subscription{route, pattern, std::move(shared_callback)});
+
+    std::lock_guard<std::mutex> l(sock_mutex_);
+    if (state_ == State::connected)
+    {
+        services::blabla::SubscribeRequest req;
+        req.mutable_header()->set_type(services::blabla::SUSCRIBE_REQUEST);
+        add_to_request(req, route, pattern, correlation_id, true);
+        queue_frame(req);
+    }
+}
+
+void Client::remove_subscription(const std::string& route, bool pattern)
+{
+    std::lock_guard<std::mutex> subs(subs_mutex_);
+    auto it = std::find_if(subscriptions_.begin(), subscriptions_.end(), [&](auto& pair) {
+        return pair.second.pattern == pattern && pair.second.route == route;
+    });
+    if (it == subscriptions_.end())
+    {
+        return;
+    }
+    subscriptions_.erase(it);
+
+    std::lock_guard<std::mutex> l(sock_mutex_);
+    if (state_ == State::connected)
+    {
+        services::blabla::SubscribeRequest req;
+        req.mutable_header()->set_type(services::blabla::SUSCRIBE_REQUEST);
+        add_to_request(req, route, pattern, 0, false);
+        queue_frame(req);
+    }
+}
+
+bool Client::ping(PongCallback callback)
+{
+    std::lock_guard<std::mutex> l(sock_mutex_);
+    if (state_ != State::connected)
+    {
+        return false;
+    }
+
+    services::blabla::Ping ping;
+    ping.mutable_header()->set_type(services::blabla::PING);
+    ping.set_correlation_id(next_ping_++);
+    pings_[ping.correlation_id()] =
+        PendingPing{std::chrono::steady_clock::now(), std::move(callback)};
+    queue_frame(ping);
+    return true;
+}
+
+void Client::queue_frame(const google::protobuf::Message& msg)
+{
+    // Kept after the messages published before.
+    send_batch();
+
+    const auto offset = append_frame(queued_, msg.ByteSizeLong());
+    msg.SerializeWithCachedSizesToArray(queued_.data() + offset);
+
+    if (!write_in_flight_)
+    {
+        start_write();
+    }
+}
+
+void Client::send_batch()
+{
+    if (linger_armed_)
+    {
+        linger_armed_ = false;
+        boost::system::error_code ec;
+        linger_timer_.cancel(ec);
+    }
+
+    if (batch_.entries_size() == 0)
+    {
+        return;
+    }
+
+    // The payloads follow the frame, in the order of the entries.
+    batch_.mutable_header()->set_type(services::blabla::MESSAGE_BATCH);
+    const auto offset = append_frame(queued_, batch_.ByteSizeLong());
+    batch_.SerializeWithCachedSizesToArray(queued_.data() + offset);
+    queued_.insert(queued_.end(), batch_payloads_.begin(), batch_payloads_.end());
+    batch_.clear_entries();
+    batch_payloads_.clear();
+
+    if (!write_in_flight_)
+    {
+        start_write();
+    }
+}
+
+// Must be called with sock_mutex_ held. A single write is in flight, what is
+// queued meanwhile goes in the next one.
+void Client::start_write()
+{
+    writing_.swap(queued_);
+    write_in_flight_ = true;
+
+    const auto connection = connection_;
+    if (channel_)
+    {
+        std::array<boost::asio::const_buffer, 1> buffers{{boost::asio::buffer(writing_)}};
+        channel_->async_write(buffers,
+                              guarded([this, connection](boost::system::error_code ec) {
+                                  on_write(ec, connection);
+                              }));
+        return;
+    }
+
+    boost::asio::async_write(socket_, boost::asio::buffer(writing_),
+                             guarded([this, connection](boost::system::error_code ec, size_t) {
+                                 on_write(ec, connection);
+                             }));
+}
+
+void Client::on_write(const boost::system::error_code& ec, uint64_t connection)
+{
+    {
+        std::lock_guard<std::mutex> l(sock_mutex_);
+        writing_.clear();
+        write_in_flight_ = false;
+
+        // The write of a lost connection may complete once the new one has
+        // queued something.
+        if ((!ec || connection != connection_) && state_ == State::connected &&
+            !queued_.empty())
+        {
+            start_write();
+        }
+    }
+
+    if (ec)
+    {
+        on_error(ec, connection);
+    }
+}
+
+void Client::read(uint64_t connection)
+{
+    if (in_.size() - in_size_ < READ_SIZE / 2)
+    {
+        in_.resize(std::max(in_.size() * 2, in_size_ + READ_SIZE));
+    }
+
+    auto buffer = boost::asio::buffer(in_.data() + in_size_, in_.size() - in_size_);
+    auto handler = guarded([this, connection](boost::system::error_code ec, size_t bytes_read) {
+        on_read(ec, bytes_read, connection);
+    });
+
+    std::lock_guard<std::mutex> l(sock_mutex_);
+    if (state_ != State::connected || connection != connection_)
+    {
+        return;
+    }
+
+    if (channel_)
+    {
+        channel_->async_read(buffer, 1, std::move(handler));
+        return;
+    }
+    socket_.async_read_some(buffer, std::move(handler));
+}
+
+void Client::on_read(const boost::system::error_code& ec, size_t bytes_read, uint64_t connection)
+{
+    if (ec)
+    {
+        on_error(ec, connection);
+        return;
+    }
+
+    in_size_ += bytes_read;
+    size_t consumed;
+    try
+    {
+        consumed = process();
+    }
+    catch (const std::exception& e)
+    {
+        LOG(log, error) << "Closing the connection: " << e.what();
+        on_error(boost::system::errc::make_error_code(boost::system::errc::bad_message),
+                 connection);
+        return;
+    }
+
+    if (consumed)
+    {
+        std::memmove(in_.data(), in_.data() + consumed, in_size_ - consumed);
+        in_size_ -= consumed;
+    }
+
+    read(connection);
+}
+
+size_t Client::process()
+{
+    const uint8_t* data = in_.data();
+    size_t offset = 0;
+
+    // Consecutive messages are likely to be for the same subscription.
+    int32_t correlation_id = 0;
+    std::shared_ptr<const MessageCallback> callback;
+
+    while (in_size_ - offset >= HEADER_SIZE_SIZE)
+    {
+        uint32_t size;
+        std::memcpy(&size, data + offset, sizeof(size));
+        size = ntohl(size);
+        if (in_size_ - offset < HEADER_SIZE_SIZE + size)
+        {
+            break;
+        }
+
+        // Every message starts with its Header, the consumer header is used
+        // to read it.
+        const uint8_t* frame = data + offset + HEADER_SIZE_SIZE;
+        if (!header_.ParseFromArray(frame, size))
+        {
+            throw std::runtime_error("Invalid message received");
+        }
+
+        size_t frame_size = HEADER_SIZE_SIZE + size;
+        switch (header_.header().type())
+        {
+        case services::blabla::MESSAGE:
+        {
+            if (in_size_ - offset < frame_size + header_.message_size())
+            {
+                return offset;
+            }
+
+            if (!callback || correlation_id != header_.correlation_id())
+            {
+                correlation_id = header_.correlation_id();
+                std::lock_guard<std::mutex> subs(subs_mutex_);
+                auto it = subscriptions_.find(correlation_id);
+                callback = it != subscriptions_.end() ? it->second.callback : nullptr;
+            }
+
+            if (callback)
+            {
+                (*callback)(header_,
+                            boost::string_view(reinterpret_cast<const char*>(frame + size),
+                                               header_.message_size()));
+            }
+            frame_size += header_.message_size();
+            break;
+        }
+        case services::blabla::PONG:
+        {
+            services::blabla::Pong pong;
+            if (!pong.ParseFromArray(frame, size))
+            {
+                throw std::runtime_error("Invalid pong received");
+            }
+
+            PendingPing ping;
+            {
+                std::lock_guard<std::mutex> l(sock_mutex_);
+                auto it = pings_.find(pong.correlation_id());
+                if (it != pings_.end())
+                {
+                    ping = std::move(it->second);
+                    pings_.erase(it);
+                }
+            }
+
+            if (ping.callback)
+            {
+                ping.callback(std::chrono::steady_clock::now() - ping.sent);
+            }
+            break;
+        }
+        case services::blabla::ERROR:
+        {
+            services::blabla::Error error;
+            if (!error.ParseFromArray(frame, size))
+            {
+                throw std::runtime_error("Invalid error received");
+            }
+
+            LOG(log, warning) << "Error from the server: " << error.description();
+            hndl_.error(error);
+            break;
+        }
+        default:
+            break;
+        }
+
+        offset += frame_size;
+    }
+
+    return offset;
 }
 
 } // namespace client
@@ -1,16 +1,39 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <vector>
 
 #include <commonpp/thread/ThreadPool.hpp>
 
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/container/flat_map.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include "blabla/shm/Channel.hpp"
+#include "proto/service.pb.h"
 
 namespace blabla
 {
 namespace client
 {
 
+// A message received on a subscription, the header and the payload are only
+// valid during the call.
+using MessageCallback = std::function<void(
+    const services::blabla::ConsumerMessageHeader& header, boost::string_view payload)>;
+using PongCallback = std::function<void(std::chrono::steady_clock::duration round_trip)>;
+
+// Called from the threads of the pool, and from configure() when it connects
+// synchronously.
 struct EventHandler
 {
     virtual ~EventHandler() = default;
@@ -22,6 +45,17 @@ struct EventHandler
     virtual void connected()
     {
     }
+
+    // The connection was lost, the pending pings are forgotten.
+    virtual void disconnected(const boost::system::error_code&)
+    {
+    }
+
+    // Sent by the server when it refuses a request, a subscription to an
+    // invalid pattern for instance.
+    virtual void error(const services::blabla::Error&)
+    {
+    }
 };
 
 struct BlablaClientConfiguration
@@ -29,9 +63,34 @@ struct BlablaClientConfiguration
     std::string host;
     int16_t port;
 
+    // When set, host and port are ignored and the client connects to a
+    // server of the same host through this AF_UNIX path, the messages then
+    // go through shared memory.
+    std::string local_path;
+
     bool sync_connect = true;
 
+    // The client connects again whenever the connection is lost. The delay
+    // between the attempts doubles from connect_retry_interval up to
+    // max_connect_retry_interval, each one being drawn between half and all
+    // of it so that the clients of a restarted server spread out.
     std::chrono::milliseconds connect_retry_interval{500};
+    std::chrono::milliseconds max_connect_retry_interval{30000};
+
+    // Publishes made while disconnected are kept, up to that many bytes, and
+    // written at once when connected again. So are the ones not written yet
+    // when the connection is lost, only the write in flight is lost. The
+    // oldest ones make room for the new ones. 0 drops them instead.
+    size_t offline_buffer_bytes = 8 * 1024 * 1024;
+
+    // Publishes are refused once that many bytes wait to be written.
+    size_t max_queued_bytes = 64 * 1024 * 1024;
+
+    // When not 0, publishes are gathered into a MessageBatch, sent once it
+    // holds max_batch_bytes of payloads or when its first message waited for
+    // linger, whichever comes first. The server accepts batches of up to 15MB.
+    std::chrono::microseconds linger{0};
+    size_t max_batch_bytes = 64 * 1024;
 };
 
 class Client
@@ -41,30 +100,165 @@ class Client
         not_connected,
         connecting,
         connected,
+        closed,
     };
 
 public:
     Client(EventHandler&);
     Client(EventHandler&, commonpp::thread::ThreadPool& pool);
 
+    // Waits for the handlers running in the pool, the ones still queued do
+    // nothing afterwards. The client must not be destroyed from its
+    // callbacks or from the ones of its EventHandler.
     ~Client();
 
     // will connect if sync_connect == true
     void configure(BlablaClientConfiguration conf);
 
+    // Queues the message, it is written along with the ones published while
+    // the previous write was in flight. Returns false if the message was
+    // dropped: max_queued_bytes reached, or not connected and no room in the
+    // offline buffer.
+    //
+    // With a linger the message waits in the current batch, unless flush is
+    // set: the batch is then sent right away.
+    bool publish(boost::string_view route, boost::string_view payload, bool flush = false);
+    // Sends the current batch without waiting for the linger.
+    void flush();
+
+    // The subscriptions are sent once connected. Subscribing again to the
+    // same prefix (pattern) replaces its callback.
+    void subscribe(const std::string& prefix, MessageCallback callback);
+    // `*` matches one token and a trailing `>` one or more tokens.
+    void subscribe_pattern(const std::string& pattern, MessageCallback callback);
+    void unsubscribe(const std::string& prefix);
+    void unsubscribe_pattern(const std::string& pattern);
+
+    // Returns false if not connected.
+    bool ping(PongCallback callback);
+
+    bool is_connected() const;
+
 private:
+    struct Subscription
+    {
+        std::string route;
+        bool pattern;
+        std::shared_ptr<const MessageCallback> callback;
+    };
+
+    struct PendingPing
+    {
+        std::chrono::steady_clock::time_point sent;
+        PongCallback callback;
+    };
+
+    // Shared with the handlers, which may outlive the client in a pool which
+    // is not its own. They run with the lock held and do nothing once the
+    // destructor cleared alive. The socket stays valid for the composed
+    // operations still in progress (connect, write).
+    struct Shared
+    {
+        explicit Shared(boost::asio::io_service& service)
+        : socket(service)
+        {
+        }
+
+        std::shared_timed_mutex mutex;
+        bool alive = true;
+        boost::asio::ip::tcp::socket socket;
+    };
+
+    // The handler does nothing once the client is destroyed.
+    template <typename Handler>
+    auto guarded(Handler handler);
+
     void sync_connect();
     void async_connect();
+    void sync_connect_local();
+    void async_connect_local();
     void async_resolve(boost::system::error_code,
                        boost::asio::ip::tcp::resolver::results_type);
     void async_connect(boost::asio::ip::tcp::resolver::results_type);
 
+    // Schedules the next connection attempt, returns its delay.
+    std::chrono::milliseconds retry_connect();
+    // Sends the subscriptions and what was published meanwhile, starts
+    // reading and tells the handler.
+    void on_connected();
+    // Errors of a previous connection are ignored.
+    void on_error(const boost::system::error_code& ec, uint64_t connection);
+
+    void add_subscription(const std::string& route, bool pattern, MessageCallback callback);
+    void remove_subscription(const std::string& route, bool pattern);
+
+    // Must be called with sock_mutex_ held.
+    void queue_frame(const google::protobuf::Message& msg);
+    void send_batch();
+    bool keep_offline(boost::string_view route, boost::string_view payload);
+    // Moves the publishes not written yet to the offline buffer.
+    void keep_unwritten_offline();
+    // Returns the size of the payloads.
+    size_t keep_unwritten_offline(const services::blabla::MessageBatch& batch,
+                                  const uint8_t* payloads);
+    void keep_unwritten_offline(boost::string_view route,
+                                const char* payload,
+                                size_t payload_size);
+    void start_write();
+    void on_write(const boost::system::error_code& ec, uint64_t connection);
+
+    void read(uint64_t connection);
+    void on_read(const boost::system::error_code& ec, size_t bytes_read, uint64_t connection);
+    // Dispatches the complete frames of the input buffer, returns the number
+    // of bytes consumed.
+    size_t process();
+
 private:
     EventHandler& hndl_;
     std::shared_ptr<commonpp::thread::ThreadPool> pool_;
-    std::mutex sock_mutex_;
-    boost::asio::ip::tcp::socket socket_;
+    const bool owns_pool_;
+    std::shared_ptr<Shared> shared_;
+    mutable std::mutex sock_mutex_;
+    boost::asio::ip::tcp::socket& socket_;
+    // Used instead of socket_ by the local clients.
+    std::shared_ptr<shm::Channel> channel_;
     BlablaClientConfiguration conf_;
+    State state_ = State::not_connected;
+    // Incremented on every connection.
+    uint64_t connection_ = 0;
+    unsigned retries_ = 0;
+    std::minstd_rand rng_{std::random_device{}()};
+    boost::asio::steady_timer retry_timer_;
+
+    // Frames waiting for the write in flight, which owns writing_.
+    std::vector<uint8_t> queued_;
+    std::vector<uint8_t> writing_;
+    bool write_in_flight_ = false;
+
+    // Publishes waiting for the linger, and their payloads.
+    services::blabla::MessageBatch batch_;
+    std::vector<uint8_t> batch_payloads_;
+    boost::asio::steady_timer linger_timer_;
+    bool linger_armed_ = false;
+
+    // Frames published while disconnected, from offline_begin_ on.
+    std::vector<uint8_t> offline_;
+    size_t offline_begin_ = 0;
+    std::deque<size_t> offline_frames_;
+    size_t offline_dropped_ = 0;
+
+    uint32_t next_ping_ = 0;
+    boost::container::flat_map<uint32_t, PendingPing> pings_;
+
+    // Taken before sock_mutex_ when both are needed.
+    std::mutex subs_mutex_;
+    int32_t next_correlation_id_ = 1;
+    boost::container::flat_map<int32_t, Subscription> subscriptions_;
+
+    // Only used by the read handlers, which run one at a time.
+    std::vector<uint8_t> in_;
+    size_t in_size_ = 0;
+    services::blabla::ConsumerMessageHeader header_;
 };
 
 } // namespace client
@@ -0,0 +1,114 @@
+#include "ClientPool.hpp"
+
+#include <stdexcept>
+
+#include "blabla/StrHash.hpp"
+
+namespace blabla
+{
+namespace client
+{
+
+void ClientPool::Events::connect_error(const boost::system::error_code& ec)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    handler.connect_error(ec);
+}
+
+void ClientPool::Events::connected()
+{
+    std::lock_guard<std::mutex> l(mutex);
+    if (++established == size)
+    {
+        handler.connected();
+    }
+}
+
+void ClientPool::Events::disconnected(const boost::system::error_code& ec)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    if (established == 0)
+    {
+        return;
+    }
+
+    // Reported once, when the pool stops being fully connected.
+    if (established-- == size)
+    {
+        handler.disconnected(ec);
+    }
+}
+
+void ClientPool::Events::error(const services::blabla::Error& error)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    handler.error(error);
+}
+
+ClientPool::ClientPool(EventHandler& handler, size_t size)
+: events_(handler, size)
+{
+    if (size == 0)
+    {
+        throw std::invalid_argument("A client pool needs at least one connection");
+    }
+
+    // Each client runs its own single threaded pool.
+    clients_.reserve(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        clients_.emplace_back(std::make_unique<Client>(events_));
+    }
+}
+
+void ClientPool::configure(const BlablaClientConfiguration& conf)
+{
+    for (auto& client : clients_)
+    {
+        client->configure(conf);
+    }
+}
+
+void ClientPool::flush()
+{
+    for (auto& client : clients_)
+    {
+        client->flush();
+    }
+}
+
+void ClientPool::subscribe(const std::string& prefix, MessageCallback callback)
+{
+    client_of(prefix).subscribe(prefix, std::move(callback));
+}
+
+void ClientPool::subscribe_pattern(const std::string& pattern, MessageCallback callback)
+{
+    client_of(pattern).subscribe_pattern(pattern, std::move(callback));
+}
+
+void ClientPool::unsubscribe(const std::string& prefix)
+{
+    client_of(prefix).unsubscribe(prefix);
+}
+
+void ClientPool::unsubscribe_pattern(const std::string& pattern)
+{
+    client_of(pattern).unsubscribe_pattern(pattern);
+}
+
+Client& ClientPool::client_of(boost::string_view route)
+{
+    if (clients_.size() == 1)
+    {
+        return *clients_.front();
+    }
+
+    // The low bits of the hash depend on the length of the route, the high
+    // ones are scaled to the number of connections instead of a modulo.
+    const uint64_t hash = detail::StrHash()(route.data(), route.size()) >> 32;
+    return *clients_[(hash * clients_.size()) >> 32];
+}
+
+} // namespace client
+} // namespace blabla
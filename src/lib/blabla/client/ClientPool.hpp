@@ -0,0 +1,87 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/utility/string_view.hpp>
+
+#include "Client.hpp"
+
+namespace blabla
+{
+namespace client
+{
+
+// Connections to the same server, each one with its own io thread. A route
+// always goes through the same connection, so the messages of a route keep
+// their order while the producer threads publishing on different routes do
+// not contend on a single connection.
+//
+// The handler sees the pool as a single connection: connected() once every
+// connection is established, disconnected() once the first one is lost.
+// connect_error() and error() are reported for each connection.
+class ClientPool
+{
+public:
+    ClientPool(EventHandler& handler, size_t size);
+
+    void configure(const BlablaClientConfiguration& conf);
+
+    bool publish(boost::string_view route, boost::string_view payload, bool flush = false)
+    {
+        return client_of(route).publish(route, payload, flush);
+    }
+
+    // Sends the current batch of every connection.
+    void flush();
+
+    // A subscription is carried by the connection of its prefix (pattern).
+    void subscribe(const std::string& prefix, MessageCallback callback);
+    void subscribe_pattern(const std::string& pattern, MessageCallback callback);
+    void unsubscribe(const std::string& prefix);
+    void unsubscribe_pattern(const std::string& pattern);
+
+    Client& client_of(boost::string_view route);
+
+    Client& operator[](size_t index)
+    {
+        return *clients_[index];
+    }
+
+    size_t size() const noexcept
+    {
+        return clients_.size();
+    }
+
+private:
+    // Handler of the connections, counts the established ones.
+    struct Events final : EventHandler
+    {
+        Events(EventHandler& handler, size_t size)
+        : handler(handler)
+        , size(size)
+        {
+        }
+
+        void connect_error(const boost::system::error_code& ec) override;
+        void connected() override;
+        void disconnected(const boost::system::error_code& ec) override;
+        void error(const services::blabla::Error& error) override;
+
+        EventHandler& handler;
+        const size_t size;
+        // The calls to handler are made with the lock held, so that they
+        // keep the order of the counts.
+        std::mutex mutex;
+        size_t established = 0;
+    };
+
+    // Outlives the connections.
+    Events events_;
+    std::vector<std::unique_ptr<Client>> clients_;
+};
+
+} // namespace client
+} // namespace blabla
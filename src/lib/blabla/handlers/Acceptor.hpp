@@ -1,34 +1,142 @@
 #pragma once
 
+#include <mutex>
+#include <vector>
+
+#include <linux/filter.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/asio/basic_socket_acceptor.hpp>
+#include <boost/asio/detail/socket_option.hpp>
+#include <boost/asio/execution/context.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/query.hpp>
 
 #include <commonpp/core/LoggingInterface.hpp>
 #include <commonpp/thread/ThreadPool.hpp>
 
+#include "Uring.hpp"
+
 namespace blabla
 {
 namespace handlers
 {
 
-struct Acceptor
+// What binding an endpoint leaves behind: nothing for TCP, the file of an
+// AF_UNIX path, which is also left by a previous run.
+inline void release_endpoint(const boost::asio::ip::tcp::endpoint&)
+{
+}
+
+inline void release_endpoint(const boost::asio::local::stream_protocol::endpoint& endpoint)
+{
+    ::unlink(endpoint.path().c_str());
+}
+
+// Accepts stream connections of Protocol (TCP or AF_UNIX), the clients use a
+// generic stream socket.
+template <typename Protocol>
+struct BasicAcceptor
 {
-    using tcp = boost::asio::ip::tcp;
+    using endpoint_type = typename Protocol::endpoint;
+    using acceptor_type = boost::asio::basic_socket_acceptor<Protocol>;
+    using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
 
 public:
-    Acceptor(commonpp::thread::ThreadPool& pool,
-             boost::asio::ip::address address,
-             int port)
+    BasicAcceptor(commonpp::thread::ThreadPool& pool, endpoint_type endpoint)
+    : pool(pool)
+    , endpoint(std::move(endpoint))
+    , acceptor(pool.getService())
+    {
+        release_endpoint(this->endpoint);
+        acceptor.open(this->endpoint.protocol());
+        acceptor.set_option(typename acceptor_type::reuse_address(true));
+        acceptor.bind(this->endpoint);
+        acceptor.listen();
+    }
+
+    // Listens from the given service, which also runs the accepted
+    // connections. The port is shared (SO_REUSEPORT): the kernel spreads the
+    // new connections amongst the acceptors bound to it. TCP only.
+    BasicAcceptor(commonpp::thread::ThreadPool& pool,
+                  endpoint_type endpoint,
+                  boost::asio::io_service& service)
     : pool(pool)
-    , acceptor(pool.getService(), tcp::endpoint(std::move(address), port))
+    , endpoint(std::move(endpoint))
+    , acceptor(service)
+    , service(&service)
+    {
+        acceptor.open(this->endpoint.protocol());
+        acceptor.set_option(typename acceptor_type::reuse_address(true));
+        acceptor.set_option(reuse_port(true));
+        acceptor.bind(this->endpoint);
+        acceptor.listen();
+    }
+
+    // A connection is then accepted by the acceptor bound in the position
+    // acceptor_of_cpu gives for the CPU handling it, amongst the ones sharing
+    // the port. The CPUs without a position (negative, or beyond the vector)
+    // use the CPU index modulo nb_acceptors. Linux only.
+    boost::system::error_code steer_by_cpu(const std::vector<int>& acceptor_of_cpu,
+                                           uint32_t nb_acceptors)
+    {
+        // A = current CPU
+        std::vector<sock_filter> code = {
+            {BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t(SKF_AD_OFF + SKF_AD_CPU)},
+        };
+
+        for (size_t cpu = 0; cpu < acceptor_of_cpu.size(); ++cpu)
+        {
+            if (acceptor_of_cpu[cpu] < 0)
+            {
+                continue;
+            }
+
+            // if A == cpu return acceptor
+            code.push_back({BPF_JMP | BPF_JEQ | BPF_K, 0, 1, uint32_t(cpu)});
+            code.push_back({BPF_RET | BPF_K, 0, 0, uint32_t(acceptor_of_cpu[cpu])});
+        }
+
+        // return A % nb_acceptors
+        code.push_back({BPF_ALU | BPF_MOD | BPF_K, 0, 0, nb_acceptors});
+        code.push_back({BPF_RET | BPF_A, 0, 0, 0});
+
+        if (code.size() > BPF_MAXINSNS)
+        {
+            return make_error_code(boost::system::errc::argument_out_of_domain);
+        }
+
+        sock_fprog program = {static_cast<unsigned short>(code.size()), code.data()};
+        if (::setsockopt(acceptor.native_handle(), SOL_SOCKET,
+                         SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) != 0)
+        {
+            return {errno, boost::system::system_category()};
+        }
+        return {};
+    }
+
+    // The connections are then accepted through io_uring, by a multishot
+    // accept. Must be called before start(), throws if the ring of the
+    // service of the acceptor cannot be created.
+    void use_uring()
     {
+        uring = &boost::asio::use_service<Uring>(boost::asio::query(
+            acceptor.get_executor(), boost::asio::execution::context));
     }
 
     template <typename Client, typename CB>
     void start(CB callback)
     {
         running = true;
-        auto client = Client::create(pool);
+        if (uring)
+        {
+            return start_uring<Client>(std::move(callback));
+        }
+
+        auto client = service ? Client::create(pool, *service) : Client::create(pool);
         auto& sock = socket(client);
         acceptor.async_accept(
             sock, [this, client = std::move(client), cb = std::move(callback)](
@@ -54,11 +162,65 @@ public:
             });
     }
 
+    template <typename Client, typename CB>
+    void start_uring(CB callback)
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        accept_op = uring->async_accept(
+            acceptor.native_handle(),
+            [this, cb = std::move(callback)](boost::system::error_code error,
+                                             int fd) mutable {
+                if (!error)
+                {
+                    auto client =
+                        service ? Client::create(pool, *service) : Client::create(pool);
+                    const typename Client::socket_type::protocol_type protocol(
+                        endpoint.protocol().family(), endpoint.protocol().protocol());
+                    boost::system::error_code ec;
+                    socket(client).assign(protocol, fd, ec);
+                    if (ec)
+                    {
+                        ::close(fd);
+                        GLOG(warning) << "Error during accept: " << ec.message();
+                        return;
+                    }
+
+                    cb(client);
+                    return;
+                }
+
+                if (error == boost::asio::error::operation_aborted)
+                {
+                    GLOG(warning) << "Stopping acceptor";
+                }
+                else
+                {
+                    GLOG(warning) << "Error during accept: " << error.message();
+                }
+
+                std::lock_guard<std::mutex> l(mutex);
+                accept_op = nullptr;
+                running = false;
+            });
+    }
+
     void stop()
     {
         if (running)
         {
-            acceptor.cancel();
+            if (uring)
+            {
+                // The kernel keeps the socket open until then.
+                std::lock_guard<std::mutex> l(mutex);
+                if (accept_op)
+                {
+                    uring->cancel(accept_op);
+                }
+            }
+            else
+            {
+                acceptor.cancel();
+            }
             acceptor.close();
             while (running != false)
             {
@@ -68,15 +230,28 @@ public:
         }
     }
 
-    ~Acceptor()
+    ~BasicAcceptor()
     {
         stop();
+        release_endpoint(endpoint);
     }
 
     commonpp::thread::ThreadPool& pool;
-    boost::asio::ip::tcp::acceptor acceptor;
+    const endpoint_type endpoint;
+    acceptor_type acceptor;
+    // Set when the connections run on the service of the acceptor.
+    boost::asio::io_service* service = nullptr;
     std::atomic_bool running{false};
+
+    // Set when accepting through io_uring.
+    Uring* uring = nullptr;
+    std::mutex mutex;
+    // The multishot accept, until its last handler.
+    Uring::Operation* accept_op = nullptr;
 };
 
+using Acceptor = BasicAcceptor<boost::asio::ip::tcp>;
+using UnixAcceptor = BasicAcceptor<boost::asio::local::stream_protocol>;
+
 } // namespace handlers
 } // namespace blabla
@@ -0,0 +1,136 @@
+#include "Buffer.hpp"
+
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+namespace blabla
+{
+namespace handlers
+{
+
+namespace
+{
+// Chunk sizes are rounded up to a power of 2, from 64KB (the usual receive
+// size) to 32MB (the biggest frame followed by the biggest payload).
+constexpr size_t MIN_SIZE_CLASS_LOG2 = 16;
+constexpr size_t NB_SIZE_CLASSES = 10;
+// Bigger chunks are not pooled.
+constexpr size_t UNPOOLED = NB_SIZE_CLASSES;
+// Released chunks are freed once the pool holds that much.
+constexpr size_t MAX_POOLED_BYTES = 256 * 1024 * 1024;
+
+struct SizeClass
+{
+    std::mutex mutex;
+    std::vector<Chunk*> chunks;
+};
+
+struct Pool
+{
+    Pool()
+    {
+        // Releasing a chunk never allocates.
+        for (size_t i = 0; i < NB_SIZE_CLASSES; ++i)
+        {
+            classes[i].chunks.reserve(MAX_POOLED_BYTES >> (i + MIN_SIZE_CLASS_LOG2));
+        }
+    }
+
+    std::array<SizeClass, NB_SIZE_CLASSES> classes;
+    std::atomic<size_t> pooled_bytes{0};
+};
+
+Pool& pool()
+{
+    // Never destroyed: chunks may be released by static destructors.
+    static Pool* pool = new Pool;
+    return *pool;
+}
+
+size_t size_class_of(size_t size)
+{
+    size_t log2 = MIN_SIZE_CLASS_LOG2;
+    while ((size_t(1) << log2) < size && log2 - MIN_SIZE_CLASS_LOG2 < UNPOOLED)
+    {
+        ++log2;
+    }
+    return log2 - MIN_SIZE_CLASS_LOG2;
+}
+} // namespace
+
+Chunk::Ptr Chunk::allocate(size_t size)
+{
+    const auto cls = size_class_of(size);
+    if (BOOST_LIKELY(cls != UNPOOLED))
+    {
+        auto& p = pool();
+        auto& sc = p.classes[cls];
+        std::unique_lock<std::mutex> l(sc.mutex);
+        if (!sc.chunks.empty())
+        {
+            auto chunk = sc.chunks.back();
+            sc.chunks.pop_back();
+            l.unlock();
+
+            p.pooled_bytes -= chunk->capacity;
+            return Ptr(chunk);
+        }
+
+        size = size_t(1) << (cls + MIN_SIZE_CLASS_LOG2);
+    }
+
+    void* memory = std::malloc(sizeof(Chunk) + size);
+    if (!memory)
+    {
+        throw std::bad_alloc();
+    }
+
+    return Ptr(new (memory) Chunk(size, cls));
+}
+
+Chunk* Chunk::create(size_t size, Owner& owner, uint32_t tag)
+{
+    void* memory = std::malloc(sizeof(Chunk) + size);
+    if (!memory)
+    {
+        throw std::bad_alloc();
+    }
+
+    return new (memory) Chunk(size, UNPOOLED, &owner, tag);
+}
+
+void Chunk::destroy(Chunk* chunk) noexcept
+{
+    chunk->~Chunk();
+    std::free(chunk);
+}
+
+void Chunk::release(Chunk* chunk) noexcept
+{
+    if (chunk->owner)
+    {
+        chunk->owner->recycle(chunk);
+        return;
+    }
+
+    if (chunk->size_class != UNPOOLED)
+    {
+        auto& p = pool();
+        if (p.pooled_bytes.fetch_add(chunk->capacity) + chunk->capacity <=
+            MAX_POOLED_BYTES)
+        {
+            auto& sc = p.classes[chunk->size_class];
+            std::lock_guard<std::mutex> l(sc.mutex);
+            sc.chunks.push_back(chunk);
+            return;
+        }
+
+        p.pooled_bytes -= chunk->capacity;
+    }
+
+    destroy(chunk);
+}
+
+} // namespace handlers
+} // namespace blabla
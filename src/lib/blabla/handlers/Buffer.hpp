@@ -1,13 +1,17 @@
 #pragma once
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <memory>
 #include <vector>
 
 #include <boost/asio/buffer.hpp>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
 #include <boost/utility.hpp>
+#include <boost/variant.hpp>
 
 namespace blabla
 {
@@ -28,6 +32,94 @@ static auto asio_buffers(Args&&... args)
         boost::asio::buffer(std::forward<Args>(args))...,
     });
 }
+
+// Non owning view over a contiguous range of buffers, asio copies the buffer
+// sequence into the operation so this avoids copying a whole vector on each
+// write.
+struct ConstBufferRange
+{
+    using value_type = boost::asio::const_buffer;
+    using const_iterator = const boost::asio::const_buffer*;
+
+    const_iterator begin() const
+    {
+        return first;
+    }
+
+    const_iterator end() const
+    {
+        return last;
+    }
+
+    const_iterator first;
+    const_iterator last;
+};
+
+// Per thread cache of blocks of BlockSize bytes. A block released by another
+// thread than the one which allocated it is cached by the releasing thread,
+// which is fine as long as every thread both allocates and releases blocks.
+template <size_t BlockSize, size_t MaxCachedBlocks = 16 * 1024>
+struct ThreadLocalPool
+{
+    static_assert(BlockSize >= sizeof(void*), "Block too small");
+
+    static void* allocate()
+    {
+        auto& cache = free_list();
+        if (BOOST_LIKELY(cache.head != nullptr))
+        {
+            auto block = cache.head;
+            cache.head = block->next;
+            --cache.size;
+            return block;
+        }
+
+        return ::operator new(BlockSize);
+    }
+
+    static void deallocate(void* ptr)
+    {
+        auto& cache = free_list();
+        if (BOOST_UNLIKELY(cache.size >= MaxCachedBlocks))
+        {
+            ::operator delete(ptr);
+            return;
+        }
+
+        auto block = static_cast<Block*>(ptr);
+        block->next = cache.head;
+        cache.head = block;
+        ++cache.size;
+    }
+
+private:
+    struct Block
+    {
+        Block* next;
+    };
+
+    struct FreeList
+    {
+        ~FreeList()
+        {
+            while (head != nullptr)
+            {
+                auto next = head->next;
+                ::operator delete(head);
+                head = next;
+            }
+        }
+
+        Block* head = nullptr;
+        size_t size = 0;
+    };
+
+    static FreeList& free_list()
+    {
+        static thread_local FreeList list;
+        return list;
+    }
+};
 } // namespace detail
 
 struct SingleOwnershipBuffer
@@ -92,53 +184,325 @@ private:
     std::array<boost::asio::const_buffer, 2> buffers;
 };
 
-struct SharedBufferWithSpecificMetadata
+// Block of bytes received from a connection. The messages delivered to the
+// subscribers point into the chunk they were received in, so it is reference
+// counted and goes back to a process wide pool once the last write using it
+// has completed.
+class Chunk : private boost::noncopyable
+{
+public:
+    using Ptr = boost::intrusive_ptr<Chunk>;
+
+    // Gets back the chunks it created instead of the pool, from any thread.
+    struct Owner
+    {
+        virtual void recycle(Chunk* chunk) noexcept = 0;
+
+    protected:
+        ~Owner() = default;
+    };
+
+    // The chunk holds at least size bytes.
+    static Ptr allocate(size_t size);
+
+    // A chunk of exactly size bytes, given back to owner once the last
+    // reference is released. It is freed by destroy().
+    static Chunk* create(size_t size, Owner& owner, uint32_t tag);
+    static void destroy(Chunk* chunk) noexcept;
+
+    // Set by create().
+    uint32_t tag() const noexcept
+    {
+        return tag_;
+    }
+
+    uint8_t* data() noexcept
+    {
+        return reinterpret_cast<uint8_t*>(this + 1);
+    }
+
+    const uint8_t* data() const noexcept
+    {
+        return reinterpret_cast<const uint8_t*>(this + 1);
+    }
+
+    size_t size() const noexcept
+    {
+        return capacity;
+    }
+
+    // Whether someone else than the caller holds a reference, in which case
+    // the bytes already received must not be modified.
+    bool shared() const noexcept
+    {
+        return references.load(std::memory_order_acquire) > 1;
+    }
+
+    friend void intrusive_ptr_add_ref(Chunk* chunk) noexcept
+    {
+        chunk->references.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    friend void intrusive_ptr_release(Chunk* chunk) noexcept
+    {
+        if (chunk->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            release(chunk);
+        }
+    }
+
+private:
+    Chunk(size_t capacity,
+          size_t size_class,
+          Owner* owner = nullptr,
+          uint32_t tag = 0)
+    : tag_(tag)
+    , capacity(capacity)
+    , size_class(size_class)
+    , owner(owner)
+    {
+    }
+
+    static void release(Chunk* chunk) noexcept;
+
+    std::atomic<uint32_t> references{0};
+    uint32_t tag_;
+    // The bytes follow the object, in the same allocation.
+    size_t capacity;
+    size_t size_class;
+    Owner* owner;
+};
+
+// A message delivered to a subscriber: a payload shared by every subscriber
+// and a small metadata specific to this one (its ConsumerMessageHeader).
+//
+// This is allocated for each delivery so it avoids the heap: the metadata is
+// stored inline unless it is unusually big, the payload is shared through an
+// intrusive reference count and the object itself comes from a per thread
+// pool.
+struct SharedBufferWithSpecificMetadata : private boost::noncopyable
 {
+    static constexpr size_t INLINE_METADATA_SIZE = 64;
+
+    // Shares [offset, offset + length) of chunk, without copying it.
     static std::unique_ptr<SharedBufferWithSpecificMetadata>
-    create_from(std::vector<uint8_t> immutable_data)
+    create_from(Chunk::Ptr chunk, size_t offset, size_t length)
     {
-        auto result = std::make_unique<SharedBufferWithSpecificMetadata>();
-        result->immutable_buffer = std::make_shared<Buffer>();
-        result->immutable_buffer->buffer = std::move(immutable_data);
+        assert(offset + length <= chunk->size());
+        std::unique_ptr<SharedBufferWithSpecificMetadata> result(
+            new SharedBufferWithSpecificMetadata);
+        result->payload = chunk->data() + offset;
+        result->payload_length = length;
+        result->chunk = std::move(chunk);
         return result;
     }
 
+    // Encoder must provide:
+    //  - size_t max_size() const;
+    //  - size_t encode(int32_t correlation_id, uint8_t* out) const;
+    template <typename Encoder>
     std::unique_ptr<SharedBufferWithSpecificMetadata>
-    new_with_metadata(std::vector<uint8_t> metadata)
+    new_with_metadata(const Encoder& encoder, int32_t correlation_id) const
     {
-        auto result = std::make_unique<SharedBufferWithSpecificMetadata>(*this);
-        result->metadata = std::move(metadata);
-        result->size.size = ::htonl(result->metadata.size());
+        std::unique_ptr<SharedBufferWithSpecificMetadata> result(
+            new SharedBufferWithSpecificMetadata);
+        result->chunk = chunk;
+        result->payload = payload;
+        result->payload_length = payload_length;
 
-        result->_buffers =
-            detail::asio_buffers(result->size.buff, result->metadata,
-                                 result->immutable_buffer->buffer);
+        uint8_t* out = result->inline_metadata.data();
+        if (BOOST_UNLIKELY(encoder.max_size() > INLINE_METADATA_SIZE))
+        {
+            result->large_metadata.reset(new uint8_t[encoder.max_size()]);
+            out = result->large_metadata.get();
+        }
 
+        result->journal_index = journal_index;
+        result->journal_offset = journal_offset;
+        result->received = received;
+        result->correlation = correlation_id;
+        result->metadata_size = encoder.encode(correlation_id, out);
+        result->size.size = ::htonl(result->metadata_size);
+        return result;
+    }
+
+    // Same payload, without metadata.
+    std::unique_ptr<SharedBufferWithSpecificMetadata> share() const
+    {
+        std::unique_ptr<SharedBufferWithSpecificMetadata> result(
+            new SharedBufferWithSpecificMetadata);
+        result->chunk = chunk;
+        result->payload = payload;
+        result->payload_length = payload_length;
+        result->journal_index = journal_index;
+        result->journal_offset = journal_offset;
+        result->received = received;
         return result;
     }
 
     size_t payload_size() const
     {
-        assert(immutable_buffer != nullptr);
-        return immutable_buffer->buffer.size();
+        assert(chunk != nullptr);
+        return payload_length;
+    }
+
+    const uint8_t* payload_data() const
+    {
+        return payload;
+    }
+
+    // Where the message was journaled, the offset is 0 if it was not.
+    void set_journal_position(uint32_t index, uint64_t offset)
+    {
+        journal_index = index;
+        journal_offset = offset;
+    }
+
+    uint32_t journal() const
+    {
+        return journal_index;
+    }
+
+    uint64_t offset() const
+    {
+        return journal_offset;
+    }
+
+    // Subscription the message is delivered to, set by new_with_metadata.
+    int32_t correlation_id() const
+    {
+        return correlation;
+    }
+
+    // When the payload was received (metrics::now()), 0 for the replayed
+    // messages.
+    void set_received_at(uint64_t time)
+    {
+        received = time;
+    }
+
+    uint64_t received_at() const
+    {
+        return received;
     }
 
     auto to_buffers() const
     {
-        return _buffers;
+        const uint8_t* metadata =
+            large_metadata ? large_metadata.get() : inline_metadata.data();
+
+        return detail::asio_buffers(
+            size.buff, boost::asio::buffer(metadata, metadata_size),
+            boost::asio::buffer(payload, payload_length));
     }
 
-private:
-    struct Buffer
+    static void* operator new(size_t size)
     {
-        std::vector<uint8_t> buffer;
-    };
+        using Pool = detail::ThreadLocalPool<sizeof(SharedBufferWithSpecificMetadata)>;
+        assert(size == sizeof(SharedBufferWithSpecificMetadata));
+        return Pool::allocate();
+    }
+
+    static void operator delete(void* ptr)
+    {
+        using Pool = detail::ThreadLocalPool<sizeof(SharedBufferWithSpecificMetadata)>;
+        Pool::deallocate(ptr);
+    }
+
+private:
+    SharedBufferWithSpecificMetadata() = default;
 
 private:
     IntBuffer size{};
-    std::vector<uint8_t> metadata;
-    std::shared_ptr<Buffer> immutable_buffer;
-    std::array<boost::asio::const_buffer, 3> _buffers;
+    uint32_t metadata_size = 0;
+    std::array<uint8_t, INLINE_METADATA_SIZE> inline_metadata;
+    std::unique_ptr<uint8_t[]> large_metadata;
+    Chunk::Ptr chunk;
+    // Part of chunk delivered by this message.
+    const uint8_t* payload = nullptr;
+    size_t payload_length = 0;
+    uint32_t journal_index = 0;
+    uint64_t journal_offset = 0;
+    uint64_t received = 0;
+    int32_t correlation = 0;
+};
+
+// Entry of a client outbound queue: keeps the underlying buffer alive until it
+// has been written and caches its asio buffers so they can be gathered.
+struct OutboundBuffer
+{
+    static constexpr size_t MAX_BUFFERS = 3;
+
+    template <typename BufferPtr>
+    OutboundBuffer(BufferPtr buff)
+    {
+        auto bufs = buff->to_buffers();
+        static_assert(std::tuple_size<decltype(bufs)>::value <= MAX_BUFFERS,
+                      "Too many buffers for an outbound entry");
+
+        std::copy(bufs.begin(), bufs.end(), buffers.begin());
+        nb_buffers = bufs.size();
+        bytes = boost::asio::buffer_size(bufs);
+        set_origin(*buff);
+        holder = std::move(buff);
+    }
+
+    template <typename Container>
+    void append_to(Container& c) const
+    {
+        c.insert(c.end(), buffers.begin(), buffers.begin() + nb_buffers);
+    }
+
+    size_t size() const
+    {
+        return bytes;
+    }
+
+    size_t buffer_count() const
+    {
+        return nb_buffers;
+    }
+
+    // A message delivered to a subscriber, not a protocol message.
+    bool is_message() const
+    {
+        return message;
+    }
+
+    // See SharedBufferWithSpecificMetadata::received_at().
+    uint64_t received_at() const
+    {
+        return received;
+    }
+
+    // The connection is closed once this buffer has been written.
+    bool close_after = false;
+    // Can be evicted by the outbound policy, protocol messages cannot.
+    bool droppable = false;
+
+private:
+    template <typename T>
+    void set_origin(const T&)
+    {
+    }
+
+    void set_origin(const SharedBufferWithSpecificMetadata& msg)
+    {
+        message = true;
+        received = msg.received_at();
+    }
+
+    using Holder =
+        boost::variant<SingleOwnershipBuffer::SingleOwnershipBufferPtr,
+                       SharedBuffer::SharedBufferPtr,
+                       std::unique_ptr<SharedBufferWithSpecificMetadata>>;
+
+    Holder holder;
+    std::array<boost::asio::const_buffer, MAX_BUFFERS> buffers;
+    size_t nb_buffers = 0;
+    size_t bytes = 0;
+    bool message = false;
+    uint64_t received = 0;
 };
 
 } // namespace handlers
@@ -1,6 +1,8 @@
 #include "Client.hpp"
 
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <cstring>
 
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
@@ -8,6 +10,9 @@
 
 #include <commonpp/core/LoggingInterface.hpp>
 
+#include "blabla/Metrics.hpp"
+#include "blabla/RoutePatterns.hpp"
+#include "blabla/journal/Journal.hpp"
 #include "proto/service.pb.h"
 
 namespace blabla
@@ -21,6 +26,23 @@ void Client::start(ClientManager* manager)
 {
     DLOG(client_logger, debug) << peer() << " started";
     this->manager = manager;
+    if (manager->uring_enabled() && !channel)
+    {
+        try
+        {
+            uring = &boost::asio::use_service<Uring>(boost::asio::query(
+                socket_.get_executor(), boost::asio::execution::context));
+            // io_uring waits for the socket itself.
+            socket_.non_blocking(false);
+        }
+        catch (const std::exception& e)
+        {
+            LOG(client_logger, error)
+                << "Cannot use io_uring for " << peer() << ": " << e.what();
+            uring = nullptr;
+        }
+    }
+
     read_message(shared_from_this());
 }
 
@@ -29,26 +51,356 @@ void Client::stop()
     return killme();
 }
 
+std::string Client::peer() const
+{
+    if (channel)
+    {
+        return "[local:" + std::to_string(channel->peer_pid()) + "]";
+    }
+
+    boost::system::error_code ec;
+    const auto endpoint = socket_.remote_endpoint(ec);
+    if (ec)
+    {
+        return "[connection lost]";
+    }
+
+    switch (endpoint.protocol().family())
+    {
+    case AF_INET:
+    {
+        sockaddr_in addr;
+        std::memcpy(&addr, endpoint.data(), sizeof(addr));
+        return "[" + boost::asio::ip::address_v4(ntohl(addr.sin_addr.s_addr)).to_string() +
+               ":" + std::to_string(ntohs(addr.sin_port)) + "]";
+    }
+    case AF_INET6:
+    {
+        sockaddr_in6 addr;
+        std::memcpy(&addr, endpoint.data(), sizeof(addr));
+        boost::asio::ip::address_v6::bytes_type bytes;
+        std::memcpy(bytes.data(), addr.sin6_addr.s6_addr, bytes.size());
+        return "[" + boost::asio::ip::address_v6(bytes, addr.sin6_scope_id).to_string() +
+               ":" + std::to_string(ntohs(addr.sin6_port)) + "]";
+    }
+    case AF_UNIX:
+    {
+        ucred credentials;
+        if (!peer_credentials(credentials))
+        {
+            return "[unix]";
+        }
+        return "[unix:" + std::to_string(credentials.pid) + "]";
+    }
+    default:
+        return "[family " + std::to_string(endpoint.protocol().family()) + "]";
+    }
+}
+
+bool Client::peer_credentials(ucred& credentials) const noexcept
+{
+    boost::system::error_code ec;
+    if (!socket_.is_open() || socket_.local_endpoint(ec).protocol().family() != AF_UNIX ||
+        ec)
+    {
+        return false;
+    }
+
+    socklen_t size = sizeof(credentials);
+    return ::getsockopt(const_cast<socket_type&>(socket_).native_handle(), SOL_SOCKET,
+                        SO_PEERCRED, &credentials, &size) == 0 &&
+           size == sizeof(credentials);
+}
+
+// Connections read as much as they can, and decode every frame received at
+// once before reading again.
+static const size_t RECEIVE_CHUNK_SIZE = 64 * 1024;
+// Buffered data are moved to the front of the chunk, or to a new one, when
+// less than this can be read after them.
+static const size_t MIN_RECEIVE_SIZE = 4 * 1024;
+
 void Client::read_message(std::shared_ptr<Client> myself)
 {
+    DispatchContext ctx;
+    ctx.myself = std::move(myself);
+
+    while (may_read())
+    {
+        ctx.parse_next = false;
+        if (!dispatch_buffered_frame(ctx))
+        {
+            if (uring)
+            {
+                if (take_received(ctx.myself))
+                {
+                    continue;
+                }
+                return;
+            }
+            return receive_more(std::move(ctx.myself));
+        }
+
+        if (!ctx.parse_next)
+        {
+            break;
+        }
+    }
+
+    if (uring)
+    {
+        stop_receiving();
+    }
+}
+
+bool Client::may_read()
+{
+    if (BOOST_LIKELY(read_pausers == 0))
+    {
+        return true;
+    }
+
+    read_parked = true;
+    // The last consumer may have resumed us in between, in which case only
+    // one of us must continue.
+    return read_pausers == 0 && read_parked.exchange(false);
+}
+
+void Client::receive_more(std::shared_ptr<Client> myself)
+{
+    const size_t pending = receive_end - receive_begin;
+    const size_t wanted = std::max(receive_needed, pending + MIN_RECEIVE_SIZE);
+
+    if (!receive_chunk || receive_chunk->size() - receive_begin < wanted ||
+        (pending == 0 && receive_chunk->size() > RECEIVE_CHUNK_SIZE))
+    {
+        if (receive_chunk && !receive_chunk->shared() &&
+            receive_chunk->size() >= wanted && receive_chunk->size() <= RECEIVE_CHUNK_SIZE)
+        {
+            std::memmove(receive_chunk->data(),
+                         receive_chunk->data() + receive_begin, pending);
+        }
+        else
+        {
+            // The delivered payloads keep the current chunk alive, the
+            // incomplete frame is copied to a new one.
+            auto chunk = Chunk::allocate(std::max(RECEIVE_CHUNK_SIZE, wanted));
+            if (pending)
+            {
+                std::memcpy(chunk->data(), receive_chunk->data() + receive_begin,
+                            pending);
+            }
+            receive_chunk = std::move(chunk);
+        }
+
+        receive_begin = 0;
+        receive_end = pending;
+    }
+    else if (pending == 0 && !receive_chunk->shared())
+    {
+        receive_begin = receive_end = 0;
+    }
+
+    // A payload being received is read at once.
+    const size_t at_least = receive_needed > pending ? receive_needed - pending : 1;
+
     std::lock_guard<std::mutex> l(mutex);
+    if (channel)
+    {
+        channel->async_read(boost::asio::buffer(receive_chunk->data() + receive_end,
+                                                receive_chunk->size() - receive_end),
+                            at_least,
+                            boost::bind(&Client::on_receive, this, std::move(myself),
+                                        boost::asio::placeholders::error,
+                                        boost::asio::placeholders::bytes_transferred));
+        return;
+    }
+
     boost::asio::async_read(
-        socket_, boost::asio::buffer(size_buffer.buff),
-        boost::bind(&Client::maybe_read_message_size, this, std::move(myself),
+        socket_,
+        boost::asio::buffer(receive_chunk->data() + receive_end,
+                            receive_chunk->size() - receive_end),
+        boost::asio::transfer_at_least(at_least),
+        boost::bind(&Client::on_receive, this, std::move(myself),
                     boost::asio::placeholders::error,
                     boost::asio::placeholders::bytes_transferred));
 }
 
+void Client::on_receive(std::shared_ptr<Client> myself,
+                        boost::system::error_code errc,
+                        std::size_t bytes_transferred)
+{
+    if (!handle_error(std::move(errc)))
+    {
+        return;
+    }
+
+    receive_end += bytes_transferred;
+    received_at = metrics::now();
+    metrics::local().bytes_in.add(bytes_transferred);
+    read_message(std::move(myself));
+}
+
+bool Client::take_received(const std::shared_ptr<Client>& myself)
+{
+    ReceivedBlock block;
+    boost::system::error_code ec;
+    {
+        std::lock_guard<std::mutex> l(receive_mutex);
+        if (!received.empty())
+        {
+            block = std::move(received.front());
+            received.pop_front();
+        }
+        else if (receive_error)
+        {
+            ec = receive_error;
+        }
+        else
+        {
+            reader_active = false;
+            start_receiving(myself);
+            return false;
+        }
+    }
+
+    if (ec)
+    {
+        handle_error(ec);
+        return false;
+    }
+
+    const size_t pending = receive_end - receive_begin;
+    if (pending == 0)
+    {
+        // The payloads are delivered from the registered buffer itself.
+        receive_chunk = std::move(block.chunk);
+        receive_begin = 0;
+        receive_end = block.size;
+    }
+    else
+    {
+        // Only what follows an incomplete frame is copied.
+        if (receive_chunk->size() - receive_end < block.size)
+        {
+            auto chunk = Chunk::allocate(
+                std::max({RECEIVE_CHUNK_SIZE, receive_needed, pending + block.size}));
+            std::memcpy(chunk->data(), receive_chunk->data() + receive_begin, pending);
+            receive_chunk = std::move(chunk);
+            receive_begin = 0;
+            receive_end = pending;
+        }
+
+        std::memcpy(receive_chunk->data() + receive_end, block.chunk->data(), block.size);
+        receive_end += block.size;
+    }
+
+    received_at = block.received_at;
+    return true;
+}
+
+void Client::on_uring_receive(std::shared_ptr<Client> myself,
+                              boost::system::error_code errc,
+                              Chunk::Ptr chunk,
+                              size_t size)
+{
+    if (errc)
+    {
+        std::lock_guard<std::mutex> l(receive_mutex);
+        receive_op = nullptr;
+        if (errc == boost::asio::error::operation_aborted)
+        {
+            // Stopped for the reader, which may be idle again already.
+            if (!reader_active)
+            {
+                start_receiving(myself);
+            }
+            return;
+        }
+
+        receive_error = errc;
+        if (reader_active)
+        {
+            return;
+        }
+        reader_active = true;
+    }
+    else
+    {
+        metrics::local().bytes_in.add(size);
+        std::lock_guard<std::mutex> l(receive_mutex);
+        received.push_back({std::move(chunk), size, metrics::now()});
+        if (reader_active)
+        {
+            return;
+        }
+        reader_active = true;
+    }
+
+    read_message(std::move(myself));
+}
+
+void Client::start_receiving(const std::shared_ptr<Client>& myself)
+{
+    if (receive_op || receive_error)
+    {
+        return;
+    }
+
+    receive_op = uring->async_receive(
+        socket_.native_handle(),
+        [this, myself](boost::system::error_code ec, Chunk::Ptr chunk, size_t size) {
+            on_uring_receive(myself, ec, std::move(chunk), size);
+        });
+}
+
+void Client::stop_receiving()
+{
+    // What is received until the cancel is queued.
+    std::lock_guard<std::mutex> l(receive_mutex);
+    if (receive_op)
+    {
+        uring->cancel(receive_op);
+    }
+}
+
 void Client::killme()
 {
     DLOG(client_logger, debug) << "Killing connection: " << peer();
+    std::vector<std::weak_ptr<Client>> producers;
     {
         std::lock_guard<std::mutex> l(mutex);
+        if (killed)
+        {
+            return;
+        }
+
+        killed = true;
+        closing = true;
         unsubscribe_all();
+        producers.swap(paused_producers);
+
+        if (dropped_messages != 0)
+        {
+            LOG(client_logger, warning)
+                << peer() << " dropped " << dropped_messages
+                << " messages because of its outbound policy";
+        }
 
         boost::system::error_code ec;
+        if (channel)
+        {
+            channel->close();
+        }
         socket_.cancel(ec);
-        socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+        socket_.shutdown(socket_type::shutdown_both, ec);
+    }
+
+    for (auto& producer : producers)
+    {
+        if (auto p = producer.lock())
+        {
+            p->resume_reads();
+        }
     }
 
     manager->remove_connection(shared_from_this());
@@ -104,26 +456,50 @@ static services::blabla::Error error(services::blabla::Error_ErrorType code,
     return err;
 }
 
-static SingleOwnershipBuffer::SingleOwnershipBufferPtr
-to_buffer(const google::protobuf::Message& msg)
+template <typename T>
+SingleOwnershipBuffer::SingleOwnershipBufferPtr Client::to_buffer(const T& msg) const
 {
+    const size_t offset = mode == WireMode::binary ? BinaryHeader::SIZE : 0;
     std::vector<uint8_t> buff;
-    buff.resize(msg.ByteSize());
-    msg.SerializeToArray(buff.data(), buff.size());
+    buff.resize(offset + msg.ByteSizeLong());
+    if (offset)
+    {
+        BinaryHeader header;
+        header.type = msg.header().type();
+        header.encode(buff.data());
+    }
+    msg.SerializeWithCachedSizesToArray(buff.data() + offset);
     return SingleOwnershipBuffer::allocate(std::move(buff));
 }
 
 static const auto HARD_MSG_SIZE_LIMIT = 15 * 1024 * 1024; // 15MB
+// A replay reads this much of the journal at a time, and waits for the
+// outbound queue to be under REPLAY_QUEUED_BYTES before reading more.
+static const size_t REPLAY_READ_BYTES = 256 * 1024;
+static const size_t REPLAY_QUEUED_BYTES = 1024 * 1024;
 
-void Client::maybe_read_message_size(std::shared_ptr<Client> myself,
-                                     boost::system::error_code errc,
-                                     std::size_t)
+// Whether a subscription to a prefix (pattern) matches route.
+static bool subscribed_to(boost::string_view subscription,
+                          bool pattern,
+                          boost::string_view route)
 {
-    if (!handle_error(std::move(errc)))
+    return pattern ? RoutePatterns::matches(subscription, route)
+                   : journal::covers(subscription, route);
+}
+
+// Returns false if the frame at receive_begin is not complete.
+bool Client::dispatch_buffered_frame(DispatchContext& ctx)
+{
+    IntBuffer size_buffer;
+    const size_t available = receive_end - receive_begin;
+    if (available < sizeof(size_buffer))
     {
-        return;
+        receive_needed = sizeof(size_buffer);
+        return false;
     }
 
+    std::memcpy(size_buffer.buff, receive_chunk->data() + receive_begin,
+                sizeof(size_buffer));
     size_buffer.size = ::ntohl(size_buffer.size);
     DLOG(client_logger, info) << "Message size to read: " << size_buffer.size;
 
@@ -131,38 +507,53 @@ void Client::maybe_read_message_size(std::shared_ptr<Client> myself,
     {
         std::string str = "Got a payload of: " + std::to_string(size_buffer.size) +
                           "B (>" + std::to_string(HARD_MSG_SIZE_LIMIT) + "B)";
-        return this->send_error(to_buffer(error(
+        this->send_error(to_buffer(error(
             services::blabla::Error_ErrorType_PAYLOAD_TOO_BIG, std::move(str))));
+        return true;
     }
     else if (BOOST_UNLIKELY(size_buffer.size == 0))
     {
-        return this->send_error(
+        this->send_error(
             to_buffer(error(services::blabla::Error_ErrorType_PAYLOAD_TOO_SHORT,
                             "Got a null payload")));
+        return true;
     }
 
-    control_message_buffer.clear();
-    control_message_buffer.resize(size_buffer.size);
-    std::lock_guard<std::mutex> l(mutex);
-    boost::asio::async_read(
-        socket_, boost::asio::buffer(control_message_buffer),
-        boost::bind(&Client::maybe_read_message, this, std::move(myself),
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
+    const size_t frame_size = sizeof(size_buffer) + size_buffer.size;
+    if (available < frame_size)
+    {
+        receive_needed = frame_size;
+        return false;
+    }
+
+    // The frame is consumed before being handled: the handlers consume the
+    // payload following it.
+    const size_t frame_begin = receive_begin;
+    const uint8_t* frame = receive_chunk->data() + receive_begin + sizeof(size_buffer);
+    receive_begin += frame_size;
+    receive_needed = 0;
+
+    MessageCracker::process(ctx, frame, size_buffer.size);
+    if (BOOST_UNLIKELY(ctx.missing_payload != 0))
+    {
+        receive_needed = frame_size + ctx.missing_payload;
+        receive_begin = frame_begin;
+        ctx.missing_payload = 0;
+        return false;
+    }
+
+    return true;
 }
 
-void Client::maybe_read_message(std::shared_ptr<Client> myself,
-                                boost::system::error_code errc,
-                                std::size_t)
+bool Client::payload_received(DispatchContext& ctx, size_t size)
 {
-    if (!handle_error(std::move(errc)))
+    if (receive_end - receive_begin >= size)
     {
-        return;
+        return true;
     }
 
-    Client::DispatchContext ctx;
-    ctx.myself = std::move(myself);
-    MessageCracker::process(ctx, control_message_buffer);
+    ctx.missing_payload = size;
+    return false;
 }
 
 void Client::decoding_error()
@@ -186,39 +577,299 @@ void Client::decoding_unknown_type()
 template <typename Buffer>
 void Client::send_error(Buffer buff)
 {
-    auto buffers = buff->to_buffers();
     std::lock_guard<std::mutex> l(mutex);
-    boost::asio::async_write(
-        socket_, buffers,
-        [conn = shared_from_this(), buff = std::move(buff)](
-            boost::system::error_code ec, std::size_t) { conn->killme(); });
+    if (closing)
+    {
+        return;
+    }
+
+    OutboundBuffer entry(std::move(buff));
+    entry.close_after = true;
+    closing = true;
+    enqueue(std::move(entry));
 }
 
 template <typename Buffer>
 void Client::send_impl(Buffer buff)
 {
     DLOG(client_logger, trace) << "Send message to : " << peer();
-    auto buffers = buff->to_buffers();
+    OutboundBuffer entry(std::move(buff));
+
     std::lock_guard<std::mutex> l(mutex);
+    if (BOOST_UNLIKELY(closing))
+    {
+        return;
+    }
+
+    enqueue(std::move(entry));
+}
+
+// Must be called with the mutex held.
+void Client::enqueue(OutboundBuffer buffer)
+{
+    queued_bytes += buffer.size();
+    shared_queued_bytes.store(queued_bytes, std::memory_order_relaxed);
+    outbound.emplace_back(std::move(buffer));
+    if (in_flight == 0)
+    {
+        start_write();
+    }
+}
+
+bool Client::over_budget(const OutboundPolicy& policy, size_t size) const
+{
+    return queued_bytes + size > policy.max_bytes ||
+           outbound.size() + 1 > policy.max_messages;
+}
+
+// Must be called with the mutex held, returns true if the message should
+// still be queued.
+bool Client::enforce_policy(const OutboundPolicy& policy,
+                            size_t size,
+                            Client* producer)
+{
+    auto& stats = manager->outbound_stats();
+
+    switch (policy.overflow)
+    {
+    case OutboundPolicy::Overflow::drop_oldest:
+    {
+        // The write in flight cannot be evicted.
+        auto it = outbound.begin() + in_flight;
+        while (it != outbound.end() && over_budget(policy, size))
+        {
+            if (!it->droppable)
+            {
+                ++it;
+                continue;
+            }
+
+            queued_bytes -= it->size();
+            ++dropped_messages;
+            stats.dropped_messages.fetch_add(1, std::memory_order_relaxed);
+            stats.dropped_bytes.fetch_add(it->size(), std::memory_order_relaxed);
+            it = outbound.erase(it);
+        }
+        shared_queued_bytes.store(queued_bytes, std::memory_order_relaxed);
+
+        if (!over_budget(policy, size))
+        {
+            return true;
+        }
+
+        // Nothing left to evict, drop the new message instead.
+        // fall-through
+    }
+    case OutboundPolicy::Overflow::drop_newest:
+    {
+        ++dropped_messages;
+        stats.dropped_messages.fetch_add(1, std::memory_order_relaxed);
+        stats.dropped_bytes.fetch_add(size, std::memory_order_relaxed);
+        return false;
+    }
+    case OutboundPolicy::Overflow::disconnect:
+    {
+        LOG(client_logger, warning)
+            << peer() << " is over its outbound budget (" << queued_bytes
+            << "B, " << outbound.size() << " messages), disconnecting";
+        stats.disconnections.fetch_add(1, std::memory_order_relaxed);
+
+        // Cannot be killed here as we might be called while the
+        // subscriptions are being iterated.
+        closing = true;
+        boost::asio::post(socket_.get_executor(),
+                          [myself = shared_from_this()] { myself->killme(); });
+        return false;
+    }
+    case OutboundPolicy::Overflow::pause_producer:
+    {
+        if (producer == nullptr)
+        {
+            return true;
+        }
+
+        auto it = std::find_if(paused_producers.begin(), paused_producers.end(),
+                               [producer](const std::weak_ptr<Client>& p) {
+                                   return p.lock().get() == producer;
+                               });
+        if (it == paused_producers.end())
+        {
+            DLOG(client_logger, debug)
+                << peer() << " is over its outbound budget, pausing "
+                << producer->peer();
+            paused_producers.emplace_back(producer->shared_from_this());
+            producer->pause_reads();
+            stats.producer_pauses.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        resume_bytes = policy.max_bytes / 2;
+        resume_messages = policy.max_messages / 2;
+        return true;
+    }
+    }
+
+    return true;
+}
+
+void Client::pause_reads()
+{
+    ++read_pausers;
+}
+
+void Client::resume_reads()
+{
+    if (--read_pausers == 0 && read_parked.exchange(false))
+    {
+        // Called from the consumer side, the buffered frames are decoded by
+        // one of our own io threads.
+        auto myself = shared_from_this();
+        boost::asio::post(socket_.get_executor(),
+                          [myself] { myself->read_message(myself); });
+    }
+}
+
+// Must be called with the mutex held and no write in flight.
+void Client::start_write()
+{
+    assert(in_flight == 0);
+    assert(!outbound.empty());
+
+    const auto& conf = manager->configuration().outbound;
+    write_buffers.clear();
+    size_t bytes = 0;
+    bool close = false;
+    // io_uring chains several sends of the usual size in a single write.
+    const size_t sends = uring ? Uring::MAX_LINKED_SENDS : 1;
+
+    // Always take at least one message, even if it exceeds the limits.
+    for (auto& buff : outbound)
+    {
+        if (in_flight != 0 &&
+            (write_buffers.size() + buff.buffer_count() >
+                 conf.max_write_buffers * sends ||
+             bytes + buff.size() > conf.max_write_bytes * sends))
+        {
+            break;
+        }
+
+        buff.append_to(write_buffers);
+        bytes += buff.size();
+        ++in_flight;
+
+        if (buff.close_after)
+        {
+            close = true;
+            break;
+        }
+    }
+
+    DLOG(client_logger, trace)
+        << "Writing " << in_flight << " messages (" << bytes << "B) to " << peer();
+
+    detail::ConstBufferRange buffers{write_buffers.data(),
+                                     write_buffers.data() + write_buffers.size()};
+    if (channel)
+    {
+        channel->async_write(buffers,
+                             boost::bind(&Client::on_write, this, shared_from_this(),
+                                         boost::asio::placeholders::error, close));
+        return;
+    }
+
+    if (uring)
+    {
+        uring->async_write(socket_.native_handle(), buffers, conf.max_write_buffers,
+                           boost::bind(&Client::on_write, this, shared_from_this(),
+                                       boost::asio::placeholders::error, close));
+        return;
+    }
+
     boost::asio::async_write(
         socket_, buffers,
-        [buff = std::move(buff)](boost::system::error_code ec, std::size_t) {
-            // Do not handle error in write. a read call will
-            // eventually detect that the socket is unusable.
+        boost::bind(&Client::on_write, this, shared_from_this(),
+                    boost::asio::placeholders::error, close));
+}
+
+void Client::on_write(std::shared_ptr<Client>, boost::system::error_code ec, bool close)
+{
+    std::vector<std::weak_ptr<Client>> producers;
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        auto& local_metrics = metrics::local();
+        const auto written_at = ec ? 0 : metrics::now();
+        auto end = outbound.begin() + in_flight;
+        for (auto it = outbound.begin(); it != end; ++it)
+        {
+            queued_bytes -= it->size();
             if (ec)
             {
-                if (ec == boost::asio::error::operation_aborted ||
-                    ec == boost::asio::error::eof ||
-                    ec == boost::asio::error::connection_reset)
-                {
-                }
-                else
+                continue;
+            }
+
+            local_metrics.bytes_out.add(it->size());
+            if (it->is_message())
+            {
+                local_metrics.messages_out.add();
+                if (it->received_at() != 0)
                 {
-                    LOG(client_logger, error)
-                        << "An error occured during write: " << ec.message();
+                    local_metrics.delivery_ns.record(written_at - it->received_at());
                 }
             }
-        });
+        }
+        shared_queued_bytes.store(queued_bytes, std::memory_order_relaxed);
+        outbound.erase(outbound.begin(), end);
+        in_flight = 0;
+
+        if (ec)
+        {
+            // Do not handle error in write. a read call will
+            // eventually detect that the socket is unusable.
+            if (ec != boost::asio::error::operation_aborted &&
+                ec != boost::asio::error::eof &&
+                ec != boost::asio::error::connection_reset &&
+                ec != boost::asio::error::broken_pipe)
+            {
+                LOG(client_logger, error)
+                    << "An error occured during write: " << ec.message();
+            }
+
+            closing = true;
+            outbound.clear();
+            queued_bytes = 0;
+            shared_queued_bytes.store(0, std::memory_order_relaxed);
+        }
+        else if (!close && !outbound.empty())
+        {
+            start_write();
+        }
+
+        if (!paused_producers.empty() && queued_bytes <= resume_bytes &&
+            outbound.size() <= resume_messages)
+        {
+            producers.swap(paused_producers);
+        }
+
+        if (replay_waiting && !closing && queued_bytes <= REPLAY_QUEUED_BYTES / 2)
+        {
+            replay_waiting = false;
+            boost::asio::post(socket_.get_executor(),
+                              boost::bind(&Client::replay, this, shared_from_this()));
+        }
+    }
+
+    for (auto& producer : producers)
+    {
+        if (auto p = producer.lock())
+        {
+            DLOG(client_logger, debug) << peer() << " resuming " << p->peer();
+            p->resume_reads();
+        }
+    }
+
+    if (close)
+    {
+        killme();
+    }
 }
 
 void Client::send(SharedBuffer::SharedBufferPtr buff)
@@ -226,31 +877,100 @@ void Client::send(SharedBuffer::SharedBufferPtr buff)
     return send_impl(std::move(buff));
 }
 
-void Client::send(std::unique_ptr<SharedBufferWithSpecificMetadata> buff)
+void Client::send(std::unique_ptr<SharedBufferWithSpecificMetadata> buff,
+                  boost::string_view route,
+                  const OutboundPolicy& policy,
+                  Client* producer)
 {
-    return send_impl(std::move(buff));
+    DLOG(client_logger, trace) << "Send message to : " << peer();
+    const auto journal = buff->journal();
+    const auto offset = buff->offset();
+    const auto correlation_id = buff->correlation_id();
+    OutboundBuffer entry(std::move(buff));
+    entry.droppable = true;
+
+    std::lock_guard<std::mutex> l(mutex);
+    if (BOOST_UNLIKELY(closing))
+    {
+        return;
+    }
+
+    if (BOOST_UNLIKELY(!replayed_until.empty()) && offset != 0)
+    {
+        auto it = std::find_if(
+            replayed_until.begin(), replayed_until.end(), [&](auto& until) {
+                return until.journal == journal &&
+                       until.correlation_id == correlation_id &&
+                       subscribed_to(until.route, until.pattern, route);
+            });
+        if (it != replayed_until.end())
+        {
+            if (offset < it->offset)
+            {
+                return;
+            }
+            // Caught up, the next messages were appended after it subscribed.
+            replayed_until.erase(it);
+        }
+    }
+
+    if (BOOST_UNLIKELY(over_budget(policy, entry.size())) &&
+        !enforce_policy(policy, entry.size(), producer))
+    {
+        return;
+    }
+
+    enqueue(std::move(entry));
 }
 
 template <>
 void Client::handle(DispatchContext& ctx, services::blabla::Ping& ping)
 {
     services::blabla::Pong pong;
+    pong.mutable_header()->set_type(services::blabla::PONG);
     pong.set_correlation_id(ping.correlation_id());
     send_impl(to_buffer(pong));
-    return read_message(std::move(ctx.myself));
+    ctx.parse_next = true;
+}
+
+template <>
+void Client::handle(DispatchContext& ctx, services::blabla::Hello& hello)
+{
+    // Only switches to binary before anything could have been delivered in
+    // protobuf, otherwise the current mode is kept.
+    const bool binary =
+        !negotiated && hello.version() == BinaryHeader::VERSION &&
+        hello.wire_mode() == services::blabla::Hello_WireMode_BINARY;
+    negotiated = true;
+
+    services::blabla::Hello reply;
+    reply.mutable_header()->set_type(services::blabla::HELLO);
+    reply.set_version(BinaryHeader::VERSION);
+    reply.set_wire_mode(binary || mode == WireMode::binary
+                            ? services::blabla::Hello_WireMode_BINARY
+                            : services::blabla::Hello_WireMode_PROTOBUF);
+    send_impl(to_buffer(reply));
+
+    if (binary)
+    {
+        DLOG(client_logger, debug) << peer() << " uses the binary wire mode";
+        mode = WireMode::binary;
+    }
+    ctx.parse_next = true;
 }
 
 template <>
-void Client::handle(DispatchContext&, services::blabla::Pong&)
+void Client::handle(DispatchContext& ctx, services::blabla::Pong&)
 {
     // traces lag time.
+    ctx.parse_next = true;
 }
 
 template <>
 void Client::handle(DispatchContext& ctx, services::blabla::SubscribeRequest& req)
 {
     std::vector<handlers::Subscription> subscriptions_to_add;
-    std::vector<boost::string_view> subscriptions_to_rm;
+    std::vector<handlers::Subscription> subscriptions_to_rm;
 
     for (auto& sub : *req.mutable_subscriptions())
     {
@@ -258,18 +978,68 @@ void Client::handle(DispatchContext& ctx, services::blabla::SubscribeRequest& re
         {
         case services::blabla::SubscribeRequest_Subscription_Type_SUBSCRIBE:
         {
-            subscriptions_to_add.emplace_back(sub.route_prefix(),
-                                              sub.correlation_id());
+            if (sub.replay_case() !=
+                services::blabla::SubscribeRequest_Subscription::REPLAY_NOT_SET)
+            {
+                if (!start_replay(sub, false))
+                {
+                    return;
+                }
+                break;
+            }
+
+            subscriptions_to_add.push_back(
+                {sub.route_prefix(), sub.correlation_id(), false, sub.queue_group()});
             break;
         }
         case services::blabla::SubscribeRequest_Subscription_Type_UNSUBSCRIBE:
         {
-            subscriptions_to_rm.emplace_back(sub.route_prefix());
+            cancel_replays(sub.route_prefix(), false);
+            subscriptions_to_rm.push_back({sub.route_prefix(), 0, false});
             break;
         }
         case services::blabla::SubscribeRequest_Subscription_Type_UNSUBSCRIBE_ALL:
         {
+            {
+                std::lock_guard<std::mutex> l(mutex);
+                replays.clear();
+                replayed_until.clear();
+            }
             unsubscribe_all();
+            joined_groups.clear();
+            break;
+        }
+        case services::blabla::SubscribeRequest_Subscription_Type_SUBSCRIBE_PATTERN:
+        case services::blabla::SubscribeRequest_Subscription_Type_UNSUBSCRIBE_PATTERN:
+        {
+            if (!RoutePatterns::is_valid(sub.route_prefix()))
+            {
+                return send_error(
+                    to_buffer(error(services::blabla::Error_ErrorType_INVALID_ROUTE,
+                                    "Invalid route pattern: " + sub.route_prefix())));
+            }
+
+            if (sub.type() ==
+                    services::blabla::SubscribeRequest_Subscription_Type_SUBSCRIBE_PATTERN &&
+                sub.replay_case() !=
+                    services::blabla::SubscribeRequest_Subscription::REPLAY_NOT_SET)
+            {
+                if (!start_replay(sub, true))
+                {
+                    return;
+                }
+            }
+            else if (sub.type() ==
+                     services::blabla::SubscribeRequest_Subscription_Type_SUBSCRIBE_PATTERN)
+            {
+                subscriptions_to_add.push_back(
+                    {sub.route_prefix(), sub.correlation_id(), true, sub.queue_group()});
+            }
+            else
+            {
+                cancel_replays(sub.route_prefix(), true);
+                subscriptions_to_rm.push_back({sub.route_prefix(), 0, true});
+            }
             break;
         }
 
@@ -282,6 +1052,17 @@ void Client::handle(DispatchContext& ctx, services::blabla::SubscribeRequest& re
         }
     }
 
+    for (auto& sub : subscriptions_to_add)
+    {
+        if (!sub.queue_group.empty() &&
+            std::find(joined_groups.begin(), joined_groups.end(), sub.queue_group) ==
+                joined_groups.end())
+        {
+            joined_groups.emplace_back(sub.queue_group.to_string());
+        }
+    }
+
+    negotiated = true;
     auto new_subscriptions = manager->subscribe(subscriptions_to_add, this);
     auto obsolete_subscriptions = manager->unsubscribe(subscriptions_to_rm, this);
 
@@ -319,39 +1100,309 @@ void Client::handle(DispatchContext& ctx, services::blabla::SubscribeRequest& re
             active_subscriptions.end(),
             std::make_move_iterator(new_subscriptions.begin()),
             std::make_move_iterator(new_subscriptions.end()));
+
+        if (!replays.empty() && !replay_running)
+        {
+            replay_running = true;
+            boost::asio::post(socket_.get_executor(),
+                              boost::bind(&Client::replay, this, ctx.myself));
+        }
+    }
+
+    ctx.parse_next = true;
+}
+
+bool Client::start_replay(const services::blabla::SubscribeRequest::Subscription& sub,
+                          bool pattern)
+{
+    if (!sub.queue_group().empty())
+    {
+        send_error(to_buffer(error(services::blabla::Error_ErrorType_NOT_IMPLEMENTED,
+                                   "A queue group cannot be replayed: " +
+                                       sub.route_prefix())));
+        return false;
+    }
+
+    auto journals = manager->journals();
+    auto index = journals ? journals->journal_of_subscription(sub.route_prefix(), pattern) : -1;
+    if (index < 0)
+    {
+        send_error(to_buffer(error(services::blabla::Error_ErrorType_INVALID_ROUTE,
+                                   "No journal holds every route of: " +
+                                       sub.route_prefix())));
+        return false;
     }
 
-    return read_message(std::move(ctx.myself));
+    auto& journal = (*journals)[index];
+    auto offset = sub.replay_case() ==
+                          services::blabla::SubscribeRequest_Subscription::kReplayFromOffset
+                      ? sub.replay_from_offset()
+                      : journal.offset_at(sub.replay_from_timestamp());
+    offset = std::min(offset, journal.end());
+
+    DLOG(client_logger, debug) << peer() << " replays " << sub.route_prefix()
+                               << " from " << offset;
+    std::lock_guard<std::mutex> l(mutex);
+    replays.push_back({next_replay_id++, static_cast<uint32_t>(index),
+                       sub.route_prefix(), sub.correlation_id(), pattern, offset});
+    return true;
+}
+
+void Client::cancel_replays(boost::string_view route, bool pattern)
+{
+    auto same = [route, pattern](auto& replay) {
+        return replay.pattern == pattern && replay.route == route;
+    };
+
+    // A replay() in progress notices that its replay is gone.
+    std::lock_guard<std::mutex> l(mutex);
+    replays.erase(std::remove_if(replays.begin(), replays.end(), same),
+                  replays.end());
+    replayed_until.erase(
+        std::remove_if(replayed_until.begin(), replayed_until.end(), same),
+        replayed_until.end());
+}
+
+void Client::replay(std::shared_ptr<Client> myself)
+{
+    Replay current;
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        if (closing || replays.empty())
+        {
+            replay_running = false;
+            return;
+        }
+        current = replays.front();
+    }
+
+    // The payloads are copied in chunks, like the received ones.
+    auto& source = (*manager->journals())[current.journal];
+    std::vector<std::unique_ptr<SharedBufferWithSpecificMetadata>> messages;
+    Chunk::Ptr chunk;
+    size_t used = 0;
+    const auto next = source.read(
+        current.offset, REPLAY_READ_BYTES, [&](const journal::Record& record) {
+            if (!subscribed_to(current.route, current.pattern, record.route))
+            {
+                return;
+            }
+
+            if (!chunk || chunk->size() - used < record.payload_size)
+            {
+                chunk = Chunk::allocate(std::max(REPLAY_READ_BYTES, record.payload_size));
+                used = 0;
+            }
+
+            std::memcpy(chunk->data() + used, record.payload, record.payload_size);
+            auto payload =
+                SharedBufferWithSpecificMetadata::create_from(chunk, used, record.payload_size);
+            used += record.payload_size;
+
+            ConsumerHeaderEncoder header(record.route, record.payload_size, record.offset);
+            messages.push_back(payload->new_with_metadata(header.in(mode),
+                                                          current.correlation_id));
+        });
+
+    // Unless an unsubscribe cancelled it meanwhile.
+    auto is_current = [&] {
+        return !replays.empty() && replays.front().id == current.id;
+    };
+
+    bool at_end = next >= source.end();
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        if (closing)
+        {
+            replay_running = false;
+            return;
+        }
+
+        if (!is_current())
+        {
+            at_end = false;
+            messages.clear();
+        }
+        else
+        {
+            replays.front().offset = next;
+        }
+
+        for (auto& msg : messages)
+        {
+            enqueue(OutboundBuffer(std::move(msg)));
+        }
+
+        if (at_end)
+        {
+            // Set before subscribing: the messages appended before are
+            // replayed, even if they are still being routed.
+            auto same = [&current](auto& until) {
+                return until.journal == current.journal &&
+                       until.pattern == current.pattern &&
+                       until.route == current.route;
+            };
+            auto it = std::find_if(replayed_until.begin(), replayed_until.end(),
+                                   same);
+            if (it == replayed_until.end())
+            {
+                replayed_until.push_back({current.journal, current.route,
+                                          current.pattern,
+                                          current.correlation_id, next});
+            }
+            else
+            {
+                it->correlation_id = current.correlation_id;
+                it->offset = std::max(it->offset, next);
+            }
+        }
+    }
+
+    std::vector<SubscriptionNode*> nodes;
+    if (at_end && source.if_at_end(next, [&] {
+            nodes = manager->subscribe(
+                {{current.route, current.correlation_id, current.pattern}}, this);
+        }))
+    {
+        DLOG(client_logger, debug) << peer() << " caught up with " << current.route
+                                   << " at " << next;
+        std::lock_guard<std::mutex> l(mutex);
+        if (closing || !is_current())
+        {
+            // Too late for unsubscribe_all() or for the unsubscribe.
+            for (auto node : nodes)
+            {
+                node->remove_client(*this);
+            }
+
+            if (closing)
+            {
+                replay_running = false;
+                return;
+            }
+        }
+        else
+        {
+            active_subscriptions.insert(active_subscriptions.end(),
+                                        nodes.begin(), nodes.end());
+            replays.pop_front();
+        }
+    }
+
+    std::lock_guard<std::mutex> l(mutex);
+    if (replays.empty())
+    {
+        replay_running = false;
+    }
+    else if (queued_bytes > REPLAY_QUEUED_BYTES)
+    {
+        replay_waiting = true;
+    }
+    else
+    {
+        boost::asio::post(socket_.get_executor(),
+                          boost::bind(&Client::replay, this, std::move(myself)));
+    }
 }
 
 template <>
 void Client::handle(DispatchContext& ctx,
                     services::blabla::ProducerMessageHeader& msg)
 {
-    raw_payload_buffer.clear();
-    raw_payload_buffer.resize(msg.message_size());
-    std::lock_guard<std::mutex> l(mutex);
-    boost::asio::async_read(
-        socket_, boost::asio::buffer(raw_payload_buffer),
-        boost::bind(&Client::maybe_read_payload, this, std::move(ctx.myself),
-                    msg.route(), boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
+    publish(ctx, msg.route(), msg.message_size());
 }
 
-void Client::maybe_read_payload(std::shared_ptr<blabla::handlers::Client> myself,
-                                std::string route,
-                                boost::system::error_code errc,
-                                std::size_t)
+template <>
+void Client::handle(DispatchContext& ctx, BinaryMessage& msg)
 {
-    if (!handle_error(std::move(errc)))
+    publish(ctx, msg.route, msg.header.message_size);
+}
+
+void Client::publish(DispatchContext& ctx, boost::string_view route, size_t payload_size)
+{
+    if (BOOST_UNLIKELY(payload_size > HARD_MSG_SIZE_LIMIT))
+    {
+        std::string str = "Got a message of: " + std::to_string(payload_size) +
+                          "B (>" + std::to_string(HARD_MSG_SIZE_LIMIT) + "B)";
+        return this->send_error(to_buffer(error(
+            services::blabla::Error_ErrorType_PAYLOAD_TOO_BIG, std::move(str))));
+    }
+    else if (BOOST_UNLIKELY(route.size() > MAX_ROUTE_LENGTH))
+    {
+        return this->send_error(
+            to_buffer(error(services::blabla::Error_ErrorType_INVALID_ROUTE,
+                            "Route too long")));
+    }
+
+    if (!payload_received(ctx, payload_size))
+    {
+        return;
+    }
+
+    auto msg = SharedBufferWithSpecificMetadata::create_from(receive_chunk, receive_begin,
+                                                             payload_size);
+    msg->set_received_at(received_at);
+    metrics::local().messages_in.add();
+    manager->emit_to(route, std::move(msg), this);
+    receive_begin += payload_size;
+    ctx.parse_next = true;
+}
+
+template <>
+void Client::handle(DispatchContext& ctx, services::blabla::MessageBatch& batch)
+{
+    uint64_t payload_size = 0;
+    batch_entries.resize(batch.entries_size());
+    for (int i = 0; i < batch.entries_size(); ++i)
+    {
+        auto& entry = *batch.mutable_entries(i);
+        if (BOOST_UNLIKELY(entry.route().size() > MAX_ROUTE_LENGTH))
+        {
+            return this->send_error(
+                to_buffer(error(services::blabla::Error_ErrorType_INVALID_ROUTE,
+                                "Route too long")));
+        }
+
+        batch_entries[i].route.swap(*entry.mutable_route());
+        batch_entries[i].message_size = entry.message_size();
+        payload_size += entry.message_size();
+    }
+
+    // The payloads are buffered together.
+    if (BOOST_UNLIKELY(payload_size > HARD_MSG_SIZE_LIMIT))
+    {
+        std::string str = "Got a batch of: " + std::to_string(payload_size) +
+                          "B (>" + std::to_string(HARD_MSG_SIZE_LIMIT) + "B)";
+        return this->send_error(to_buffer(error(
+            services::blabla::Error_ErrorType_PAYLOAD_TOO_BIG, std::move(str))));
+    }
+
+    if (!payload_received(ctx, payload_size))
     {
         return;
     }
 
-    manager->emit_to(std::move(route),
-                     SharedBufferWithSpecificMetadata::create_from(
-                         std::move(raw_payload_buffer)));
-    return read_message(std::move(myself));
+    emit_batch(payload_size);
+    ctx.parse_next = true;
+}
+
+void Client::emit_batch(size_t payload_size)
+{
+    // Every message is a slice of the receive chunk.
+    size_t offset = receive_begin;
+    for (auto& entry : batch_entries)
+    {
+        batch_messages.push_back(
+            {entry.route, SharedBufferWithSpecificMetadata::create_from(
+                              receive_chunk, offset, entry.message_size)});
+        batch_messages.back().message->set_received_at(received_at);
+        offset += entry.message_size;
+    }
+    receive_begin += payload_size;
+    metrics::local().messages_in.add(batch_messages.size());
+
+    manager->emit_batch(batch_messages, this);
+    batch_messages.clear();
 }
 
 } // namespace handlers
@@ -1,8 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iterator>
 #include <memory>
 #include <mutex>
 
+#include <sys/socket.h>
+
+#include <boost/asio/generic/stream_protocol.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/container/flat_map.hpp>
@@ -11,11 +18,20 @@
 #include <commonpp/core/LoggingInterface.hpp>
 #include <commonpp/thread/ThreadPool.hpp>
 
+#include "blabla/Blabla.hpp"
+#include "blabla/shm/Channel.hpp"
+
 #include "Buffer.hpp"
 #include "Protocol.hpp"
+#include "Uring.hpp"
 
 namespace blabla
 {
+namespace journal
+{
+class Journals;
+}
+
 namespace handlers
 {
 struct Client;
@@ -27,38 +43,109 @@ struct ClientError
 };
 
 using Route = boost::string_view;
-using Subscription = std::pair<boost::string_view, int32_t>;
+struct Subscription
+{
+    boost::string_view route;
+    int32_t correlation_id = 0;
+    // route is a pattern with `*` and `>` wildcards instead of a prefix.
+    bool pattern = false;
+    // Each message goes to a single member of the group, unless empty.
+    boost::string_view queue_group;
+};
+
+// A message of a MessageBatch.
+struct BatchMessage
+{
+    boost::string_view route;
+    std::unique_ptr<SharedBufferWithSpecificMetadata> message;
+};
+
+// Service wide counters of the outbound policies.
+struct OutboundStats
+{
+    std::atomic<uint64_t> dropped_messages{0};
+    std::atomic<uint64_t> dropped_bytes{0};
+    std::atomic<uint64_t> disconnections{0};
+    std::atomic<uint64_t> producer_pauses{0};
+};
 
 struct ClientManager
 {
     virtual ~ClientManager() = default;
 
+    virtual const ServiceConfiguration& configuration() const = 0;
+    // The configured backend is io_uring and the kernel supports it.
+    virtual bool uring_enabled() const = 0;
+    virtual OutboundStats& outbound_stats() = 0;
+    // Null unless the service keeps a journal.
+    virtual journal::Journals* journals() = 0;
+
     virtual void on_new_client(std::shared_ptr<Client> client) = 0;
     virtual void remove_connection(std::shared_ptr<Client> client) = 0;
 
     virtual std::vector<SubscriptionNode*> subscribe(std::vector<Subscription>,
                                                      Client* client) = 0;
     virtual std::vector<SubscriptionNode*>
-    unsubscribe(std::vector<boost::string_view>, Client* client) = 0;
-    virtual void emit_to(std::string route,
-                         std::unique_ptr<SharedBufferWithSpecificMetadata>) = 0;
+    unsubscribe(std::vector<Subscription>, Client* client) = 0;
+    virtual void emit_to(boost::string_view route,
+                         std::unique_ptr<SharedBufferWithSpecificMetadata>,
+                         Client* producer) = 0;
+    // The messages are delivered in the order of the batch.
+    virtual void emit_batch(std::vector<BatchMessage>& batch, Client* producer) = 0;
 };
 
-// XXX: Maybe add a queue for round robin delivery amongst consumers.
+// Bytes queued for a client and not written yet, read without its lock.
+size_t outbound_bytes(const Client& client) noexcept;
+
 struct SubscriptionNode
 {
-    void add_client(handlers::Client& client, int32_t correlation_id)
+    void add_client(handlers::Client& client,
+                    int32_t correlation_id,
+                    boost::string_view queue_group = {})
     {
         std::lock_guard<tbb::spin_rw_mutex> l(mutex);
-        clients.emplace(std::addressof(client), correlation_id);
+        if (queue_group.empty())
+        {
+            clients.emplace(std::addressof(client), correlation_id);
+            return;
+        }
+
+        auto it = std::find_if(groups.begin(), groups.end(), [queue_group](auto& group) {
+            return group->name == queue_group;
+        });
+        if (it == groups.end())
+        {
+            groups.emplace_back(std::make_unique<QueueGroup>());
+            groups.back()->name = queue_group.to_string();
+            it = std::prev(groups.end());
+        }
+        (*it)->members.emplace(std::addressof(client), correlation_id);
+        group_count.store(groups.size(), std::memory_order_relaxed);
     }
 
     void remove_client(handlers::Client& client)
     {
         std::lock_guard<tbb::spin_rw_mutex> l(mutex);
         clients.erase(std::addressof(client));
+        for (auto it = groups.begin(); it != groups.end();)
+        {
+            (*it)->members.erase(std::addressof(client));
+            it = (*it)->members.empty() ? groups.erase(it) : std::next(it);
+        }
+        group_count.store(groups.size(), std::memory_order_relaxed);
     }
 
+    // No client, in a queue group or not.
+    bool empty()
+    {
+        mutex.lock_read();
+        const bool no_client = clients.empty() && groups.empty();
+        mutex.unlock();
+        return no_client;
+    }
+
+    // Calls cb on every client which is not in a queue group, see
+    // foreach_queue_group.
     template <typename CB>
     void foreach_client(CB&& cb)
     {
@@ -79,85 +166,322 @@ struct SubscriptionNode
         mutex.unlock();
     }
 
+    // Calls cb on a single member of each queue group of the nodes matching a
+    // route. The members of the groups of the same name are gathered across
+    // the nodes: a message goes to one of them even if they subscribed
+    // through different prefixes or patterns, and a consumer in a group
+    // through several nodes counts once.
+    template <typename CB>
+    static void foreach_queue_group(const std::vector<SubscriptionNode*>& nodes, CB&& cb)
+    {
+        auto has_groups = [](SubscriptionNode* node) {
+            return node->group_count.load(std::memory_order_relaxed) != 0;
+        };
+        if (BOOST_LIKELY(std::none_of(nodes.begin(), nodes.end(), has_groups)))
+        {
+            return;
+        }
+
+        std::vector<SubscriptionNode*> grouped;
+        std::copy_if(nodes.begin(), nodes.end(), std::back_inserter(grouped), has_groups);
+
+        // The writers lock a single node at a time, the readers lock them in
+        // the order of their addresses.
+        std::sort(grouped.begin(), grouped.end());
+        grouped.erase(std::unique(grouped.begin(), grouped.end()), grouped.end());
+        for (auto node : grouped)
+        {
+            node->mutex.lock_read();
+        }
+
+        const size_t turn = next_turn();
+        try
+        {
+            if (grouped.size() == 1)
+            {
+                for (auto& group : grouped.front()->groups)
+                {
+                    auto& member = *least_loaded(group->members.begin(),
+                                                 group->members.end(), turn,
+                                                 [](auto& member) { return member.first; });
+                    cb(*member.first, member.second);
+                }
+            }
+            else
+            {
+                foreach_gathered_group(grouped, turn, cb);
+            }
+        }
+        catch (...)
+        {
+            for (auto node : grouped)
+            {
+                node->mutex.unlock();
+            }
+            throw;
+        }
+
+        for (auto node : grouped)
+        {
+            node->mutex.unlock();
+        }
+    }
+
 private:
+    struct QueueGroup
+    {
+        std::string name;
+        boost::container::flat_map<handlers::Client*, int32_t> members;
+    };
+
+    struct GroupMember
+    {
+        const std::string* group;
+        handlers::Client* client;
+        int32_t correlation_id;
+    };
+
+    // Per thread cursor, so that the members keeping up share the load
+    // without the publishing threads sharing a counter. It moves once per
+    // message: moving it once per group would always start the search of a
+    // group at the same member when the groups are as many as its members.
+    static size_t next_turn() noexcept
+    {
+        static thread_local size_t cursor = 0;
+        return cursor++;
+    }
+
+    // The member with the fewest outbound bytes, the search starts at the
+    // member of the turn.
+    template <typename It, typename ClientOf>
+    static It least_loaded(It first, It last, size_t turn, ClientOf client_of)
+    {
+        const size_t size = last - first;
+        const size_t start = turn % size;
+
+        auto best = first + start;
+        auto best_bytes = outbound_bytes(*client_of(*best));
+        for (size_t i = 1; i < size && best_bytes != 0; ++i)
+        {
+            auto candidate = first + (start + i) % size;
+            auto bytes = outbound_bytes(*client_of(*candidate));
+            if (bytes < best_bytes)
+            {
+                best = candidate;
+                best_bytes = bytes;
+            }
+        }
+        return best;
+    }
+
+    // The nodes must be read locked.
+    template <typename CB>
+    static void foreach_gathered_group(const std::vector<SubscriptionNode*>& nodes,
+                                       size_t turn,
+                                       CB& cb)
+    {
+        static thread_local std::vector<GroupMember> gathered;
+        std::vector<GroupMember> members;
+        members.swap(gathered);
+        members.clear();
+        for (auto node : nodes)
+        {
+            for (auto& group : node->groups)
+            {
+                for (auto& member : group->members)
+                {
+                    members.push_back({&group->name, member.first, member.second});
+                }
+            }
+        }
+
+        std::sort(members.begin(), members.end(), [](const auto& lhs, const auto& rhs) {
+            return *lhs.group != *rhs.group ? *lhs.group < *rhs.group
+                                            : lhs.client < rhs.client;
+        });
+        members.erase(std::unique(members.begin(), members.end(),
+                                  [](const auto& lhs, const auto& rhs) {
+                                      return lhs.client == rhs.client &&
+                                             *lhs.group == *rhs.group;
+                                  }),
+                      members.end());
+
+        for (auto first = members.begin(); first != members.end();)
+        {
+            auto last = std::find_if(first, members.end(), [first](const auto& member) {
+                return *member.group != *first->group;
+            });
+            auto& member = *least_loaded(first, last, turn,
+                                         [](auto& member) { return member.client; });
+            cb(*member.client, member.correlation_id);
+            first = last;
+        }
+
+        members.swap(gathered);
+    }
+
     tbb::spin_rw_mutex mutex;
     boost::container::flat_map<handlers::Client*, int32_t> clients;
+    std::vector<std::unique_ptr<QueueGroup>> groups;
+    // Size of groups, read without the lock to skip the nodes without any.
+    std::atomic<size_t> group_count{0};
 };
 
 struct Client : MessageCracker<Client>, std::enable_shared_from_this<Client>
 {
-    using tcp = boost::asio::ip::tcp;
+    // TCP or AF_UNIX.
+    using socket_type = boost::asio::generic::stream_protocol::socket;
     friend MessageCracker<Client>;
+    friend size_t outbound_bytes(const Client& client) noexcept;
 
     struct DispatchContext
     {
         std::shared_ptr<Client> myself;
+        // Set by the handlers which are done with the connection input, the
+        // next buffered frame can be decoded. Otherwise the handler resumes
+        // reading itself (or the connection is closing).
+        bool parse_next = false;
+        // Set by the handlers when the payload following the frame is not
+        // entirely received, the frame is decoded again once it is.
+        size_t missing_payload = 0;
     };
 
 private:
-    Client(commonpp::thread::ThreadPool& pool)
+    Client(commonpp::thread::ThreadPool& pool, boost::asio::io_service& service)
     : pool(pool)
-    , socket_(pool.getService())
+    , socket_(service)
     {
     }
 
 public:
     static std::shared_ptr<Client> create(commonpp::thread::ThreadPool& pool)
     {
-        return std::shared_ptr<Client>(new Client(pool));
+        return create(pool, pool.getService());
     }
 
-    auto peer() const
+    // The connection runs on service, which must belong to pool.
+    static std::shared_ptr<Client> create(commonpp::thread::ThreadPool& pool,
+                                          boost::asio::io_service& service)
     {
-        boost::system::error_code ec;
-        const auto& e = socket_.remote_endpoint(ec);
-        if (BOOST_LIKELY(!ec))
-        {
-            return "[" + e.address().to_string() + ":" +
-                   std::to_string(e.port()) + "]";
-        }
-        return std::string("[connection lost]");
+        return std::shared_ptr<Client>(new Client(pool, service));
     }
 
+    std::string peer() const;
+
+    // Process on the other side of an AF_UNIX connection, as reported by the
+    // kernel (SO_PEERCRED). Returns false for the other connections, on which
+    // the kernel reports an overflow uid instead of failing.
+    bool peer_credentials(ucred& credentials) const noexcept;
+
     ~Client() = default;
 
+    // The connection goes through channel instead of the socket, which is
+    // not opened. Must be called before start().
+    void attach(std::shared_ptr<shm::Channel> channel)
+    {
+        this->channel = std::move(channel);
+    }
+
     void start(ClientManager* manager);
     void stop();
 
     // unsafe, should not be used by the client code..
-    boost::asio::ip::tcp::socket& socket() noexcept
+    socket_type& socket() noexcept
     {
         return socket_;
     }
-    const boost::asio::ip::tcp::socket& socket() const noexcept
+    const socket_type& socket() const noexcept
     {
         return socket_;
     }
 
     void send(SharedBuffer::SharedBufferPtr);
-    void send(std::unique_ptr<SharedBufferWithSpecificMetadata>);
+    // A message published on route. producer may be null, it is only used by
+    // OutboundPolicy::pause_producer.
+    void send(std::unique_ptr<SharedBufferWithSpecificMetadata>,
+              boost::string_view route,
+              const OutboundPolicy& policy,
+              Client* producer);
+
+    // Set once, before the client subscribes.
+    WireMode wire_mode() const noexcept
+    {
+        return mode;
+    }
+
+    // Shard of the connection, in shard per core mode. Set before start().
+    size_t shard_index() const noexcept
+    {
+        return shard;
+    }
+    void set_shard_index(size_t index) noexcept
+    {
+        shard = index;
+    }
+
+    // Queue groups the connection joined. Only valid while it handles a
+    // subscription request.
+    const std::vector<std::string>& queue_groups() const noexcept
+    {
+        return joined_groups;
+    }
+
+    // A producer stops reading while at least one of its consumers is over
+    // its outbound budget.
+    void pause_reads();
+    void resume_reads();
 
 private:
     template <typename T>
     void send_impl(T buffer);
 
+    bool enforce_policy(const OutboundPolicy& policy,
+                        size_t size,
+                        Client* producer);
+    bool over_budget(const OutboundPolicy& policy, size_t size) const;
+    void enqueue(OutboundBuffer buffer);
+
     template <typename T>
     void send_error(T buffer);
+    // Frames a control message in the wire mode of the connection.
+    template <typename T>
+    SingleOwnershipBuffer::SingleOwnershipBufferPtr to_buffer(const T& msg) const;
+
+    void start_write();
+    void on_write(std::shared_ptr<Client>, boost::system::error_code, bool close);
 
     void killme();
     bool handle_error(boost::system::error_code);
 
+    // Queues the replay of a subscription, returns false if the journal
+    // cannot be replayed (an error was sent).
+    bool start_replay(const services::blabla::SubscribeRequest::Subscription&, bool pattern);
+    // Drops the replays of a subscription, pending or done.
+    void cancel_replays(boost::string_view route, bool pattern);
+    // Delivers the next messages of the first replay, and subscribes to the
+    // live ones once it caught up.
+    void replay(std::shared_ptr<Client>);
+
+    // Decodes the frames already received, then reads more.
     void read_message(std::shared_ptr<Client>);
-    void maybe_read_message_size(std::shared_ptr<Client>,
-                                 boost::system::error_code,
-                                 std::size_t);
-    void maybe_read_message(std::shared_ptr<Client>,
-                            boost::system::error_code,
-                            std::size_t);
-    void maybe_read_payload(std::shared_ptr<Client>,
-                            std::string,
-                            boost::system::error_code,
-                            std::size_t);
+    bool may_read();
+    bool dispatch_buffered_frame(DispatchContext&);
+    void receive_more(std::shared_ptr<Client>);
+    void on_receive(std::shared_ptr<Client>, boost::system::error_code, std::size_t);
+    // io_uring: appends the next received block to the buffered frames.
+    // Returns false if there is none, the reader is then idle.
+    bool take_received(const std::shared_ptr<Client>&);
+    void on_uring_receive(std::shared_ptr<Client>,
+                          boost::system::error_code,
+                          Chunk::Ptr,
+                          size_t);
+    // Must be called with the receive mutex held.
+    void start_receiving(const std::shared_ptr<Client>&);
+    void stop_receiving();
+    // Whether the size bytes following the frame being handled are received.
+    bool payload_received(DispatchContext&, size_t size);
+    void publish(DispatchContext&, boost::string_view route, size_t payload_size);
+    void emit_batch(size_t payload_size);
     void unsubscribe_all();
 
 private:
@@ -170,16 +494,116 @@ private:
 private:
     mutable std::mutex mutex;
     commonpp::thread::ThreadPool& pool;
-    tcp::socket socket_;
+    socket_type socket_;
 
-    // XXX: put this definition somewhere
-    IntBuffer size_buffer;
     ClientManager* manager = nullptr;
-    std::vector<uint8_t> control_message_buffer;
-    std::vector<uint8_t> raw_payload_buffer;
+    // Reads and writes through io_uring when set.
+    Uring* uring = nullptr;
+    // Local clients only.
+    std::shared_ptr<shm::Channel> channel;
+
+    size_t shard = 0;
+
+    WireMode mode = WireMode::protobuf;
+    // The wire mode cannot change anymore: a Hello was received or the
+    // client subscribed.
+    bool negotiated = false;
+
+    // Frames are decoded from [receive_begin, receive_end). The payloads are
+    // delivered as slices of the chunk, which is replaced instead of being
+    // overwritten while they reference it.
+    Chunk::Ptr receive_chunk;
+    size_t receive_begin = 0;
+    size_t receive_end = 0;
+    // Size of the incomplete frame (and payload) at receive_begin, if known.
+    size_t receive_needed = 0;
+    // When the last bytes were received, the payloads decoded from them are
+    // stamped with it.
+    uint64_t received_at = 0;
+
+    // io_uring: the blocks of the multishot receive, queued until the reader
+    // takes them. A single thread reads at a time, the one which set
+    // reader_active. The receive is cancelled while the reader is stopped
+    // (paused, or closing), and started again once it is idle.
+    struct ReceivedBlock
+    {
+        Chunk::Ptr chunk;
+        size_t size;
+        uint64_t received_at;
+    };
+    std::mutex receive_mutex;
+    std::deque<ReceivedBlock> received;
+    Uring::Operation* receive_op = nullptr;
+    bool reader_active = true;
+    // End of the stream, handled once the queued blocks are decoded.
+    boost::system::error_code receive_error;
+
+    // Entries of the MessageBatch being read, kept to reuse their capacity.
+    struct BatchEntry
+    {
+        std::string route;
+        uint32_t message_size;
+    };
+    std::vector<BatchEntry> batch_entries;
+    std::vector<BatchMessage> batch_messages;
+
+    // Outbound queue, a single write is in flight at a time and it gathers
+    // the first `in_flight` entries of the queue.
+    std::deque<OutboundBuffer> outbound;
+    std::vector<boost::asio::const_buffer> write_buffers;
+    size_t in_flight = 0;
+    bool closing = false;
+    bool killed = false;
+
+    // Accounting of the outbound queue, including the write in flight.
+    size_t queued_bytes = 0;
+    size_t dropped_messages = 0;
+    // Copy of queued_bytes for the queue groups, which read it unlocked.
+    std::atomic<size_t> shared_queued_bytes{0};
+
+    // Producers paused because of this client, resumed once the queue is
+    // back under resume_bytes/resume_messages.
+    std::vector<std::weak_ptr<Client>> paused_producers;
+    size_t resume_bytes = 0;
+    size_t resume_messages = 0;
+
+    // Subscriptions waiting for the journal to be replayed, in order: they
+    // are added once it caught up.
+    struct Replay
+    {
+        uint64_t id;
+        uint32_t journal;
+        std::string route;
+        int32_t correlation_id;
+        bool pattern;
+        // Next offset to replay.
+        uint64_t offset;
+    };
+    std::deque<Replay> replays;
+    uint64_t next_replay_id = 0;
+    // A call to replay() is pending, or waits for the outbound queue to
+    // drain (replay_waiting).
+    bool replay_running = false;
+    bool replay_waiting = false;
+    // The live messages of a replayed subscription before this offset of
+    // its journal were replayed. Erased once one from the offset on is
+    // received, or on unsubscribe.
+    struct ReplayedUntil
+    {
+        uint32_t journal;
+        std::string route;
+        bool pattern;
+        int32_t correlation_id;
+        uint64_t offset;
+    };
+    std::vector<ReplayedUntil> replayed_until;
+
+    std::atomic<int> read_pausers{0};
+    std::atomic_bool read_parked{false};
     // XXX: micro race condition if we stop the server while we process a
     // subscription request.
     std::vector<SubscriptionNode*> active_subscriptions;
+    std::vector<std::string> joined_groups;
 };
 
 inline auto& socket(std::shared_ptr<Client>& client)
@@ -198,5 +622,10 @@ inline auto& socket(Client& client)
     return client.socket();
 }
 
+inline size_t outbound_bytes(const Client& client) noexcept
+{
+    return client.shared_queued_bytes.load(std::memory_order_relaxed);
+}
+
 } // namespace handlers
 } // namespace blabla
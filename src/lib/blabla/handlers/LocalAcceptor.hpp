@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/asio/basic_socket_acceptor.hpp>
+#include <boost/asio/generic/seq_packet_protocol.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include <commonpp/core/LoggingInterface.hpp>
+#include <commonpp/thread/ThreadPool.hpp>
+
+#include "blabla/shm/Channel.hpp"
+
+namespace blabla
+{
+namespace handlers
+{
+
+// Accepts the clients of the same host on an AF_UNIX SOCK_SEQPACKET socket,
+// they then talk to the server through a shared memory channel.
+struct LocalAcceptor
+{
+    using protocol = boost::asio::generic::seq_packet_protocol;
+
+public:
+    LocalAcceptor(commonpp::thread::ThreadPool& pool,
+                  std::string path,
+                  uint64_t ring_capacity)
+    : pool(pool)
+    , path(std::move(path))
+    , ring_capacity(ring_capacity)
+    , acceptor(pool.getService())
+    {
+        // Left by a previous run.
+        ::unlink(this->path.c_str());
+
+        // Only the address of the local endpoint is used.
+        protocol::endpoint endpoint(boost::asio::local::stream_protocol::endpoint(this->path));
+        acceptor.open(endpoint.protocol());
+        acceptor.bind(endpoint);
+        acceptor.listen();
+    }
+
+    // allow(const ucred&) tells whether the process on the other side may
+    // connect, it is called before the handshake.
+    template <typename Client, typename CB, typename Filter>
+    void start(CB callback, Filter allow)
+    {
+        running = true;
+        auto client = Client::create(pool);
+        auto socket = std::make_unique<protocol::socket>(client->socket().get_executor());
+        auto& sock = *socket;
+        acceptor.async_accept(
+            sock, [this, client = std::move(client), socket = std::move(socket),
+                   cb = std::move(callback), allow = std::move(allow)](
+                      const boost::system::error_code& error) mutable {
+                if (!error)
+                {
+                    if (permitted(*socket, allow))
+                    {
+                        try
+                        {
+                            auto& ctx = static_cast<boost::asio::io_context&>(
+                                boost::asio::query(socket->get_executor(),
+                                                   boost::asio::execution::context));
+                            client->attach(shm::Channel::accept(ctx, socket->release(),
+                                                                ring_capacity));
+                            cb(client);
+                        }
+                        catch (const std::exception& e)
+                        {
+                            GLOG(warning) << "Local handshake failed: " << e.what();
+                        }
+                    }
+
+                    start<Client>(std::move(cb), std::move(allow));
+                    return;
+                }
+
+                if (error == boost::asio::error::operation_aborted)
+                {
+                    GLOG(warning) << "Stopping local acceptor";
+                }
+                else
+                {
+                    GLOG(warning) << "Error during local accept: " << error.message();
+                }
+
+                running = false;
+            });
+    }
+
+    // Closes the socket of a peer which may not connect.
+    template <typename Filter>
+    static bool permitted(protocol::socket& socket, Filter& allow)
+    {
+        ucred credentials;
+        socklen_t size = sizeof(credentials);
+        if (::getsockopt(socket.native_handle(), SOL_SOCKET, SO_PEERCRED, &credentials,
+                         &size) == 0 &&
+            size == sizeof(credentials) && allow(credentials))
+        {
+            return true;
+        }
+
+        boost::system::error_code ec;
+        socket.close(ec);
+        return false;
+    }
+
+    void stop()
+    {
+        if (running)
+        {
+            acceptor.cancel();
+            acceptor.close();
+            while (running != false)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    ~LocalAcceptor()
+    {
+        stop();
+        ::unlink(path.c_str());
+    }
+
+    commonpp::thread::ThreadPool& pool;
+    const std::string path;
+    const uint64_t ring_capacity;
+    boost::asio::basic_socket_acceptor<protocol> acceptor;
+    std::atomic_bool running{false};
+};
+
+} // namespace handlers
+} // namespace blabla
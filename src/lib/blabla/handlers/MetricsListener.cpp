@@ -0,0 +1,211 @@
+#include "MetricsListener.hpp"
+
+#include <chrono>
+#include <istream>
+#include <thread>
+
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+
+#include <commonpp/core/LoggingInterface.hpp>
+
+namespace blabla
+{
+namespace handlers
+{
+
+CREATE_LOGGER(metrics_logger, "handlers::metrics");
+
+namespace
+{
+const size_t MAX_REQUEST_BYTES = 8 * 1024;
+// A scraper which does not send its request in time is disconnected.
+const auto REQUEST_TIMEOUT = std::chrono::seconds(10);
+// Accepting again right away would spin while out of file descriptors.
+const auto ACCEPT_RETRY_DELAY = std::chrono::milliseconds(100);
+} // namespace
+
+// The handlers of a session run on its strand.
+struct MetricsListener::Session : std::enable_shared_from_this<Session>
+{
+    Session(boost::asio::io_service& service, std::shared_ptr<State> state)
+    : socket(boost::asio::make_strand(service))
+    , timer(socket.get_executor())
+    , request(MAX_REQUEST_BYTES)
+    , state(std::move(state))
+    {
+    }
+
+    void start()
+    {
+        auto myself = shared_from_this();
+        timer.expires_after(REQUEST_TIMEOUT);
+        timer.async_wait([myself](const boost::system::error_code& ec) {
+            if (!ec)
+            {
+                boost::system::error_code ignored;
+                myself->socket.close(ignored);
+            }
+        });
+
+        boost::asio::async_read_until(
+            socket, request, "\r\n\r\n",
+            [myself](const boost::system::error_code& ec, size_t) {
+                myself->on_request(ec);
+            });
+    }
+
+    void on_request(const boost::system::error_code& ec)
+    {
+        if (ec)
+        {
+            // Closed, timed out or the request is too large.
+            timer.cancel();
+            return;
+        }
+
+        std::istream in(&request);
+        std::string method;
+        std::string target;
+        in >> method >> target;
+
+        if (method != "GET")
+        {
+            return respond("405 Method Not Allowed", "text/plain", "GET only\n");
+        }
+
+        if (target != "/metrics")
+        {
+            return respond("404 Not Found", "text/plain", "Not found\n");
+        }
+
+        std::string body;
+        {
+            std::lock_guard<std::mutex> l(state->mutex);
+            if (!state->render)
+            {
+                return respond("503 Service Unavailable", "text/plain", "Stopping\n");
+            }
+            body = state->render();
+        }
+        respond("200 OK", "text/plain; version=0.0.4", body);
+    }
+
+    void respond(const char* status, const char* content_type, const std::string& body)
+    {
+        response = std::string("HTTP/1.1 ") + status + "\r\nContent-Type: " + content_type +
+                   "\r\nContent-Length: " + std::to_string(body.size()) +
+                   "\r\nConnection: close\r\n\r\n" + body;
+
+        auto myself = shared_from_this();
+        boost::asio::async_write(socket, boost::asio::buffer(response),
+                                 [myself](const boost::system::error_code&, size_t) {
+                                     boost::system::error_code ignored;
+                                     myself->timer.cancel();
+                                     myself->socket.shutdown(
+                                         boost::asio::ip::tcp::socket::shutdown_both,
+                                         ignored);
+                                     myself->socket.close(ignored);
+                                 });
+    }
+
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::steady_timer timer;
+    boost::asio::streambuf request;
+    std::string response;
+    std::shared_ptr<State> state;
+};
+
+MetricsListener::MetricsListener(boost::asio::io_service& service,
+                                 boost::asio::ip::tcp::endpoint endpoint,
+                                 Render render)
+: service(service)
+, strand(boost::asio::make_strand(service))
+, acceptor(strand)
+, retry_timer(strand)
+, state(std::make_shared<State>())
+{
+    state->render = std::move(render);
+
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    acceptor.bind(endpoint);
+    acceptor.listen();
+
+    running = true;
+    accept();
+}
+
+MetricsListener::~MetricsListener()
+{
+    {
+        std::lock_guard<std::mutex> l(state->mutex);
+        state->render = nullptr;
+    }
+
+    if (running)
+    {
+        // The handlers read the acceptor and the timer, they are closed from
+        // the strand.
+        boost::asio::post(strand, [this] {
+            stopped = true;
+            boost::system::error_code ec;
+            acceptor.close(ec);
+            retry_timer.cancel(ec);
+        });
+        while (running)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+void MetricsListener::accept()
+{
+    auto session = std::make_shared<Session>(service, state);
+    auto& socket = session->socket;
+    acceptor.async_accept(socket, [this, session = std::move(session)](
+                                      const boost::system::error_code& error) {
+        if (stopped)
+        {
+            running = false;
+            return;
+        }
+
+        if (!error)
+        {
+            session->start();
+            accept();
+            return;
+        }
+
+        if (error == boost::asio::error::operation_aborted)
+        {
+            running = false;
+            return;
+        }
+
+        LOG(metrics_logger, warning) << "Error during accept: " << error.message();
+        if (error == boost::system::errc::too_many_files_open ||
+            error == boost::system::errc::too_many_files_open_in_system)
+        {
+            retry_timer.expires_after(ACCEPT_RETRY_DELAY);
+            retry_timer.async_wait([this](const boost::system::error_code& ec) {
+                if (ec || stopped)
+                {
+                    running = false;
+                    return;
+                }
+                accept();
+            });
+            return;
+        }
+        accept();
+    });
+}
+
+} // namespace handlers
+} // namespace blabla
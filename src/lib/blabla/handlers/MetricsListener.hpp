@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+
+namespace blabla
+{
+namespace handlers
+{
+
+// Minimal HTTP server of the metrics: GET /metrics answers the text returned
+// by render, in the Prometheus exposition format. The connection is closed
+// after each response.
+class MetricsListener
+{
+public:
+    using Render = std::function<std::string()>;
+
+    // Throws boost::system::system_error if the endpoint cannot be bound.
+    MetricsListener(boost::asio::io_service& service,
+                    boost::asio::ip::tcp::endpoint endpoint,
+                    Render render);
+    // render is not called anymore once destroyed.
+    ~MetricsListener();
+
+private:
+    struct Session;
+
+    // Shared with the sessions, which may outlive the listener.
+    struct State
+    {
+        std::mutex mutex;
+        Render render;
+    };
+
+    // Accepts until stopped, errors are logged and the accept is retried.
+    void accept();
+
+    boost::asio::io_service& service;
+    // The handlers of the acceptor and of the timer, and the stop, run on
+    // this strand.
+    boost::asio::strand<boost::asio::io_service::executor_type> strand;
+    boost::asio::ip::tcp::acceptor acceptor;
+    // Delays the accept after running out of file descriptors.
+    boost::asio::steady_timer retry_timer;
+    std::shared_ptr<State> state;
+    // Only accessed on the strand.
+    bool stopped = false;
+    std::atomic_bool running{false};
+};
+
+} // namespace handlers
+} // namespace blabla
@@ -0,0 +1,100 @@
+#include "Protocol.hpp"
+
+#include <cstring>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+namespace blabla
+{
+namespace handlers
+{
+
+ConsumerHeaderEncoder::ConsumerHeaderEncoder(boost::string_view route,
+                                             uint32_t message_size,
+                                             uint64_t offset)
+: route(route)
+, message_size(message_size)
+, offset(offset)
+{
+}
+
+const std::vector<uint8_t>& ConsumerHeaderEncoder::protobuf_prefix() const
+{
+    if (!prefix.empty())
+    {
+        return prefix;
+    }
+
+    services::blabla::ConsumerMessageHeader header;
+    {
+        header.mutable_header()->set_type(services::blabla::MESSAGE);
+        header.set_route(route.data(), route.size());
+        header.set_message_size(message_size);
+        header.set_offset(offset);
+    }
+
+    prefix.resize(header.ByteSizeLong());
+    header.SerializeWithCachedSizesToArray(prefix.data());
+    return prefix;
+}
+
+size_t ConsumerHeaderEncoder::max_size(WireMode mode) const
+{
+    if (mode == WireMode::binary)
+    {
+        return BinaryHeader::SIZE + (offset ? sizeof(offset) : 0) + route.size();
+    }
+
+    return protobuf_prefix().size() + MAX_CORRELATION_ID_SIZE;
+}
+
+size_t ConsumerHeaderEncoder::encode(WireMode mode,
+                                     int32_t correlation_id,
+                                     uint8_t* out) const
+{
+    using google::protobuf::io::CodedOutputStream;
+    using google::protobuf::internal::WireFormatLite;
+
+    if (mode == WireMode::binary)
+    {
+        BinaryHeader header;
+        header.type = services::blabla::MESSAGE;
+        header.route_length = static_cast<uint16_t>(route.size());
+        header.message_size = message_size;
+        header.correlation_id = correlation_id;
+
+        size_t size = BinaryHeader::SIZE;
+        if (offset != 0)
+        {
+            header.flags |= BinaryHeader::FLAG_OFFSET;
+            const uint32_t be_offset[] = {htonl(uint32_t(offset >> 32)),
+                                          htonl(uint32_t(offset))};
+            std::memcpy(out + size, be_offset, sizeof(be_offset));
+            size += sizeof(be_offset);
+        }
+
+        header.encode(out);
+        std::memcpy(out + size, route.data(), route.size());
+        return size + route.size();
+    }
+
+    const auto& prefix = protobuf_prefix();
+    std::memcpy(out, prefix.data(), prefix.size());
+    if (correlation_id == 0)
+    {
+        // proto3 does not serialize default values.
+        return prefix.size();
+    }
+
+    auto end = CodedOutputStream::WriteTagToArray(
+        WireFormatLite::MakeTag(
+            services::blabla::ConsumerMessageHeader::kCorrelationIdFieldNumber,
+            WireFormatLite::WIRETYPE_VARINT),
+        out + prefix.size());
+    end = CodedOutputStream::WriteVarint32SignExtendedToArray(correlation_id, end);
+    return end - out;
+}
+
+} // namespace handlers
+} // namespace blabla
@@ -2,20 +2,106 @@
 
 #include "proto/service.pb.h"
 
+#include <arpa/inet.h>
+#include <cstring>
+
+#include <boost/utility/string_view.hpp>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 
+#include <commonpp/core/LoggingInterface.hpp>
+
 namespace blabla
 {
 namespace handlers
 {
 
+// Wire format of the frames of a connection, a Hello switches it from
+// protobuf to binary.
+enum class WireMode
+{
+    protobuf,
+    binary,
+};
+
+// Fixed layout header of the binary wire mode, see Hello in service.proto.
+struct BinaryHeader
+{
+    static constexpr uint8_t VERSION = 1;
+    static constexpr size_t SIZE = 16;
+    // The offset of a delivered message follows the header.
+    static constexpr uint16_t FLAG_OFFSET = 1;
+
+    // Returns false if data does not start with a valid header.
+    bool decode(const uint8_t* data, size_t size)
+    {
+        if (BOOST_UNLIKELY(size < SIZE || data[0] != VERSION))
+        {
+            return false;
+        }
+
+        uint16_t u16;
+        uint32_t u32;
+        type = static_cast<services::blabla::MsgType>(data[1]);
+        std::memcpy(&u16, data + 2, sizeof(u16));
+        flags = ntohs(u16);
+        std::memcpy(&u16, data + 4, sizeof(u16));
+        route_length = ntohs(u16);
+        std::memcpy(&u32, data + 8, sizeof(u32));
+        message_size = ntohl(u32);
+        std::memcpy(&u32, data + 12, sizeof(u32));
+        correlation_id = static_cast<int32_t>(ntohl(u32));
+        return true;
+    }
+
+    // Writes SIZE bytes.
+    void encode(uint8_t* out) const
+    {
+        const uint16_t be_flags = htons(flags);
+        const uint16_t be_route_length = htons(route_length);
+        const uint16_t reserved = 0;
+        const uint32_t be_message_size = htonl(message_size);
+        const uint32_t be_correlation_id = htonl(static_cast<uint32_t>(correlation_id));
+
+        out[0] = VERSION;
+        out[1] = static_cast<uint8_t>(type);
+        std::memcpy(out + 2, &be_flags, sizeof(be_flags));
+        std::memcpy(out + 4, &be_route_length, sizeof(be_route_length));
+        std::memcpy(out + 6, &reserved, sizeof(reserved));
+        std::memcpy(out + 8, &be_message_size, sizeof(be_message_size));
+        std::memcpy(out + 12, &be_correlation_id, sizeof(be_correlation_id));
+    }
+
+    services::blabla::MsgType type = services::blabla::UNUSED;
+    // Only set by the server, ignored otherwise.
+    uint16_t flags = 0;
+    uint16_t route_length = 0;
+    uint32_t message_size = 0;
+    int32_t correlation_id = 0;
+};
+
+// Routes are at most this long, so they fit in a BinaryHeader.
+static constexpr size_t MAX_ROUTE_LENGTH = UINT16_MAX;
+
+// A MESSAGE frame of the binary wire mode.
+struct BinaryMessage
+{
+    BinaryHeader header;
+    boost::string_view route;
+};
+
+// Dispatcher must provide WireMode wire_mode() const.
 template <typename Dispatcher>
 struct MessageCracker
 {
     template <typename Context>
-    void process(Context& ctx, std::vector<uint8_t>& buff)
+    void process(Context& ctx, const uint8_t* data, size_t size)
     {
-        google::protobuf::io::ArrayInputStream in(buff.data(), buff.size());
+        if (dispatcher().wire_mode() == WireMode::binary)
+        {
+            return process_binary(ctx, data, size);
+        }
+
+        google::protobuf::io::ArrayInputStream in(data, size);
         services::blabla::DecodableMessage msg;
         if (!msg.ParseFromZeroCopyStream(&in))
         {
@@ -24,7 +110,48 @@ struct MessageCracker
             return;
         }
 
-        switch (msg.type().type())
+        dispatch(ctx, msg.type().type(), data, size);
+    }
+
+private:
+    // The type is known from the fixed header: messages are decoded without
+    // protobuf and the control messages are decoded once.
+    template <typename Context>
+    void process_binary(Context& ctx, const uint8_t* data, size_t size)
+    {
+        BinaryMessage msg;
+        if (!msg.header.decode(data, size))
+        {
+            GLOG(error) << "Received invalid header";
+            dispatcher().decoding_error();
+            return;
+        }
+
+        data += BinaryHeader::SIZE;
+        size -= BinaryHeader::SIZE;
+        if (BOOST_LIKELY(msg.header.type == services::blabla::MESSAGE))
+        {
+            if (BOOST_UNLIKELY(msg.header.route_length != size))
+            {
+                GLOG(error) << "Received invalid route length";
+                dispatcher().decoding_error();
+                return;
+            }
+
+            msg.route = boost::string_view(reinterpret_cast<const char*>(data), size);
+            return dispatcher().handle(ctx, msg);
+        }
+
+        dispatch(ctx, msg.header.type, data, size);
+    }
+
+    template <typename Context>
+    void dispatch(Context& ctx,
+                  services::blabla::MsgType type,
+                  const uint8_t* data,
+                  size_t size)
+    {
+        switch (type)
         {
         default:
             // fall-through
@@ -33,13 +160,17 @@ struct MessageCracker
             return;
 
         case services::blabla::PING:
-            return handle<services::blabla::Ping>(ctx, buff);
+            return handle<services::blabla::Ping>(ctx, data, size);
         case services::blabla::PONG:
-            return handle<services::blabla::Pong>(ctx, buff);
+            return handle<services::blabla::Pong>(ctx, data, size);
         case services::blabla::SUSCRIBE_REQUEST:
-            return handle<services::blabla::SubscribeRequest>(ctx, buff);
+            return handle<services::blabla::SubscribeRequest>(ctx, data, size);
         case services::blabla::MESSAGE:
-            return handle<services::blabla::ProducerMessageHeader>(ctx, buff);
+            return handle<services::blabla::ProducerMessageHeader>(ctx, data, size);
+        case services::blabla::MESSAGE_BATCH:
+            return handle<services::blabla::MessageBatch>(ctx, data, size);
+        case services::blabla::HELLO:
+            return handle<services::blabla::Hello>(ctx, data, size);
 
         case services::blabla::ERROR:
             // XXX: server should not receive errors.
@@ -47,16 +178,15 @@ struct MessageCracker
         }
     }
 
-private:
     template <typename T, typename Context>
-    void handle(Context& ctx, std::vector<uint8_t>& buff)
+    void handle(Context& ctx, const uint8_t* data, size_t size)
     {
         static_assert(std::is_base_of<google::protobuf::Message, T>::value == true,
                       "T must be derived from google::protobuf::Message");
         static thread_local T msg;
 
         msg.Clear();
-        google::protobuf::io::ArrayInputStream in(buff.data(), buff.size());
+        google::protobuf::io::ArrayInputStream in(data, size);
         if (!msg.ParseFromZeroCopyStream(&in))
         {
             GLOG(error) << "Received invalid payload";
@@ -74,5 +204,69 @@ private:
         return static_cast<Dispatcher&>(*this);
     }
 };
+
+// Encodes the header of a message delivered to many subscribers.
+//
+// In protobuf, everything but the correlation id is serialized once, the
+// correlation id is appended for each subscriber: protobuf accepts fields in
+// any order so the result is a valid ConsumerMessageHeader. It is only
+// serialized if a subscriber uses the protobuf wire mode.
+class ConsumerHeaderEncoder
+{
+public:
+    // route must outlive the encoder. offset is the position of the message
+    // in its journal, 0 if it is not journaled.
+    ConsumerHeaderEncoder(boost::string_view route, uint32_t message_size, uint64_t offset = 0);
+
+    // Encoder for the subscribers using mode, as expected by
+    // SharedBufferWithSpecificMetadata::new_with_metadata.
+    class InMode
+    {
+    public:
+        InMode(const ConsumerHeaderEncoder& encoder, WireMode mode)
+        : encoder(encoder)
+        , mode(mode)
+        {
+        }
+
+        size_t max_size() const
+        {
+            return encoder.max_size(mode);
+        }
+
+        size_t encode(int32_t correlation_id, uint8_t* out) const
+        {
+            return encoder.encode(mode, correlation_id, out);
+        }
+
+    private:
+        const ConsumerHeaderEncoder& encoder;
+        WireMode mode;
+    };
+
+    InMode in(WireMode mode) const
+    {
+        return InMode(*this, mode);
+    }
+
+    // Upper bound of the size of an encoded header.
+    size_t max_size(WireMode mode) const;
+
+    // out must be able to hold max_size(mode) bytes, returns the number of
+    // bytes written.
+    size_t encode(WireMode mode, int32_t correlation_id, uint8_t* out) const;
+
+private:
+    const std::vector<uint8_t>& protobuf_prefix() const;
+
+    // tag + a negative int32 is sign extended to a 10 bytes varint.
+    static constexpr size_t MAX_CORRELATION_ID_SIZE = 1 + 10;
+
+    boost::string_view route;
+    uint32_t message_size;
+    uint64_t offset;
+    mutable std::vector<uint8_t> prefix;
+};
+
 } // namespace handlers
 } // namespace blabla
\ No newline at end of file
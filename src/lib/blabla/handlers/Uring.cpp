@@ -0,0 +1,1014 @@
+#include "Uring.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/asio/error.hpp>
+#include <boost/asio/post.hpp>
+
+#include <commonpp/core/LoggingInterface.hpp>
+
+#ifdef BLABLA_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace blabla
+{
+namespace handlers
+{
+
+CREATE_LOGGER(uring_logger, "handlers::uring");
+
+boost::asio::execution_context::id Uring::id;
+constexpr size_t Uring::MAX_LINKED_SENDS;
+
+#ifdef BLABLA_HAVE_IO_URING
+
+// The system calls are used directly, liburing is not needed for this
+// little.
+static int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete = 0)
+{
+    const unsigned flags = min_complete != 0 ? IORING_ENTER_GETEVENTS : 0;
+    return static_cast<int>(
+        ::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+// The polls linked to a send are tagged with the address of its operation
+// and this bit, so that they can be cancelled with it.
+static const uint64_t POLL_TAG = 1;
+
+static int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+    return static_cast<int>(
+        ::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+static std::runtime_error system_error(const char* what)
+{
+    return std::runtime_error(std::string(what) + ": " + std::strerror(errno));
+}
+
+struct Uring::Ring
+{
+    static constexpr unsigned ENTRIES = 1024;
+
+    Ring(unsigned entries = ENTRIES)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd = io_uring_setup(entries, &params);
+        if (fd < 0)
+        {
+            throw system_error("io_uring_setup");
+        }
+
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+            !(params.features & IORING_FEAT_NODROP))
+        {
+            ::close(fd);
+            throw std::runtime_error("io_uring is too old");
+        }
+
+        rings_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                              params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        rings = ::mmap(nullptr, rings_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (rings == MAP_FAILED)
+        {
+            ::close(fd);
+            throw system_error("mmap");
+        }
+
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(
+            ::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+        {
+            ::munmap(rings, rings_size);
+            ::close(fd);
+            throw system_error("mmap");
+        }
+
+        auto base = static_cast<uint8_t*>(rings);
+        sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+        // Entries are submitted in order, the indirection array is the
+        // identity.
+        auto array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; ++i)
+        {
+            array[i] = i;
+        }
+        tail = *sq_tail;
+    }
+
+    ~Ring()
+    {
+        ::munmap(sqes, sqes_size);
+        ::munmap(rings, rings_size);
+        ::close(fd);
+    }
+
+    unsigned available() const
+    {
+        return sq_entries - (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+    }
+
+    io_uring_sqe* get_sqe()
+    {
+        auto sqe = &sqes[tail & sq_mask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        ++tail;
+        ++pending;
+        return sqe;
+    }
+
+    // Returns false if the kernel could not take them yet.
+    bool submit()
+    {
+        if (pending == 0)
+        {
+            return true;
+        }
+
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        const int submitted = io_uring_enter(fd, pending);
+        if (submitted < 0)
+        {
+            if (errno == EAGAIN || errno == EBUSY || errno == EINTR)
+            {
+                return false;
+            }
+            throw system_error("io_uring_enter");
+        }
+
+        pending -= submitted;
+        return pending == 0;
+    }
+
+    // Blocks until a completion is queued.
+    void wait()
+    {
+        if (io_uring_enter(fd, 0, 1) < 0 && errno != EINTR)
+        {
+            throw system_error("io_uring_enter");
+        }
+    }
+
+    bool supports(const std::vector<uint8_t>& opcodes) const
+    {
+        const size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        std::vector<uint8_t> buffer(size);
+        auto probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        {
+            return false;
+        }
+
+        for (auto opcode : opcodes)
+        {
+            if (opcode > probe->last_op ||
+                !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int fd = -1;
+    void* rings = nullptr;
+    size_t rings_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+
+    // Local tail of the submission queue, published on submit.
+    unsigned tail = 0;
+    // Entries prepared but not submitted yet.
+    unsigned pending = 0;
+};
+
+// The receive buffers, handed to the kernel through a ring it picks them from
+// (IORING_REGISTER_PBUF_RING). The payloads are delivered as slices of the
+// buffer they were received in, which goes back to the ring once the last
+// one is written. The chunks come back from any thread, possibly once the
+// service is gone: the last one then destroys this.
+struct Uring::Buffers final : Chunk::Owner
+{
+    // A power of 2.
+    static constexpr unsigned COUNT = 256;
+    static constexpr size_t SIZE = 64 * 1024;
+    static constexpr uint16_t GROUP = 0;
+
+    Buffers(Uring& uring, int ring_fd)
+    : uring(&uring)
+    , lent(COUNT, false)
+    {
+        ring_size = (COUNT * sizeof(io_uring_buf) + 4095) & ~size_t(4095);
+        auto memory = ::mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            throw system_error("mmap");
+        }
+        ring = static_cast<io_uring_buf_ring*>(memory);
+
+        try
+        {
+            for (unsigned i = 0; i < COUNT; ++i)
+            {
+                chunks.push_back(Chunk::create(SIZE, *this, i));
+            }
+
+            io_uring_buf_reg reg;
+            std::memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+            reg.ring_entries = COUNT;
+            reg.bgid = GROUP;
+            if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            {
+                throw system_error("io_uring_register");
+            }
+        }
+        catch (...)
+        {
+            for (auto chunk : chunks)
+            {
+                Chunk::destroy(chunk);
+            }
+            ::munmap(ring, ring_size);
+            throw;
+        }
+
+        for (auto chunk : chunks)
+        {
+            provide(chunk);
+        }
+    }
+
+    ~Buffers()
+    {
+        ::munmap(ring, ring_size);
+    }
+
+    // The chunk of a completion, lent to a connection.
+    Chunk::Ptr take(uint16_t bid)
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        lent[bid] = true;
+        ++out;
+        return Chunk::Ptr(chunks[bid]);
+    }
+
+    // A receive found the ring empty: returns true if it has to wait for a
+    // buffer to be given back, in which case resume_starved() is posted then.
+    bool starve()
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        if (out < COUNT)
+        {
+            return false;
+        }
+
+        starving = true;
+        return true;
+    }
+
+    void recycle(Chunk* chunk) noexcept override
+    {
+        bool last = false;
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            --out;
+            if (uring)
+            {
+                lent[chunk->tag()] = false;
+                provide(chunk);
+                if (starving)
+                {
+                    starving = false;
+                    auto service = uring;
+                    boost::asio::post(service->ctx,
+                                      [service] { service->resume_starved(); });
+                }
+                return;
+            }
+
+            Chunk::destroy(chunk);
+            last = out == 0;
+        }
+
+        if (last)
+        {
+            delete this;
+        }
+    }
+
+    // On shutdown, once the kernel does not use the buffers anymore. The
+    // chunks still lent are freed when released.
+    void detach()
+    {
+        bool last = false;
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            uring = nullptr;
+            for (auto chunk : chunks)
+            {
+                if (!lent[chunk->tag()])
+                {
+                    Chunk::destroy(chunk);
+                }
+            }
+            last = out == 0;
+        }
+
+        if (last)
+        {
+            delete this;
+        }
+    }
+
+    // Must be called with the mutex held, or before the ring is shared.
+    void provide(Chunk* chunk)
+    {
+        // The entries start at the beginning of the ring, the tail overlays
+        // a reserved field of the first one. The header declares them after
+        // an empty struct, which is not empty in C++: ring->bufs is wrong.
+        auto& buf = reinterpret_cast<io_uring_buf*>(ring)[tail & (COUNT - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(chunk->data());
+        buf.len = SIZE;
+        buf.bid = static_cast<uint16_t>(chunk->tag());
+        __atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+    }
+
+    std::mutex mutex;
+    // Null once detached.
+    Uring* uring;
+    io_uring_buf_ring* ring = nullptr;
+    size_t ring_size = 0;
+    uint16_t tail = 0;
+    std::vector<Chunk*> chunks;
+    std::vector<bool> lent;
+    size_t out = 0;
+    bool starving = false;
+};
+
+constexpr unsigned Uring::Buffers::COUNT;
+
+bool Uring::supported()
+{
+    static const bool supported = [] {
+        try
+        {
+            Ring ring(8);
+            // The multishot receive and the provided buffer rings are not
+            // probed, they came with the zero copy send in Linux 6.0.
+            if (!ring.supports({IORING_OP_SENDMSG, IORING_OP_POLL_ADD, IORING_OP_ACCEPT,
+                                IORING_OP_RECV, IORING_OP_ASYNC_CANCEL,
+                                IORING_OP_SEND_ZC}))
+            {
+                LOG(uring_logger, warning)
+                    << "io_uring does not support multishot accept and recv";
+                return false;
+            }
+            return true;
+        }
+        catch (const std::exception& e)
+        {
+            LOG(uring_logger, warning) << "io_uring is not usable: " << e.what();
+            return false;
+        }
+    }();
+    return supported;
+}
+
+Uring::Uring(boost::asio::execution_context& ctx)
+: boost::asio::execution_context::service(ctx)
+, ctx(static_cast<boost::asio::io_context&>(ctx))
+, ring(new Ring)
+, completions(this->ctx)
+{
+    const int event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0)
+    {
+        throw system_error("eventfd");
+    }
+
+    completions.assign(event_fd);
+    if (io_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+    {
+        throw system_error("io_uring_register");
+    }
+
+    buffers = new Buffers(*this, ring->fd);
+    wait_completions();
+}
+
+Uring::~Uring() = default;
+
+void Uring::shutdown()
+{
+    boost::system::error_code ec;
+    completions.close(ec);
+
+    std::lock_guard<std::mutex> l(mutex);
+    // Never submitted, or stopped by the kernel.
+    for (const auto& entry : backlog)
+    {
+        if (entry.second != Action::cancel)
+        {
+            operations.erase(operations.iterator_to(*entry.first));
+            delete entry.first;
+        }
+    }
+    backlog.clear();
+    for (auto op : starved)
+    {
+        operations.erase(operations.iterator_to(*op));
+        delete op;
+    }
+    starved.clear();
+
+    // The kernel may still read the message and the buffers of what is in
+    // flight, which is cancelled and freed once completed.
+    try
+    {
+        cancel_all();
+        while (!operations.empty())
+        {
+            ring->wait();
+            drain();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        // Freeing the operations and the buffers could let the kernel write
+        // into freed memory, they are leaked instead.
+        LOG(uring_logger, error)
+            << "Cannot cancel the io_uring operations: " << e.what();
+        operations.clear();
+        return;
+    }
+
+    buffers->detach();
+    buffers = nullptr;
+    ring.reset();
+}
+
+void Uring::cancel_all()
+{
+    for (auto& op : operations)
+    {
+        const uint64_t user_data = reinterpret_cast<uint64_t>(&op);
+        for (const uint64_t target : {user_data | POLL_TAG, user_data})
+        {
+            while (ring->available() == 0)
+            {
+                if (!ring->submit())
+                {
+                    // Room is made by the completions.
+                    ring->wait();
+                    drain();
+                }
+            }
+
+            // The completions of the cancels themselves are ignored. The
+            // linked sends share their user_data.
+            auto cancel = ring->get_sqe();
+            cancel->opcode = IORING_OP_ASYNC_CANCEL;
+            cancel->addr = target;
+            cancel->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+            cancel->user_data = 0;
+        }
+    }
+
+    while (!ring->submit())
+    {
+        ring->wait();
+        drain();
+    }
+}
+
+void Uring::drain()
+{
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        const auto& cqe = ring->cqes[head & ring->cq_mask];
+        const auto user_data = cqe.user_data;
+        const int res = cqe.res;
+        const uint32_t flags = cqe.flags;
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+        if (user_data == 0 || (user_data & POLL_TAG))
+        {
+            continue;
+        }
+
+        // The handler is destroyed without being called, like the asio
+        // ones on shutdown.
+        auto op = reinterpret_cast<Operation*>(user_data);
+        bool done = !(flags & IORING_CQE_F_MORE);
+        if (op->type == Operation::Type::write)
+        {
+            auto write = static_cast<WriteOperation*>(op);
+            done = ++write->completed == write->sends;
+        }
+        else if (op->type == Operation::Type::accept && res >= 0)
+        {
+            ::close(res);
+        }
+        else if (flags & IORING_CQE_F_BUFFER)
+        {
+            buffers->take(flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+
+        if (done)
+        {
+            operations.erase(operations.iterator_to(*op));
+            delete op;
+        }
+    }
+}
+
+Uring::Operation* Uring::start(std::unique_ptr<Operation> op)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    operations.push_back(*op);
+    submit(op.get(), Action::submit);
+    return op.release();
+}
+
+void Uring::cancel(Operation* op)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    if (op->cancelled)
+    {
+        return;
+    }
+
+    op->cancelled = true;
+    auto it = std::find(starved.begin(), starved.end(), op);
+    if (it != starved.end())
+    {
+        // Cancelled by the kernel, without receiving anything.
+        starved.erase(it);
+        submit(op, Action::submit);
+    }
+    submit(op, Action::cancel);
+}
+
+void Uring::submit(Operation* op, Action action)
+{
+    schedule_flush();
+    if (!backlog.empty() ||
+        (ring->available() < entries(op, action) && !ring->submit()))
+    {
+        backlog.emplace_back(op, action);
+        return;
+    }
+
+    prepare(op, action);
+}
+
+unsigned Uring::entries(Operation* op, Action action) const
+{
+    if (op->type != Operation::Type::write || action == Action::cancel)
+    {
+        return 1;
+    }
+
+    auto write = static_cast<WriteOperation*>(op);
+    const size_t remaining = write->iov.size() - write->first;
+    const size_t sends =
+        (remaining + write->buffers_per_send - 1) / write->buffers_per_send;
+    return std::min(sends, MAX_LINKED_SENDS) + (action == Action::submit_when_writable);
+}
+
+void Uring::prepare(Operation* op, Action action)
+{
+    if (action == Action::cancel)
+    {
+        // Ignored if op is done already.
+        auto cancel = ring->get_sqe();
+        cancel->opcode = IORING_OP_ASYNC_CANCEL;
+        cancel->addr = reinterpret_cast<uint64_t>(op);
+        cancel->user_data = 0;
+        return;
+    }
+
+    if (op->type == Operation::Type::write)
+    {
+        return prepare_sends(static_cast<WriteOperation*>(op),
+                             action == Action::submit_when_writable);
+    }
+
+    auto sqe = ring->get_sqe();
+    sqe->fd = op->fd;
+    sqe->user_data = reinterpret_cast<uint64_t>(op);
+    if (op->type == Operation::Type::accept)
+    {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    else
+    {
+        // The kernel picks a buffer of the group for each block.
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = Buffers::GROUP;
+    }
+}
+
+void Uring::prepare_sends(WriteOperation* op, bool wait_writable)
+{
+    if (wait_writable)
+    {
+        // The sends only start once the socket is writable.
+        auto poll = ring->get_sqe();
+        poll->opcode = IORING_OP_POLL_ADD;
+        poll->fd = op->fd;
+        poll->poll32_events = POLLOUT;
+        poll->flags = IOSQE_IO_LINK;
+        poll->user_data = reinterpret_cast<uint64_t>(op) | POLL_TAG;
+    }
+
+    // Each send writes all of its buffers (MSG_WAITALL) or fails, which
+    // cancels the ones linked after it: the bytes are never reordered.
+    op->sends = 0;
+    op->completed = 0;
+    size_t index = op->first;
+    io_uring_sqe* send = nullptr;
+    while (index < op->iov.size() && op->sends < MAX_LINKED_SENDS)
+    {
+        auto& msg = op->msgs[op->sends];
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = op->iov.data() + index;
+        msg.msg_iovlen = std::min(op->iov.size() - index, op->buffers_per_send);
+
+        size_t bytes = 0;
+        for (size_t i = 0; i < msg.msg_iovlen; ++i)
+        {
+            bytes += msg.msg_iov[i].iov_len;
+        }
+        op->expected[op->sends++] = bytes;
+        index += msg.msg_iovlen;
+
+        send = ring->get_sqe();
+        send->opcode = IORING_OP_SENDMSG;
+        send->fd = op->fd;
+        send->addr = reinterpret_cast<uint64_t>(&msg);
+        send->len = 1;
+        send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        send->flags = IOSQE_IO_LINK;
+        send->user_data = reinterpret_cast<uint64_t>(op);
+    }
+    send->flags = 0;
+}
+
+void Uring::schedule_flush()
+{
+    if (!flush_scheduled)
+    {
+        flush_scheduled = true;
+        boost::asio::post(ctx, [this] { flush(); });
+    }
+}
+
+void Uring::flush()
+{
+    std::lock_guard<std::mutex> l(mutex);
+    flush_scheduled = false;
+    if (!ring)
+    {
+        return;
+    }
+
+    // The kernel may be busy with completions, in which case this is tried
+    // again once they are processed.
+    while (ring->submit() && !backlog.empty())
+    {
+        while (!backlog.empty())
+        {
+            const auto& front = backlog.front();
+            if (ring->available() < entries(front.first, front.second))
+            {
+                break;
+            }
+
+            prepare(front.first, front.second);
+            backlog.pop_front();
+        }
+    }
+
+    if (ring->pending != 0 || !backlog.empty())
+    {
+        schedule_flush();
+    }
+}
+
+void Uring::wait_completions()
+{
+    completions.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                           [this](boost::system::error_code ec) {
+                               if (ec)
+                               {
+                                   return;
+                               }
+
+                               uint64_t count;
+                               ::read(completions.native_handle(), &count,
+                                      sizeof(count));
+                               reap();
+                               wait_completions();
+                           });
+}
+
+void Uring::reap()
+{
+    // Only one completion handler runs at a time, the queue is only read
+    // here.
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        const auto& cqe = ring->cqes[head & ring->cq_mask];
+        const auto user_data = cqe.user_data;
+        const int res = cqe.res;
+        const uint32_t flags = cqe.flags;
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+        // Cancel, or poll of linked sends.
+        if (user_data == 0 || (user_data & POLL_TAG))
+        {
+            continue;
+        }
+
+        auto op = reinterpret_cast<Operation*>(user_data);
+        switch (op->type)
+        {
+        case Operation::Type::write:
+            complete(static_cast<WriteOperation*>(op), res);
+            break;
+        case Operation::Type::accept:
+            complete(static_cast<AcceptOperation*>(op), res, flags);
+            break;
+        case Operation::Type::receive:
+            complete(static_cast<ReceiveOperation*>(op), res, flags);
+            break;
+        }
+    }
+}
+
+void Uring::complete(WriteOperation* op, int res)
+{
+    const size_t index = op->completed++;
+    if (res == -ECANCELED)
+    {
+        // A previous send of the chain failed.
+    }
+    else if (res == -EAGAIN)
+    {
+        // Non-blocking socket.
+        op->wait_writable = true;
+    }
+    else if (res < 0)
+    {
+        if (!op->error)
+        {
+            op->error.assign(-res, boost::system::system_category());
+        }
+    }
+    else if (res == 0 || op->short_send)
+    {
+        // A send ran after a short one: the stream is corrupted.
+        op->error = boost::asio::error::broken_pipe;
+    }
+    else
+    {
+        consume(op, res);
+        op->short_send = static_cast<size_t>(res) < op->expected[index];
+    }
+
+    if (op->completed < op->sends)
+    {
+        return;
+    }
+
+    if (!op->error && op->first < op->iov.size())
+    {
+        const auto action =
+            op->wait_writable ? Action::submit_when_writable : Action::submit;
+        op->short_send = false;
+        op->wait_writable = false;
+        std::lock_guard<std::mutex> l(mutex);
+        submit(op, action);
+        return;
+    }
+
+    finish(op, op->error);
+}
+
+void Uring::complete(AcceptOperation* op, int res, uint32_t flags)
+{
+    if (res >= 0)
+    {
+        op->accepted({}, res);
+        if ((flags & IORING_CQE_F_MORE) || rearm(op))
+        {
+            return;
+        }
+        res = -ECANCELED;
+    }
+
+    finish(op, res == -ECANCELED
+                   ? boost::asio::error::operation_aborted
+                   : boost::system::error_code(-res, boost::system::system_category()));
+}
+
+void Uring::complete(ReceiveOperation* op, int res, uint32_t flags)
+{
+    Chunk::Ptr chunk;
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        chunk = buffers->take(flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+
+    if (res > 0)
+    {
+        op->received({}, std::move(chunk), res);
+        if ((flags & IORING_CQE_F_MORE) || rearm(op))
+        {
+            return;
+        }
+        res = -ECANCELED;
+    }
+    else if (res == -ENOBUFS)
+    {
+        // Every buffer is lent, the receive waits for one to come back.
+        std::lock_guard<std::mutex> l(mutex);
+        if (!op->cancelled)
+        {
+            if (buffers->starve())
+            {
+                starved.push_back(op);
+            }
+            else
+            {
+                submit(op, Action::submit);
+            }
+            return;
+        }
+        res = -ECANCELED;
+    }
+
+    boost::system::error_code ec;
+    if (res == 0)
+    {
+        ec = boost::asio::error::eof;
+    }
+    else if (res == -ECANCELED)
+    {
+        ec = boost::asio::error::operation_aborted;
+    }
+    else
+    {
+        ec.assign(-res, boost::system::system_category());
+    }
+    finish(op, ec);
+}
+
+bool Uring::rearm(Operation* op)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    if (op->cancelled)
+    {
+        return false;
+    }
+
+    submit(op, Action::submit);
+    return true;
+}
+
+void Uring::resume_starved()
+{
+    std::lock_guard<std::mutex> l(mutex);
+    for (auto op : starved)
+    {
+        submit(op, Action::submit);
+    }
+    starved.clear();
+}
+
+void Uring::finish(Operation* op, boost::system::error_code ec)
+{
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        operations.erase(operations.iterator_to(*op));
+    }
+
+    std::unique_ptr<Operation> done(op);
+    switch (op->type)
+    {
+    case Operation::Type::write:
+        static_cast<WriteOperation*>(op)->complete(ec);
+        break;
+    case Operation::Type::accept:
+        static_cast<AcceptOperation*>(op)->accepted(ec, -1);
+        break;
+    case Operation::Type::receive:
+        static_cast<ReceiveOperation*>(op)->received(ec, nullptr, 0);
+        break;
+    }
+}
+
+bool Uring::consume(WriteOperation* op, size_t written)
+{
+    while (op->first < op->iov.size() && written >= op->iov[op->first].iov_len)
+    {
+        written -= op->iov[op->first].iov_len;
+        ++op->first;
+    }
+
+    if (op->first == op->iov.size())
+    {
+        return true;
+    }
+
+    auto& partial = op->iov[op->first];
+    partial.iov_base = static_cast<uint8_t*>(partial.iov_base) + written;
+    partial.iov_len -= written;
+    return false;
+}
+
+#else
+
+struct Uring::Ring
+{
+};
+
+struct Uring::Buffers
+{
+};
+
+bool Uring::supported()
+{
+    return false;
+}
+
+Uring::Uring(boost::asio::execution_context& ctx)
+: boost::asio::execution_context::service(ctx)
+, ctx(static_cast<boost::asio::io_context&>(ctx))
+, completions(this->ctx)
+{
+    throw std::runtime_error("Built without io_uring support");
+}
+
+Uring::~Uring() = default;
+
+void Uring::shutdown()
+{
+}
+
+Uring::Operation* Uring::start(std::unique_ptr<Operation>)
+{
+    return nullptr;
+}
+
+void Uring::cancel(Operation*)
+{
+}
+
+#endif
+
+} // namespace handlers
+} // namespace blabla
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/intrusive/list.hpp>
+#include <boost/system/error_code.hpp>
+
+#include "Buffer.hpp"
+
+namespace blabla
+{
+namespace handlers
+{
+
+// Drives the connections of an io_context through io_uring: the listening
+// sockets with a multishot accept, the reads with a multishot recv into
+// buffers registered with the kernel, and the writes with linked sends. The
+// operations started while the io_context runs a handler are submitted
+// together, with a single system call, once the handler is done: a message
+// fanned out to many subscribers costs one system call instead of one
+// writev per subscriber.
+//
+// Completions are signaled through an eventfd watched by the io_context, the
+// handlers run on its threads like the asio ones.
+class Uring : public boost::asio::execution_context::service
+{
+public:
+    static boost::asio::execution_context::id id;
+
+    // Sends chained by a write, each one of at most buffers_per_send
+    // buffers: the kernel starts a send once the previous one is done.
+    static constexpr size_t MAX_LINKED_SENDS = 8;
+
+    struct Operation;
+
+    // Throws if the ring cannot be created.
+    explicit Uring(boost::asio::execution_context& ctx);
+    ~Uring();
+
+    // Whether the kernel supports what is used (Linux 6.0), checked once.
+    static bool supported();
+
+    // Same as boost::asio::async_write: every buffer is written unless an
+    // error occurs. The buffers must stay valid until the handler is called.
+    template <typename Buffers, typename Handler>
+    void async_write(int fd,
+                     const Buffers& buffers,
+                     size_t buffers_per_send,
+                     Handler handler)
+    {
+        std::unique_ptr<WriteOperation> op(new WriteImpl<Handler>(std::move(handler)));
+        op->fd = fd;
+        op->buffers_per_send =
+            std::max<size_t>(std::min<size_t>(buffers_per_send, IOV_MAX), 1);
+        for (const auto& buffer : buffers)
+        {
+            if (buffer.size() != 0)
+            {
+                op->iov.push_back({const_cast<void*>(buffer.data()), buffer.size()});
+            }
+        }
+
+        start(std::move(op));
+    }
+
+    // Calls handler(ec, fd) for every connection accepted on the listening
+    // socket fd, until an error or cancel() (operation_aborted). The accepted
+    // sockets are blocking, io_uring waits for them.
+    template <typename Handler>
+    Operation* async_accept(int fd, Handler handler)
+    {
+        std::unique_ptr<AcceptOperation> op(new AcceptImpl<Handler>(std::move(handler)));
+        op->fd = fd;
+        return start(std::move(op));
+    }
+
+    // Calls handler(ec, chunk, size) for every block received on fd, until
+    // the end of the stream (eof), an error or cancel() (operation_aborted).
+    // The block is at the beginning of the chunk, one of the registered
+    // buffers: it is given back to the kernel once released.
+    template <typename Handler>
+    Operation* async_receive(int fd, Handler handler)
+    {
+        std::unique_ptr<ReceiveOperation> op(new ReceiveImpl<Handler>(std::move(handler)));
+        op->fd = fd;
+        return start(std::move(op));
+    }
+
+    // The handler of op is then called with operation_aborted. The caller
+    // must make sure that it was not called with an error already.
+    void cancel(Operation* op);
+
+    struct Operation : boost::intrusive::list_base_hook<>
+    {
+        enum class Type
+        {
+            write,
+            accept,
+            receive,
+        };
+
+        explicit Operation(Type type)
+        : type(type)
+        {
+        }
+        virtual ~Operation() = default;
+
+        const Type type;
+        int fd = -1;
+        // cancel() was called.
+        bool cancelled = false;
+    };
+
+private:
+    struct WriteOperation : Operation
+    {
+        WriteOperation()
+        : Operation(Type::write)
+        {
+        }
+        virtual void complete(boost::system::error_code ec) = 0;
+
+        std::vector<iovec> iov;
+        // First buffer not entirely written.
+        size_t first = 0;
+        size_t buffers_per_send = 1;
+
+        // The linked sends in flight, and the bytes each one must write.
+        msghdr msgs[MAX_LINKED_SENDS];
+        size_t expected[MAX_LINKED_SENDS];
+        size_t sends = 0;
+        size_t completed = 0;
+        // A send wrote less than expected, the next ones must have been
+        // cancelled by the kernel.
+        bool short_send = false;
+        bool wait_writable = false;
+        boost::system::error_code error;
+    };
+
+    template <typename Handler>
+    struct WriteImpl final : WriteOperation
+    {
+        WriteImpl(Handler handler)
+        : handler(std::move(handler))
+        {
+        }
+
+        void complete(boost::system::error_code ec) override
+        {
+            handler(ec);
+        }
+
+        Handler handler;
+    };
+
+    struct AcceptOperation : Operation
+    {
+        AcceptOperation()
+        : Operation(Type::accept)
+        {
+        }
+        virtual void accepted(boost::system::error_code ec, int fd) = 0;
+    };
+
+    template <typename Handler>
+    struct AcceptImpl final : AcceptOperation
+    {
+        AcceptImpl(Handler handler)
+        : handler(std::move(handler))
+        {
+        }
+
+        void accepted(boost::system::error_code ec, int fd) override
+        {
+            handler(ec, fd);
+        }
+
+        Handler handler;
+    };
+
+    struct ReceiveOperation : Operation
+    {
+        ReceiveOperation()
+        : Operation(Type::receive)
+        {
+        }
+        virtual void
+        received(boost::system::error_code ec, Chunk::Ptr chunk, size_t size) = 0;
+    };
+
+    template <typename Handler>
+    struct ReceiveImpl final : ReceiveOperation
+    {
+        ReceiveImpl(Handler handler)
+        : handler(std::move(handler))
+        {
+        }
+
+        void received(boost::system::error_code ec, Chunk::Ptr chunk, size_t size) override
+        {
+            handler(ec, std::move(chunk), size);
+        }
+
+        Handler handler;
+    };
+
+    // What a submission does with its operation.
+    enum class Action
+    {
+        submit,
+        submit_when_writable,
+        cancel,
+    };
+
+    struct Ring;
+    struct Buffers;
+
+    void shutdown() override;
+
+    Operation* start(std::unique_ptr<Operation> op);
+    // Must be called with the mutex held.
+    void submit(Operation* op, Action action);
+    // Submission queue entries needed by the action.
+    unsigned entries(Operation* op, Action action) const;
+    // Fills the submission queue entries, which must have room.
+    void prepare(Operation* op, Action action);
+    void prepare_sends(WriteOperation* op, bool wait_writable);
+    void schedule_flush();
+    void flush();
+    void wait_completions();
+    void reap();
+    void complete(WriteOperation* op, int res);
+    void complete(AcceptOperation* op, int res, uint32_t flags);
+    void complete(ReceiveOperation* op, int res, uint32_t flags);
+    // Submits a multishot operation again once the kernel stopped it, unless
+    // it is cancelled, in which case it returns false.
+    bool rearm(Operation* op);
+    // Calls the last handler of op and destroys it.
+    void finish(Operation* op, boost::system::error_code ec);
+    // Submits again the receives which ran out of buffers.
+    void resume_starved();
+    // Cancels the operations in flight, on shutdown. Must be called with the
+    // mutex held.
+    void cancel_all();
+    // Frees the completed operations without calling their handler, on
+    // shutdown. Must be called with the mutex held.
+    void drain();
+    // Returns true if op has been entirely written.
+    static bool consume(WriteOperation* op, size_t written);
+
+    boost::asio::io_context& ctx;
+    std::unique_ptr<Ring> ring;
+    // Owned by the chunks lent to the connections as well.
+    Buffers* buffers = nullptr;
+    boost::asio::posix::stream_descriptor completions;
+
+    std::mutex mutex;
+    // Operations in flight, destroyed on shutdown once the kernel is done
+    // with them.
+    boost::intrusive::list<Operation> operations;
+    // Submissions waiting for room in the submission queue.
+    std::deque<std::pair<Operation*, Action>> backlog;
+    // Receives waiting for a buffer to be given back.
+    std::vector<ReceiveOperation*> starved;
+    bool flush_scheduled = false;
+};
+
+} // namespace handlers
+} // namespace blabla
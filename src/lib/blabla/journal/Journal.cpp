@@ -0,0 +1,627 @@
+#include "Journal.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/system/system_error.hpp>
+
+#include <commonpp/core/LoggingInterface.hpp>
+#include <commonpp/thread/Thread.hpp>
+
+namespace blabla
+{
+namespace journal
+{
+
+CREATE_LOGGER(journal_logger, "journal");
+
+namespace
+{
+[[noreturn]] void throw_errno(const std::string& what)
+{
+    throw boost::system::system_error(errno, boost::system::system_category(),
+                                      what);
+}
+
+void make_directory(const std::string& path)
+{
+    for (size_t slash = path.find('/', 1);; slash = path.find('/', slash + 1))
+    {
+        auto parent = path.substr(0, slash);
+        if (::mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            throw_errno("mkdir " + parent);
+        }
+
+        if (slash == std::string::npos)
+        {
+            return;
+        }
+    }
+}
+
+void sync_directory(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw_errno("open " + path);
+    }
+
+    auto result = ::fsync(fd);
+    auto error = errno;
+    ::close(fd);
+    if (result != 0)
+    {
+        errno = error;
+        throw_errno("fsync " + path);
+    }
+}
+
+// Base offsets of the segment files of a directory, sorted.
+std::vector<uint64_t> list_segments(const std::string& path)
+{
+    std::vector<uint64_t> offsets;
+    auto dir = ::opendir(path.c_str());
+    if (!dir)
+    {
+        throw_errno("opendir " + path);
+    }
+
+    while (auto entry = ::readdir(dir))
+    {
+        char* end;
+        auto offset = std::strtoull(entry->d_name, &end, 10);
+        if (end != entry->d_name && Segment::file_name(offset) == entry->d_name)
+        {
+            offsets.push_back(offset);
+        }
+    }
+
+    ::closedir(dir);
+    std::sort(offsets.begin(), offsets.end());
+    return offsets;
+}
+
+uint64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// Tokens of a pattern before its first wildcard.
+boost::string_view literal_prefix(boost::string_view pattern)
+{
+    for (size_t begin = 0; begin <= pattern.size();)
+    {
+        auto dot = pattern.find('.', begin);
+        auto token = pattern.substr(begin, dot == boost::string_view::npos
+                                               ? boost::string_view::npos
+                                               : dot - begin);
+        if (token == "*" || token == ">")
+        {
+            return pattern.substr(0, begin == 0 ? 0 : begin - 1);
+        }
+
+        if (dot == boost::string_view::npos)
+        {
+            break;
+        }
+        begin = dot + 1;
+    }
+    return pattern;
+}
+} // namespace
+
+bool covers(boost::string_view prefix, boost::string_view route)
+{
+    return prefix.empty() ||
+           (route.starts_with(prefix) &&
+            (route.size() == prefix.size() || route[prefix.size()] == '.'));
+}
+
+Journal::Journal(std::string prefix,
+                 std::string directory,
+                 const JournalConfiguration& conf,
+                 std::function<void()> request_maintenance)
+: route_prefix(std::move(prefix))
+, directory(std::move(directory))
+, conf(conf)
+, request_maintenance(std::move(request_maintenance))
+{
+    make_directory(this->directory);
+    recover_spare();
+    for (auto offset : list_segments(this->directory))
+    {
+        auto segment = Segment::open(
+            this->directory + "/" + Segment::file_name(offset), offset,
+            conf.index_interval_bytes);
+        if (segment->base_offset() < next_offset && !segments.empty())
+        {
+            LOG(journal_logger, warning)
+                << "Ignoring the overlapping segment " << offset << " of "
+                << this->directory;
+            continue;
+        }
+
+        next_offset = segment->next_offset();
+        last_timestamp = std::max(last_timestamp, segment->last_timestamp());
+        segments.push_back(std::move(segment));
+    }
+
+    if (segments.empty())
+    {
+        segments.push_back(Segment::create(this->directory, next_offset,
+                                           conf.segment_bytes,
+                                           conf.index_interval_bytes));
+        directory_changed = true;
+    }
+    spare = Segment::create_spare(this->directory, conf.segment_bytes,
+                                  conf.index_interval_bytes);
+
+    LOG(journal_logger, info) << "Journal of '" << route_prefix << "' in "
+                              << this->directory << ": " << begin() << " to "
+                              << next_offset;
+}
+
+Journal::~Journal()
+{
+    // The flusher is stopped.
+    for (auto& segment : unnamed)
+    {
+        try
+        {
+            segment->rename(directory + "/" +
+                            Segment::file_name(segment->base_offset()));
+        }
+        catch (const std::exception& e)
+        {
+            LOG(journal_logger, error) << "Cannot name a segment: " << e.what();
+        }
+    }
+
+    for (auto& segment : retired)
+    {
+        segment->remove();
+    }
+
+    if (spare)
+    {
+        spare->remove();
+    }
+}
+
+void Journal::recover_spare()
+{
+    const auto path = directory + "/" + Segment::SPARE_NAME;
+    const auto base = Segment::first_offset(path);
+    if (base == 0)
+    {
+        ::unlink(path.c_str());
+        return;
+    }
+
+    LOG(journal_logger, warning)
+        << "Recovering the segment " << base << " of " << directory;
+    const auto name = directory + "/" + Segment::file_name(base);
+    if (::rename(path.c_str(), name.c_str()) != 0)
+    {
+        throw_errno("rename " + path);
+    }
+}
+
+uint64_t Journal::append(boost::string_view route,
+                         const uint8_t* payload,
+                         size_t size)
+{
+    const auto bytes = Segment::record_size(route.size(), size);
+    auto timestamp = now();
+
+    std::shared_ptr<Segment> segment;
+    size_t position;
+    uint64_t offset;
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        while (!segments.back()->reserve(bytes, position))
+        {
+            if (bytes > conf.segment_bytes)
+            {
+                LOG(journal_logger, warning)
+                    << "A message of " << size << "B on " << route
+                    << " does not fit in a journal segment";
+                return 0;
+            }
+
+            if (spare)
+            {
+                roll();
+            }
+            else if (!wait_for_spare(l))
+            {
+                LOG(journal_logger, error)
+                    << "No segment to append to in " << directory;
+                return 0;
+            }
+        }
+
+        // Kept monotonic for the lookups by time.
+        last_timestamp = std::max(last_timestamp, timestamp);
+        timestamp = last_timestamp;
+        segment = segments.back();
+        offset = next_offset++;
+        pending.push_back({segment, position, timestamp, false});
+    }
+
+    // Only this message is written there, the readers do not see it before
+    // it is committed.
+    segment->write(position, offset, timestamp, route, payload, size);
+
+    std::lock_guard<std::mutex> l(mutex);
+    pending[pending.size() - (next_offset - offset)].written = true;
+    while (!pending.empty() && pending.front().written)
+    {
+        auto& front = pending.front();
+        front.segment->commit(front.position, committed_end(), front.timestamp);
+        pending.pop_front();
+    }
+    return offset;
+}
+
+void Journal::roll()
+{
+    spare->rebase(next_offset);
+    unnamed.push_back(spare);
+    segments.push_back(std::move(spare));
+    // The appends waiting for the spare can use this segment.
+    spare_ready.notify_all();
+
+    if (conf.max_segments != 0 && segments.size() > conf.max_segments)
+    {
+        retired.push_back(std::move(segments.front()));
+        segments.erase(segments.begin());
+    }
+    maintenance.store(true, std::memory_order_relaxed);
+}
+
+bool Journal::wait_for_spare(std::unique_lock<std::mutex>& l)
+{
+    // Creating a segment allocates its file, which is left to the flusher
+    // even when it is late: the other appends wait as well.
+    const auto full = segments.back();
+    maintenance_failed = false;
+    maintenance.store(true, std::memory_order_relaxed);
+    request_maintenance();
+    spare_ready.wait(l, [&] {
+        return spare || segments.back() != full || maintenance_failed;
+    });
+    return spare || segments.back() != full;
+}
+
+void Journal::maintain()
+{
+    std::vector<std::shared_ptr<Segment>> taken;
+    std::vector<std::shared_ptr<Segment>> removed;
+    bool prepare;
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        maintenance.store(false, std::memory_order_relaxed);
+        taken.swap(unnamed);
+        removed.swap(retired);
+        prepare = !spare;
+    }
+
+    for (size_t i = 0; i < taken.size(); ++i)
+    {
+        try
+        {
+            taken[i]->rename(directory + "/" +
+                             Segment::file_name(taken[i]->base_offset()));
+        }
+        catch (...)
+        {
+            // Retried by the next call, the spare file is not recreated before
+            // the segment it became is renamed.
+            std::lock_guard<std::mutex> l(mutex);
+            unnamed.insert(unnamed.begin(), taken.begin() + i, taken.end());
+            retired.insert(retired.end(), removed.begin(), removed.end());
+            maintenance.store(true, std::memory_order_relaxed);
+            maintenance_failed = true;
+            spare_ready.notify_all();
+            throw;
+        }
+    }
+
+    // Readers holding the segments still see them, they are unmapped with
+    // their last reference.
+    for (auto& segment : removed)
+    {
+        segment->remove();
+    }
+
+    std::shared_ptr<Segment> next;
+    try
+    {
+        if (prepare)
+        {
+            next = Segment::create_spare(directory, conf.segment_bytes,
+                                         conf.index_interval_bytes);
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        directory_changed =
+            directory_changed || !taken.empty() || !removed.empty();
+        maintenance_failed = true;
+        spare_ready.notify_all();
+        throw;
+    }
+
+    std::lock_guard<std::mutex> l(mutex);
+    if (next)
+    {
+        spare = std::move(next);
+        spare_ready.notify_all();
+    }
+    if (!taken.empty() || !removed.empty())
+    {
+        directory_changed = true;
+    }
+}
+
+uint64_t Journal::end() const
+{
+    std::lock_guard<std::mutex> l(mutex);
+    return committed_end();
+}
+
+uint64_t Journal::begin() const
+{
+    std::lock_guard<std::mutex> l(mutex);
+    return segments.front()->base_offset();
+}
+
+uint64_t Journal::offset_at(uint64_t timestamp) const
+{
+    timestamp *= 1000 * 1000;
+
+    std::shared_ptr<Segment> segment;
+    size_t position;
+    size_t size;
+    uint64_t offset;
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        auto it = std::find_if(segments.begin(), segments.end(),
+                               [timestamp](auto& s) {
+                                   return !s->empty() &&
+                                          s->last_timestamp() >= timestamp;
+                               });
+        if (it == segments.end())
+        {
+            return committed_end();
+        }
+
+        segment = *it;
+        position = segment->seek_time(timestamp);
+        size = segment->size();
+        offset = segment->next_offset();
+    }
+
+    segment->scan(position, size, [&](const Record& record) {
+        if (record.timestamp < timestamp)
+        {
+            return true;
+        }
+
+        offset = record.offset;
+        return false;
+    });
+    return offset;
+}
+
+std::shared_ptr<Segment> Journal::find(uint64_t offset) const
+{
+    auto it = std::upper_bound(segments.begin(), segments.end(), offset,
+                               [](uint64_t offset, const auto& segment) {
+                                   return offset < segment->base_offset();
+                               });
+    if (it != segments.begin())
+    {
+        --it;
+    }
+
+    // Past the records of the segment: in a gap or at the end.
+    for (; it != segments.end(); ++it)
+    {
+        if ((*it)->next_offset() > offset)
+        {
+            return *it;
+        }
+    }
+    return nullptr;
+}
+
+void Journal::sync()
+{
+    std::vector<std::pair<std::shared_ptr<Segment>, size_t>> dirty;
+    bool sync_directory = false;
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        for (auto& segment : segments)
+        {
+            if (segment->synced_size() < segment->size())
+            {
+                dirty.emplace_back(segment, segment->size());
+            }
+        }
+        std::swap(sync_directory, directory_changed);
+    }
+
+    for (auto& pair : dirty)
+    {
+        pair.first->sync(pair.second);
+    }
+
+    if (sync_directory)
+    {
+        journal::sync_directory(directory);
+    }
+}
+
+Journals::Journals(const JournalConfiguration& conf)
+: conf(conf)
+{
+    auto prefixes = conf.route_prefixes;
+    // Longest first, the equal ones next to each other.
+    std::sort(prefixes.begin(), prefixes.end(), [](auto& lhs, auto& rhs) {
+        return lhs.size() != rhs.size() ? lhs.size() > rhs.size() : lhs < rhs;
+    });
+    prefixes.erase(std::unique(prefixes.begin(), prefixes.end()),
+                   prefixes.end());
+
+    for (auto& prefix : prefixes)
+    {
+        if (prefix.find('/') != std::string::npos)
+        {
+            throw boost::system::system_error(
+                boost::system::errc::make_error_code(
+                    boost::system::errc::invalid_argument),
+                "Invalid journal prefix " + prefix);
+        }
+
+        auto name = prefix.empty() ? std::string("_") : prefix;
+        journals.emplace_back(std::make_unique<Journal>(
+            prefix, conf.directory + "/" + name, conf,
+            [this] { notify_maintenance(); }));
+    }
+
+    flusher = std::thread([this] { run(); });
+}
+
+Journals::~Journals()
+{
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    flusher.join();
+}
+
+int Journals::journal_of(boost::string_view route) const
+{
+    for (size_t i = 0; i < journals.size(); ++i)
+    {
+        if (covers(journals[i]->prefix(), route))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int Journals::journal_of_subscription(boost::string_view route,
+                                      bool pattern) const
+{
+    auto prefix = pattern ? literal_prefix(route) : route;
+    auto index = journal_of(prefix);
+    if (index < 0)
+    {
+        return -1;
+    }
+
+    // The routes of a longer prefix under the subscription go to another
+    // journal, patterns are not looked into.
+    for (int i = 0; i < index; ++i)
+    {
+        if (covers(prefix, journals[i]->prefix()))
+        {
+            return -1;
+        }
+    }
+    return index;
+}
+
+void Journals::notify()
+{
+    if (!pending.exchange(true, std::memory_order_acq_rel))
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        cv.notify_one();
+    }
+}
+
+void Journals::notify_maintenance()
+{
+    if (!maintenance.exchange(true, std::memory_order_acq_rel))
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        cv.notify_one();
+    }
+}
+
+void Journals::run()
+{
+    commonpp::thread::set_current_thread_name("journal");
+
+    std::unique_lock<std::mutex> l(mutex);
+    while (true)
+    {
+        if (conf.fsync == FsyncPolicy::periodic)
+        {
+            cv.wait_for(l, conf.fsync_interval,
+                        [this] { return stopping || maintenance.load(); });
+        }
+        else
+        {
+            cv.wait(l, [this] {
+                return stopping || pending.load() || maintenance.load();
+            });
+        }
+
+        // What was appended during the flush is flushed by the next one.
+        pending = false;
+        maintenance = false;
+        const bool last = stopping;
+        l.unlock();
+
+        for (auto& journal : journals)
+        {
+            try
+            {
+                if (journal->needs_maintenance())
+                {
+                    journal->maintain();
+                }
+
+                if (conf.fsync != FsyncPolicy::never)
+                {
+                    journal->sync();
+                }
+            }
+            catch (const std::exception& e)
+            {
+                LOG(journal_logger, error)
+                    << "Cannot flush the journal of '" << journal->prefix()
+                    << "': " << e.what();
+            }
+        }
+
+        if (last)
+        {
+            return;
+        }
+        l.lock();
+    }
+}
+
+} // namespace journal
+} // namespace blabla
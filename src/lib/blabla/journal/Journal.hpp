@@ -0,0 +1,267 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/utility/string_view.hpp>
+
+#include "blabla/Blabla.hpp"
+#include "blabla/handlers/Buffer.hpp"
+
+#include "Segment.hpp"
+
+namespace blabla
+{
+namespace journal
+{
+
+// Whether route is prefix or one of its sub routes ('.' boundaries).
+bool covers(boost::string_view prefix, boost::string_view route);
+
+// Append only log of the messages published on the routes of a prefix, made
+// of segments. Offsets start at 1 and follow each other.
+//
+// Appending only reserves the room of the message under the lock, then copies
+// it to the mapped segment. The files are flushed to the disk by the Journals
+// thread. It also prepares the next segment and names or removes the previous
+// ones (maintain()), so that rolling to a new segment only swaps pointers: an
+// append waits for it if it is not ready.
+class Journal
+{
+public:
+    // Opens the segments of the directory, which is created if needed.
+    // request_maintenance is called when an append waits for maintain().
+    // Throws boost::system::system_error.
+    Journal(std::string prefix,
+            std::string directory,
+            const JournalConfiguration& conf,
+            std::function<void()> request_maintenance);
+    ~Journal();
+
+    const std::string& prefix() const noexcept
+    {
+        return route_prefix;
+    }
+
+    // Returns the offset of the message, 0 if it could not be journaled.
+    uint64_t append(boost::string_view route,
+                    const uint8_t* payload,
+                    size_t size);
+
+    // Offset following the last message which can be read.
+    uint64_t end() const;
+    // Offset of the first message still in the journal.
+    uint64_t begin() const;
+    // Offset of the first message appended at or after timestamp
+    // (milliseconds since the epoch), end() if there is none.
+    uint64_t offset_at(uint64_t timestamp) const;
+
+    // Calls cb(const Record&) on the messages from offset on, until about
+    // max_bytes were read or the end is reached. The record is only valid
+    // during the call. Returns the offset following the last message read.
+    template <typename CB>
+    uint64_t read(uint64_t offset, size_t max_bytes, CB&& cb) const
+    {
+        size_t bytes = 0;
+        while (bytes < max_bytes)
+        {
+            std::shared_ptr<Segment> segment;
+            size_t position;
+            size_t size;
+            uint64_t segment_end;
+            {
+                std::lock_guard<std::mutex> l(mutex);
+                segment = find(offset);
+                if (!segment)
+                {
+                    return std::max(offset, committed_end());
+                }
+
+                offset = std::max(offset, segment->base_offset());
+                position = segment->seek(offset);
+                size = segment->size();
+                segment_end = segment->next_offset();
+            }
+
+            segment->scan(position, size, [&](const Record& record) {
+                if (record.offset < offset)
+                {
+                    return true;
+                }
+
+                cb(record);
+                offset = record.offset + 1;
+                bytes += record.size;
+                return bytes < max_bytes;
+            });
+
+            if (bytes < max_bytes)
+            {
+                // The segment was read up to its end.
+                offset = std::max(offset, segment_end);
+            }
+        }
+
+        return offset;
+    }
+
+    // Runs f with the journal locked if nothing was appended from offset on,
+    // even if it cannot be read yet: the messages appended afterwards are not
+    // appended before f returns.
+    template <typename F>
+    bool if_at_end(uint64_t offset, F&& f)
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        if (offset < next_offset)
+        {
+            return false;
+        }
+
+        f();
+        return true;
+    }
+
+    // Flushes what was appended to the disk, from a single thread.
+    void sync();
+
+    // A segment was taken since the last call to maintain().
+    bool needs_maintenance() const noexcept
+    {
+        return maintenance.load(std::memory_order_relaxed);
+    }
+    // Renames the segments taken since the last call, removes the ones
+    // beyond max_segments and prepares the next one, from the thread calling
+    // sync().
+    void maintain();
+
+private:
+    // A message appended and not committed yet.
+    struct Pending
+    {
+        std::shared_ptr<Segment> segment;
+        size_t position;
+        uint64_t timestamp;
+        bool written;
+    };
+
+    // Segment holding offset or the first one after it, must be called with
+    // the lock held.
+    std::shared_ptr<Segment> find(uint64_t offset) const;
+    // Must be called with the lock held.
+    void roll();
+    // Waits for maintain() to prepare the spare segment or for another append
+    // to roll, returns false if maintain() failed.
+    bool wait_for_spare(std::unique_lock<std::mutex>& l);
+    // Offset of the first message not committed, must be called with the
+    // lock held.
+    uint64_t committed_end() const noexcept
+    {
+        return next_offset - pending.size();
+    }
+    // A spare segment taken before a crash keeps its records, under the name
+    // of its base offset.
+    void recover_spare();
+
+    const std::string route_prefix;
+    const std::string directory;
+    const JournalConfiguration& conf;
+    const std::function<void()> request_maintenance;
+
+    mutable std::mutex mutex;
+    // Oldest first.
+    std::vector<std::shared_ptr<Segment>> segments;
+    uint64_t next_offset = 1;
+    uint64_t last_timestamp = 0;
+    // Offsets [committed_end(), next_offset), committed in order once written.
+    std::deque<Pending> pending;
+    // A segment was created or removed since the last sync.
+    bool directory_changed = false;
+
+    // Next segment, taken by roll().
+    std::shared_ptr<Segment> spare;
+    std::condition_variable spare_ready;
+    // The last call to maintain() failed, see wait_for_spare().
+    bool maintenance_failed = false;
+    // Taken and not renamed yet.
+    std::vector<std::shared_ptr<Segment>> unnamed;
+    // Beyond max_segments, their files are not removed yet.
+    std::vector<std::shared_ptr<Segment>> retired;
+    std::atomic_bool maintenance{false};
+};
+
+// The journals of a service, and the thread flushing them.
+class Journals
+{
+public:
+    // Throws boost::system::system_error if a journal cannot be opened.
+    explicit Journals(const JournalConfiguration& conf);
+    ~Journals();
+
+    // Journals the message if its route is journaled and records its
+    // position in the message.
+    void append(boost::string_view route,
+                handlers::SharedBufferWithSpecificMetadata& msg)
+    {
+        auto index = journal_of(route);
+        if (index < 0)
+        {
+            return;
+        }
+
+        auto& journal = *journals[index];
+        auto offset =
+            journal.append(route, msg.payload_data(), msg.payload_size());
+        if (BOOST_LIKELY(offset != 0))
+        {
+            msg.set_journal_position(index, offset);
+            if (conf.fsync == FsyncPolicy::eager)
+            {
+                notify();
+            }
+        }
+
+        if (BOOST_UNLIKELY(journal.needs_maintenance()))
+        {
+            notify_maintenance();
+        }
+    }
+
+    // Index of the journal of a route, -1 if it is not journaled.
+    int journal_of(boost::string_view route) const;
+    // Index of the journal holding every route a subscription matches, -1 if
+    // there is none.
+    int journal_of_subscription(boost::string_view route, bool pattern) const;
+
+    Journal& operator[](size_t index)
+    {
+        return *journals[index];
+    }
+
+private:
+    void notify();
+    void notify_maintenance();
+    void run();
+
+    const JournalConfiguration& conf;
+    // Longest prefix first.
+    std::vector<std::unique_ptr<Journal>> journals;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic_bool pending{false};
+    // A journal needs maintenance.
+    std::atomic_bool maintenance{false};
+    bool stopping = false;
+    // Flushes the journals (unless FsyncPolicy::never) and maintains them.
+    std::thread flusher;
+};
+
+} // namespace journal
+} // namespace blabla
@@ -0,0 +1,355 @@
+#include "Segment.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/crc.hpp>
+#include <boost/system/system_error.hpp>
+
+namespace blabla
+{
+namespace journal
+{
+
+namespace
+{
+constexpr size_t ALIGNMENT = 8;
+// Fields of the header covered by the checksum.
+constexpr size_t CHECKSUM_START = offsetof(RecordHeader, offset);
+
+[[noreturn]] void throw_errno(const std::string& what)
+{
+    throw boost::system::system_error(errno, boost::system::system_category(),
+                                      what);
+}
+
+uint32_t checksum(const uint8_t* record, size_t route_size, size_t payload_size)
+{
+    boost::crc_32_type crc;
+    crc.process_block(record + CHECKSUM_START,
+                      record + sizeof(RecordHeader) + route_size +
+                          payload_size);
+    return crc.checksum();
+}
+
+uint8_t* map(int fd, size_t size, const std::string& path)
+{
+    auto memory =
+        ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED)
+    {
+        auto error = errno;
+        ::close(fd);
+        errno = error;
+        throw_errno("mmap " + path);
+    }
+    return static_cast<uint8_t*>(memory);
+}
+} // namespace
+
+constexpr const char* Segment::SPARE_NAME;
+
+Segment::Segment(std::string path,
+                 int fd,
+                 uint8_t* data,
+                 size_t capacity,
+                 uint64_t base_offset,
+                 size_t index_interval)
+: path(std::move(path))
+, fd(fd)
+, data(data)
+, capacity(capacity)
+, base(base_offset)
+, index_interval(std::max<size_t>(index_interval, 1))
+, next(base_offset)
+{
+}
+
+Segment::~Segment()
+{
+    ::munmap(data, capacity);
+    ::close(fd);
+}
+
+std::string Segment::file_name(uint64_t base_offset)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%020" PRIu64 ".log", base_offset);
+    return name;
+}
+
+size_t Segment::record_size(size_t route_size, size_t payload_size)
+{
+    const auto size = sizeof(RecordHeader) + route_size + payload_size;
+    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+uint64_t Segment::first_offset(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    RecordHeader header;
+    const auto read = ::pread(fd, &header, sizeof(header), 0);
+    ::close(fd);
+    return read == ssize_t(sizeof(header)) && header.size != 0 ? header.offset
+                                                                : 0;
+}
+
+std::shared_ptr<Segment> Segment::create(const std::string& directory,
+                                         uint64_t base_offset,
+                                         size_t capacity,
+                                         size_t index_interval)
+{
+    return create_file(directory + "/" + file_name(base_offset), base_offset,
+                       capacity, index_interval);
+}
+
+std::shared_ptr<Segment> Segment::create_spare(const std::string& directory,
+                                               size_t capacity,
+                                               size_t index_interval)
+{
+    return create_file(directory + "/" + SPARE_NAME, 0, capacity,
+                       index_interval);
+}
+
+std::shared_ptr<Segment> Segment::create_file(std::string path,
+                                              uint64_t base_offset,
+                                              size_t capacity,
+                                              size_t index_interval)
+{
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw_errno("open " + path);
+    }
+
+    // Allocated now so that a full disk is not discovered through a SIGBUS.
+    int error = ::posix_fallocate(fd, 0, capacity);
+    if (error != 0)
+    {
+        ::close(fd);
+        ::unlink(path.c_str());
+        errno = error;
+        throw_errno("fallocate " + path);
+    }
+
+    auto data = map(fd, capacity, path);
+    return std::shared_ptr<Segment>(
+        new Segment(std::move(path), fd, data, capacity, base_offset,
+                    index_interval));
+}
+
+std::shared_ptr<Segment> Segment::open(const std::string& path,
+                                       uint64_t base_offset,
+                                       size_t index_interval)
+{
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw_errno("open " + path);
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < ssize_t(sizeof(RecordHeader)))
+    {
+        ::close(fd);
+        throw boost::system::system_error(
+            boost::system::errc::make_error_code(
+                boost::system::errc::invalid_argument),
+            "Invalid segment " + path);
+    }
+
+    const size_t capacity = st.st_size;
+    auto data = map(fd, capacity, path);
+    std::shared_ptr<Segment> segment(
+        new Segment(path, fd, data, capacity, base_offset, index_interval));
+
+    size_t position = 0;
+    while (segment->valid(position, segment->next))
+    {
+        auto record = segment->at(position);
+        segment->add_to_index(record.offset, record.timestamp, position);
+        segment->latest = record.timestamp;
+        segment->next = record.offset + 1;
+        position += record.size;
+    }
+
+    segment->written = position;
+    segment->reserved = position;
+    segment->synced = position;
+    if (position + sizeof(uint32_t) <= capacity)
+    {
+        uint32_t size;
+        std::memcpy(&size, data + position, sizeof(size));
+        if (size != 0)
+        {
+            // A torn write: what follows must not be mistaken for records
+            // once new ones are appended.
+            std::memset(data + position, 0, capacity - position);
+        }
+    }
+
+    return segment;
+}
+
+bool Segment::valid(size_t position, uint64_t offset) const
+{
+    if (position + sizeof(RecordHeader) > capacity)
+    {
+        return false;
+    }
+
+    RecordHeader header;
+    std::memcpy(&header, data + position, sizeof(header));
+    return header.size != 0 && header.size % ALIGNMENT == 0 &&
+           header.size <= capacity - position && header.offset == offset &&
+           record_size(header.route_size, header.payload_size) == header.size &&
+           checksum(data + position, header.route_size, header.payload_size) ==
+               header.checksum;
+}
+
+Record Segment::at(size_t position) const
+{
+    const auto header = reinterpret_cast<const RecordHeader*>(data + position);
+    const auto route = reinterpret_cast<const char*>(header + 1);
+
+    Record record;
+    record.offset = header->offset;
+    record.timestamp = header->timestamp;
+    record.route = boost::string_view(route, header->route_size);
+    record.payload =
+        reinterpret_cast<const uint8_t*>(route + header->route_size);
+    record.payload_size = header->payload_size;
+    record.size = header->size;
+    return record;
+}
+
+bool Segment::reserve(size_t size, size_t& position)
+{
+    if (size > capacity - reserved)
+    {
+        return false;
+    }
+
+    position = reserved;
+    reserved += size;
+    return true;
+}
+
+void Segment::write(size_t position,
+                    uint64_t offset,
+                    uint64_t timestamp,
+                    boost::string_view route,
+                    const uint8_t* payload,
+                    size_t payload_size)
+{
+    auto out = data + position;
+    RecordHeader header;
+    header.size =
+        static_cast<uint32_t>(record_size(route.size(), payload_size));
+    header.offset = offset;
+    header.timestamp = timestamp;
+    header.payload_size = static_cast<uint32_t>(payload_size);
+    header.route_size = static_cast<uint16_t>(route.size());
+    header.reserved = 0;
+
+    std::memcpy(out + sizeof(header), route.data(), route.size());
+    std::memcpy(out + sizeof(header) + route.size(), payload, payload_size);
+    std::memcpy(out, &header, sizeof(header));
+    header.checksum = checksum(out, route.size(), payload_size);
+    std::memcpy(out + offsetof(RecordHeader, checksum), &header.checksum,
+                sizeof(header.checksum));
+}
+
+void Segment::commit(size_t position, uint64_t offset, uint64_t timestamp)
+{
+    assert(position == written);
+    RecordHeader header;
+    std::memcpy(&header, data + position, sizeof(header));
+
+    add_to_index(offset, timestamp, position);
+    written += header.size;
+    next = offset + 1;
+    latest = timestamp;
+}
+
+void Segment::add_to_index(uint64_t offset, uint64_t timestamp, size_t position)
+{
+    if (index.empty() || position - index.back().position >= index_interval)
+    {
+        index.push_back({offset, timestamp, position});
+    }
+}
+
+size_t Segment::seek(uint64_t offset) const
+{
+    auto it = std::upper_bound(index.begin(), index.end(), offset,
+                               [](uint64_t offset, const IndexEntry& entry) {
+                                   return offset < entry.offset;
+                               });
+    return it == index.begin() ? 0 : std::prev(it)->position;
+}
+
+size_t Segment::seek_time(uint64_t timestamp) const
+{
+    // The timestamps of a journal never decrease. The last entry before it
+    // may be followed by records of this timestamp.
+    auto it = std::lower_bound(index.begin(), index.end(), timestamp,
+                               [](const IndexEntry& entry, uint64_t timestamp) {
+                                   return entry.timestamp < timestamp;
+                               });
+    return it == index.begin() ? 0 : std::prev(it)->position;
+}
+
+void Segment::sync(size_t end)
+{
+    if (end <= synced)
+    {
+        return;
+    }
+
+    const size_t page = ::sysconf(_SC_PAGESIZE);
+    const size_t first = synced & ~(page - 1);
+    if (::msync(data + first, end - first, MS_SYNC) != 0)
+    {
+        throw_errno("msync " + path);
+    }
+    synced = end;
+}
+
+void Segment::remove()
+{
+    ::unlink(path.c_str());
+}
+
+void Segment::rebase(uint64_t base_offset)
+{
+    assert(empty());
+    base = base_offset;
+    next = base_offset;
+}
+
+void Segment::rename(std::string new_path)
+{
+    if (::rename(path.c_str(), new_path.c_str()) != 0)
+    {
+        throw_errno("rename " + path);
+    }
+    path = std::move(new_path);
+}
+
+} // namespace journal
+} // namespace blabla
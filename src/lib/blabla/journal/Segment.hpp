@@ -0,0 +1,207 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/utility/string_view.hpp>
+
+namespace blabla
+{
+namespace journal
+{
+
+// A record of a segment, followed by the route and the payload. Records are 8
+// bytes aligned and the file is zeroed after the last one.
+struct RecordHeader
+{
+    // Of the whole record, padding included.
+    uint32_t size;
+    // CRC32 of everything following this field, up to the end of the payload.
+    uint32_t checksum;
+    uint64_t offset;
+    // Nanoseconds since the epoch.
+    uint64_t timestamp;
+    uint32_t payload_size;
+    uint16_t route_size;
+    uint16_t reserved;
+};
+
+static_assert(sizeof(RecordHeader) == 32, "Unexpected record header layout");
+
+// A record of a mapped segment.
+struct Record
+{
+    uint64_t offset;
+    uint64_t timestamp;
+    boost::string_view route;
+    const uint8_t* payload;
+    size_t payload_size;
+    // Bytes taken by the record in the segment.
+    size_t size;
+};
+
+// Preallocated file of a journal, mapped in memory and named after the offset
+// of its first record.
+//
+// A record is appended in three steps: its room is reserved and it is then
+// committed under the lock of the journal, which also protects the index and
+// the positions, and it is written in between without the lock. The records
+// are committed in the order of their positions. The bytes before size() are
+// never modified again: they can be read without the lock once size() was
+// read under it.
+class Segment
+{
+public:
+    struct IndexEntry
+    {
+        uint64_t offset;
+        uint64_t timestamp;
+        size_t position;
+    };
+
+    // Name of the segment file prepared before it is needed, it is renamed
+    // after its base offset once it was taken.
+    static constexpr const char* SPARE_NAME = "spare.log";
+
+    // Throw boost::system::system_error.
+    static std::shared_ptr<Segment> create(const std::string& directory,
+                                           uint64_t base_offset,
+                                           size_t capacity,
+                                           size_t index_interval);
+    // A segment of the directory named SPARE_NAME, see rebase().
+    static std::shared_ptr<Segment> create_spare(const std::string& directory,
+                                                 size_t capacity,
+                                                 size_t index_interval);
+    // Maps an existing segment and rebuilds its index. It ends at the first
+    // invalid record, which is erased with what follows.
+    static std::shared_ptr<Segment> open(const std::string& path,
+                                         uint64_t base_offset,
+                                         size_t index_interval);
+    ~Segment();
+
+    Segment(const Segment&) = delete;
+    Segment& operator=(const Segment&) = delete;
+
+    static std::string file_name(uint64_t base_offset);
+    // Offset of the first record of a segment file, 0 if it has none or
+    // cannot be read. The record is not checked.
+    static uint64_t first_offset(const std::string& path);
+    // Size of a record in a segment.
+    static size_t record_size(size_t route_size, size_t payload_size);
+
+    // Sets the position of a record of this size (record_size()), returns
+    // false if it does not fit.
+    bool reserve(size_t size, size_t& position);
+    // Writes a record at a reserved position, see commit().
+    void write(size_t position,
+               uint64_t offset,
+               uint64_t timestamp,
+               boost::string_view route,
+               const uint8_t* payload,
+               size_t payload_size);
+    // Makes the record written at position visible, the previous ones must
+    // have been committed.
+    void commit(size_t position, uint64_t offset, uint64_t timestamp);
+
+    // Position of the first record at or after offset (timestamp), or of a
+    // record before it: the index is sparse.
+    size_t seek(uint64_t offset) const;
+    size_t seek_time(uint64_t timestamp) const;
+
+    // Calls cb(const Record&) on the records in [position, end) until it
+    // returns false.
+    template <typename CB>
+    void scan(size_t position, size_t end, CB&& cb) const
+    {
+        while (position < end)
+        {
+            auto record = at(position);
+            if (!cb(record))
+            {
+                return;
+            }
+            position += record.size;
+        }
+    }
+
+    // Flushes [synced, end) to the disk, from a single thread.
+    void sync(size_t end);
+    // The file goes away with the last reference to the segment.
+    void remove();
+
+    // Sets the offset of the first record of an empty segment. Its file is
+    // renamed accordingly afterwards (rename()), from the thread calling
+    // sync() and remove().
+    void rebase(uint64_t base_offset);
+    // Throws boost::system::system_error.
+    void rename(std::string new_path);
+
+    uint64_t base_offset() const noexcept
+    {
+        return base;
+    }
+
+    // Offset following the last record.
+    uint64_t next_offset() const noexcept
+    {
+        return next;
+    }
+
+    uint64_t last_timestamp() const noexcept
+    {
+        return latest;
+    }
+
+    size_t size() const noexcept
+    {
+        return written;
+    }
+
+    size_t synced_size() const noexcept
+    {
+        return synced;
+    }
+
+    bool empty() const noexcept
+    {
+        return written == 0;
+    }
+
+private:
+    Segment(std::string path,
+            int fd,
+            uint8_t* data,
+            size_t capacity,
+            uint64_t base_offset,
+            size_t index_interval);
+
+    static std::shared_ptr<Segment> create_file(std::string path,
+                                                uint64_t base_offset,
+                                                size_t capacity,
+                                                size_t index_interval);
+
+    Record at(size_t position) const;
+    // Whether a valid record of this offset is at position.
+    bool valid(size_t position, uint64_t offset) const;
+    void add_to_index(uint64_t offset, uint64_t timestamp, size_t position);
+
+    std::string path;
+    const int fd;
+    uint8_t* const data;
+    const size_t capacity;
+    uint64_t base;
+    const size_t index_interval;
+
+    // Up to the last committed record, and to the last reserved one.
+    size_t written = 0;
+    size_t reserved = 0;
+    uint64_t next;
+    uint64_t latest = 0;
+    std::vector<IndexEntry> index;
+    size_t synced = 0;
+};
+
+} // namespace journal
+} // namespace blabla
@@ -0,0 +1,684 @@
+#include "Channel.hpp"
+
+#include <cassert>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/asio/post.hpp>
+#include <boost/system/system_error.hpp>
+
+namespace blabla
+{
+namespace shm
+{
+
+namespace
+{
+constexpr uint32_t VERSION = 1;
+constexpr size_t HEADERS_SIZE = 4096;
+
+static_assert(2 * sizeof(RingHeader) <= HEADERS_SIZE, "Ring headers too big");
+
+[[noreturn]] void throw_errno(const char* what)
+{
+    throw boost::system::system_error(errno, boost::system::system_category(), what);
+}
+
+// Closes the descriptor unless released.
+struct FileDescriptor
+{
+    explicit FileDescriptor(int fd = -1)
+    : fd(fd)
+    {
+    }
+
+    ~FileDescriptor()
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+    }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int release()
+    {
+        auto result = fd;
+        fd = -1;
+        return result;
+    }
+
+    int fd;
+};
+
+struct Mapping
+{
+    Mapping(int fd, size_t size)
+    : size(size)
+    {
+        memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (memory == MAP_FAILED)
+        {
+            throw_errno("mmap");
+        }
+    }
+
+    ~Mapping()
+    {
+        if (memory)
+        {
+            ::munmap(memory, size);
+        }
+    }
+
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+
+    void* release()
+    {
+        auto result = memory;
+        memory = nullptr;
+        return result;
+    }
+
+    void* memory;
+    size_t size;
+};
+
+bool is_power_of_2(uint64_t value)
+{
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+pid_t peer_pid_of(int fd)
+{
+    ucred credentials{};
+    socklen_t size = sizeof(credentials);
+    if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0)
+    {
+        return 0;
+    }
+    return credentials.pid;
+}
+
+void drain_eventfd(int fd)
+{
+    eventfd_t value;
+    ::eventfd_read(fd, &value);
+}
+} // namespace
+
+ssize_t Ring::write(const uint8_t* buffer, size_t size)
+{
+    const auto tail = header->tail.load(std::memory_order_acquire);
+    const auto used = position - tail;
+    if (used > capacity)
+    {
+        return -1;
+    }
+
+    const auto n = std::min<uint64_t>(size, capacity - used);
+    const auto offset = position & (capacity - 1);
+    const auto first = std::min<uint64_t>(n, capacity - offset);
+    std::memcpy(data + offset, buffer, first);
+    std::memcpy(data, buffer + first, n - first);
+
+    position += n;
+    header->head.store(position, std::memory_order_release);
+    return n;
+}
+
+ssize_t Ring::read(uint8_t* buffer, size_t size)
+{
+    const auto head = header->head.load(std::memory_order_acquire);
+    const auto available = head - position;
+    if (available > capacity)
+    {
+        return -1;
+    }
+
+    const auto n = std::min<uint64_t>(size, available);
+    const auto offset = position & (capacity - 1);
+    const auto first = std::min<uint64_t>(n, capacity - offset);
+    std::memcpy(buffer, data + offset, first);
+    std::memcpy(buffer + first, data, n - first);
+
+    position += n;
+    header->tail.store(position, std::memory_order_release);
+    return n;
+}
+
+bool Ring::writable() const
+{
+    return position - header->tail.load(std::memory_order_acquire) != capacity;
+}
+
+bool Ring::readable() const
+{
+    return header->head.load(std::memory_order_acquire) != position;
+}
+
+size_t Channel::memory_size(uint64_t capacity)
+{
+    return HEADERS_SIZE + 2 * capacity;
+}
+
+Channel::Channel(boost::asio::io_context& ctx,
+                 Side side,
+                 Descriptors fds,
+                 void* memory,
+                 size_t memory_size,
+                 uint64_t capacity)
+: ctx(ctx)
+, memory(memory)
+, mapped(memory_size)
+, peer(peer_pid_of(fds.control))
+, control(ctx, fds.control)
+, wake(ctx, fds.wake)
+, notify(fds.notify)
+{
+    auto headers = static_cast<RingHeader*>(memory);
+    auto data = static_cast<uint8_t*>(memory) + HEADERS_SIZE;
+
+    // The first ring carries the client messages, the second one the server
+    // messages.
+    Ring to_server(&headers[0], data, capacity);
+    Ring to_client(&headers[1], data + capacity, capacity);
+    input = side == Side::server ? to_server : to_client;
+    output = side == Side::server ? to_client : to_server;
+}
+
+Channel::~Channel()
+{
+    ::close(notify);
+    ::munmap(memory, mapped);
+}
+
+std::shared_ptr<Channel>
+Channel::accept(boost::asio::io_context& ctx, int control_fd, uint64_t capacity)
+{
+    FileDescriptor control(control_fd);
+    if (!is_power_of_2(capacity))
+    {
+        throw boost::system::system_error(
+            make_error_code(boost::system::errc::invalid_argument),
+            "ring capacity must be a power of 2");
+    }
+
+    FileDescriptor memory(
+        ::memfd_create("blabla-local", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    if (memory.fd < 0)
+    {
+        throw_errno("memfd_create");
+    }
+
+    const auto size = memory_size(capacity);
+    if (::ftruncate(memory.fd, size) != 0)
+    {
+        throw_errno("ftruncate");
+    }
+
+    // The client holds the file too: resized, our next access to the rings
+    // would take a SIGBUS.
+    if (::fcntl(memory.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+    {
+        throw_errno("fcntl(F_ADD_SEALS)");
+    }
+
+    // The file is zero filled: the headers start empty.
+    Mapping mapping(memory.fd, size);
+
+    FileDescriptor server_wake(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    FileDescriptor client_wake(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    if (server_wake.fd < 0 || client_wake.fd < 0)
+    {
+        throw_errno("eventfd");
+    }
+
+    Handshake handshake{Handshake::MAGIC, VERSION, capacity};
+    iovec iov{&handshake, sizeof(handshake)};
+
+    // memory, wake of the client, notify of the client.
+    const int fds[] = {memory.fd, client_wake.fd, server_wake.fd};
+    alignas(cmsghdr) char control_buffer[CMSG_SPACE(sizeof(fds))] = {};
+
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control_buffer;
+    msg.msg_controllen = sizeof(control_buffer);
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (::sendmsg(control.fd, &msg, MSG_NOSIGNAL) != ssize_t(sizeof(handshake)))
+    {
+        throw_errno("sendmsg");
+    }
+
+    auto channel = std::make_shared<Channel>(
+        ctx, Side::server,
+        Descriptors{control.release(), server_wake.release(), client_wake.release()},
+        mapping.release(), size, capacity);
+    channel->wait_control();
+    return channel;
+}
+
+std::shared_ptr<Channel> Channel::connect(boost::asio::io_context& ctx,
+                                          const std::string& path)
+{
+    FileDescriptor control(::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0));
+    if (control.fd < 0)
+    {
+        throw_errno("socket");
+    }
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        throw boost::system::system_error(
+            make_error_code(boost::system::errc::filename_too_long), path);
+    }
+    std::memcpy(address.sun_path, path.data(), path.size());
+
+    if (::connect(control.fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        throw_errno("connect");
+    }
+
+    Handshake handshake{};
+    iovec iov{&handshake, sizeof(handshake)};
+    int fds[3];
+    alignas(cmsghdr) char control_buffer[CMSG_SPACE(sizeof(fds))] = {};
+
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control_buffer;
+    msg.msg_controllen = sizeof(control_buffer);
+
+    const auto received = ::recvmsg(control.fd, &msg, MSG_CMSG_CLOEXEC);
+    if (received < 0)
+    {
+        throw_errno("recvmsg");
+    }
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    if (received != sizeof(handshake) || !cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    {
+        throw boost::system::system_error(
+            make_error_code(boost::system::errc::protocol_error),
+            "invalid handshake");
+    }
+
+    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    FileDescriptor memory(fds[0]);
+    FileDescriptor wake(fds[1]);
+    FileDescriptor notify(fds[2]);
+
+    struct stat st;
+    if (handshake.magic != Handshake::MAGIC || handshake.version != VERSION ||
+        !is_power_of_2(handshake.capacity) || ::fstat(memory.fd, &st) != 0 ||
+        size_t(st.st_size) < memory_size(handshake.capacity))
+    {
+        throw boost::system::system_error(
+            make_error_code(boost::system::errc::protocol_error),
+            "invalid handshake");
+    }
+
+    const auto size = memory_size(handshake.capacity);
+    Mapping mapping(memory.fd, size);
+
+    auto channel = std::make_shared<Channel>(
+        ctx, Side::client,
+        Descriptors{control.release(), wake.release(), notify.release()},
+        mapping.release(), size, handshake.capacity);
+    channel->wait_control();
+    return channel;
+}
+
+void Channel::start(std::unique_ptr<ReadOperation> op)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    assert(!pending_read);
+    pending_read = std::move(op);
+
+    boost::system::error_code ec = error;
+    if (ec || perform(*pending_read, ec))
+    {
+        return complete_read(ec);
+    }
+    wait_wake();
+}
+
+void Channel::start(std::unique_ptr<WriteOperation> op)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    assert(!pending_write);
+    pending_write = std::move(op);
+
+    boost::system::error_code ec = error;
+    if (ec || perform(*pending_write, ec))
+    {
+        return complete_write(ec);
+    }
+    wait_wake();
+}
+
+bool Channel::perform(ReadOperation& op, boost::system::error_code& ec)
+{
+    auto& waiting = input.header->reader_waiting;
+    waiting.store(0, std::memory_order_relaxed);
+
+    while (true)
+    {
+        auto n = input.read(static_cast<uint8_t*>(op.buffer.data()) + op.transferred,
+                            op.buffer.size() - op.transferred);
+        if (n < 0)
+        {
+            ec = make_error_code(boost::system::errc::bad_message);
+            return true;
+        }
+
+        if (n > 0)
+        {
+            op.transferred += n;
+            // Pairs with the fence of the writer going to sleep.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (input.header->writer_waiting.load(std::memory_order_relaxed))
+            {
+                notify_peer();
+            }
+        }
+
+        if (op.transferred >= op.at_least)
+        {
+            return true;
+        }
+
+        waiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!input.readable())
+        {
+            return false;
+        }
+        waiting.store(0, std::memory_order_relaxed);
+    }
+}
+
+bool Channel::perform(WriteOperation& op, boost::system::error_code& ec)
+{
+    auto& waiting = output.header->writer_waiting;
+    waiting.store(0, std::memory_order_relaxed);
+
+    while (true)
+    {
+        bool written = false;
+        while (op.first != op.buffers.size())
+        {
+            auto& buffer = op.buffers[op.first];
+            auto n = output.write(static_cast<const uint8_t*>(buffer.data()),
+                                  buffer.size());
+            if (n < 0)
+            {
+                ec = make_error_code(boost::system::errc::bad_message);
+                return true;
+            }
+
+            written |= n != 0;
+            buffer += n;
+            if (buffer.size() != 0)
+            {
+                break;
+            }
+            ++op.first;
+        }
+
+        if (written)
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (output.header->reader_waiting.load(std::memory_order_relaxed))
+            {
+                notify_peer();
+            }
+        }
+
+        if (op.first == op.buffers.size())
+        {
+            return true;
+        }
+
+        waiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!output.writable())
+        {
+            return false;
+        }
+        waiting.store(0, std::memory_order_relaxed);
+    }
+}
+
+void Channel::complete_read(boost::system::error_code ec)
+{
+    boost::asio::post(ctx, [op = std::move(pending_read), ec] {
+        op->complete(ec, op->transferred);
+    });
+}
+
+void Channel::complete_write(boost::system::error_code ec)
+{
+    boost::asio::post(ctx, [op = std::move(pending_write), ec] { op->complete(ec); });
+}
+
+void Channel::wait_wake()
+{
+    if (wake_armed)
+    {
+        return;
+    }
+
+    wake_armed = true;
+    wake.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                    [self = shared_from_this()](boost::system::error_code ec) {
+                        self->on_wake(ec);
+                    });
+}
+
+void Channel::on_wake(boost::system::error_code ec)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    wake_armed = false;
+    if (ec || error)
+    {
+        return;
+    }
+
+    drain_eventfd(wake.native_handle());
+    if (pending_read && perform(*pending_read, ec))
+    {
+        complete_read(ec);
+    }
+
+    ec.clear();
+    if (pending_write && perform(*pending_write, ec))
+    {
+        complete_write(ec);
+    }
+
+    if (pending_read || pending_write)
+    {
+        wait_wake();
+    }
+}
+
+void Channel::wait_control()
+{
+    control.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                       [self = shared_from_this()](boost::system::error_code ec) {
+                           self->on_control(ec);
+                       });
+}
+
+void Channel::on_control(boost::system::error_code ec)
+{
+    if (ec)
+    {
+        return;
+    }
+
+    // Nothing is expected on the control socket but its end.
+    char byte;
+    auto n = ::recv(control.native_handle(), &byte, sizeof(byte), MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+    {
+        fail(boost::asio::error::eof);
+        return;
+    }
+
+    wait_control();
+}
+
+void Channel::fail(boost::system::error_code ec)
+{
+    std::lock_guard<std::mutex> l(mutex);
+    if (error)
+    {
+        return;
+    }
+
+    error = ec;
+    if (pending_read)
+    {
+        complete_read(ec);
+    }
+    if (pending_write)
+    {
+        complete_write(ec);
+    }
+
+    boost::system::error_code ignored;
+    wake.cancel(ignored);
+    control.cancel(ignored);
+}
+
+void Channel::close()
+{
+    fail(boost::asio::error::operation_aborted);
+    ::shutdown(control.native_handle(), SHUT_RDWR);
+}
+
+void Channel::notify_peer()
+{
+    ::eventfd_write(notify, 1);
+}
+
+void Channel::block(boost::system::error_code& ec)
+{
+    pollfd fds[] = {
+        {wake.native_handle(), POLLIN, 0},
+        {control.native_handle(), POLLIN, 0},
+    };
+
+    while (::poll(fds, 2, -1) < 0)
+    {
+        if (errno != EINTR)
+        {
+            ec.assign(errno, boost::system::system_category());
+            return;
+        }
+    }
+
+    if (fds[1].revents)
+    {
+        char byte;
+        auto n = ::recv(control.native_handle(), &byte, sizeof(byte), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        {
+            ec = boost::asio::error::eof;
+            return;
+        }
+    }
+
+    if (fds[0].revents)
+    {
+        drain_eventfd(wake.native_handle());
+    }
+}
+
+size_t Channel::read_some(boost::asio::mutable_buffer buffer,
+                          boost::system::error_code& ec)
+{
+    ReadImpl<void (*)(boost::system::error_code, size_t)> op(nullptr);
+    op.buffer = buffer;
+    op.at_least = 1;
+
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            if (error)
+            {
+                ec = error;
+                return 0;
+            }
+
+            if (perform(op, ec))
+            {
+                return op.transferred;
+            }
+        }
+
+        block(ec);
+        if (ec)
+        {
+            return 0;
+        }
+    }
+}
+
+void Channel::write(boost::asio::const_buffer buffer, boost::system::error_code& ec)
+{
+    WriteImpl<void (*)(boost::system::error_code)> op(nullptr);
+    op.buffers.emplace_back(buffer);
+
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            if (error)
+            {
+                ec = error;
+                return;
+            }
+
+            if (perform(op, ec))
+            {
+                return;
+            }
+        }
+
+        block(ec);
+        if (ec)
+        {
+            return;
+        }
+    }
+}
+
+} // namespace shm
+} // namespace blabla
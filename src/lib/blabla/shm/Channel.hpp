@@ -0,0 +1,271 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace blabla
+{
+namespace shm
+{
+
+// Local transport between the server and a client of the same host: a byte
+// stream in each direction, carried by single producer single consumer rings
+// in a shared memory file (memfd). Frames are the same as on TCP.
+//
+// A side only makes a system call to wake its peer up, through the eventfd of
+// the peer, when the peer waits for data or for room in a ring.
+//
+// The channel is set up over an AF_UNIX SOCK_SEQPACKET socket: the server
+// sends the memory and eventfds on accept (SCM_RIGHTS). The socket is then
+// kept to detect when the peer goes away.
+
+// Shared by both processes, at the beginning of the memory.
+struct RingHeader
+{
+    // Bytes ever written, only modified by the writer.
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint32_t> writer_waiting;
+
+    // Bytes ever read, only modified by the reader.
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> reader_waiting;
+};
+
+// Sent with the file descriptors on accept.
+struct Handshake
+{
+    static constexpr uint32_t MAGIC = 0x626c6131; // "bla1"
+
+    uint32_t magic;
+    uint32_t version;
+    // Bytes of each ring, a power of 2.
+    uint64_t capacity;
+};
+
+// View of a ring from one side. The counter of the other side is read from
+// the shared memory, ours is kept locally: the peer can only make us fail.
+class Ring
+{
+public:
+    Ring() = default;
+    Ring(RingHeader* header, uint8_t* data, uint64_t capacity)
+    : header(header)
+    , data(data)
+    , capacity(capacity)
+    {
+    }
+
+    // Copy as much as possible, return the number of bytes copied or -1 if
+    // the peer corrupted the ring.
+    ssize_t write(const uint8_t* buffer, size_t size);
+    ssize_t read(uint8_t* buffer, size_t size);
+
+    // Whether a write (read) would copy something, or fail.
+    bool writable() const;
+    bool readable() const;
+
+    RingHeader* header = nullptr;
+    uint8_t* data = nullptr;
+    uint64_t capacity = 0;
+    // Our head when writing, our tail when reading.
+    uint64_t position = 0;
+};
+
+class Channel : public std::enable_shared_from_this<Channel>
+{
+public:
+    enum class Side
+    {
+        server,
+        client,
+    };
+
+    struct Descriptors
+    {
+        // The SOCK_SEQPACKET connection.
+        int control;
+        // Written by the peer to wake us up.
+        int wake;
+        // Written to wake the peer up.
+        int notify;
+    };
+
+    // Takes the descriptors, the memory is mapped by the caller.
+    Channel(boost::asio::io_context& ctx,
+            Side side,
+            Descriptors fds,
+            void* memory,
+            size_t memory_size,
+            uint64_t capacity);
+    ~Channel();
+
+    // Server side of the handshake, on an accepted socket. Throws
+    // boost::system::system_error.
+    static std::shared_ptr<Channel>
+    accept(boost::asio::io_context& ctx, int control, uint64_t capacity);
+
+    // Client side, blocks until the server answered. Throws
+    // boost::system::system_error.
+    static std::shared_ptr<Channel> connect(boost::asio::io_context& ctx,
+                                            const std::string& path);
+
+    // Completes once at least `at_least` bytes have been read into buffer,
+    // like boost::asio::async_read with transfer_at_least.
+    template <typename Handler>
+    void async_read(boost::asio::mutable_buffer buffer, size_t at_least, Handler handler)
+    {
+        std::unique_ptr<ReadOperation> op(new ReadImpl<Handler>(std::move(handler)));
+        op->buffer = buffer;
+        op->at_least = std::max<size_t>(at_least, 1);
+        start(std::move(op));
+    }
+
+    // Completes once every buffer has been written, like
+    // boost::asio::async_write. The buffers must stay valid until then.
+    template <typename Buffers, typename Handler>
+    void async_write(const Buffers& buffers, Handler handler)
+    {
+        std::unique_ptr<WriteOperation> op(new WriteImpl<Handler>(std::move(handler)));
+        for (const auto& buffer : buffers)
+        {
+            if (buffer.size() != 0)
+            {
+                op->buffers.emplace_back(buffer);
+            }
+        }
+        start(std::move(op));
+    }
+
+    // Blocking versions, they must not run along the asynchronous ones.
+    size_t read_some(boost::asio::mutable_buffer buffer, boost::system::error_code& ec);
+    template <typename Buffers>
+    void write(const Buffers& buffers, boost::system::error_code& ec)
+    {
+        for (const auto& buffer : buffers)
+        {
+            write(boost::asio::const_buffer(buffer), ec);
+            if (ec)
+            {
+                return;
+            }
+        }
+    }
+    void write(boost::asio::const_buffer buffer, boost::system::error_code& ec);
+
+    // Pending operations complete with operation_aborted, the peer sees the
+    // channel closed.
+    void close();
+
+    // Process on the other side, as reported by the kernel.
+    pid_t peer_pid() const noexcept
+    {
+        return peer;
+    }
+
+    // The rings are placed after the headers, on their own pages.
+    static size_t memory_size(uint64_t capacity);
+
+private:
+    struct ReadOperation
+    {
+        virtual ~ReadOperation() = default;
+        virtual void complete(boost::system::error_code ec, size_t bytes) = 0;
+
+        boost::asio::mutable_buffer buffer;
+        size_t at_least = 0;
+        size_t transferred = 0;
+    };
+
+    template <typename Handler>
+    struct ReadImpl final : ReadOperation
+    {
+        ReadImpl(Handler handler)
+        : handler(std::move(handler))
+        {
+        }
+
+        void complete(boost::system::error_code ec, size_t bytes) override
+        {
+            handler(ec, bytes);
+        }
+
+        Handler handler;
+    };
+
+    struct WriteOperation
+    {
+        virtual ~WriteOperation() = default;
+        virtual void complete(boost::system::error_code ec) = 0;
+
+        std::vector<boost::asio::const_buffer> buffers;
+        size_t first = 0;
+    };
+
+    template <typename Handler>
+    struct WriteImpl final : WriteOperation
+    {
+        WriteImpl(Handler handler)
+        : handler(std::move(handler))
+        {
+        }
+
+        void complete(boost::system::error_code ec) override
+        {
+            handler(ec);
+        }
+
+        Handler handler;
+    };
+
+    void start(std::unique_ptr<ReadOperation> op);
+    void start(std::unique_ptr<WriteOperation> op);
+
+    // Must be called with the mutex held. Returns true if the operation is
+    // done, otherwise the peer is asked to wake us up.
+    bool perform(ReadOperation& op, boost::system::error_code& ec);
+    bool perform(WriteOperation& op, boost::system::error_code& ec);
+    void complete_read(boost::system::error_code ec);
+    void complete_write(boost::system::error_code ec);
+    void wait_wake();
+    void on_wake(boost::system::error_code ec);
+    void wait_control();
+    void on_control(boost::system::error_code ec);
+    // Waits for a wake up or the peer going away, for the blocking
+    // operations.
+    void block(boost::system::error_code& ec);
+
+    void notify_peer();
+    void fail(boost::system::error_code ec);
+
+    boost::asio::io_context& ctx;
+    void* memory;
+    size_t mapped;
+    Ring input;
+    Ring output;
+    pid_t peer = 0;
+
+    std::mutex mutex;
+    boost::asio::posix::stream_descriptor control;
+    boost::asio::posix::stream_descriptor wake;
+    int notify;
+    bool wake_armed = false;
+    // Set once closed or broken, every operation fails with it.
+    boost::system::error_code error;
+
+    std::unique_ptr<ReadOperation> pending_read;
+    std::unique_ptr<WriteOperation> pending_write;
+};
+
+} // namespace shm
+} // namespace blabla
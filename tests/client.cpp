@@ -0,0 +1,328 @@
+#define BOOST_TEST_MODULE Client
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+
+#include "blabla/client/Client.hpp"
+
+using namespace blabla::client;
+using boost::asio::ip::tcp;
+
+namespace
+{
+// Never expires during a test.
+constexpr std::chrono::hours LINGER(1);
+
+struct Events : EventHandler
+{
+    void connected() override
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        ++connections;
+        changed.notify_all();
+    }
+
+    void disconnected(const boost::system::error_code&) override
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        ++disconnections;
+        changed.notify_all();
+    }
+
+    // Returns false if the counts are not reached in time.
+    bool wait_for(size_t nb_connections, size_t nb_disconnections)
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        return changed.wait_for(l, std::chrono::seconds(10), [&] {
+            return connections >= nb_connections &&
+                   disconnections >= nb_disconnections;
+        });
+    }
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t connections = 0;
+    size_t disconnections = 0;
+};
+
+// A frame read by the server, with the payloads following it.
+struct Frame
+{
+    services::blabla::MsgType type;
+    std::string data;
+    std::string payload;
+};
+
+// Stands for the broker: reads what the client writes.
+struct Server
+{
+    // BlablaClientConfiguration::port is signed, the ephemeral ports do not
+    // fit in it.
+    Server()
+    : acceptor(service)
+    {
+        for (port = 20200; port < 32767; ++port)
+        {
+            if (listen())
+            {
+                return;
+            }
+        }
+        BOOST_FAIL("No port to listen on");
+    }
+
+    // The client cannot connect again until listen() is called.
+    void drop()
+    {
+        acceptor.close();
+        peer.reset();
+    }
+
+    bool listen()
+    {
+        boost::system::error_code ec;
+        acceptor.open(tcp::v4());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        acceptor.bind(tcp::endpoint(tcp::v4(), port), ec);
+        if (ec)
+        {
+            acceptor.close();
+            return false;
+        }
+        acceptor.listen();
+        return true;
+    }
+
+    void accept()
+    {
+        peer = std::make_unique<tcp::socket>(service);
+        acceptor.accept(*peer);
+    }
+
+    Frame read()
+    {
+        uint32_t size;
+        boost::asio::read(*peer, boost::asio::buffer(&size, sizeof(size)));
+
+        Frame frame;
+        frame.data.resize(ntohl(size));
+        boost::asio::read(*peer, boost::asio::buffer(&frame.data[0],
+                                                     frame.data.size()));
+
+        services::blabla::DecodableMessage decodable;
+        BOOST_REQUIRE(decodable.ParseFromString(frame.data));
+        frame.type = decodable.type().type();
+
+        size_t payload_size = 0;
+        if (frame.type == services::blabla::MESSAGE)
+        {
+            payload_size = as<services::blabla::ProducerMessageHeader>(frame)
+                               .message_size();
+        }
+        else if (frame.type == services::blabla::MESSAGE_BATCH)
+        {
+            auto batch = as<services::blabla::MessageBatch>(frame);
+            for (auto& entry : batch.entries())
+            {
+                payload_size += entry.message_size();
+            }
+        }
+
+        frame.payload.resize(payload_size);
+        if (payload_size)
+        {
+            boost::asio::read(*peer, boost::asio::buffer(&frame.payload[0],
+                                                         payload_size));
+        }
+        return frame;
+    }
+
+    template <typename T>
+    static T as(const Frame& frame)
+    {
+        T msg;
+        BOOST_REQUIRE(msg.ParseFromString(frame.data));
+        return msg;
+    }
+
+    BlablaClientConfiguration configuration() const
+    {
+        BlablaClientConfiguration conf;
+        conf.host = "127.0.0.1";
+        conf.port = port;
+        conf.sync_connect = true;
+        conf.connect_retry_interval = std::chrono::milliseconds(10);
+        conf.max_connect_retry_interval = std::chrono::milliseconds(10);
+        return conf;
+    }
+
+    boost::asio::io_service service;
+    tcp::acceptor acceptor;
+    int16_t port;
+    std::unique_ptr<tcp::socket> peer;
+};
+
+// The size of a publish kept offline.
+size_t frame_size(const std::string& route, const std::string& payload)
+{
+    services::blabla::ProducerMessageHeader header;
+    header.mutable_header()->set_type(services::blabla::MESSAGE);
+    header.set_route(route);
+    header.set_message_size(payload.size());
+    return sizeof(uint32_t) + header.ByteSizeLong() + payload.size();
+}
+} // namespace
+
+BOOST_AUTO_TEST_CASE(batch_thresholds)
+{
+    Server server;
+    Events events;
+    Client client(events);
+    auto conf = server.configuration();
+    conf.linger = LINGER;
+    conf.max_batch_bytes = 100;
+    client.configure(conf);
+    server.accept();
+
+    // Sent once it holds max_batch_bytes of payloads.
+    for (char c : {'a', 'b', 'c'})
+    {
+        BOOST_REQUIRE(client.publish("r", std::string(40, c)));
+    }
+    auto frame = server.read();
+    BOOST_REQUIRE_EQUAL(frame.type, services::blabla::MESSAGE_BATCH);
+    auto batch = Server::as<services::blabla::MessageBatch>(frame);
+    BOOST_REQUIRE_EQUAL(batch.entries_size(), 3);
+    BOOST_CHECK_EQUAL(batch.entries(0).route(), "r");
+    BOOST_CHECK_EQUAL(batch.entries(2).message_size(), 40);
+    BOOST_CHECK(frame.payload == std::string(40, 'a') + std::string(40, 'b') +
+                                     std::string(40, 'c'));
+
+    // Or when flushed.
+    BOOST_REQUIRE(client.publish("s", "d"));
+    BOOST_REQUIRE(client.publish("s", "e"));
+    client.flush();
+    frame = server.read();
+    BOOST_REQUIRE_EQUAL(frame.type, services::blabla::MESSAGE_BATCH);
+    batch = Server::as<services::blabla::MessageBatch>(frame);
+    BOOST_CHECK_EQUAL(batch.entries_size(), 2);
+    BOOST_CHECK_EQUAL(frame.payload, "de");
+
+    BOOST_REQUIRE(client.publish("s", "f", true));
+    frame = server.read();
+    BOOST_REQUIRE_EQUAL(frame.type, services::blabla::MESSAGE_BATCH);
+    batch = Server::as<services::blabla::MessageBatch>(frame);
+    BOOST_CHECK_EQUAL(batch.entries_size(), 1);
+    BOOST_CHECK_EQUAL(frame.payload, "f");
+
+    // Control frames come after the messages published before them.
+    BOOST_REQUIRE(client.publish("s", "g"));
+    BOOST_REQUIRE(client.ping([](auto) {}));
+    frame = server.read();
+    BOOST_REQUIRE_EQUAL(frame.type, services::blabla::MESSAGE_BATCH);
+    BOOST_CHECK_EQUAL(frame.payload, "g");
+    BOOST_CHECK_EQUAL(server.read().type, services::blabla::PING);
+}
+
+// The batch not sent when the connection is lost and what is published
+// until it is back share the offline buffer, the oldest publishes are
+// dropped first.
+BOOST_AUTO_TEST_CASE(offline_buffer_overflow)
+{
+    Server server;
+    Events events;
+    Client client(events);
+    auto conf = server.configuration();
+    conf.linger = LINGER;
+    conf.offline_buffer_bytes = 3 * frame_size("r", "p0");
+    client.configure(conf);
+    server.accept();
+    BOOST_REQUIRE(events.wait_for(1, 0));
+
+    BOOST_REQUIRE(client.publish("r", "p0"));
+    BOOST_REQUIRE(client.publish("r", "p1"));
+    server.drop();
+    BOOST_REQUIRE(events.wait_for(1, 1));
+
+    for (auto payload : {"p2", "p3", "p4"})
+    {
+        BOOST_CHECK(client.publish("r", payload));
+    }
+    // Never fits.
+    const std::string too_big(conf.offline_buffer_bytes, 'x');
+    BOOST_CHECK(!client.publish("r", too_big));
+
+    BOOST_REQUIRE(server.listen());
+    server.accept();
+    BOOST_REQUIRE(events.wait_for(2, 1));
+    BOOST_REQUIRE(client.ping([](auto) {}));
+
+    for (auto payload : {"p2", "p3", "p4"})
+    {
+        auto frame = server.read();
+        BOOST_REQUIRE_EQUAL(frame.type, services::blabla::MESSAGE);
+        auto msg = Server::as<services::blabla::ProducerMessageHeader>(frame);
+        BOOST_CHECK_EQUAL(msg.route(), "r");
+        BOOST_CHECK_EQUAL(frame.payload, payload);
+    }
+    BOOST_CHECK_EQUAL(server.read().type, services::blabla::PING);
+}
+
+BOOST_AUTO_TEST_CASE(subscriptions_are_sent_again_at_once)
+{
+    Server server;
+    Events events;
+    Client client(events);
+    auto conf = server.configuration();
+    conf.offline_buffer_bytes = 1024;
+    client.configure(conf);
+    server.accept();
+
+    auto ignore = [](auto&, auto) {};
+    client.subscribe("a", ignore);
+    client.subscribe_pattern("b.*", ignore);
+    client.subscribe("c", ignore);
+    client.unsubscribe("c");
+    for (size_t i = 0; i < 4; ++i)
+    {
+        BOOST_CHECK_EQUAL(server.read().type,
+                          services::blabla::SUSCRIBE_REQUEST);
+    }
+
+    server.drop();
+    BOOST_REQUIRE(events.wait_for(1, 1));
+    BOOST_REQUIRE(client.publish("r", "offline"));
+    BOOST_REQUIRE(server.listen());
+    server.accept();
+
+    // Before what was published while disconnected.
+    auto frame = server.read();
+    BOOST_REQUIRE_EQUAL(frame.type, services::blabla::SUSCRIBE_REQUEST);
+    auto req = Server::as<services::blabla::SubscribeRequest>(frame);
+    BOOST_REQUIRE_EQUAL(req.subscriptions_size(), 2);
+    BOOST_CHECK_EQUAL(req.subscriptions(0).route_prefix(), "a");
+    BOOST_CHECK_EQUAL(
+        req.subscriptions(0).type(),
+        services::blabla::SubscribeRequest_Subscription_Type_SUBSCRIBE);
+    BOOST_CHECK_EQUAL(req.subscriptions(0).correlation_id(), 1);
+    BOOST_CHECK_EQUAL(req.subscriptions(1).route_prefix(), "b.*");
+    BOOST_CHECK_EQUAL(
+        req.subscriptions(1).type(),
+        services::blabla::SubscribeRequest_Subscription_Type_SUBSCRIBE_PATTERN);
+    BOOST_CHECK_EQUAL(req.subscriptions(1).correlation_id(), 2);
+
+    frame = server.read();
+    BOOST_REQUIRE_EQUAL(frame.type, services::blabla::MESSAGE);
+    BOOST_CHECK_EQUAL(frame.payload, "offline");
+}
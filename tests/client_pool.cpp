@@ -0,0 +1,143 @@
+#define BOOST_TEST_MODULE ClientPool
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/asio/ip/tcp.hpp>
+
+#include "blabla/client/ClientPool.hpp"
+
+using namespace blabla::client;
+using boost::asio::ip::tcp;
+
+namespace
+{
+struct Events : EventHandler
+{
+    void connected() override
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        ++connections;
+        changed.notify_all();
+    }
+
+    void disconnected(const boost::system::error_code&) override
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        ++disconnections;
+        changed.notify_all();
+    }
+
+    // Returns false if the counts are not reached in time.
+    bool wait_for(size_t nb_connections, size_t nb_disconnections)
+    {
+        std::unique_lock<std::mutex> l(mutex);
+        return changed.wait_for(l, std::chrono::seconds(10), [&] {
+            return connections >= nb_connections &&
+                   disconnections >= nb_disconnections;
+        });
+    }
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t connections = 0;
+    size_t disconnections = 0;
+};
+
+// The server side of the connections, which only accepts and closes them.
+struct Server
+{
+    // BlablaClientConfiguration::port is signed, the ephemeral ports do not
+    // fit in it.
+    Server()
+    : acceptor(service)
+    {
+        acceptor.open(tcp::v4());
+        for (uint16_t port = 20200; port < 32767; ++port)
+        {
+            boost::system::error_code ec;
+            acceptor.bind(tcp::endpoint(tcp::v4(), port), ec);
+            if (!ec)
+            {
+                acceptor.listen();
+                return;
+            }
+        }
+        BOOST_FAIL("No port to listen on");
+    }
+
+    void accept()
+    {
+        peers.emplace_back(std::make_unique<tcp::socket>(service));
+        acceptor.accept(*peers.back());
+    }
+
+    void close(size_t peer)
+    {
+        peers[peer]->close();
+    }
+
+    BlablaClientConfiguration configuration() const
+    {
+        BlablaClientConfiguration conf;
+        conf.host = "127.0.0.1";
+        conf.port = acceptor.local_endpoint().port();
+        conf.sync_connect = true;
+        conf.connect_retry_interval = std::chrono::milliseconds(10);
+        conf.max_connect_retry_interval = std::chrono::milliseconds(10);
+        return conf;
+    }
+
+    boost::asio::io_service service;
+    tcp::acceptor acceptor;
+    std::vector<std::unique_ptr<tcp::socket>> peers;
+};
+} // namespace
+
+BOOST_AUTO_TEST_CASE(sync_connect_is_reported)
+{
+    Server server;
+    Events events;
+    ClientPool pool(events, 2);
+    pool.configure(server.configuration());
+    server.accept();
+    server.accept();
+
+    BOOST_CHECK(pool[0].is_connected());
+    BOOST_CHECK(pool[1].is_connected());
+    std::lock_guard<std::mutex> l(events.mutex);
+    BOOST_CHECK_EQUAL(events.connections, 1);
+    BOOST_CHECK_EQUAL(events.disconnections, 0);
+}
+
+BOOST_AUTO_TEST_CASE(lost_connections)
+{
+    Server server;
+    Events events;
+    ClientPool pool(events, 2);
+    pool.configure(server.configuration());
+    server.accept();
+    server.accept();
+
+    // Reported when the first connection is lost, and once both are back.
+    server.close(0);
+    BOOST_REQUIRE(events.wait_for(1, 1));
+    server.accept();
+    BOOST_REQUIRE(events.wait_for(2, 1));
+
+    // Losing both is a single disconnection.
+    server.close(1);
+    server.close(2);
+    BOOST_REQUIRE(events.wait_for(2, 2));
+    server.accept();
+    server.accept();
+    BOOST_REQUIRE(events.wait_for(3, 2));
+
+    std::lock_guard<std::mutex> l(events.mutex);
+    BOOST_CHECK_EQUAL(events.connections, 3);
+    BOOST_CHECK_EQUAL(events.disconnections, 2);
+}
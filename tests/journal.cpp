@@ -0,0 +1,371 @@
+#define BOOST_TEST_MODULE Journal
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "blabla/journal/Journal.hpp"
+#include "blabla/journal/Segment.hpp"
+
+using namespace blabla;
+using namespace blabla::journal;
+
+namespace
+{
+// A directory of its own for each test, removed afterwards.
+struct Directory
+{
+    Directory()
+    {
+        char name[] = "/tmp/blabla_journal_XXXXXX";
+        BOOST_REQUIRE(::mkdtemp(name) != nullptr);
+        path = name;
+        conf.directory = path;
+        conf.route_prefixes = {"a"};
+        conf.segment_bytes = 64 * 1024;
+        conf.index_interval_bytes = 256;
+        conf.fsync = FsyncPolicy::never;
+    }
+
+    ~Directory()
+    {
+        boost::filesystem::remove_all(path);
+    }
+
+    // A journal of the routes under "a", rolled by the test.
+    std::unique_ptr<Journal> open()
+    {
+        return std::make_unique<Journal>("a", path + "/a", conf, [] {});
+    }
+
+    std::string segment_path(uint64_t base_offset) const
+    {
+        return path + "/a/" + Segment::file_name(base_offset);
+    }
+
+    std::string path;
+    JournalConfiguration conf;
+};
+
+std::string payload_of(uint64_t i)
+{
+    return "message " + std::to_string(i);
+}
+
+uint64_t append(Journal& journal,
+                const std::string& route,
+                const std::string& payload)
+{
+    return journal.append(route,
+                          reinterpret_cast<const uint8_t*>(payload.data()),
+                          payload.size());
+}
+
+// Offsets and payloads of the records read from offset on.
+std::vector<std::pair<uint64_t, std::string>>
+read_all(const Journal& journal, uint64_t offset)
+{
+    std::vector<std::pair<uint64_t, std::string>> records;
+    journal.read(offset, SIZE_MAX, [&](const Record& record) {
+        auto payload = reinterpret_cast<const char*>(record.payload);
+        records.emplace_back(record.offset,
+                             std::string(payload, record.payload_size));
+    });
+    return records;
+}
+
+void write_record(Segment& segment, uint64_t offset, const std::string& payload)
+{
+    size_t position;
+    BOOST_REQUIRE(
+        segment.reserve(Segment::record_size(3, payload.size()), position));
+    segment.write(position, offset, offset * 10, "a.b",
+                  reinterpret_cast<const uint8_t*>(payload.data()),
+                  payload.size());
+    segment.commit(position, offset, offset * 10);
+}
+} // namespace
+
+BOOST_FIXTURE_TEST_CASE(offsets_follow_each_other, Directory)
+{
+    auto journal = open();
+    BOOST_CHECK_EQUAL(journal->begin(), 1);
+    BOOST_CHECK_EQUAL(journal->end(), 1);
+
+    for (uint64_t i = 1; i <= 10; ++i)
+    {
+        BOOST_CHECK_EQUAL(append(*journal, "a.b", payload_of(i)), i);
+    }
+    BOOST_CHECK_EQUAL(journal->end(), 11);
+
+    auto records = read_all(*journal, 4);
+    BOOST_REQUIRE_EQUAL(records.size(), 7);
+    BOOST_CHECK_EQUAL(records.front().first, 4);
+    BOOST_CHECK_EQUAL(records.front().second, payload_of(4));
+    BOOST_CHECK_EQUAL(records.back().first, 10);
+}
+
+BOOST_FIXTURE_TEST_CASE(too_large_message, Directory)
+{
+    auto journal = open();
+    const std::string payload(conf.segment_bytes, 'x');
+    BOOST_CHECK_EQUAL(append(*journal, "a.b", payload), 0);
+    BOOST_CHECK_EQUAL(append(*journal, "a.b", "fits"), 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(segments_are_recovered, Directory)
+{
+    const std::string payload(1000, 'x');
+    {
+        auto journal = open();
+        for (uint64_t i = 1; i <= 200; ++i)
+        {
+            BOOST_REQUIRE_EQUAL(append(*journal, "a.b", payload), i);
+            if (journal->needs_maintenance())
+            {
+                journal->maintain();
+            }
+        }
+    }
+
+    // The spare segment is removed, the ones taken are named after their
+    // first offset.
+    BOOST_CHECK(!boost::filesystem::exists(path + "/a/" + Segment::SPARE_NAME));
+    BOOST_CHECK(boost::filesystem::exists(segment_path(1)));
+    BOOST_CHECK(boost::filesystem::exists(segment_path(64)));
+
+    auto journal = open();
+    BOOST_CHECK_EQUAL(journal->begin(), 1);
+    BOOST_CHECK_EQUAL(journal->end(), 201);
+    BOOST_CHECK_EQUAL(read_all(*journal, 1).size(), 200);
+    BOOST_CHECK_EQUAL(append(*journal, "a.b", payload), 201);
+}
+
+BOOST_FIXTURE_TEST_CASE(taken_spare_is_recovered, Directory)
+{
+    {
+        auto journal = open();
+        for (uint64_t i = 1; i <= 100; ++i)
+        {
+            append(*journal, "a.b", std::string(1000, 'x'));
+        }
+        // The spare taken by the second segment is not renamed before the
+        // crash, its name is recovered from its first record.
+        BOOST_REQUIRE(journal->needs_maintenance());
+        boost::filesystem::copy_file(path + "/a/" + Segment::SPARE_NAME,
+                                     path + "/crashed");
+    }
+    boost::filesystem::remove(segment_path(64));
+    boost::filesystem::rename(path + "/crashed",
+                              path + "/a/" + Segment::SPARE_NAME);
+
+    auto journal = open();
+    BOOST_CHECK_EQUAL(journal->end(), 101);
+    BOOST_CHECK(boost::filesystem::exists(segment_path(64)));
+}
+
+BOOST_FIXTURE_TEST_CASE(torn_write_is_truncated, Directory)
+{
+    {
+        auto journal = open();
+        for (uint64_t i = 1; i <= 5; ++i)
+        {
+            append(*journal, "a.b", payload_of(i));
+        }
+    }
+
+    // Corrupts the payload of the third record: its checksum no longer
+    // matches.
+    const auto record = Segment::record_size(3, payload_of(1).size());
+    {
+        std::fstream file(segment_path(1),
+                          std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(2 * record + sizeof(RecordHeader) + 3);
+        file.put('!');
+    }
+
+    {
+        auto journal = open();
+        BOOST_CHECK_EQUAL(journal->end(), 3);
+        BOOST_CHECK_EQUAL(read_all(*journal, 1).size(), 2);
+
+        // What followed was erased: the new records are not mixed with it.
+        BOOST_CHECK_EQUAL(append(*journal, "a.b", "new"), 3);
+        auto records = read_all(*journal, 1);
+        BOOST_REQUIRE_EQUAL(records.size(), 3);
+        BOOST_CHECK_EQUAL(records.back().second, "new");
+    }
+
+    auto journal = open();
+    BOOST_CHECK_EQUAL(journal->end(), 4);
+}
+
+BOOST_FIXTURE_TEST_CASE(torn_header_is_truncated, Directory)
+{
+    {
+        auto journal = open();
+        for (uint64_t i = 1; i <= 5; ++i)
+        {
+            append(*journal, "a.b", payload_of(i));
+        }
+    }
+
+    // A record size which does not match the route and payload sizes.
+    const auto record = Segment::record_size(3, payload_of(1).size());
+    {
+        std::fstream file(segment_path(1),
+                          std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(3 * record);
+        const uint32_t size = 8;
+        file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    }
+
+    auto journal = open();
+    BOOST_CHECK_EQUAL(journal->end(), 4);
+}
+
+BOOST_FIXTURE_TEST_CASE(sparse_index_lookup, Directory)
+{
+    auto segment =
+        Segment::create(path, 1, 64 * 1024, conf.index_interval_bytes);
+    std::vector<size_t> positions;
+    for (uint64_t offset = 1; offset <= 300; ++offset)
+    {
+        positions.push_back(segment->size());
+        write_record(*segment, offset, payload_of(offset));
+    }
+    BOOST_CHECK_EQUAL(segment->next_offset(), 301);
+    BOOST_CHECK_EQUAL(segment->last_timestamp(), 3000);
+
+    for (uint64_t offset = 1; offset <= 300; ++offset)
+    {
+        // At or before the record, less than an interval and a record away.
+        const auto position = positions[offset - 1];
+        const auto found = segment->seek(offset);
+        BOOST_CHECK_LE(found, position);
+        BOOST_CHECK_LT(position - found,
+                       conf.index_interval_bytes +
+                           Segment::record_size(3, payload_of(offset).size()));
+
+        const auto by_time = segment->seek_time(offset * 10);
+        BOOST_CHECK_LE(by_time, position);
+
+        bool seen = false;
+        segment->scan(found, segment->size(), [&](const Record& record) {
+            seen = record.offset == offset;
+            return record.offset < offset;
+        });
+        BOOST_CHECK(seen);
+    }
+    segment->remove();
+}
+
+BOOST_FIXTURE_TEST_CASE(offset_at_timestamp, Directory)
+{
+    auto journal = open();
+    BOOST_CHECK_EQUAL(journal->offset_at(0), journal->end());
+
+    append(*journal, "a.b", "first");
+    append(*journal, "a.b", "second");
+    BOOST_CHECK_EQUAL(journal->offset_at(0), 1);
+
+    const uint64_t future = 7258118400000; // 2200-01-01 in milliseconds.
+    BOOST_CHECK_EQUAL(journal->offset_at(future), 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(replay_cut_off, Directory)
+{
+    auto journal = open();
+    for (uint64_t i = 1; i <= 100; ++i)
+    {
+        append(*journal, i % 2 ? "a.odd" : "a.even", payload_of(i));
+    }
+
+    // A replay reads about max_bytes at a time, and resumes where it stopped.
+    const auto record = Segment::record_size(5, payload_of(1).size());
+    std::vector<uint64_t> offsets;
+    uint64_t next = 1;
+    size_t reads = 0;
+    while (next < journal->end())
+    {
+        next = journal->read(next, 10 * record, [&](const Record& record) {
+            offsets.push_back(record.offset);
+        });
+        ++reads;
+    }
+    BOOST_CHECK_EQUAL(next, 101);
+    BOOST_CHECK_EQUAL(offsets.size(), 100);
+    BOOST_CHECK_GE(reads, 9);
+    for (size_t i = 0; i < offsets.size(); ++i)
+    {
+        BOOST_CHECK_EQUAL(offsets[i], i + 1);
+    }
+
+    // It subscribes once nothing was appended past what it read, the
+    // messages appended afterwards are delivered live.
+    bool subscribed = false;
+    BOOST_CHECK(journal->if_at_end(next, [&] { subscribed = true; }));
+    BOOST_CHECK(subscribed);
+
+    append(*journal, "a.odd", "late");
+    subscribed = false;
+    BOOST_CHECK(!journal->if_at_end(next, [&] { subscribed = true; }));
+    BOOST_CHECK(!subscribed);
+    BOOST_CHECK_EQUAL(journal->read(next, SIZE_MAX, [](const Record&) {}), 102);
+}
+
+BOOST_FIXTURE_TEST_CASE(concurrent_appends, Directory)
+{
+    conf.fsync = FsyncPolicy::eager;
+    {
+        Journals journals(conf);
+        std::atomic<size_t> failures{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&journals, &failures] {
+                const std::string payload(100, 'x');
+                for (int i = 0; i < 5000; ++i)
+                {
+                    if (append(journals[0], "a.b", payload) == 0)
+                    {
+                        ++failures;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        // The segments rolled to were prepared by the flusher, and the
+        // records were committed in order.
+        BOOST_CHECK_EQUAL(failures, 0);
+        BOOST_CHECK_EQUAL(journals[0].end(), 20001);
+        auto records = read_all(journals[0], 1);
+        BOOST_REQUIRE_EQUAL(records.size(), 20000);
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            BOOST_REQUIRE_EQUAL(records[i].first, i + 1);
+        }
+    }
+
+    Journals journals(conf);
+    BOOST_CHECK_EQUAL(journals[0].end(), 20001);
+}
+
+BOOST_AUTO_TEST_CASE(covered_routes)
+{
+    BOOST_CHECK(covers("", "a.b"));
+    BOOST_CHECK(covers("a", "a"));
+    BOOST_CHECK(covers("a", "a.b"));
+    BOOST_CHECK(!covers("a", "ab"));
+    BOOST_CHECK(!covers("a.b", "a"));
+}
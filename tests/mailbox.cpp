@@ -0,0 +1,107 @@
+#define BOOST_TEST_MODULE Mailbox
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "blabla/Shard.hpp"
+
+using namespace blabla;
+
+namespace
+{
+// The batches are told apart by their byte count.
+std::unique_ptr<DeliveryBatch> batch_of(size_t tag)
+{
+    auto batch = std::make_unique<DeliveryBatch>();
+    batch->bytes = tag;
+    return batch;
+}
+} // namespace
+
+BOOST_AUTO_TEST_CASE(empty)
+{
+    Mailbox mailbox;
+    BOOST_CHECK(mailbox.take().empty());
+}
+
+BOOST_AUTO_TEST_CASE(push_order)
+{
+    Mailbox mailbox;
+    // Only the first push finds the mailbox empty.
+    BOOST_CHECK(mailbox.push(batch_of(1)));
+    BOOST_CHECK(!mailbox.push(batch_of(2)));
+    BOOST_CHECK(!mailbox.push(batch_of(3)));
+
+    auto batches = mailbox.take();
+    BOOST_REQUIRE_EQUAL(batches.size(), 3);
+    for (size_t i = 0; i < batches.size(); ++i)
+    {
+        BOOST_CHECK_EQUAL(batches[i]->bytes, i + 1);
+    }
+
+    BOOST_CHECK(mailbox.take().empty());
+    BOOST_CHECK(mailbox.push(batch_of(4)));
+}
+
+BOOST_AUTO_TEST_CASE(destroyed_with_batches)
+{
+    Mailbox mailbox;
+    mailbox.push(batch_of(1));
+    mailbox.push(batch_of(2));
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_producers)
+{
+    const size_t producers = 4;
+    const size_t per_producer = 20000;
+
+    Mailbox mailbox;
+    std::atomic<size_t> notifications{0};
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; ++p)
+    {
+        threads.emplace_back([&, p] {
+            for (size_t i = 0; i < per_producer; ++i)
+            {
+                if (mailbox.push(batch_of(p * per_producer + i)))
+                {
+                    ++notifications;
+                }
+            }
+        });
+    }
+
+    // Each producer's batches come in the order it pushed them.
+    std::vector<size_t> next(producers, 0);
+    size_t received = 0;
+    size_t takes = 0;
+    bool ordered = true;
+    while (received < producers * per_producer)
+    {
+        auto batches = mailbox.take();
+        if (!batches.empty())
+        {
+            ++takes;
+        }
+
+        for (auto& batch : batches)
+        {
+            const auto producer = batch->bytes / per_producer;
+            ordered = ordered && batch->bytes % per_producer == next[producer];
+            ++next[producer];
+        }
+        received += batches.size();
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    BOOST_CHECK(ordered);
+    BOOST_CHECK(mailbox.take().empty());
+    // The consumer is notified once per take which emptied the mailbox.
+    BOOST_CHECK_EQUAL(notifications, takes);
+}
@@ -0,0 +1,256 @@
+#define BOOST_TEST_MODULE OutboundPolicy
+#include <boost/test/unit_test.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <commonpp/thread/ThreadPool.hpp>
+
+#include "blabla/handlers/Client.hpp"
+
+using namespace blabla;
+using namespace blabla::handlers;
+
+namespace
+{
+// Every message is queued with its 4 bytes size, without metadata.
+constexpr size_t PAYLOAD_SIZE = 100;
+constexpr size_t MESSAGE_SIZE = 4 + PAYLOAD_SIZE;
+
+struct Manager : ClientManager
+{
+    const ServiceConfiguration& configuration() const override
+    {
+        return conf;
+    }
+    bool uring_enabled() const override
+    {
+        return false;
+    }
+    OutboundStats& outbound_stats() override
+    {
+        return stats;
+    }
+    journal::Journals* journals() override
+    {
+        return nullptr;
+    }
+
+    void on_new_client(std::shared_ptr<Client>) override
+    {
+    }
+    void remove_connection(std::shared_ptr<Client>) override
+    {
+    }
+
+    std::vector<SubscriptionNode*> subscribe(std::vector<Subscription>,
+                                             Client*) override
+    {
+        return {};
+    }
+    std::vector<SubscriptionNode*> unsubscribe(std::vector<Subscription>,
+                                               Client*) override
+    {
+        return {};
+    }
+    void emit_to(boost::string_view,
+                 std::unique_ptr<SharedBufferWithSpecificMetadata>,
+                 Client*) override
+    {
+    }
+    void emit_batch(std::vector<BatchMessage>&, Client*) override
+    {
+    }
+
+    ServiceConfiguration conf;
+    OutboundStats stats;
+};
+
+// The io_service only runs when polled: the first message sent is the write
+// in flight until then, the next ones stay queued.
+struct Connections
+{
+    Connections()
+    : pool(1)
+    {
+    }
+
+    ~Connections()
+    {
+        for (auto fd : peers)
+        {
+            ::close(fd);
+        }
+        poll();
+    }
+
+    Client& add()
+    {
+        clients.push_back(Client::create(pool, service));
+        int fds[2];
+        BOOST_REQUIRE_EQUAL(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        clients.back()->socket().assign(
+            Client::socket_type::protocol_type(AF_UNIX, 0), fds[0]);
+        peers.push_back(fds[1]);
+        clients.back()->start(&manager);
+        return *clients.back();
+    }
+
+    // Message i is PAYLOAD_SIZE times the character 'a' + i.
+    void send(Client& client,
+              const OutboundPolicy& policy,
+              char i,
+              Client* producer = nullptr)
+    {
+        auto chunk = Chunk::allocate(PAYLOAD_SIZE);
+        std::fill(chunk->data(), chunk->data() + PAYLOAD_SIZE, 'a' + i);
+        client.send(SharedBufferWithSpecificMetadata::create_from(
+                        std::move(chunk), 0, PAYLOAD_SIZE),
+                    "route", policy, producer);
+    }
+
+    void poll()
+    {
+        service.restart();
+        service.poll();
+    }
+
+    // The messages written to the peer of a client, by index.
+    std::string received(size_t client)
+    {
+        poll();
+        std::string messages;
+        char message[MESSAGE_SIZE];
+        while (::recv(peers[client], message, sizeof(message),
+                      MSG_DONTWAIT | MSG_WAITALL) == ssize_t(sizeof(message)))
+        {
+            messages.push_back(message[4] - 'a');
+        }
+        return messages;
+    }
+
+    Manager manager;
+    commonpp::thread::ThreadPool pool;
+    boost::asio::io_service service;
+    std::vector<std::shared_ptr<Client>> clients;
+    std::vector<int> peers;
+};
+
+OutboundPolicy policy(OutboundPolicy::Overflow overflow)
+{
+    OutboundPolicy policy;
+    policy.overflow = overflow;
+    policy.max_bytes = 3 * MESSAGE_SIZE;
+    return policy;
+}
+} // namespace
+
+BOOST_AUTO_TEST_CASE(drop_oldest)
+{
+    Connections connections;
+    auto& client = connections.add();
+    auto& stats = connections.manager.stats;
+    auto p = policy(OutboundPolicy::Overflow::drop_oldest);
+    for (char i = 0; i < 5; ++i)
+    {
+        connections.send(client, p, i);
+    }
+
+    // The write in flight is not evicted.
+    BOOST_CHECK_EQUAL(outbound_bytes(client), 3 * MESSAGE_SIZE);
+    BOOST_CHECK_EQUAL(stats.dropped_messages.load(), 2);
+    BOOST_CHECK_EQUAL(stats.dropped_bytes.load(), 2 * MESSAGE_SIZE);
+    BOOST_CHECK(connections.received(0) == std::string({0, 3, 4}));
+}
+
+BOOST_AUTO_TEST_CASE(drop_oldest_without_anything_to_evict)
+{
+    Connections connections;
+    auto& client = connections.add();
+    auto& stats = connections.manager.stats;
+    auto p = policy(OutboundPolicy::Overflow::drop_oldest);
+    p.max_bytes = MESSAGE_SIZE;
+    connections.send(client, p, 0);
+    connections.send(client, p, 1);
+
+    BOOST_CHECK_EQUAL(outbound_bytes(client), MESSAGE_SIZE);
+    BOOST_CHECK_EQUAL(stats.dropped_messages.load(), 1);
+    BOOST_CHECK(connections.received(0) == std::string({0}));
+}
+
+BOOST_AUTO_TEST_CASE(drop_newest)
+{
+    Connections connections;
+    auto& client = connections.add();
+    auto& stats = connections.manager.stats;
+    auto p = policy(OutboundPolicy::Overflow::drop_newest);
+    p.max_bytes = 10 * MESSAGE_SIZE;
+    p.max_messages = 3;
+    for (char i = 0; i < 5; ++i)
+    {
+        connections.send(client, p, i);
+    }
+
+    BOOST_CHECK_EQUAL(outbound_bytes(client), 3 * MESSAGE_SIZE);
+    BOOST_CHECK_EQUAL(stats.dropped_messages.load(), 2);
+    BOOST_CHECK_EQUAL(stats.dropped_bytes.load(), 2 * MESSAGE_SIZE);
+    BOOST_CHECK(connections.received(0) == std::string({0, 1, 2}));
+}
+
+BOOST_AUTO_TEST_CASE(disconnect)
+{
+    Connections connections;
+    auto& client = connections.add();
+    auto& stats = connections.manager.stats;
+    auto p = policy(OutboundPolicy::Overflow::disconnect);
+    for (char i = 0; i < 5; ++i)
+    {
+        connections.send(client, p, i);
+    }
+
+    // Nothing is queued once the client is closing.
+    BOOST_CHECK_EQUAL(outbound_bytes(client), 3 * MESSAGE_SIZE);
+    BOOST_CHECK_EQUAL(stats.disconnections.load(), 1);
+    BOOST_CHECK_EQUAL(stats.dropped_messages.load(), 0);
+
+    connections.poll();
+    char byte;
+    while (::recv(connections.peers[0], &byte, 1, MSG_DONTWAIT) > 0)
+    {
+    }
+    BOOST_CHECK_EQUAL(::recv(connections.peers[0], &byte, 1, MSG_DONTWAIT), 0);
+}
+
+// The queue goes over the budget by what is sent until the producers are
+// paused.
+BOOST_AUTO_TEST_CASE(pause_producer)
+{
+    Connections connections;
+    auto& client = connections.add();
+    auto& stats = connections.manager.stats;
+    auto& producer = connections.add();
+    auto& other = connections.add();
+    auto p = policy(OutboundPolicy::Overflow::pause_producer);
+    for (char i = 0; i < 3; ++i)
+    {
+        connections.send(client, p, i, &producer);
+    }
+    BOOST_CHECK_EQUAL(stats.producer_pauses.load(), 0);
+
+    connections.send(client, p, 3, &producer);
+    connections.send(client, p, 4, &producer);
+    BOOST_CHECK_EQUAL(stats.producer_pauses.load(), 1);
+    connections.send(client, p, 5, &other);
+    BOOST_CHECK_EQUAL(stats.producer_pauses.load(), 2);
+    // Without a producer to pause.
+    connections.send(client, p, 6);
+
+    BOOST_CHECK_EQUAL(outbound_bytes(client), 7 * MESSAGE_SIZE);
+    BOOST_CHECK_EQUAL(stats.dropped_messages.load(), 0);
+    BOOST_CHECK(connections.received(0) == std::string({0, 1, 2, 3, 4, 5, 6}));
+    BOOST_CHECK_EQUAL(outbound_bytes(client), 0);
+}
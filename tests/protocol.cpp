@@ -0,0 +1,237 @@
+#define BOOST_TEST_MODULE Protocol
+#include <boost/test/unit_test.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <commonpp/thread/ThreadPool.hpp>
+
+#include "blabla/handlers/Client.hpp"
+#include "blabla/handlers/Protocol.hpp"
+
+using namespace blabla;
+using namespace blabla::handlers;
+
+namespace
+{
+const std::vector<int32_t> CORRELATION_IDS = {0, 127, 128, INT32_MAX, -42};
+
+services::blabla::ConsumerMessageHeader decode(
+    const ConsumerHeaderEncoder& encoder, int32_t correlation_id)
+{
+    auto in = encoder.in(WireMode::protobuf);
+    std::vector<uint8_t> out(in.max_size());
+    const size_t size = in.encode(correlation_id, out.data());
+    BOOST_REQUIRE_LE(size, out.size());
+
+    services::blabla::ConsumerMessageHeader header;
+    BOOST_REQUIRE(header.ParseFromArray(out.data(), size));
+    return header;
+}
+
+// Records what is published, as the service would route it.
+struct Manager : ClientManager
+{
+    const ServiceConfiguration& configuration() const override
+    {
+        return conf;
+    }
+    bool uring_enabled() const override
+    {
+        return false;
+    }
+    OutboundStats& outbound_stats() override
+    {
+        return stats;
+    }
+    journal::Journals* journals() override
+    {
+        return nullptr;
+    }
+
+    void on_new_client(std::shared_ptr<Client>) override
+    {
+    }
+    void remove_connection(std::shared_ptr<Client>) override
+    {
+    }
+
+    std::vector<SubscriptionNode*> subscribe(std::vector<Subscription>,
+                                             Client*) override
+    {
+        return {};
+    }
+    std::vector<SubscriptionNode*> unsubscribe(std::vector<Subscription>,
+                                               Client*) override
+    {
+        return {};
+    }
+    void emit_to(boost::string_view route,
+                 std::unique_ptr<SharedBufferWithSpecificMetadata> msg,
+                 Client*) override
+    {
+        auto payload = reinterpret_cast<const char*>(msg->payload_data());
+        published.emplace_back(route.to_string(),
+                               std::string(payload, msg->payload_size()));
+    }
+    void emit_batch(std::vector<BatchMessage>&, Client*) override
+    {
+    }
+
+    ServiceConfiguration conf;
+    OutboundStats stats;
+    std::vector<std::pair<std::string, std::string>> published;
+};
+
+void append_frame(std::string& stream, const std::string& frame)
+{
+    const uint32_t size = htonl(static_cast<uint32_t>(frame.size()));
+    stream.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    stream.append(frame);
+}
+
+// Switches the connection to the binary wire mode.
+void append_hello(std::string& stream)
+{
+    services::blabla::Hello hello;
+    hello.mutable_header()->set_type(services::blabla::HELLO);
+    hello.set_version(BinaryHeader::VERSION);
+    hello.set_wire_mode(services::blabla::Hello_WireMode_BINARY);
+    append_frame(stream, hello.SerializeAsString());
+}
+
+// A binary MESSAGE frame, followed by its payload.
+void append_message(std::string& stream,
+                    const std::string& route,
+                    const std::string& payload)
+{
+    BinaryHeader header;
+    header.type = services::blabla::MESSAGE;
+    header.route_length = static_cast<uint16_t>(route.size());
+    header.message_size = static_cast<uint32_t>(payload.size());
+
+    std::string frame(BinaryHeader::SIZE, '\0');
+    header.encode(reinterpret_cast<uint8_t*>(&frame[0]));
+    append_frame(stream, frame + route);
+    stream.append(payload);
+}
+
+// A connection which is fed by hand, its io_service is only polled.
+struct Connection
+{
+    Connection()
+    : pool(1)
+    , client(Client::create(pool, service))
+    {
+        int fds[2];
+        BOOST_REQUIRE_EQUAL(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        client->socket().assign(Client::socket_type::protocol_type(AF_UNIX, 0),
+                                fds[0]);
+        peer = fds[1];
+        client->start(&manager);
+    }
+
+    ~Connection()
+    {
+        // The client stops on the end of the stream.
+        ::close(peer);
+        poll();
+    }
+
+    void write(const char* data, size_t size)
+    {
+        BOOST_REQUIRE_EQUAL(::write(peer, data, size), ssize_t(size));
+        poll();
+    }
+
+    void poll()
+    {
+        service.restart();
+        service.poll();
+    }
+
+    Manager manager;
+    commonpp::thread::ThreadPool pool;
+    boost::asio::io_service service;
+    std::shared_ptr<Client> client;
+    int peer = -1;
+};
+} // namespace
+
+// The correlation id appended to the serialized prefix decodes as if the
+// whole header was serialized by protobuf.
+BOOST_AUTO_TEST_CASE(protobuf_header_with_correlation_id)
+{
+    for (uint64_t offset : {uint64_t(0), uint64_t(1) << 40})
+    {
+        ConsumerHeaderEncoder encoder("a.route", 42, offset);
+        for (auto correlation_id : CORRELATION_IDS)
+        {
+            services::blabla::ConsumerMessageHeader expected;
+            expected.mutable_header()->set_type(services::blabla::MESSAGE);
+            expected.set_route("a.route");
+            expected.set_message_size(42);
+            expected.set_correlation_id(correlation_id);
+            expected.set_offset(offset);
+
+            auto header = decode(encoder, correlation_id);
+            BOOST_CHECK_EQUAL(header.correlation_id(), correlation_id);
+            BOOST_CHECK_MESSAGE(header.SerializeAsString() ==
+                                    expected.SerializeAsString(),
+                                header.DebugString());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(binary_header_with_correlation_id)
+{
+    ConsumerHeaderEncoder encoder("a.route", 42, 7);
+    auto in = encoder.in(WireMode::binary);
+    for (auto correlation_id : CORRELATION_IDS)
+    {
+        std::vector<uint8_t> out(in.max_size());
+        BOOST_REQUIRE_EQUAL(in.encode(correlation_id, out.data()), out.size());
+
+        BinaryHeader header;
+        BOOST_REQUIRE(header.decode(out.data(), out.size()));
+        BOOST_CHECK_EQUAL(header.type, services::blabla::MESSAGE);
+        BOOST_CHECK(header.flags & BinaryHeader::FLAG_OFFSET);
+        BOOST_CHECK_EQUAL(header.route_length, 7);
+        BOOST_CHECK_EQUAL(header.message_size, 42);
+        BOOST_CHECK_EQUAL(header.correlation_id, correlation_id);
+        BOOST_CHECK_EQUAL(std::string(out.end() - 7, out.end()), "a.route");
+    }
+}
+
+// However the stream is split by the reads, the same messages are decoded.
+BOOST_AUTO_TEST_CASE(binary_frames_split_at_every_byte)
+{
+    std::string stream;
+    append_hello(stream);
+    append_message(stream, "a.b", "first");
+    append_message(stream, "a.c", std::string(300, 'x'));
+    append_message(stream, "a.d", "");
+
+    for (size_t split = 1; split < stream.size(); ++split)
+    {
+        Connection connection;
+        connection.write(stream.data(), split);
+        connection.write(stream.data() + split, stream.size() - split);
+
+        auto& published = connection.manager.published;
+        BOOST_REQUIRE_MESSAGE(published.size() == 3, "split at " << split);
+        BOOST_CHECK_EQUAL(published[0].first, "a.b");
+        BOOST_CHECK_EQUAL(published[0].second, "first");
+        BOOST_CHECK_EQUAL(published[1].first, "a.c");
+        BOOST_CHECK(published[1].second == std::string(300, 'x'));
+        BOOST_CHECK_EQUAL(published[2].first, "a.d");
+        BOOST_CHECK(published[2].second.empty());
+    }
+}
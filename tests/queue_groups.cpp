@@ -0,0 +1,245 @@
+#define BOOST_TEST_MODULE QueueGroups
+#include <boost/test/unit_test.hpp>
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <commonpp/thread/ThreadPool.hpp>
+
+#include "blabla/handlers/Client.hpp"
+
+using namespace blabla;
+using namespace blabla::handlers;
+
+namespace
+{
+struct Manager : ClientManager
+{
+    const ServiceConfiguration& configuration() const override
+    {
+        return conf;
+    }
+    bool uring_enabled() const override
+    {
+        return false;
+    }
+    OutboundStats& outbound_stats() override
+    {
+        return stats;
+    }
+    journal::Journals* journals() override
+    {
+        return nullptr;
+    }
+
+    void on_new_client(std::shared_ptr<Client>) override
+    {
+    }
+    void remove_connection(std::shared_ptr<Client>) override
+    {
+    }
+
+    std::vector<SubscriptionNode*> subscribe(std::vector<Subscription>,
+                                             Client*) override
+    {
+        return {};
+    }
+    std::vector<SubscriptionNode*> unsubscribe(std::vector<Subscription>,
+                                               Client*) override
+    {
+        return {};
+    }
+    void emit_to(boost::string_view,
+                 std::unique_ptr<SharedBufferWithSpecificMetadata>,
+                 Client*) override
+    {
+    }
+    void emit_batch(std::vector<BatchMessage>&, Client*) override
+    {
+    }
+
+    ServiceConfiguration conf;
+    OutboundStats stats;
+};
+
+// The clients are never run: what they are sent stays in their outbound
+// queue, which is what the queue groups compare.
+struct Clients
+{
+    Clients()
+    : pool(1)
+    {
+    }
+
+    ~Clients()
+    {
+        for (auto fd : peers)
+        {
+            ::close(fd);
+        }
+    }
+
+    Client& add()
+    {
+        clients.push_back(Client::create(pool, service));
+        return *clients.back();
+    }
+
+    Client& add_loaded(size_t bytes)
+    {
+        auto& client = add();
+        int fds[2];
+        BOOST_REQUIRE_EQUAL(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        client.socket().assign(Client::socket_type::protocol_type(AF_UNIX, 0),
+                               fds[0]);
+        peers.push_back(fds[1]);
+
+        client.start(&manager);
+        client.send(SharedBuffer::allocate(std::vector<uint8_t>(bytes)));
+        return client;
+    }
+
+    Manager manager;
+    commonpp::thread::ThreadPool pool;
+    boost::asio::io_service service;
+    std::vector<std::shared_ptr<Client>> clients;
+    std::vector<int> peers;
+};
+
+// Correlation id of each delivery, by client.
+using Deliveries = std::map<Client*, std::vector<int32_t>>;
+
+Deliveries deliver(const std::vector<SubscriptionNode*>& nodes, size_t times)
+{
+    Deliveries deliveries;
+    for (size_t i = 0; i < times; ++i)
+    {
+        SubscriptionNode::foreach_queue_group(
+            nodes, [&deliveries](Client& client, int32_t correlation_id) {
+                deliveries[&client].push_back(correlation_id);
+            });
+    }
+    return deliveries;
+}
+} // namespace
+
+BOOST_AUTO_TEST_CASE(one_member_per_group)
+{
+    Clients clients;
+    auto& first = clients.add();
+    auto& second = clients.add();
+    auto& third = clients.add();
+    auto& plain = clients.add();
+
+    SubscriptionNode node;
+    node.add_client(first, 1, "g");
+    node.add_client(second, 2, "g");
+    node.add_client(third, 3, "h");
+    node.add_client(plain, 4);
+
+    auto deliveries = deliver({&node}, 1);
+    BOOST_CHECK_EQUAL(deliveries.size(), 2);
+    BOOST_CHECK_EQUAL(deliveries.count(&plain), 0);
+    BOOST_CHECK_EQUAL(deliveries.count(&first) + deliveries.count(&second), 1);
+    BOOST_REQUIRE_EQUAL(deliveries.count(&third), 1);
+    BOOST_CHECK_EQUAL(deliveries[&third].front(), 3);
+
+    // The members of a group are not part of the plain clients.
+    std::vector<Client*> plain_clients;
+    node.foreach_client([&plain_clients](Client& client, int32_t) {
+        plain_clients.push_back(&client);
+    });
+    BOOST_REQUIRE_EQUAL(plain_clients.size(), 1);
+    BOOST_CHECK(plain_clients.front() == &plain);
+}
+
+BOOST_AUTO_TEST_CASE(idle_members_share_the_load)
+{
+    Clients clients;
+    SubscriptionNode node;
+    for (int32_t i = 0; i < 3; ++i)
+    {
+        node.add_client(clients.add(), i, "g");
+    }
+
+    auto deliveries = deliver({&node}, 30);
+    BOOST_REQUIRE_EQUAL(deliveries.size(), 3);
+    for (auto& pair : deliveries)
+    {
+        BOOST_CHECK_EQUAL(pair.second.size(), 10);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(least_loaded_member)
+{
+    Clients clients;
+    auto& busy = clients.add_loaded(3000);
+    auto& lightest = clients.add_loaded(1000);
+    auto& loaded = clients.add_loaded(2000);
+    BOOST_CHECK_LT(outbound_bytes(lightest), outbound_bytes(loaded));
+    BOOST_CHECK_LT(outbound_bytes(loaded), outbound_bytes(busy));
+
+    SubscriptionNode node;
+    node.add_client(busy, 1, "g");
+    node.add_client(lightest, 2, "g");
+    node.add_client(loaded, 3, "g");
+
+    auto deliveries = deliver({&node}, 10);
+    BOOST_REQUIRE_EQUAL(deliveries.size(), 1);
+    BOOST_REQUIRE_EQUAL(deliveries.count(&lightest), 1);
+    BOOST_CHECK_EQUAL(deliveries[&lightest].size(), 10);
+
+    // An idle member is preferred to any loaded one.
+    auto& idle = clients.add();
+    node.add_client(idle, 4, "g");
+    deliveries = deliver({&node}, 10);
+    BOOST_REQUIRE_EQUAL(deliveries.size(), 1);
+    BOOST_CHECK_EQUAL(deliveries[&idle].size(), 10);
+}
+
+BOOST_AUTO_TEST_CASE(groups_are_gathered_across_nodes)
+{
+    Clients clients;
+    auto& both = clients.add();
+    auto& other = clients.add();
+    auto& alone = clients.add();
+
+    // As if subscribed through a prefix and a pattern matching the route.
+    SubscriptionNode prefix;
+    SubscriptionNode pattern;
+    prefix.add_client(both, 1, "g");
+    pattern.add_client(both, 1, "g");
+    pattern.add_client(other, 2, "g");
+    pattern.add_client(alone, 3, "h");
+
+    auto deliveries = deliver({&prefix, &pattern, &prefix}, 20);
+    BOOST_REQUIRE_EQUAL(deliveries.size(), 3);
+    // A member of a group through both nodes counts once.
+    BOOST_CHECK_EQUAL(deliveries[&both].size(), 10);
+    BOOST_CHECK_EQUAL(deliveries[&other].size(), 10);
+    BOOST_CHECK_EQUAL(deliveries[&alone].size(), 20);
+    BOOST_CHECK(deliveries[&other] == std::vector<int32_t>(10, 2));
+}
+
+BOOST_AUTO_TEST_CASE(empty_groups_are_removed)
+{
+    Clients clients;
+    auto& first = clients.add();
+    auto& second = clients.add();
+
+    SubscriptionNode node;
+    node.add_client(first, 1, "g");
+    node.add_client(second, 2, "g");
+
+    node.remove_client(first);
+    auto deliveries = deliver({&node}, 5);
+    BOOST_REQUIRE_EQUAL(deliveries.size(), 1);
+    BOOST_CHECK_EQUAL(deliveries[&second].size(), 5);
+
+    node.remove_client(second);
+    BOOST_CHECK(deliver({&node}, 1).empty());
+}
@@ -0,0 +1,157 @@
+#define BOOST_TEST_MODULE Ring
+#include <boost/test/unit_test.hpp>
+
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "blabla/shm/Channel.hpp"
+
+using namespace blabla::shm;
+
+namespace
+{
+// Both sides of a ring, in the memory of the test.
+struct Rings
+{
+    explicit Rings(uint64_t capacity)
+    : memory(capacity)
+    , writer(&header, memory.data(), capacity)
+    , reader(&header, memory.data(), capacity)
+    {
+        header.head = 0;
+        header.tail = 0;
+    }
+
+    RingHeader header;
+    std::vector<uint8_t> memory;
+    Ring writer;
+    Ring reader;
+};
+
+const uint8_t* bytes(const char* text)
+{
+    return reinterpret_cast<const uint8_t*>(text);
+}
+} // namespace
+
+BOOST_AUTO_TEST_CASE(write_then_read)
+{
+    Rings rings(16);
+    BOOST_CHECK(!rings.reader.readable());
+    BOOST_CHECK(rings.writer.writable());
+
+    BOOST_CHECK_EQUAL(rings.writer.write(bytes("hello"), 5), 5);
+    BOOST_CHECK(rings.reader.readable());
+
+    uint8_t buffer[16];
+    BOOST_CHECK_EQUAL(rings.reader.read(buffer, 3), 3);
+    BOOST_CHECK_EQUAL(std::memcmp(buffer, "hel", 3), 0);
+    BOOST_CHECK_EQUAL(rings.reader.read(buffer, sizeof(buffer)), 2);
+    BOOST_CHECK_EQUAL(std::memcmp(buffer, "lo", 2), 0);
+
+    BOOST_CHECK(!rings.reader.readable());
+    BOOST_CHECK_EQUAL(rings.reader.read(buffer, sizeof(buffer)), 0);
+}
+
+BOOST_AUTO_TEST_CASE(full_ring)
+{
+    Rings rings(8);
+    BOOST_CHECK_EQUAL(rings.writer.write(bytes("0123456789"), 10), 8);
+    BOOST_CHECK(!rings.writer.writable());
+    BOOST_CHECK_EQUAL(rings.writer.write(bytes("x"), 1), 0);
+
+    uint8_t buffer[8];
+    BOOST_CHECK_EQUAL(rings.reader.read(buffer, 2), 2);
+    BOOST_CHECK(rings.writer.writable());
+    BOOST_CHECK_EQUAL(rings.writer.write(bytes("89"), 2), 2);
+}
+
+BOOST_AUTO_TEST_CASE(wraps_around)
+{
+    Rings rings(8);
+    uint8_t buffer[8];
+    BOOST_CHECK_EQUAL(rings.writer.write(bytes("abcdef"), 6), 6);
+    BOOST_CHECK_EQUAL(rings.reader.read(buffer, 6), 6);
+
+    // Split between the end and the beginning of the memory.
+    BOOST_CHECK_EQUAL(rings.writer.write(bytes("ghijklmn"), 8), 8);
+    BOOST_CHECK_EQUAL(rings.reader.read(buffer, 8), 8);
+    BOOST_CHECK_EQUAL(std::memcmp(buffer, "ghijklmn", 8), 0);
+    BOOST_CHECK_EQUAL(rings.writer.position, 14);
+    BOOST_CHECK_EQUAL(rings.reader.position, 14);
+}
+
+BOOST_AUTO_TEST_CASE(corrupted_by_the_peer)
+{
+    Rings rings(8);
+    uint8_t buffer[8];
+
+    // A head more than a ring ahead of what was read.
+    rings.header.head = 9;
+    BOOST_CHECK_EQUAL(rings.reader.read(buffer, sizeof(buffer)), -1);
+
+    // A tail past what was written.
+    rings.header.tail = 1;
+    BOOST_CHECK_EQUAL(rings.writer.write(bytes("a"), 1), -1);
+}
+
+BOOST_AUTO_TEST_CASE(single_producer_single_consumer)
+{
+    const size_t total = 4 * 1024 * 1024;
+    Rings rings(4096);
+
+    std::thread producer([&] {
+        std::vector<uint8_t> chunk(1000);
+        size_t written = 0;
+        while (written < total)
+        {
+            const auto size = std::min(chunk.size(), total - written);
+            for (size_t i = 0; i < size; ++i)
+            {
+                chunk[i] = static_cast<uint8_t>((written + i) % 251);
+            }
+
+            size_t done = 0;
+            while (done < size)
+            {
+                auto n = rings.writer.write(chunk.data() + done, size - done);
+                if (n <= 0)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                done += n;
+            }
+            written += size;
+        }
+    });
+
+    std::vector<uint8_t> buffer(1500);
+    size_t read = 0;
+    bool intact = true;
+    while (read < total)
+    {
+        auto n = rings.reader.read(buffer.data(), buffer.size());
+        if (n < 0)
+        {
+            intact = false;
+            break;
+        }
+
+        for (ssize_t i = 0; i < n; ++i)
+        {
+            intact = intact && buffer[i] == (read + i) % 251;
+        }
+        read += n;
+        if (n == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+
+    BOOST_CHECK(intact);
+    BOOST_CHECK_EQUAL(read, total);
+    BOOST_CHECK(!rings.reader.readable());
+}
@@ -0,0 +1,146 @@
+#define BOOST_TEST_MODULE RoutePatterns
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "blabla/RoutePatterns.hpp"
+
+using namespace blabla;
+
+namespace
+{
+// The trie only stores the nodes, they are told apart by their address.
+handlers::SubscriptionNode* node_of(size_t i)
+{
+    static char nodes[64];
+    return reinterpret_cast<handlers::SubscriptionNode*>(&nodes[i]);
+}
+
+std::vector<handlers::SubscriptionNode*> match(const RoutePatterns& patterns,
+                                               boost::string_view route)
+{
+    std::vector<handlers::SubscriptionNode*> subscriptions;
+    patterns.match(route, subscriptions);
+    std::sort(subscriptions.begin(), subscriptions.end());
+    return subscriptions;
+}
+
+const std::vector<std::string> PATTERNS = {
+    "a",     "a.b",   "a.*",   "a.>",   "*",     ">",     "*.b",
+    "a.*.c", "a.b.c", "*.*.c", "a.b.>", "*.b.>", "b.>",   "a.*.>",
+};
+
+const std::vector<std::string> ROUTES = {
+    "a",     "b",     "a.b",   "a.c",     "b.b",   "a.b.c", "a.c.c",
+    "b.b.c", "a.b.d", "c.b.c", "a.b.c.d", "b.a",   "ab",    "a.bc",
+};
+} // namespace
+
+BOOST_AUTO_TEST_CASE(valid_patterns)
+{
+    for (auto& pattern : PATTERNS)
+    {
+        BOOST_CHECK_MESSAGE(RoutePatterns::is_valid(pattern), pattern);
+    }
+
+    for (auto pattern : {"", ".", ".a", "a..b", "a*", "a.b*", "a.>.b",
+                         ">.a", "a.>>", "**"})
+    {
+        BOOST_CHECK_MESSAGE(!RoutePatterns::is_valid(pattern), pattern);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(single_token_wildcard)
+{
+    BOOST_CHECK(RoutePatterns::matches("a.*.c", "a.b.c"));
+    BOOST_CHECK(!RoutePatterns::matches("a.*.c", "a.c"));
+    BOOST_CHECK(!RoutePatterns::matches("a.*.c", "a.b.b.c"));
+    BOOST_CHECK(RoutePatterns::matches("*", "a"));
+    BOOST_CHECK(!RoutePatterns::matches("*", "a.b"));
+    BOOST_CHECK(!RoutePatterns::matches("a.*", "a"));
+}
+
+BOOST_AUTO_TEST_CASE(tail_wildcard)
+{
+    BOOST_CHECK(RoutePatterns::matches("a.>", "a.b"));
+    BOOST_CHECK(RoutePatterns::matches("a.>", "a.b.c"));
+    BOOST_CHECK(!RoutePatterns::matches("a.>", "a"));
+    BOOST_CHECK(!RoutePatterns::matches("a.>", "ab.c"));
+    BOOST_CHECK(RoutePatterns::matches(">", "a"));
+    BOOST_CHECK(RoutePatterns::matches(">", "a.b.c"));
+}
+
+BOOST_AUTO_TEST_CASE(literal_tokens)
+{
+    BOOST_CHECK(RoutePatterns::matches("a.b", "a.b"));
+    BOOST_CHECK(!RoutePatterns::matches("a.b", "a.bc"));
+    BOOST_CHECK(!RoutePatterns::matches("a.b", "a"));
+    BOOST_CHECK(!RoutePatterns::matches("a", "a.b"));
+}
+
+BOOST_AUTO_TEST_CASE(find_inserted)
+{
+    RoutePatterns patterns;
+    BOOST_CHECK(patterns.empty());
+    for (size_t i = 0; i < PATTERNS.size(); ++i)
+    {
+        BOOST_CHECK(patterns.find(PATTERNS[i]) == nullptr);
+        patterns.insert(PATTERNS[i], node_of(i));
+    }
+    BOOST_CHECK(!patterns.empty());
+
+    for (size_t i = 0; i < PATTERNS.size(); ++i)
+    {
+        BOOST_CHECK_MESSAGE(patterns.find(PATTERNS[i]) == node_of(i),
+                            PATTERNS[i]);
+    }
+    BOOST_CHECK(patterns.find("a.b.*") == nullptr);
+    BOOST_CHECK(patterns.find("c.>") == nullptr);
+
+    size_t nodes = 0;
+    patterns.foreach_node([&nodes](handlers::SubscriptionNode*) { ++nodes; });
+    BOOST_CHECK_EQUAL(nodes, PATTERNS.size());
+}
+
+// The trie finds the same patterns as matching them one by one.
+BOOST_AUTO_TEST_CASE(trie_agrees_with_matches)
+{
+    RoutePatterns patterns;
+    for (size_t i = 0; i < PATTERNS.size(); ++i)
+    {
+        patterns.insert(PATTERNS[i], node_of(i));
+    }
+
+    for (auto& route : ROUTES)
+    {
+        std::vector<handlers::SubscriptionNode*> expected;
+        for (size_t i = 0; i < PATTERNS.size(); ++i)
+        {
+            if (RoutePatterns::matches(PATTERNS[i], route))
+            {
+                expected.push_back(node_of(i));
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+
+        BOOST_CHECK_MESSAGE(match(patterns, route) == expected, route);
+    }
+
+    // >, a.>, a.*.c, a.b.c, *.*.c, a.b.>, *.b.> and a.*.>
+    BOOST_CHECK_EQUAL(match(patterns, "a.b.c").size(), 8);
+}
+
+BOOST_AUTO_TEST_CASE(copy_is_deep)
+{
+    RoutePatterns patterns;
+    patterns.insert("a.*", node_of(0));
+
+    RoutePatterns copy(patterns);
+    copy.insert("a.>", node_of(1));
+
+    BOOST_CHECK_EQUAL(match(patterns, "a.b").size(), 1);
+    BOOST_CHECK_EQUAL(match(copy, "a.b").size(), 2);
+    BOOST_CHECK(patterns.find("a.>") == nullptr);
+}